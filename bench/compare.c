@@ -0,0 +1,237 @@
+// Compares two sets of benchmark results written by bench_runner and fails if any
+// benchmark got slower. Built and run by `make bench-compare`:
+//
+//     build/bench_compare [--threshold percent] [--alpha p] baseline.json current.json
+//
+// A benchmark counts as slower when its median wall time grew by more than the
+// threshold and a one-sided Mann-Whitney U test on the run times says the current
+// runs are slower than the baseline runs with significance alpha. Both are needed:
+// the threshold ignores tiny real changes, and the test ignores big noisy ones.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_util.h"
+
+#define DEFAULT_THRESHOLD (5.0) // Percent
+#define DEFAULT_ALPHA (0.05)
+#define MAX_BENCHMARKS (256)
+#define MAX_RUNS (256)
+#define EXACT_MAX_RUNS (50) // Up to this many runs per side without ties, p-values are exact
+
+typedef struct {
+    char name[128];
+    double times[MAX_RUNS];
+    int count;
+} Benchmark;
+
+typedef struct {
+    Benchmark benchmarks[MAX_BENCHMARKS];
+    int count;
+} Results;
+
+// Reads the benchmark names and run times from a file written by bench_runner.
+// This isn't a general JSON parser; it relies on the runner's key names.
+static bool results_read(const char *path, Results *results) {
+    char *text = file_read_all(path);
+    if (!text) {
+        return false;
+    }
+
+    results->count = 0;
+    char *cursor = text;
+    while ((cursor = strstr(cursor, "\"name\": \"")) && results->count < MAX_BENCHMARKS) {
+        Benchmark *benchmark = &results->benchmarks[results->count++];
+        cursor += strlen("\"name\": \"");
+        char *end = strchr(cursor, '"');
+        if (!end) {
+            break;
+        }
+        snprintf(benchmark->name, sizeof(benchmark->name), "%.*s", (int)(end - cursor), cursor);
+
+        benchmark->count = 0;
+        char *times = strstr(end, "\"times_ms\": [");
+        if (!times) {
+            break;
+        }
+        cursor = times + strlen("\"times_ms\": [");
+        while (*cursor != ']' && benchmark->count < MAX_RUNS) {
+            char *next;
+            benchmark->times[benchmark->count++] = strtod(cursor, &next);
+            cursor = next;
+            while (*cursor == ',' || *cursor == ' ') {
+                cursor++;
+            }
+        }
+    }
+
+    free(text);
+    return true;
+}
+
+static Benchmark *results_find(Results *results, const char *name) {
+    for (int i = 0; i < results->count; i++) {
+        if (strcmp(results->benchmarks[i].name, name) == 0) {
+            return &results->benchmarks[i];
+        }
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(const Benchmark *benchmark) {
+    double sorted[MAX_RUNS];
+    memcpy(sorted, benchmark->times, sizeof(double) * benchmark->count);
+    qsort(sorted, benchmark->count, sizeof(double), compare_doubles);
+    int n = benchmark->count;
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// Probability of a U statistic of at least u when the two samples (of n and m runs)
+// come from the same distribution, counting the orderings of the runs that give each U
+static double exact_upper_tail(int n, int m, double u) {
+    // ways[i][j][k]: orderings of i runs against j runs with U = k
+    int max_u = n * m;
+    double *ways = calloc((size_t)(n + 1) * (m + 1) * (max_u + 1), sizeof(double));
+#define WAYS(i, j, k) ways[((size_t)(i) * (m + 1) + (j)) * (max_u + 1) + (k)]
+    for (int i = 0; i <= n; i++) {
+        for (int j = 0; j <= m; j++) {
+            if (i == 0 || j == 0) {
+                WAYS(i, j, 0) = 1;
+                continue;
+            }
+            for (int k = 0; k <= i * j; k++) {
+                // The largest run is either one of the first sample's, beating all j of
+                // the second's, or one of the second's, beating none
+                double from_first = k >= j ? WAYS(i - 1, j, k - j) : 0;
+                WAYS(i, j, k) = from_first + WAYS(i, j - 1, k);
+            }
+        }
+    }
+
+    double total = 0;
+    double tail = 0;
+    for (int k = 0; k <= max_u; k++) {
+        total += WAYS(n, m, k);
+        if (k >= u) {
+            tail += WAYS(n, m, k);
+        }
+    }
+#undef WAYS
+    free(ways);
+    return tail / total;
+}
+
+// One-sided Mann-Whitney U test: the probability of current's runs being at least
+// this much slower than baseline's if both came from the same distribution
+static double mann_whitney_p(const Benchmark *baseline, const Benchmark *current) {
+    int n = current->count;
+    int m = baseline->count;
+
+    // U counts the pairs where the current run is slower, ties counting half
+    double u = 0;
+    bool ties = false;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < m; j++) {
+            if (current->times[i] > baseline->times[j]) {
+                u += 1;
+            }
+            else if (current->times[i] == baseline->times[j]) {
+                u += 0.5;
+                ties = true;
+            }
+        }
+    }
+
+    if (!ties && n <= EXACT_MAX_RUNS && m <= EXACT_MAX_RUNS) {
+        return exact_upper_tail(n, m, u);
+    }
+
+    // Normal approximation with a continuity correction. Ties only come from timer
+    // resolution, so the variance isn't corrected for them.
+    double mean = n * m / 2.0;
+    double sd = sqrt(n * m * (n + m + 1) / 12.0);
+    double z = (u - 0.5 - mean) / sd;
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+int main(int argc, char *argv[]) {
+    double threshold = DEFAULT_THRESHOLD;
+    double alpha = DEFAULT_ALPHA;
+    const char *paths[2];
+    int path_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+            alpha = atof(argv[++i]);
+        }
+        else if (path_count < 2) {
+            paths[path_count++] = argv[i];
+        }
+    }
+    if (path_count != 2) {
+        printf("Usage: %s [--threshold percent] [--alpha p] <baseline.json> <current.json>\n", argv[0]);
+        return 2;
+    }
+
+    static Results baseline;
+    static Results current;
+    if (!results_read(paths[0], &baseline)) {
+        printf("Error: Unable to read baseline %s (make bench-baseline writes one)\n", paths[0]);
+        return 2;
+    }
+    if (!results_read(paths[1], &current)) {
+        printf("Error: Unable to read results %s\n", paths[1]);
+        return 2;
+    }
+
+    printf("%-20s %12s %12s %9s %9s  %s\n", "benchmark", "baseline ms", "current ms", "change", "p", "verdict");
+    int regressions = 0;
+    for (int i = 0; i < current.count; i++) {
+        Benchmark *now = &current.benchmarks[i];
+        Benchmark *before = results_find(&baseline, now->name);
+        if (!before) {
+            printf("%-20s %12s %12.1f %9s %9s  new\n", now->name, "-", median(now), "-", "-");
+            continue;
+        }
+
+        double before_ms = median(before);
+        double now_ms = median(now);
+        double change = 100.0 * (now_ms - before_ms) / before_ms;
+        double p = mann_whitney_p(before, now);
+        double p_faster = mann_whitney_p(now, before);
+
+        const char *verdict = "ok";
+        if (change > threshold && p < alpha) {
+            verdict = "SLOWER";
+            regressions++;
+        }
+        else if (change < -threshold && p_faster < alpha) {
+            verdict = "faster";
+        }
+        printf("%-20s %12.1f %12.1f %+8.1f%% %9.4f  %s\n", now->name, before_ms, now_ms, change, p, verdict);
+    }
+    for (int i = 0; i < baseline.count; i++) {
+        if (!results_find(&current, baseline.benchmarks[i].name)) {
+            printf("%-20s %12.1f %12s %9s %9s  missing\n", baseline.benchmarks[i].name, median(&baseline.benchmarks[i]), "-", "-", "-");
+        }
+    }
+
+    if (regressions > 0) {
+        printf("%d benchmark%s slower than the baseline by more than %.1f%% (alpha %.3g)\n",
+            regressions, regressions == 1 ? " is" : "s are", threshold, alpha);
+        return 1;
+    }
+    printf("No regressions beyond %.1f%% (alpha %.3g)\n", threshold, alpha);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Builds lvm with the default array-of-structs value stack and with VM_SOA_STACK
+# (separate type and payload arrays), then runs every benchmark with both and
+# prints the best wall time of each, plus cache misses where perf is available.
+# Run with `make bench-layouts`, or `sh bench/compare_layouts.sh [runs]`.
+
+RUNS=${1:-3}
+AOS_DIR=build/layout-aos
+SOA_DIR=build/layout-soa
+
+# The Makefile doesn't track headers, so always build from scratch
+rm -rf "$AOS_DIR" "$SOA_DIR"
+make -s BUILD_DIR="$AOS_DIR" || exit 1
+make -s BUILD_DIR="$SOA_DIR" SOA_STACK=1 || exit 1
+
+# Prints the best wall time in milliseconds of RUNS runs of the command
+best_time() {
+    best=
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        end=$(date +%s%N)
+        elapsed=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+# Prints the last-level cache misses of one run of the command, or n/a without perf
+cache_misses() {
+    if ! command -v perf > /dev/null 2>&1; then
+        echo "n/a"
+        return
+    fi
+    perf stat -x, -e cache-misses "$@" 2>&1 > /dev/null | awk -F, '/cache-misses/ { print $1 }'
+}
+
+printf "%-28s %10s %10s %14s %14s\n" "benchmark" "aos ms" "soa ms" "aos misses" "soa misses"
+for source in bench/*.mslisp; do
+    name=$(basename "$source" .mslisp)
+    aos_time=$(best_time "$AOS_DIR/lvm" "$source")
+    soa_time=$(best_time "$SOA_DIR/lvm" "$source")
+    aos_misses=$(cache_misses "$AOS_DIR/lvm" "$source")
+    soa_misses=$(cache_misses "$SOA_DIR/lvm" "$source")
+    printf "%-28s %10s %10s %14s %14s\n" "$name" "$aos_time" "$soa_time" "$aos_misses" "$soa_misses"
+done
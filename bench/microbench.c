@@ -0,0 +1,211 @@
+// Times the VM's string and list primitives on their own, at a few sizes, so changes
+// to them can be measured without the noise of whole programs. Built and run by
+// `make microbench`:
+//
+//     build/microbench [name]
+//
+// Each benchmark first runs for a while to warm up, then finds an iteration count
+// that takes at least MICROBENCH_SAMPLE_NS, and times MICROBENCH_SAMPLES batches of
+// that many iterations. It reports the min, median and 99th percentile time per
+// iteration over the batches. Given a name, only the benchmarks containing it run.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "vmstring.h"
+
+#define MICROBENCH_WARMUP_NS (20000000L) // Time spent running a benchmark before timing it
+#define MICROBENCH_SAMPLE_NS (200000L) // Shortest batch of iterations that is timed
+#define MICROBENCH_SAMPLES (200) // Batches timed per benchmark
+
+/**
+ * What a benchmark works on, made before it's timed
+ */
+typedef struct {
+    size_t size;
+    char *text; // size characters
+    String *string; // A string of size characters
+    String *same; // An equal string, in different memory
+    List *list; // A list of size integers
+    VM *vm;
+} Fixture;
+
+/**
+ * A benchmark: runs the primitive being measured the given number of times
+ */
+typedef struct {
+    const char *name;
+    void (*run)(Fixture *fixture, long iterations);
+} Microbench;
+
+static const size_t sizes[] = {16, 256, 4096};
+
+// Keeps the compiler from throwing away results nobody reads
+static volatile size_t sink;
+
+static long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static Fixture fixture_create(size_t size) {
+    Fixture fixture;
+    fixture.size = size;
+    fixture.text = malloc(size + 1);
+    for (size_t i = 0; i < size; i++) {
+        fixture.text[i] = 'a' + i % 26;
+    }
+    fixture.text[size] = '\0';
+    fixture.string = string_create_from(fixture.text);
+    fixture.same = string_create_from(fixture.text);
+
+    fixture.list = malloc(sizeof(List));
+    fixture.list->count = size;
+    fixture.list->capacity = size;
+    fixture.list->elements = malloc(sizeof(Value) * size);
+    for (size_t i = 0; i < size; i++) {
+        fixture.list->elements[i] = (Value){.type = VAL_INTEGER, .as.integer = (int)i};
+    }
+
+    fixture.vm = vm_create();
+    return fixture;
+}
+
+static void fixture_free(Fixture *fixture) {
+    free(fixture->text);
+    string_free(fixture->string);
+    string_free(fixture->same);
+    free(fixture->list->elements);
+    free(fixture->list);
+    vm_free(fixture->vm);
+}
+
+// Appends size characters to a string emptied first, which keeps its capacity
+static void bench_string_append(Fixture *fixture, long iterations) {
+    String *s = string_create();
+    for (long i = 0; i < iterations; i++) {
+        s->len = 0;
+        s->data[0] = '\0';
+        string_append(s, fixture->text);
+    }
+    sink += s->len;
+    string_free(s);
+}
+
+static void bench_string_copy(Fixture *fixture, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        String *copy = string_copy(fixture->string);
+        sink += copy->len;
+        string_free(copy);
+    }
+}
+
+// Takes the whole string as its own substring, which moves and reallocates it in place
+static void bench_string_substr(Fixture *fixture, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        string_substr(fixture->string, 0, fixture->size);
+    }
+    sink += fixture->string->len;
+}
+
+// Compares equal strings, which has to look at every character
+static void bench_string_equal(Fixture *fixture, long iterations) {
+    bool equal = false;
+    for (long i = 0; i < iterations; i++) {
+        string_equal(fixture->string, fixture->same, &equal);
+        sink += equal;
+    }
+}
+
+static void bench_list_copy(Fixture *fixture, long iterations) {
+    for (long i = 0; i < iterations; i++) {
+        List *copy = list_copy(fixture->list);
+        sink += copy->count;
+        free(copy->elements);
+        free(copy);
+    }
+}
+
+// Pushes one value per iteration, emptying the stack whenever it holds size values
+static void bench_stack_push_value(Fixture *fixture, long iterations) {
+    VM *vm = fixture->vm;
+    Value value = {.type = VAL_INTEGER, .as.integer = 1};
+    for (long i = 0; i < iterations; i++) {
+        if (vm->sp == (int)fixture->size) {
+            vm->sp = 0;
+        }
+        stack_push_value(vm, value);
+    }
+    sink += vm->sp;
+}
+
+static const Microbench benchmarks[] = {
+    {"string_append", bench_string_append},
+    {"string_copy", bench_string_copy},
+    {"string_substr", bench_string_substr},
+    {"string_equal", bench_string_equal},
+    {"list_copy", bench_list_copy},
+    {"stack_push_value", bench_stack_push_value},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void microbench_run(const Microbench *bench, size_t size) {
+    Fixture fixture = fixture_create(size);
+
+    // Warm up, which also finds a batch size that takes long enough to time
+    long iterations = 1;
+    long warmup_start = now_ns();
+    while (true) {
+        long start = now_ns();
+        bench->run(&fixture, iterations);
+        long elapsed = now_ns() - start;
+        if (elapsed < MICROBENCH_SAMPLE_NS) {
+            iterations *= 2;
+        }
+        else if (now_ns() - warmup_start >= MICROBENCH_WARMUP_NS) {
+            break;
+        }
+    }
+
+    double per_iteration[MICROBENCH_SAMPLES];
+    for (int i = 0; i < MICROBENCH_SAMPLES; i++) {
+        long start = now_ns();
+        bench->run(&fixture, iterations);
+        per_iteration[i] = (double)(now_ns() - start) / iterations;
+    }
+    qsort(per_iteration, MICROBENCH_SAMPLES, sizeof(double), compare_doubles);
+
+    printf("%-18s %6zu %10ld %12.2f %12.2f %12.2f\n",
+        bench->name, size, iterations,
+        per_iteration[0],
+        per_iteration[MICROBENCH_SAMPLES / 2],
+        per_iteration[MICROBENCH_SAMPLES * 99 / 100]);
+    fflush(stdout);
+
+    fixture_free(&fixture);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    printf("%-18s %6s %10s %12s %12s %12s\n", "benchmark", "size", "batch", "min ns", "median ns", "p99 ns");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        if (filter && !strstr(benchmarks[b].name, filter)) {
+            continue;
+        }
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            microbench_run(&benchmarks[b], sizes[s]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+// Runs each benchmark program through lvm a number of times and reports, as JSON,
+// the wall time of every run (and their median), the bytecode instructions the VM
+// dispatched and the peak resident set size. Built and run by `make bench`:
+//
+//     build/bench_runner [--runs N] [--lvm path] [--out path] bench/*.mslisp
+//
+// Programs run as child processes, with their output thrown away, so that the peak
+// RSS of one doesn't hide in another's. The instruction count comes from lvm --stats.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_RUNS (5)
+#define DEFAULT_LVM ("build/lvm")
+#define STATS_MAX (4096) // Enough for everything lvm --stats writes
+#define INSTRUCTIONS_LINE ("Instructions dispatched: ")
+
+typedef struct {
+    double wall_ms;
+    long max_rss_kb;
+    unsigned long instructions;
+} RunResult;
+
+static double now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+// Runs lvm --stats on the file once. Returns false if it couldn't be run or failed.
+static bool run_once(const char *lvm, const char *file, RunResult *result) {
+    int stats_pipe[2];
+    if (pipe(stats_pipe) != 0) {
+        return false;
+    }
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(stats_pipe[1], STDERR_FILENO);
+        close(stats_pipe[0]);
+        execl(lvm, lvm, "--stats", file, (char *)NULL);
+        _exit(127);
+    }
+    close(stats_pipe[1]);
+
+    // The stats come at the very end, so reading until EOF waits for the program
+    char stats[STATS_MAX];
+    size_t length = 0;
+    ssize_t got;
+    while ((got = read(stats_pipe[0], stats + length, sizeof(stats) - 1 - length)) > 0) {
+        length += got;
+        if (length == sizeof(stats) - 1) {
+            // Keep only the end, which is where the stats are
+            memmove(stats, stats + length / 2, length - length / 2);
+            length -= length / 2;
+        }
+    }
+    stats[length] = '\0';
+    close(stats_pipe[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return false;
+    }
+    result->wall_ms = now_ms() - start;
+    result->max_rss_kb = usage.ru_maxrss;
+
+    char *line = strstr(stats, INSTRUCTIONS_LINE);
+    result->instructions = line ? strtoul(line + strlen(INSTRUCTIONS_LINE), NULL, 10) : 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Name of the benchmark: the file name without its directory or extension
+static void benchmark_name(const char *file, char *name, size_t size) {
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    snprintf(name, size, "%s", base);
+    char *dot = strrchr(name, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int runs = DEFAULT_RUNS;
+    const char *lvm = DEFAULT_LVM;
+    const char *out_path = NULL;
+    const char **files = malloc(sizeof(char*) * argc);
+    int file_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--lvm") == 0 && i + 1 < argc) {
+            lvm = argv[++i];
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+        else {
+            files[file_count++] = argv[i];
+        }
+    }
+    if (file_count == 0 || runs < 1) {
+        printf("Usage: %s [--runs N] [--lvm path] [--out path] <benchmark>...\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        printf("Error: Unable to write to %s\n", out_path);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"lvm\": \"%s\",\n", lvm);
+    fprintf(out, "  \"runs\": %d,\n", runs);
+    fprintf(out, "  \"benchmarks\": [");
+
+    bool all_ok = true;
+    int written = 0;
+    double *times = malloc(sizeof(double) * runs);
+    for (int f = 0; f < file_count; f++) {
+        char name[256];
+        benchmark_name(files[f], name, sizeof(name));
+
+        RunResult result = {0};
+        long max_rss_kb = 0;
+        bool ok = true;
+        for (int r = 0; r < runs && ok; r++) {
+            ok = run_once(lvm, files[f], &result);
+            times[r] = result.wall_ms;
+            if (result.max_rss_kb > max_rss_kb) {
+                max_rss_kb = result.max_rss_kb;
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "%-20s failed\n", name);
+            all_ok = false;
+            continue;
+        }
+
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"file\": \"%s\", \"times_ms\": [", written++ > 0 ? "," : "", name, files[f]);
+        for (int r = 0; r < runs; r++) {
+            fprintf(out, "%s%.3f", r > 0 ? ", " : "", times[r]);
+        }
+
+        qsort(times, runs, sizeof(double), compare_doubles);
+        double median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+        fprintf(out, "], \"median_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"instructions\": %lu, \"max_rss_kb\": %ld}",
+            median, times[0], times[runs - 1], result.instructions, max_rss_kb);
+        fprintf(stderr, "%-20s %10.1f ms %14lu insns %9ld KB\n", name, median, result.instructions, max_rss_kb);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    free(times);
+    free(files);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include "allocprofile.h"
+
+#include <stdlib.h>
+
+static const char *kind_names[ALLOC_KIND_COUNT] = {"string", "list"};
+
+AllocProfile *alloc_profile_create(size_t code_count) {
+    AllocProfile *allocs = malloc(sizeof(AllocProfile));
+    for (int kind = 0; kind < ALLOC_KIND_COUNT; kind++) {
+        allocs->sites[kind] = calloc(code_count, sizeof(AllocSite));
+    }
+    allocs->pc_count = code_count;
+    return allocs;
+}
+
+void alloc_profile_free(AllocProfile *allocs) {
+    if (!allocs) {
+        return;
+    }
+    for (int kind = 0; kind < ALLOC_KIND_COUNT; kind++) {
+        free(allocs->sites[kind]);
+    }
+    free(allocs);
+}
+
+// qsort can't take the profile, so the comparator reads it from here
+static AllocProfile *sorting;
+
+// Sites are numbered kind * pc_count + pc
+static AllocSite *site_at(AllocProfile *allocs, size_t index) {
+    return &allocs->sites[index / allocs->pc_count][index % allocs->pc_count];
+}
+
+static int compare_sites_by_bytes(const void *a, const void *b) {
+    unsigned long bytes_a = site_at(sorting, *(const size_t *)a)->bytes;
+    unsigned long bytes_b = site_at(sorting, *(const size_t *)b)->bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+void alloc_profile_print(AllocProfile *allocs, VM *vm, BytecodeBuf *bbuf, const char *source, FILE *out) {
+    size_t site_count = ALLOC_KIND_COUNT * allocs->pc_count;
+    size_t *sites = malloc(sizeof(size_t) * (site_count + 1));
+    size_t used = 0;
+    unsigned long total_count = 0;
+    unsigned long total_bytes = 0;
+    for (size_t i = 0; i < site_count; i++) {
+        AllocSite *site = site_at(allocs, i);
+        if (site->count > 0) {
+            sites[used++] = i;
+            total_count += site->count;
+            total_bytes += site->bytes;
+        }
+    }
+    sorting = allocs;
+    qsort(sites, used, sizeof(size_t), compare_sites_by_bytes);
+
+    fprintf(out, "Allocations: %lu, %lu bytes\n", total_count, total_bytes);
+    fprintf(out, "%6s %-16s %-6s %12s %14s %7s %6s  %s\n",
+        "pc", "opcode", "kind", "count", "bytes", "%", "line", "source");
+    for (size_t i = 0; i < used && i < ALLOC_PROFILE_TOP_SITES; i++) {
+        int pc = (int)(sites[i] % allocs->pc_count);
+        AllocSite *site = site_at(allocs, sites[i]);
+        fprintf(out, "%6d %-16s %-6s %12lu %14lu %6.2f%% ",
+            pc, opcode_name(vm->code[pc].opCode), kind_names[sites[i] / allocs->pc_count],
+            site->count, site->bytes, 100.0 * site->bytes / total_bytes);
+
+        SourceMapEntry *entry = bbuf ? bytecode_source(bbuf, pc) : NULL;
+        if (!entry || entry->pos.line == 0) {
+            fprintf(out, "%6s\n", "?");
+            continue;
+        }
+        fprintf(out, "%6d  ", entry->pos.line);
+        if (source) {
+            source_print_line(source, entry->pos.line, out);
+        }
+        fprintf(out, "\n");
+    }
+    free(sites);
+}
@@ -0,0 +1,68 @@
+#ifndef ALLOCPROFILE_H
+#define ALLOCPROFILE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "vm.h"
+#include "codegen.h"
+
+#define ALLOC_PROFILE_TOP_SITES (20) // Allocation sites listed in the report
+
+/**
+ * What an allocation made
+ */
+typedef enum {
+    ALLOC_STRING,
+    ALLOC_LIST,
+    ALLOC_KIND_COUNT
+} AllocKind;
+
+/**
+ * Allocations made by one instruction
+ */
+typedef struct {
+    unsigned long count;
+    unsigned long bytes; // Of the String or List and its storage, when it was made
+} AllocSite;
+
+/**
+ * Strings and lists made by each instruction, recorded by the VM while vm->allocs is set.
+ * The JITs and the register VM aren't used while it is, since they don't keep vm->pc.
+ */
+struct AllocProfile {
+    AllocSite *sites[ALLOC_KIND_COUNT]; // By kind, then by address of the instruction
+    size_t pc_count; // Number of instructions in the code
+};
+
+/**
+ * Creates an empty allocation profile for code of the given length
+ */
+AllocProfile *alloc_profile_create(size_t code_count);
+
+/**
+ * Frees an allocation profile
+ */
+void alloc_profile_free(AllocProfile *allocs);
+
+/**
+ * Records an allocation made by the instruction at pc
+ */
+static inline void alloc_profile_record(AllocProfile *allocs, int pc, AllocKind kind, size_t bytes) {
+    if (pc < 0 || (size_t)pc >= allocs->pc_count) {
+        return;
+    }
+    AllocSite *site = &allocs->sites[kind][pc];
+    site->count++;
+    site->bytes += bytes;
+}
+
+/**
+ * Writes the allocation sites that made the most bytes, with their opcodes and, where
+ * the bytecode has positions, the source lines they were compiled from
+ * @param vm The VM the profile was recorded on, for the opcodes of its instructions
+ * @param source The program's text, or NULL to leave out the source lines
+ */
+void alloc_profile_print(AllocProfile *allocs, VM *vm, BytecodeBuf *bbuf, const char *source, FILE *out);
+
+#endif // ALLOCPROFILE_H
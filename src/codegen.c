@@ -5,6 +5,7 @@
 
 #include "vmstring.h"
 #include "parser.h"
+#include "typeinfer.h"
 #include "vm.h"
 
 void codegen_error(char *msg) {
@@ -18,6 +19,20 @@ SymbolTable* symbol_table_create() {
     table->capacity = 8;
     table->names = malloc(sizeof(String*) * table->capacity);
     table->locations = malloc(sizeof(int) * table->capacity);
+    table->local_count = 0;
+    table->local_capacity = 8;
+    table->local_names = malloc(sizeof(String*) * table->local_capacity);
+    table->local_slots = malloc(sizeof(int) * table->local_capacity);
+    table->function_count = 0;
+    table->function_capacity = 8;
+    table->function_names = malloc(sizeof(String*) * table->function_capacity);
+    table->function_indices = malloc(sizeof(int) * table->function_capacity);
+    table->scope_count = 0;
+    table->scope_capacity = 4;
+    table->scopes = malloc(sizeof(FunctionScope) * table->scope_capacity);
+
+    // Scope of the top-level code
+    symbol_table_push_scope(table);
     return table;
 }
 
@@ -27,6 +42,14 @@ void symbol_table_free(SymbolTable *table) {
     }
     free(table->names);
     free(table->locations);
+    free(table->local_names);
+    free(table->local_slots);
+    free(table->function_names);
+    free(table->function_indices);
+    while (table->scope_count > 0) {
+        symbol_table_pop_scope(table);
+    }
+    free(table->scopes);
     free(table);
 }
 
@@ -62,45 +85,338 @@ int symbol_table_define(SymbolTable *table, String *name) {
     return table->locations[table->count - 1];
 }
 
+// Looks up a local of the given function scope, innermost first
+static int symbol_table_lookup_local_in_scope(SymbolTable *table, int scope, String *name) {
+    int end = (scope + 1 < table->scope_count) ? table->scopes[scope + 1].local_base : table->local_count;
+
+    // Search backwards so inner locals shadow outer ones
+    for (int i = end - 1; i >= table->scopes[scope].local_base; i--) {
+        if (strcmp(table->local_names[i]->data, name->data) == 0) {
+            return table->local_slots[i];
+        }
+    }
+
+    // Not found
+    return -1;
+}
+
+int symbol_table_lookup_local(SymbolTable *table, String *name) {
+    return symbol_table_lookup_local_in_scope(table, table->scope_count - 1, name);
+}
+
+// Looks up (or adds) a capture of the given function scope
+static int symbol_table_resolve_capture_in_scope(SymbolTable *table, int scope, String *name) {
+    // The top-level code isn't a closure
+    if (scope == 0) {
+        return -1;
+    }
+
+    FunctionScope *fscope = &table->scopes[scope];
+    for (int i = 0; i < fscope->capture_count; i++) {
+        if (strcmp(fscope->capture_names[i]->data, name->data) == 0) {
+            return i;
+        }
+    }
+
+    // Only capture variables the enclosing function can load itself
+    if (
+        symbol_table_lookup_local_in_scope(table, scope - 1, name) == -1 &&
+        symbol_table_resolve_capture_in_scope(table, scope - 1, name) == -1
+    ) {
+        return -1;
+    }
+
+    if (fscope->capture_count >= fscope->capture_capacity) {
+        fscope->capture_capacity *= 2;
+        fscope->capture_names = realloc(fscope->capture_names, sizeof(String*) * fscope->capture_capacity);
+    }
+    fscope->capture_names[fscope->capture_count] = name;
+    return fscope->capture_count++;
+}
+
+int symbol_table_resolve_capture(SymbolTable *table, String *name) {
+    return symbol_table_resolve_capture_in_scope(table, table->scope_count - 1, name);
+}
+
+void symbol_table_push_scope(SymbolTable *table) {
+    // Check if we need to resize
+    if (table->scope_count >= table->scope_capacity) {
+        table->scope_capacity *= 2;
+        table->scopes = realloc(table->scopes, sizeof(FunctionScope) * table->scope_capacity);
+    }
+
+    FunctionScope *fscope = &table->scopes[table->scope_count++];
+    fscope->local_base = table->local_count;
+    fscope->capture_count = 0;
+    fscope->capture_capacity = 4;
+    fscope->capture_names = malloc(sizeof(String*) * fscope->capture_capacity);
+}
+
+void symbol_table_pop_scope(SymbolTable *table) {
+    FunctionScope *fscope = &table->scopes[--table->scope_count];
+    symbol_table_pop_locals(table, fscope->local_base);
+    free(fscope->capture_names);
+}
+
+void symbol_table_push_local(SymbolTable *table, String *name, int slot) {
+    // Check if we need to resize
+    if (table->local_count >= table->local_capacity) {
+        table->local_capacity *= 2;
+        table->local_names = realloc(table->local_names, sizeof(String*) * table->local_capacity);
+        table->local_slots = realloc(table->local_slots, sizeof(int) * table->local_capacity);
+    }
+
+    table->local_names[table->local_count] = name;
+    table->local_slots[table->local_count] = slot;
+    table->local_count++;
+}
+
+void symbol_table_pop_locals(SymbolTable *table, int local_count) {
+    table->local_count = local_count;
+}
+
+int symbol_table_lookup_function(SymbolTable *table, String *name) {
+    for (int i = 0; i < table->function_count; i++) {
+        if (strcmp(table->function_names[i]->data, name->data) == 0) {
+            return table->function_indices[i];
+        }
+    }
+
+    // Not found
+    return -1;
+}
+
+void symbol_table_define_function(SymbolTable *table, String *name, int index) {
+    // Check if we need to resize
+    if (table->function_count >= table->function_capacity) {
+        table->function_capacity *= 2;
+        table->function_names = realloc(table->function_names, sizeof(String*) * table->function_capacity);
+        table->function_indices = realloc(table->function_indices, sizeof(int) * table->function_capacity);
+    }
+
+    table->function_names[table->function_count] = name;
+    table->function_indices[table->function_count] = index;
+    table->function_count++;
+}
+
 BytecodeBuf* bytecode_create() {
     BytecodeBuf *buf = malloc(sizeof(BytecodeBuf));
     buf->count = 0;
     buf->cap = 8;
+    buf->depth = 0;
     buf->instructions = malloc(sizeof(Instruction) * buf->cap);
+    buf->function_count = 0;
+    buf->function_cap = 8;
+    buf->functions = malloc(sizeof(FunctionProto) * buf->function_cap);
+    buf->function_names = malloc(sizeof(String*) * buf->function_cap);
+    buf->source_map_count = 0;
+    buf->source_map_cap = 8;
+    buf->source_map = malloc(sizeof(SourceMapEntry) * buf->source_map_cap);
+    buf->pos = (SourcePos){0, 0};
+    buf->function = -1;
     return buf;
 }
 
 void bytecode_free(BytecodeBuf *bbuf) {
     free(bbuf->instructions);
+    free(bbuf->functions);
+    free(bbuf->function_names);
+    free(bbuf->source_map);
     free(bbuf);
 }
 
+int bytecode_add_function(BytecodeBuf *bbuf, FunctionProto function) {
+    if (bbuf->function_count >= bbuf->function_cap) {
+        bbuf->function_cap *= 2;
+        bbuf->functions = realloc(bbuf->functions, sizeof(FunctionProto) * bbuf->function_cap);
+        bbuf->function_names = realloc(bbuf->function_names, sizeof(String*) * bbuf->function_cap);
+    }
+    bbuf->functions[bbuf->function_count] = function;
+    bbuf->function_names[bbuf->function_count] = NULL;
+    return bbuf->function_count++;
+}
+
+// Starts a new source map entry at the next instruction, unless it would continue the last one
+static void bytecode_map_source(BytecodeBuf *bbuf) {
+    if (bbuf->source_map_count > 0) {
+        SourceMapEntry *last = &bbuf->source_map[bbuf->source_map_count - 1];
+        if (last->function == bbuf->function && last->pos.line == bbuf->pos.line && last->pos.col == bbuf->pos.col) {
+            return;
+        }
+    }
+    if (bbuf->source_map_count >= bbuf->source_map_cap) {
+        bbuf->source_map_cap *= 2;
+        bbuf->source_map = realloc(bbuf->source_map, sizeof(SourceMapEntry) * bbuf->source_map_cap);
+    }
+    bbuf->source_map[bbuf->source_map_count++] = (SourceMapEntry){
+        .pc = (int)bbuf->count,
+        .function = bbuf->function,
+        .pos = bbuf->pos
+    };
+}
+
 void bytecode_emit(BytecodeBuf *bbuf, Instruction insn) {
     if (bbuf->count >= bbuf->cap) {
         bbuf->cap *= 2;
         bbuf->instructions = realloc(bbuf->instructions, sizeof(Instruction) * bbuf->cap);
     }
+    bytecode_map_source(bbuf);
     bbuf->instructions[bbuf->count++] = insn;
+    bbuf->depth += instruction_stack_effect(insn, bbuf->functions);
+}
+
+SourceMapEntry *bytecode_source(BytecodeBuf *bbuf, int pc) {
+    if (pc < 0 || pc >= (int)bbuf->count) {
+        return NULL;
+    }
+
+    // Last entry starting at or before pc
+    int low = 0;
+    int high = bbuf->source_map_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (bbuf->source_map[mid].pc <= pc) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return &bbuf->source_map[low];
+}
+
+const char *bytecode_function_name(BytecodeBuf *bbuf, int function) {
+    if (function < 0) {
+        return "main";
+    }
+    return bbuf->function_names[function] ? bbuf->function_names[function]->data : "lambda";
+}
+
+// Makes the instructions emitted from here on map to the given node
+// @return The position to restore once the node is compiled
+static SourcePos codegen_enter(ASTProgram *program, int node, BytecodeBuf *bbuf) {
+    SourcePos outer = bbuf->pos;
+    bbuf->pos = ast_position(program, node);
+    return outer;
+}
+
+// Emits a load of the named variable. Names are looked up as locals of the function being
+// compiled, then variables captured from enclosing functions, then globals, and finally
+// user-defined functions (which are loaded as closures).
+static void codegen_load_variable(String *name, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    int slot = symbol_table_lookup_local(symtable, name);
+    if (slot != -1) {
+        bytecode_emit(bbuf, (Instruction){OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = slot}});
+        return;
+    }
+
+    int capture = symbol_table_resolve_capture(symtable, name);
+    if (capture != -1) {
+        bytecode_emit(bbuf, (Instruction){OP_LOAD_CAPTURE, {.type = VAL_INTEGER, .as.integer = capture}});
+        return;
+    }
+
+    int var_location = symbol_table_lookup(symtable, name);
+    if (var_location != -1) {
+        bytecode_emit(
+            bbuf, 
+            (Instruction){
+                OP_LOAD_VAR, 
+                {
+                    .type = VAL_INTEGER, 
+                    .as.integer = var_location
+                }
+            }
+        );
+        return;
+    }
+
+    int function_index = symbol_table_lookup_function(symtable, name);
+    if (function_index != -1) {
+        bytecode_emit(bbuf, (Instruction){OP_MAKE_CLOSURE, {.type = VAL_INTEGER, .as.integer = function_index}});
+        return;
+    }
+
+    char err_msg[256];
+    snprintf(err_msg, sizeof(err_msg), "Undefined variable: %s\n", name->data);
+    codegen_error(err_msg);
+}
+
+// Checks that a parameter list is a list literal of symbols
+static void codegen_check_params(ASTProgram *program, int params_node, char *form_name) {
+    if (ast_type(program, params_node) != AST_LITERAL_LIST) {
+        char err_msg[256];
+        snprintf(err_msg, sizeof(err_msg), "%s: expected a list of parameter names\n", form_name);
+        codegen_error(err_msg);
+    }
+    for (int i = 0; i < ast_child_count(program, params_node); i++) {
+        if (ast_type(program, ast_child(program, params_node, i)) != AST_SYMBOL) {
+            char err_msg[256];
+            snprintf(err_msg, sizeof(err_msg), "%s: parameter names must be symbols\n", form_name);
+            codegen_error(err_msg);
+        }
+    }
+}
+
+// Binary opcodes and their forms for operands of a known type
+static const struct {
+    OpCode generic;
+    OpCode integers;
+    OpCode floats;
+} specialized_ops[] = {
+    {OP_ADD, OP_ADD_II, OP_ADD_FF},
+    {OP_SUB, OP_SUB_II, OP_SUB_FF},
+    {OP_MUL, OP_MUL_II, OP_MUL_FF},
+    {OP_EQ, OP_EQ_II, OP_EQ_FF},
+    {OP_NEQ, OP_NEQ_II, OP_NEQ_FF},
+    {OP_LT, OP_LT_II, OP_LT_FF},
+    {OP_LTE, OP_LTE_II, OP_LTE_FF},
+    {OP_GT, OP_GT_II, OP_GT_FF},
+    {OP_GTE, OP_GTE_II, OP_GTE_FF},
+};
+
+// Returns the form of opCode that skips the VM's type checks, if both operands
+// are proven to be integers or both floats. Otherwise returns opCode unchanged.
+static OpCode codegen_specialize(OpCode opCode, StaticType first, StaticType second) {
+    if (first != second || (first != TYPE_INTEGER && first != TYPE_FLOAT)) {
+        return opCode;
+    }
+
+    for (size_t i = 0; i < sizeof(specialized_ops) / sizeof(specialized_ops[0]); i++) {
+        if (specialized_ops[i].generic == opCode) {
+            return first == TYPE_INTEGER ? specialized_ops[i].integers : specialized_ops[i].floats;
+        }
+    }
+    return opCode;
 }
 
 // Helper to compile functions that take an exact number of arguments
 static void codegen_function_exact_args(
-    ASTNode *node,
+    ASTProgram *program,
+    int node,
     BytecodeBuf *bbuf,
     SymbolTable *symtable,
     OpCode opCode,
     char *func_name,
     size_t arg_count
 ) {
-    if (node->list.count != (int)arg_count + 1) {
+    if (ast_child_count(program, node) != (int)arg_count + 1) {
         char err_msg[256];
         sprintf(err_msg, "Function '%s' expects exactly %zu arguments\n", func_name, arg_count);
         codegen_error(err_msg);
     }
 
     // Compile all argument expressions
-    for (int i = 1; i < node->list.count; i++) {
-        codegen_compile_expr(node->list.children[i], bbuf, symtable);
+    for (int i = 1; i < ast_child_count(program, node); i++) {
+        codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
+    }
+
+    if (arg_count == 2) {
+        opCode = codegen_specialize(
+            opCode,
+            typeinfer_node_type(program, ast_child(program, node, 1)),
+            typeinfer_node_type(program, ast_child(program, node, 2))
+        );
     }
 
     // Add function opcode
@@ -109,44 +425,197 @@ static void codegen_function_exact_args(
 
 // Helper to compile functions that take two or more arguments
 static void codegen_function_twoplus_args(
-    ASTNode *node,
+    ASTProgram *program,
+    int node,
     BytecodeBuf *bbuf,
     SymbolTable *symtable,
     OpCode opCode,
     char *func_name
 ) {
-    if (node->list.count < 3) {
+    if (ast_child_count(program, node) < 3) {
         char err_msg[256];
         sprintf(err_msg, "Function '%s' expects at least 2 arguments\n", func_name);
         codegen_error(err_msg);
     }
 
     // Compile all argument expressions
-    for (int i = 1; i < node->list.count; i++) {
-        codegen_compile_expr(node->list.children[i], bbuf, symtable);
+    for (int i = 1; i < ast_child_count(program, node); i++) {
+        codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
     }
 
-    // Add enough + instructions to sum all arguments
-    for (int i = 1; i < node->list.count - 1; i++) {
-        bytecode_emit(bbuf, (Instruction){opCode, {0}});
+    // Add enough + instructions to sum all arguments.
+    // They combine from the right, so track the type of the running result.
+    int last = ast_child_count(program, node) - 1;
+    StaticType result_type = typeinfer_node_type(program, ast_child(program, node, last));
+    for (int i = last - 1; i >= 1; i--) {
+        StaticType arg_type = typeinfer_node_type(program, ast_child(program, node, i));
+        bytecode_emit(bbuf, (Instruction){codegen_specialize(opCode, arg_type, result_type), {0}});
+
+        if (arg_type == TYPE_INTEGER && result_type == TYPE_INTEGER) {
+            result_type = TYPE_INTEGER;
+        }
+        else if (
+            (arg_type == TYPE_INTEGER || arg_type == TYPE_FLOAT) &&
+            (result_type == TYPE_INTEGER || result_type == TYPE_FLOAT)
+        ) {
+            result_type = TYPE_FLOAT;
+        }
+        else {
+            result_type = TYPE_UNKNOWN;
+        }
+    }
+}
+
+// Forward declaration
+static void codegen_function_call(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable, bool tail);
+
+// Compiles an expression in tail position of a function body, where a call to a
+// user-defined function can replace the current frame instead of pushing a new one
+static void codegen_compile_tail(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    if (ast_type(program, node) == AST_LIST) {
+        SourcePos outer = codegen_enter(program, node, bbuf);
+        codegen_function_call(program, node, bbuf, symtable, true);
+        bbuf->pos = outer;
+    }
+    else {
+        codegen_compile_expr(program, node, bbuf, symtable);
+    }
+}
+
+// Helper to compile a sequence of expressions (children first_child onwards) where
+// only the value of the last one is kept on the stack
+static void codegen_body(
+    ASTProgram *program,
+    int node,
+    int first_child,
+    BytecodeBuf *bbuf,
+    SymbolTable *symtable,
+    bool tail
+) {
+    int count = ast_child_count(program, node);
+    for (int i = first_child; i < count; i++) {
+        if (i > first_child) {
+            bytecode_emit(bbuf, (Instruction){OP_DISCARD, {0}});
+        }
+
+        if (tail && i == count - 1) {
+            codegen_compile_tail(program, ast_child(program, node, i), bbuf, symtable);
+        }
+        else {
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
+        }
     }
 }
 
-void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtable) {
-    if (node->type != AST_LIST) {
+// Helper to call a closure that is only known at runtime. The closure goes on the
+// stack below the arguments.
+static void codegen_closure_call(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable, bool tail) {
+    for (int i = 0; i < ast_child_count(program, node); i++) {
+        codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
+    }
+
+    int arg_count = ast_child_count(program, node) - 1;
+    bytecode_emit(bbuf, (Instruction){tail ? OP_TAIL_CALL_CLOSURE : OP_CALL_CLOSURE, {.type = VAL_INTEGER, .as.integer = arg_count}});
+}
+
+// Compiles (lambda [params] body...): the body goes in place with a jump around it,
+// followed by code that copies the variables it captures into a new closure
+static void codegen_lambda(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    if (ast_child_count(program, node) < 3) {
+        codegen_error("lambda expects a parameter list and at least 1 body expression");
+    }
+
+    int params_node = ast_child(program, node, 1);
+    codegen_check_params(program, params_node, "lambda");
+    int arity = ast_child_count(program, params_node);
+    int index = bytecode_add_function(bbuf, (FunctionProto){.entry = -1, .arity = arity, .capture_count = 0});
+
+    // Jump placeholder (the body only runs when called)
+    int jmp_past_body_insn_idx = bbuf->count;
+    bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}}); // Placeholder for jump address
+    bytecode_emit(bbuf, (Instruction){OP_JMP, {0}});
+    bbuf->functions[index].entry = bbuf->count;
+
+    // The arguments are the first slots of the new frame
+    int outer_depth = bbuf->depth;
+    symbol_table_push_scope(symtable);
+    bbuf->depth = arity;
+    for (int i = 0; i < arity; i++) {
+        symbol_table_push_local(symtable, ast_payload(program, ast_child(program, params_node, i))->symbol, i);
+    }
+
+    // Compiling the body finds the variables it needs from enclosing functions
+    int outer_function = bbuf->function;
+    bbuf->function = index;
+    codegen_body(program, node, 2, bbuf, symtable, true);
+    bytecode_emit(bbuf, (Instruction){OP_RET, {0}});
+    bbuf->function = outer_function;
+
+    FunctionScope *fscope = &symtable->scopes[symtable->scope_count - 1];
+    int capture_count = fscope->capture_count;
+    String **capture_names = fscope->capture_names;
+    fscope->capture_names = NULL; // Still needed after the scope is gone
+    symbol_table_pop_scope(symtable);
+    bbuf->depth = outer_depth;
+
+    // Fix jump placeholder
+    bbuf->instructions[jmp_past_body_insn_idx].operand.as.integer = bbuf->count;
+
+    // Copy the captured values into the closure
+    for (int i = 0; i < capture_count; i++) {
+        codegen_load_variable(capture_names[i], bbuf, symtable);
+    }
+    free(capture_names);
+    bbuf->functions[index].capture_count = capture_count;
+    bytecode_emit(bbuf, (Instruction){OP_MAKE_CLOSURE, {.type = VAL_INTEGER, .as.integer = index}});
+}
+
+// Compiles a call (or special form) given as a list node. If tail is true, the
+// call is in tail position of a function body.
+static void codegen_function_call(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable, bool tail) {
+    if (ast_type(program, node) != AST_LIST) {
         codegen_error("Expected AST_LIST node for function call");
     }
     
     // Empty lists not supported.
-    if (node->list.count == 0) {
+    if (ast_child_count(program, node) == 0) {
         codegen_error("Cannot compile empty function call");
     }
 
-    ASTNode *func_node = node->list.children[0];
-    if (func_node->type != AST_SYMBOL) {
-        codegen_error("Expected function name to be a symbol");
+    int func_node = ast_child(program, node, 0);
+    if (ast_type(program, func_node) != AST_SYMBOL) {
+        // Calling the result of an expression, e.g. ((lambda [x] x) 1)
+        codegen_closure_call(program, node, bbuf, symtable, tail);
+        return;
+    }
+    String *func_name = ast_payload(program, func_node)->symbol;
+
+    // Local variables (which may hold closures) shadow all functions
+    if (
+        symbol_table_lookup_local(symtable, func_name) != -1 ||
+        symbol_table_resolve_capture(symtable, func_name) != -1
+    ) {
+        codegen_closure_call(program, node, bbuf, symtable, tail);
+        return;
+    }
+
+    // User-defined functions (these may shadow built-in functions)
+    int function_index = symbol_table_lookup_function(symtable, func_name);
+    if (function_index != -1) {
+        int arity = bbuf->functions[function_index].arity;
+        if (ast_child_count(program, node) != arity + 1) {
+            char err_msg[256];
+            snprintf(err_msg, sizeof(err_msg), "Function '%s' expects exactly %d arguments\n", func_name->data, arity);
+            codegen_error(err_msg);
+        }
+
+        // Arguments are left on the stack and become the callee's first slots
+        for (int i = 1; i < ast_child_count(program, node); i++) {
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
+        }
+        bytecode_emit(bbuf, (Instruction){tail ? OP_TAIL_CALL : OP_CALL, {.type = VAL_INTEGER, .as.integer = function_index}});
+        return;
     }
-    String *func_name = func_node->symbol;
 
 
     //////////////////////////////////////////////////////////
@@ -155,19 +624,31 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
 
     // define (variable definition)
     if (strcmp(func_name->data, "define") == 0) {
-        if (node->list.count != 3) {
+        if (ast_child_count(program, node) != 3) {
             codegen_error("define expects exactly 2 arguments");
         }
 
-        ASTNode *var_name_node = node->list.children[1];
-        if (var_name_node->type != AST_SYMBOL) {
+        int var_name_node = ast_child(program, node, 1);
+        if (ast_type(program, var_name_node) != AST_SYMBOL) {
             codegen_error("define: first argument must be a symbol");
         }
-        String *var_name = var_name_node->symbol;
+        String *var_name = ast_payload(program, var_name_node)->symbol;
 
         // Compile the value expression
-        ASTNode *value_node = node->list.children[2];
-        codegen_compile_expr(value_node, bbuf, symtable);
+        int value_node = ast_child(program, node, 2);
+        codegen_compile_expr(program, value_node, bbuf, symtable);
+
+        // Redefining a local variable just overwrites its stack slot
+        int slot = symbol_table_lookup_local(symtable, var_name);
+        if (slot != -1) {
+            bytecode_emit(bbuf, (Instruction){OP_STORE_LOCAL, {.type = VAL_INTEGER, .as.integer = slot}});
+            return;
+        }
+
+        // Closures hold copies of captured variables, so assigning one would only change the copy
+        if (symbol_table_resolve_capture(symtable, var_name) != -1) {
+            codegen_error("define: cannot change a variable captured from an enclosing function");
+        }
 
         // Define the variable in the symbol table
         int location = symbol_table_define(symtable, var_name);
@@ -182,22 +663,67 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
         return;
     }
 
+    // defun (only reaches here when not at the top level)
+    else if (strcmp(func_name->data, "defun") == 0) {
+        codegen_error("defun is only allowed at the top level");
+    }
+
+    // lambda (anonymous function)
+    else if (strcmp(func_name->data, "lambda") == 0) {
+        codegen_lambda(program, node, bbuf, symtable);
+    }
+
     // do (sequence of expressions)
     else if (strcmp(func_name->data, "do") == 0) {
-        if (node->list.count < 2) {
+        if (ast_child_count(program, node) < 2) {
             codegen_error("do expects at least 1 argument");
         }
 
         // Compile all expressions in sequence
-        for (int i = 1; i < node->list.count; i++) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
-        }
         // (The value of the last expression will be the result)
+        codegen_body(program, node, 1, bbuf, symtable, tail);
+    }
+
+    // let (local variables)
+    else if (strcmp(func_name->data, "let") == 0) {
+        if (ast_child_count(program, node) < 3) {
+            codegen_error("let expects a binding list and at least 1 body expression");
+        }
+
+        int bindings_node = ast_child(program, node, 1);
+        if (
+            ast_type(program, bindings_node) != AST_LITERAL_LIST ||
+            ast_child_count(program, bindings_node) % 2 != 0
+        ) {
+            codegen_error("let: first argument must be a list of symbol/value pairs");
+        }
+
+        // Each value is left on the stack, and its slot becomes the variable.
+        // Earlier bindings are visible to later ones.
+        int outer_local_count = symtable->local_count;
+        int binding_count = ast_child_count(program, bindings_node) / 2;
+        for (int i = 0; i < binding_count; i++) {
+            int name_node = ast_child(program, bindings_node, 2 * i);
+            if (ast_type(program, name_node) != AST_SYMBOL) {
+                codegen_error("let: variable names must be symbols");
+            }
+
+            codegen_compile_expr(program, ast_child(program, bindings_node, 2 * i + 1), bbuf, symtable);
+            symbol_table_push_local(symtable, ast_payload(program, name_node)->symbol, bbuf->depth - 1);
+        }
+
+        codegen_body(program, node, 2, bbuf, symtable, tail);
+
+        // The locals go out of scope, so drop their slots from under the result
+        if (binding_count > 0) {
+            bytecode_emit(bbuf, (Instruction){OP_SLIDE, {.type = VAL_INTEGER, .as.integer = binding_count}});
+        }
+        symbol_table_pop_locals(symtable, outer_local_count);
     }
 
     // while (loop)
     else if (strcmp(func_name->data, "while") == 0) {
-        if (node->list.count < 3) {
+        if (ast_child_count(program, node) < 3) {
             codegen_error("while expects at least 2 arguments");
         }
 
@@ -205,16 +731,17 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
         int loop_start_addr = bbuf->count;
 
         // Compile condition expression
-        codegen_compile_expr(node->list.children[1], bbuf, symtable);
+        codegen_compile_expr(program, ast_child(program, node, 1), bbuf, symtable);
 
         // Jump if false placeholder
         int jmp_false_insn_index = bbuf->count;
-        bytecode_emit(bbuf, (Instruction){OP_HALT, {0}}); // Placeholder for jump address
+        bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}}); // Placeholder for jump address
         bytecode_emit(bbuf, (Instruction){OP_JMP_IF_FALSE, {0}});
 
-        // Compile body
-        for (int i = 2; i < node->list.count; i++) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
+        // Compile body, dropping the value of each expression so the stack doesn't grow per iteration
+        for (int i = 2; i < ast_child_count(program, node); i++) {
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
+            bytecode_emit(bbuf, (Instruction){OP_DISCARD, {0}});
         }
 
         // Jump back to loop start
@@ -223,160 +750,178 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
 
         // Fix up the jump false instruction to jump here
         int end_addr = bbuf->count;
-        bbuf->instructions[jmp_false_insn_index].opCode = OP_PUSH;
-        bbuf->instructions[jmp_false_insn_index].operand.type = VAL_INTEGER;
         bbuf->instructions[jmp_false_insn_index].operand.as.integer = end_addr;
+
+        // The loop itself evaluates to false
+        bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_BOOL, .as.boolean = false}});
     }
 
     // if (conditional)
     else if (strcmp(func_name->data, "if") == 0) {
-        if (node->list.count != 4) {
+        if (ast_child_count(program, node) != 4) {
             codegen_error("if expects exactly 3 arguments");
         }
 
         // Compile condition expression
-        codegen_compile_expr(node->list.children[1], bbuf, symtable);
+        codegen_compile_expr(program, ast_child(program, node, 1), bbuf, symtable);
 
         // Jump if false placeholder (jump past "then" block)
         int jmp_past_then_insn_idx = bbuf->count;
-        bytecode_emit(bbuf, (Instruction){OP_HALT, {0}}); // Placeholder for jump address
+        bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}}); // Placeholder for jump address
         bytecode_emit(bbuf, (Instruction){OP_JMP_IF_FALSE, {0}});
+        int branch_depth = bbuf->depth;
 
         // Compile "then" block
-        codegen_compile_expr(node->list.children[2], bbuf, symtable);
+        if (tail) {
+            codegen_compile_tail(program, ast_child(program, node, 2), bbuf, symtable);
+        }
+        else {
+            codegen_compile_expr(program, ast_child(program, node, 2), bbuf, symtable);
+        }
 
         // Jump placeholder (jump past "else" block)
         int jmp_past_else_insn_idx = bbuf->count;
-        bytecode_emit(bbuf, (Instruction){OP_HALT, {0}}); // Placeholder for jump address
+        bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}}); // Placeholder for jump address
         bytecode_emit(bbuf, (Instruction){OP_JMP, {0}});
 
         // Fix jump placeholder #1
         int past_then_addr = bbuf->count;
-        bbuf->instructions[jmp_past_then_insn_idx].opCode = OP_PUSH;
-        bbuf->instructions[jmp_past_then_insn_idx].operand.type = VAL_INTEGER;
         bbuf->instructions[jmp_past_then_insn_idx].operand.as.integer = past_then_addr;
 
-        // Compile "else" block
-        codegen_compile_expr(node->list.children[3], bbuf, symtable);
+        // Compile "else" block, which starts with the stack as it was before the "then" block
+        bbuf->depth = branch_depth;
+        if (tail) {
+            codegen_compile_tail(program, ast_child(program, node, 3), bbuf, symtable);
+        }
+        else {
+            codegen_compile_expr(program, ast_child(program, node, 3), bbuf, symtable);
+        }
 
         // Fix jump placeholder #2
         int past_else_addr = bbuf->count;
-        bbuf->instructions[jmp_past_else_insn_idx].opCode = OP_PUSH;
-        bbuf->instructions[jmp_past_else_insn_idx].operand.type = VAL_INTEGER;
         bbuf->instructions[jmp_past_else_insn_idx].operand.as.integer = past_else_addr;
     }
 
     // list (create list)
     else if (strcmp(func_name->data, "list") == 0) {
-        if (node->list.count < 1) {
+        if (ast_child_count(program, node) < 1) {
             codegen_error("list expects at least 0 arguments");
         }
 
         // Compile all element expressions
-        for (int i = 1; i < node->list.count; i++) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
+        for (int i = 1; i < ast_child_count(program, node); i++) {
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
         }
 
         // Emit MAKE_LIST instruction
         Instruction make_list_insn;
         make_list_insn.opCode = OP_MAKE_LIST;
         make_list_insn.operand.type = VAL_INTEGER;
-        make_list_insn.operand.as.integer = node->list.count - 1; // Number of elements
+        make_list_insn.operand.as.integer = ast_child_count(program, node) - 1; // Number of elements
         bytecode_emit(bbuf, make_list_insn);
     }
 
     // list-append (append to list)
     else if (strcmp(func_name->data, "list-append") == 0) {
-        if (node->list.count < 2) {
+        if (ast_child_count(program, node) < 2) {
             codegen_error("list-append expects at least 1 argument");
         }
 
         // Compile all argument expressions in reverse order
         // (Because the opcode will pop them in order, we need to push them in reverse order)
-        for (int i = node->list.count - 1; i > 0; i--) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
+        for (int i = ast_child_count(program, node) - 1; i > 0; i--) {
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
         }
 
         // Emit enough LIST_APPEND instructions
-        for (int i = 2; i < node->list.count; i++) {
+        for (int i = 2; i < ast_child_count(program, node); i++) {
             bytecode_emit(bbuf, (Instruction){OP_LIST_APPEND, {0}});
         }
     }
 
     // list-sublist
     else if (strcmp(func_name->data, "list-sublist") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LIST_SUBLIST, "list-sublist", 3);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LIST_SUBLIST, "list-sublist", 3);
     }
 
     // list-remove
     else if (strcmp(func_name->data, "list-remove") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LIST_REMOVE, "list-remove", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LIST_REMOVE, "list-remove", 2);
     }
 
     // list-set
     else if (strcmp(func_name->data, "list-set") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LIST_SET, "list-set", 3);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LIST_SET, "list-set", 3);
     }
 
     // list-get
     else if (strcmp(func_name->data, "list-get") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LIST_GET, "list-get", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LIST_GET, "list-get", 2);
     }
 
     // list-length
     else if (strcmp(func_name->data, "list-length") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LIST_LEN, "list-length", 1);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LIST_LEN, "list-length", 1);
+    }
+
+    // heap-snapshot
+    else if (strcmp(func_name->data, "heap-snapshot") == 0) {
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_HEAP_SNAPSHOT, "heap-snapshot", 1);
     }
 
     // + (addition)
     else if (strcmp(func_name->data, "+") == 0) {
-        codegen_function_twoplus_args(node, bbuf, symtable, OP_ADD, "+");
+        codegen_function_twoplus_args(program, node, bbuf, symtable, OP_ADD, "+");
     }
 
     // - (subtraction)
     else if (strcmp(func_name->data, "-") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_SUB, "-", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_SUB, "-", 2);
     }
 
     // * (multiplication)
     else if (strcmp(func_name->data, "*") == 0) {
-        codegen_function_twoplus_args(node, bbuf, symtable, OP_MUL, "*");
+        codegen_function_twoplus_args(program, node, bbuf, symtable, OP_MUL, "*");
     }
 
     // / (division)
     else if (strcmp(func_name->data, "/") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_DIV, "/", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_DIV, "/", 2);
     }
 
     // % (modulo)
     else if (strcmp(func_name->data, "%") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_MOD, "%", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_MOD, "%", 2);
     }
 
     // and (logic)
     else if (strcmp(func_name->data, "and") == 0) {
-        codegen_function_twoplus_args(node, bbuf, symtable, OP_LOGIC_AND, "and");
+        codegen_function_twoplus_args(program, node, bbuf, symtable, OP_LOGIC_AND, "and");
     }
 
     // or (logic)
     else if (strcmp(func_name->data, "or") == 0) {
-        codegen_function_twoplus_args(node, bbuf, symtable, OP_LOGIC_OR, "or");
+        codegen_function_twoplus_args(program, node, bbuf, symtable, OP_LOGIC_OR, "or");
     }
 
     // not (logic)
     else if (strcmp(func_name->data, "not") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LOGIC_NOT, "not", 1);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LOGIC_NOT, "not", 1);
     }
 
     // print
     else if (strcmp(func_name->data, "print") == 0) {
-        if (node->list.count < 2) {
+        if (ast_child_count(program, node) < 2) {
             codegen_error("print expects at least 1 argument");
         }
 
         // Compile all argument expressions
-        for (int i = 1; i < node->list.count; i++) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
+        for (int i = 1; i < ast_child_count(program, node); i++) {
+            if (i > 1) {
+                // Only the last argument is returned
+                bytecode_emit(bbuf, (Instruction){OP_DISCARD, {0}});
+            }
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
 
             // Print each argument
             bytecode_emit(bbuf, (Instruction){OP_PRINT, {0}});
@@ -385,13 +930,17 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
 
     // println
     else if (strcmp(func_name->data, "println") == 0) {
-        if (node->list.count < 2) {
+        if (ast_child_count(program, node) < 2) {
             codegen_error("println expects at least 1 argument");
         }
 
         // Compile all argument expressions
-        for (int i = 1; i < node->list.count; i++) {
-            codegen_compile_expr(node->list.children[i], bbuf, symtable);
+        for (int i = 1; i < ast_child_count(program, node); i++) {
+            if (i > 1) {
+                // Only the last argument is returned
+                bytecode_emit(bbuf, (Instruction){OP_DISCARD, {0}});
+            }
+            codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
 
             // Print each argument
             bytecode_emit(bbuf, (Instruction){OP_PRINTLN, {0}});
@@ -400,23 +949,23 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
 
     // concat (string concatenation)
     else if (strcmp(func_name->data, "concat") == 0) {
-        codegen_function_twoplus_args(node, bbuf, symtable, OP_CONCATSTR, "concat");
+        codegen_function_twoplus_args(program, node, bbuf, symtable, OP_CONCATSTR, "concat");
     }
 
     // substr (substring)
     else if (strcmp(func_name->data, "substr") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_SUBSTR, "substr", 3);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_SUBSTR, "substr", 3);
     }
 
     // char-at (get character from string)
     else if (strcmp(func_name->data, "char-at") == 0) {
-        if (node->list.count != 3) {
+        if (ast_child_count(program, node) != 3) {
             codegen_error("char-at expects exactly 2 arguments");
         }
 
         // Compile args: string, index, and constant length 1 for the substring length
-        codegen_compile_expr(node->list.children[1], bbuf, symtable);
-        codegen_compile_expr(node->list.children[2], bbuf, symtable);
+        codegen_compile_expr(program, ast_child(program, node, 1), bbuf, symtable);
+        codegen_compile_expr(program, ast_child(program, node, 2), bbuf, symtable);
         bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}});
 
         // Add function opcode
@@ -425,61 +974,66 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
 
     // = (numerical equality)
     else if (strcmp(func_name->data, "=") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_EQ, "=", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_EQ, "=", 2);
     }
     
     // == (also numerical equality)
     else if (strcmp(func_name->data, "==") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_EQ, "==", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_EQ, "==", 2);
     }
 
     // != (numerical inequality)
     else if (strcmp(func_name->data, "!=") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_NEQ, "!=", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_NEQ, "!=", 2);
     }
 
     // < (numerical less than)
     else if (strcmp(func_name->data, "<") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LT, "<", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LT, "<", 2);
     }
 
     // <= (numerical less than or equal)
     else if (strcmp(func_name->data, "<=") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_LTE, "<=", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_LTE, "<=", 2);
     }
 
     // > (numerical greater than)
     else if (strcmp(func_name->data, ">") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_GT, ">", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_GT, ">", 2);
     }
 
     // >= (numerical greater than or equal)
     else if (strcmp(func_name->data, ">=") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_GTE, ">=", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_GTE, ">=", 2);
     }
 
     // str= (string equality)
     else if (strcmp(func_name->data, "str=") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_STR_EQ, "str=", 2);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_STR_EQ, "str=", 2);
     }
 
     // strlen (string length)
     else if (strcmp(func_name->data, "strlen") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_STRLEN, "strlen", 1);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_STRLEN, "strlen", 1);
     }
 
     // int2float
     else if (strcmp(func_name->data, "int2float") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_INT2FLOAT, "int2float", 1);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_INT2FLOAT, "int2float", 1);
     }
 
     // float2int
     else if (strcmp(func_name->data, "float2int") == 0) {
-        codegen_function_exact_args(node, bbuf, symtable, OP_FLOAT2INT, "float2int", 1);
+        codegen_function_exact_args(program, node, bbuf, symtable, OP_FLOAT2INT, "float2int", 1);
     }
 
 
 
+    // A global variable holding a closure
+    else if (symbol_table_lookup(symtable, func_name) != -1) {
+        codegen_closure_call(program, node, bbuf, symtable, tail);
+    }
+
     // Unsupported function
     else {
         char err_msg[256];
@@ -488,15 +1042,19 @@ void codegen_function_call(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtab
     }
 }
 
-void codegen_compile_expr(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtable) {
-    switch (node->type) {
+void codegen_compile_expr(ASTProgram *program,
+    int node, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    ASTPayload *payload = ast_payload(program, node);
+    SourcePos outer = codegen_enter(program, node, bbuf);
+
+    switch (ast_type(program, node)) {
 
         // Literals
         case AST_INTEGER: {
             Instruction insn;
             insn.opCode = OP_PUSH;
             insn.operand.type = VAL_INTEGER;
-            insn.operand.as.integer = node->integer;
+            insn.operand.as.integer = payload->integer;
             bytecode_emit(bbuf, insn);
             break;
         }
@@ -504,7 +1062,7 @@ void codegen_compile_expr(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtabl
             Instruction insn;
             insn.opCode = OP_PUSH;
             insn.operand.type = VAL_FLOAT;
-            insn.operand.as.floating = node->floating;
+            insn.operand.as.floating = payload->floating;
             bytecode_emit(bbuf, insn);
             break;
         }
@@ -512,7 +1070,7 @@ void codegen_compile_expr(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtabl
             Instruction insn;
             insn.opCode = OP_PUSH;
             insn.operand.type = VAL_BOOL;
-            insn.operand.as.boolean = node->boolean;
+            insn.operand.as.boolean = payload->boolean;
             bytecode_emit(bbuf, insn);
             break;
         }
@@ -520,59 +1078,139 @@ void codegen_compile_expr(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtabl
             Instruction insn;
             insn.opCode = OP_PUSH;
             insn.operand.type = VAL_STRING;
-            insn.operand.as.string = node->string;
+            insn.operand.as.string = payload->string;
             bytecode_emit(bbuf, insn);
             break;
         }
         // List literal e.g. [1 2 3]
         case AST_LITERAL_LIST: {
             // Compile all element expressions
-            for (int i = 0; i < node->list_literal.count; i++) {
-                codegen_compile_expr(node->list_literal.children[i], bbuf, symtable);
+            for (int i = 0; i < ast_child_count(program, node); i++) {
+                codegen_compile_expr(program, ast_child(program, node, i), bbuf, symtable);
             }
 
             // Emit MAKE_LIST instruction
             Instruction make_list_insn;
             make_list_insn.opCode = OP_MAKE_LIST;
             make_list_insn.operand.type = VAL_INTEGER;
-            make_list_insn.operand.as.integer = node->list_literal.count; // Number of elements
+            make_list_insn.operand.as.integer = ast_child_count(program, node); // Number of elements
             bytecode_emit(bbuf, make_list_insn);
             break;
         }
 
         // Symbols (lone symbol = variable load)
         case AST_SYMBOL: {
-            int var_location = symbol_table_lookup(symtable, node->symbol);
-            if (var_location == -1) {
-                char err_msg[256];
-                snprintf(err_msg, sizeof(err_msg), "Undefined variable: %s\n", node->symbol->data);
-                codegen_error(err_msg);
-            }
-
-            bytecode_emit(
-                bbuf, 
-                (Instruction){
-                    OP_LOAD_VAR, 
-                    {
-                        .type = VAL_INTEGER, 
-                        .as.integer = var_location
-                    }
-                }
-            );
+            codegen_load_variable(payload->symbol, bbuf, symtable);
             break;
         }
 
         // Function calls (lists)
         case AST_LIST: {
-            codegen_function_call(node, bbuf, symtable);
+            codegen_function_call(program, node, bbuf, symtable, false);
             break;
         }
     }
+    bbuf->pos = outer;
+}
+
+// Returns true if the node is a (defun ...) form
+static bool codegen_is_defun(ASTProgram *program, int node) {
+    return ast_type(program, node) == AST_LIST &&
+        ast_child_count(program, node) > 0 &&
+        ast_type(program, ast_child(program, node, 0)) == AST_SYMBOL &&
+        strcmp(ast_payload(program, ast_child(program, node, 0))->symbol->data, "defun") == 0;
+}
+
+// Registers the name and arity of a (defun name [params] body...) form
+static void codegen_declare_function(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    if (ast_child_count(program, node) < 4) {
+        codegen_error("defun expects a name, a parameter list and at least 1 body expression");
+    }
+
+    int name_node = ast_child(program, node, 1);
+    if (ast_type(program, name_node) != AST_SYMBOL) {
+        codegen_error("defun: function name must be a symbol");
+    }
+    String *name = ast_payload(program, name_node)->symbol;
+    if (symbol_table_lookup_function(symtable, name) != -1) {
+        char err_msg[256];
+        snprintf(err_msg, sizeof(err_msg), "Function '%s' is defined more than once\n", name->data);
+        codegen_error(err_msg);
+    }
+
+    int params_node = ast_child(program, node, 2);
+    codegen_check_params(program, params_node, "defun");
+
+    // The entry address is filled in when the body is compiled
+    int index = bytecode_add_function(
+        bbuf,
+        (FunctionProto){.entry = -1, .arity = ast_child_count(program, params_node), .capture_count = 0}
+    );
+    symbol_table_define_function(symtable, name, index);
+    bbuf->function_names[index] = name;
+}
+
+// Compiles the body of a declared function in place, with a jump around it
+static void codegen_defun(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    int index = symbol_table_lookup_function(symtable, ast_payload(program, ast_child(program, node, 1))->symbol);
+    int params_node = ast_child(program, node, 2);
+    int arity = ast_child_count(program, params_node);
+    SourcePos outer = codegen_enter(program, node, bbuf);
+
+    // Jump placeholder (the body only runs when called)
+    int jmp_past_body_insn_idx = bbuf->count;
+    bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}}); // Placeholder for jump address
+    bytecode_emit(bbuf, (Instruction){OP_JMP, {0}});
+    bbuf->functions[index].entry = bbuf->count;
+
+    // The arguments are the first slots of the new frame
+    int outer_depth = bbuf->depth;
+    symbol_table_push_scope(symtable);
+    bbuf->depth = arity;
+    for (int i = 0; i < arity; i++) {
+        symbol_table_push_local(symtable, ast_payload(program, ast_child(program, params_node, i))->symbol, i);
+    }
+
+    int outer_function = bbuf->function;
+    bbuf->function = index;
+    codegen_body(program, node, 3, bbuf, symtable, true);
+    bytecode_emit(bbuf, (Instruction){OP_RET, {0}});
+    bbuf->function = outer_function;
+
+    symbol_table_pop_scope(symtable);
+    bbuf->depth = outer_depth;
+
+    // Fix jump placeholder
+    bbuf->instructions[jmp_past_body_insn_idx].operand.as.integer = bbuf->count;
+
+    // The definition itself evaluates to true
+    bytecode_emit(bbuf, (Instruction){OP_PUSH, {.type = VAL_BOOL, .as.boolean = true}});
+    bbuf->pos = outer;
 }
 
 void codegen_compile(ASTProgram *program, BytecodeBuf *bbuf, SymbolTable *symtable) {
+    // Known operand types let arithmetic and comparisons skip the VM's type checks
+    typeinfer_program(program);
+
+    // Declare all functions first so they can be called before they are defined
+    for (int i = 0; i < program->count; i++) {
+        if (codegen_is_defun(program, program->expressions[i])) {
+            codegen_declare_function(program, program->expressions[i], bbuf, symtable);
+        }
+    }
+
     for (int i = 0; i < program->count; i++) {
-        codegen_compile_expr(program->expressions[i], bbuf, symtable);
+        if (i > 0) {
+            // Only the value of the last top-level expression stays on the stack
+            bytecode_emit(bbuf, (Instruction){OP_DISCARD, {0}});
+        }
+
+        if (codegen_is_defun(program, program->expressions[i])) {
+            codegen_defun(program, program->expressions[i], bbuf, symtable);
+        }
+        else {
+            codegen_compile_expr(program, program->expressions[i], bbuf, symtable);
+        }
     }
     bytecode_emit(bbuf, (Instruction){OP_HALT, {0}});
 }
@@ -5,6 +5,15 @@
 #include "parser.h"
 #include "vm.h"
 
+/**
+ * A run of instructions compiled from the same expression, which lasts until the next entry's pc
+ */
+typedef struct {
+    int pc; // Address of the first instruction of the run
+    int function; // Index of the function whose body the run is in, or -1 for top-level code
+    SourcePos pos; // Where the expression starts in the source
+} SourceMapEntry;
+
 /**
  * A buffer to hold generated bytecode instructions
  */
@@ -12,8 +21,30 @@ typedef struct {
     Instruction *instructions;
     size_t count;
     size_t cap;
+    int depth; // Number of values the emitted code leaves on the stack above the frame pointer
+
+    FunctionProto *functions; // Compiled functions, by index
+    String **function_names; // Name of each function, or NULL for lambdas (not owned)
+    int function_count;
+    int function_cap;
+
+    SourceMapEntry *source_map; // Where the instructions came from, in order of pc
+    int source_map_count;
+    int source_map_cap;
+    SourcePos pos; // Position of the expression being compiled, recorded for each instruction emitted
+    int function; // Function being compiled, or -1 for top-level code
 } BytecodeBuf;
 
+/**
+ * Compile state of a function body (or the top-level code) whose locals are in scope
+ */
+typedef struct {
+    int local_base; // Index of this function's first local in SymbolTable.local_names
+    String **capture_names; // Variables of enclosing functions copied into this function's closures (not owned)
+    int capture_count;
+    int capture_capacity;
+} FunctionScope;
+
 /**
  * A simple symbol table for variable storage
  */
@@ -22,6 +53,20 @@ typedef struct {
     int *locations;
     int count;
     int capacity;
+
+    String **local_names; // Local variables currently in scope, innermost last (not owned)
+    int *local_slots; // Stack slot of each local, relative to the frame pointer
+    int local_count;
+    int local_capacity;
+
+    String **function_names; // Names of user-defined functions (not owned)
+    int *function_indices; // Index of each function in BytecodeBuf.functions
+    int function_count;
+    int function_capacity;
+
+    FunctionScope *scopes; // Functions being compiled, innermost last. The first one is the top-level code.
+    int scope_count;
+    int scope_capacity;
 } SymbolTable;
 
 /**
@@ -40,15 +85,33 @@ void bytecode_free(BytecodeBuf *bbuf);
 void codegen_compile(ASTProgram *program, BytecodeBuf *bbuf, SymbolTable *symtable);
 
 /**
- * Compiles a single AST expression into bytecode instructions
+ * Compiles a single AST expression (given by its node index) into bytecode instructions
  */
-void codegen_compile_expr(ASTNode *node, BytecodeBuf *bbuf, SymbolTable *symtable);
+void codegen_compile_expr(ASTProgram *program, int node, BytecodeBuf *bbuf, SymbolTable *symtable);
 
 /**
  * Emits a single instruction into the given bytecode buffer
  */
 void bytecode_emit(BytecodeBuf *bbuf, Instruction insn);
 
+/**
+ * Adds a function to the given bytecode buffer, returning its index
+ * @return Index of the new function
+ */
+int bytecode_add_function(BytecodeBuf *bbuf, FunctionProto function);
+
+/**
+ * Looks up the source map entry of the instruction at the given address
+ * @return The entry, or NULL if the address is out of range
+ */
+SourceMapEntry *bytecode_source(BytecodeBuf *bbuf, int pc);
+
+/**
+ * Returns the name of a function for reports: its defun name, "lambda", or "main" for
+ * top-level code (index -1)
+ */
+const char *bytecode_function_name(BytecodeBuf *bbuf, int function);
+
 /**
  * Creates a new symbol table
  */
@@ -71,4 +134,48 @@ int symbol_table_lookup(SymbolTable *table, String *name);
  */
 int symbol_table_define(SymbolTable *table, String *name);
 
+/**
+ * Looks up a local variable of the function being compiled, innermost first
+ * @return Stack slot of the local relative to the frame pointer, or -1 if not found
+ */
+int symbol_table_lookup_local(SymbolTable *table, String *name);
+
+/**
+ * Brings a local variable into scope. The name is not copied.
+ */
+void symbol_table_push_local(SymbolTable *table, String *name, int slot);
+
+/**
+ * Takes local variables out of scope until only local_count of them remain
+ */
+void symbol_table_pop_locals(SymbolTable *table, int local_count);
+
+/**
+ * Looks up a user-defined function by name
+ * @return Index of the function, or -1 if not found
+ */
+int symbol_table_lookup_function(SymbolTable *table, String *name);
+
+/**
+ * Records the name of a user-defined function. The name is not copied.
+ */
+void symbol_table_define_function(SymbolTable *table, String *name, int index);
+
+/**
+ * Starts compiling the body of a new function inside the current one
+ */
+void symbol_table_push_scope(SymbolTable *table);
+
+/**
+ * Finishes compiling the innermost function body, taking its locals out of scope
+ */
+void symbol_table_pop_scope(SymbolTable *table);
+
+/**
+ * Looks up a variable that the function being compiled has to capture from an
+ * enclosing function, adding it to the function's captures on first use
+ * @return Capture index of the variable, or -1 if no enclosing function has it
+ */
+int symbol_table_resolve_capture(SymbolTable *table, String *name);
+
 #endif // CODEGEN_H
@@ -0,0 +1,324 @@
+#include "disasm.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "lexer.h"
+#include "verifier.h"
+
+#define DISASM_STRING_WIDTH (24) // Characters of a string operand shown before cutting it off
+
+static bool is_jump(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_JMP_IF || opCode == OP_JMP_IF_FALSE;
+}
+
+// Whether control never falls through to the instruction after this one
+static bool ends_flow(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_RET || opCode == OP_HALT ||
+        opCode == OP_TAIL_CALL || opCode == OP_TAIL_CALL_CLOSURE;
+}
+
+// Instructions that make a new string, list or closure every time they run
+static bool allocates(OpCode opCode) {
+    switch (opCode) {
+        case OP_MAKE_LIST:
+        case OP_MAKE_CLOSURE:
+        case OP_CONCATSTR:
+        case OP_SUBSTR:
+        case OP_LIST_APPEND:
+        case OP_LIST_SUBLIST:
+        case OP_LIST_REMOVE:
+        case OP_LIST_SET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_call(OpCode opCode) {
+    return opCode == OP_CALL || opCode == OP_TAIL_CALL ||
+        opCode == OP_CALL_CLOSURE || opCode == OP_TAIL_CALL_CLOSURE;
+}
+
+// Where the jump at pc goes, read from the OP_PUSH before it, or -1 if it isn't a jump or can't be known
+static int jump_target(BytecodeBuf *bbuf, size_t pc) {
+    if (pc == 0 || !is_jump(bbuf->instructions[pc].opCode)) {
+        return -1;
+    }
+    Instruction push = bbuf->instructions[pc - 1];
+    if (push.opCode != OP_PUSH || push.operand.type != VAL_INTEGER) {
+        return -1;
+    }
+    int target = push.operand.as.integer;
+    return target >= 0 && (size_t)target < bbuf->count ? target : -1;
+}
+
+// Function whose body the instruction at pc is in, or -1 for top-level code
+static int region_of(BytecodeBuf *bbuf, size_t pc) {
+    SourceMapEntry *entry = bytecode_source(bbuf, (int)pc);
+    return entry ? entry->function : -1;
+}
+
+// Adds the costs of the instructions from start to end that belong to the cost's function
+static void count_costs(BytecodeBuf *bbuf, LoopCost *cost) {
+    for (int pc = cost->start; pc <= cost->end; pc++) {
+        if (region_of(bbuf, pc) != cost->function) {
+            continue;
+        }
+        Instruction insn = bbuf->instructions[pc];
+        cost->instructions++;
+        cost->pushes += instruction_stack_outputs(insn.opCode);
+        cost->pops += instruction_stack_inputs(insn, bbuf->functions);
+        cost->allocations += allocates(insn.opCode);
+        cost->calls += is_call(insn.opCode);
+    }
+}
+
+LoopCost *disasm_loops(BytecodeBuf *bbuf, int *count) {
+    LoopCost *loops = malloc(sizeof(LoopCost) * (bbuf->count + 1));
+    *count = 0;
+    for (size_t pc = 0; pc < bbuf->count; pc++) {
+        Instruction insn = bbuf->instructions[pc];
+        int function = region_of(bbuf, pc);
+        int start = jump_target(bbuf, pc);
+        if (insn.opCode == OP_TAIL_CALL && insn.operand.as.integer == function) {
+            start = bbuf->functions[function].entry;
+        }
+        else if (start > (int)pc) {
+            start = -1;
+        }
+        if (start < 0) {
+            continue;
+        }
+        LoopCost *loop = &loops[(*count)++];
+        *loop = (LoopCost){.start = start, .end = (int)pc, .function = function};
+        count_costs(bbuf, loop);
+    }
+    return loops;
+}
+
+// Formats an instruction's operand for reading, cutting it off if it doesn't fit
+static void format_operand(BytecodeBuf *bbuf, Instruction insn, char *buf, size_t size) {
+    int n = insn.operand.as.integer;
+    buf[0] = '\0';
+    switch (insn.opCode) {
+        case OP_PUSH:
+            switch (insn.operand.type) {
+                case VAL_INTEGER:
+                    snprintf(buf, size, "%d", n);
+                    break;
+                case VAL_FLOAT:
+                    snprintf(buf, size, "%g", insn.operand.as.floating);
+                    break;
+                case VAL_BOOL:
+                    snprintf(buf, size, "%s", insn.operand.as.boolean ? "true" : "false");
+                    break;
+                case VAL_STRING: {
+                    String *string = insn.operand.as.string;
+                    bool cut = string->len > DISASM_STRING_WIDTH;
+                    snprintf(buf, size, "\"%.*s%s", cut ? DISASM_STRING_WIDTH : (int)string->len,
+                        string->data, cut ? "...\"" : "\"");
+                    // Keep each instruction on one line
+                    for (char *c = buf; *c; c++) {
+                        if (*c == '\n' || *c == '\t') {
+                            *c = ' ';
+                        }
+                    }
+                    break;
+                }
+                default:
+                    snprintf(buf, size, "<%s>", insn.operand.type == VAL_LIST ? "list" : "function");
+                    break;
+            }
+            break;
+        case OP_STORE_VAR:
+        case OP_LOAD_VAR:
+            snprintf(buf, size, "global %d", n);
+            break;
+        case OP_LOAD_LOCAL:
+        case OP_STORE_LOCAL:
+            snprintf(buf, size, "slot %d", n);
+            break;
+        case OP_LOAD_CAPTURE:
+            snprintf(buf, size, "capture %d", n);
+            break;
+        case OP_MAKE_LIST:
+            snprintf(buf, size, "%d values", n);
+            break;
+        case OP_SLIDE:
+            snprintf(buf, size, "%d", n);
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_MAKE_CLOSURE:
+            if (n >= 0 && n < bbuf->function_count) {
+                snprintf(buf, size, "%s (#%d)", bytecode_function_name(bbuf, n), n);
+            }
+            else {
+                snprintf(buf, size, "#%d", n);
+            }
+            break;
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+            snprintf(buf, size, "%d args", n);
+            break;
+        default:
+            break;
+    }
+}
+
+static void print_costs(LoopCost *cost, FILE *out) {
+    fprintf(out, "%d instructions, %d pushes, %d pops, %d allocations, %d calls",
+        cost->instructions, cost->pushes, cost->pops, cost->allocations, cost->calls);
+}
+
+void disasm_print(BytecodeBuf *bbuf, const char *source, FILE *out) {
+    size_t count = bbuf->count;
+
+    // Blocks start at the top-level code, at function entries, at jump targets and after
+    // instructions that don't fall through
+    bool *leaders = calloc(count + 1, sizeof(bool));
+    leaders[0] = true;
+    for (int i = 0; i < bbuf->function_count; i++) {
+        if (bbuf->functions[i].entry >= 0 && (size_t)bbuf->functions[i].entry < count) {
+            leaders[bbuf->functions[i].entry] = true;
+        }
+    }
+    for (size_t pc = 0; pc < count; pc++) {
+        int target = jump_target(bbuf, pc);
+        if (target >= 0) {
+            leaders[target] = true;
+        }
+        if (target >= 0 || ends_flow(bbuf->instructions[pc].opCode)) {
+            leaders[pc + 1] = true;
+        }
+    }
+
+    int *block_of = malloc(sizeof(int) * (count + 1));
+    int *block_starts = malloc(sizeof(int) * (count + 1));
+    int block_count = 0;
+    for (size_t pc = 0; pc < count; pc++) {
+        if (leaders[pc]) {
+            block_starts[block_count++] = (int)pc;
+        }
+        block_of[pc] = block_count - 1;
+    }
+
+    // Up to two successors of each block: where its last instruction jumps, and the next block
+    int (*successors)[2] = malloc(sizeof(int[2]) * (block_count + 1));
+    for (int b = 0; b < block_count; b++) {
+        int last = (b + 1 < block_count ? block_starts[b + 1] : (int)count) - 1;
+        OpCode op = bbuf->instructions[last].opCode;
+        int target = jump_target(bbuf, last);
+        successors[b][0] = target >= 0 ? block_of[target] : -1;
+        successors[b][1] = !ends_flow(op) && b + 1 < block_count ? b + 1 : -1;
+    }
+
+    int *depths = malloc(sizeof(int) * (count + 1));
+    bool verified = bytecode_stack_depths(
+        bbuf->instructions, count, bbuf->functions, bbuf->function_count, depths
+    );
+
+    int region = -2;
+    int line = 0;
+    for (size_t pc = 0; pc < count; pc++) {
+        Instruction insn = bbuf->instructions[pc];
+
+        int function = region_of(bbuf, pc);
+        if (function != region) {
+            if (function < 0) {
+                fprintf(out, "%s== main ==\n", pc > 0 ? "\n" : "");
+            }
+            else {
+                FunctionProto *proto = &bbuf->functions[function];
+                fprintf(out, "\n== %s (#%d, entry %d, %d arguments, %d captures) ==\n",
+                    bytecode_function_name(bbuf, function), function, proto->entry, proto->arity, proto->capture_count);
+            }
+            region = function;
+        }
+
+        if (leaders[pc]) {
+            int block = block_of[pc];
+            fprintf(out, "B%d:", block);
+            bool entry = pc == 0;
+            for (int i = 0; i < bbuf->function_count; i++) {
+                entry = entry || bbuf->functions[i].entry == (int)pc;
+            }
+            if (entry) {
+                fprintf(out, " entry");
+            }
+            const char *separator = " from ";
+            for (int b = 0; b < block_count; b++) {
+                if (successors[b][0] == block || successors[b][1] == block) {
+                    fprintf(out, "%sB%d", separator, b);
+                    separator = ", ";
+                }
+            }
+            fprintf(out, "\n");
+        }
+
+        SourceMapEntry *entry = bytecode_source(bbuf, (int)pc);
+        if (source && entry && entry->pos.line != 0 && entry->pos.line != line) {
+            line = entry->pos.line;
+            fprintf(out, "        ; %d: ", line);
+            source_print_line(source, line, out);
+            fprintf(out, "\n");
+        }
+
+        char operand[64];
+        format_operand(bbuf, insn, operand, sizeof(operand));
+        int target = jump_target(bbuf, pc);
+        if (target >= 0) {
+            snprintf(operand, sizeof(operand), "-> %d (B%d)", target, block_of[target]);
+        }
+        fprintf(out, "%6zu  %-20s %-24s", pc, opcode_name(insn.opCode), operand);
+        if (verified && depths[pc] >= 0) {
+            fprintf(out, " depth %d", depths[pc]);
+        }
+        fprintf(out, "\n");
+    }
+
+    // Costs of each function, top-level code first
+    fprintf(out, "\nFunctions (static counts, every instruction once):\n");
+    for (int function = -1; function < bbuf->function_count; function++) {
+        LoopCost cost = {.start = 0, .end = (int)count - 1, .function = function};
+        count_costs(bbuf, &cost);
+        int blocks = 0;
+        for (int b = 0; b < block_count; b++) {
+            blocks += region_of(bbuf, block_starts[b]) == function;
+        }
+        fprintf(out, "  %-20s %d blocks, ", bytecode_function_name(bbuf, function), blocks);
+        print_costs(&cost, out);
+        fprintf(out, "\n");
+    }
+
+    int loop_count;
+    LoopCost *loops = disasm_loops(bbuf, &loop_count);
+    fprintf(out, "\nLoops (one pass over each body, every instruction once): %d\n", loop_count);
+    for (int i = 0; i < loop_count; i++) {
+        LoopCost *loop = &loops[i];
+        fprintf(out, "  %d-%d in %s", loop->start, loop->end, bytecode_function_name(bbuf, loop->function));
+        SourceMapEntry *entry = bytecode_source(bbuf, loop->start);
+        if (entry && entry->pos.line != 0) {
+            fprintf(out, ", line %d", entry->pos.line);
+        }
+        fprintf(out, ": ");
+        print_costs(loop, out);
+        const char *separator = " (";
+        for (int pc = loop->start; pc <= loop->end; pc++) {
+            OpCode op = bbuf->instructions[pc].opCode;
+            if (allocates(op) && region_of(bbuf, pc) == loop->function) {
+                fprintf(out, "%s%s", separator, opcode_name(op));
+                separator = ", ";
+            }
+        }
+        fprintf(out, "%s\n", loop->allocations > 0 ? ")" : "");
+    }
+
+    free(loops);
+    free(depths);
+    free(successors);
+    free(block_starts);
+    free(block_of);
+    free(leaders);
+}
@@ -0,0 +1,40 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdio.h>
+
+#include "codegen.h"
+
+/**
+ * Static costs of one pass over a loop body, from its first instruction to the jump or tail
+ * call that goes back to it. Only instructions of the loop's own function are counted, and
+ * each is counted once, so branches the loop skips and inner loops' repeats aren't told apart.
+ */
+typedef struct {
+    int start; // Address the loop jumps back to
+    int end; // Address of the jump back
+    int function; // Function the loop is in, or -1 for top-level code
+    int instructions;
+    int pushes; // Values the instructions leave on the stack
+    int pops; // Values the instructions take off the stack
+    int allocations; // Instructions that make a string, list or closure
+    int calls;
+} LoopCost;
+
+/**
+ * Finds the loops in compiled code: backward jumps, and tail calls a function makes to itself
+ * @param count Set to the number of loops found
+ * @returns The loops in order of address of the jump back (to be freed by the caller)
+ */
+LoopCost *disasm_loops(BytecodeBuf *bbuf, int *count);
+
+/**
+ * Writes the code one instruction per line, split into basic blocks with their predecessors,
+ * with decoded operands, jump targets, the stack depth before each instruction (if the code
+ * can be verified) and the source lines it came from. Then writes the static costs of each
+ * function and each loop.
+ * @param source The program's text, or NULL to leave out the source lines
+ */
+void disasm_print(BytecodeBuf *bbuf, const char *source, FILE *out);
+
+#endif // DISASM_H
@@ -0,0 +1,276 @@
+#include "emitc.h"
+#include "verifier.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static void emitc_error(char *msg) {
+    fprintf(stderr, "Emit C error: %s\n", msg);
+    exit(1);
+}
+
+// Writes text as the contents of a C string literal
+static void emitc_string_literal(FILE *out, String *s) {
+    fputc('"', out);
+    for (size_t i = 0; i < s->len; i++) {
+        unsigned char c = (unsigned char)s->data[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c >= 0x20 && c < 0x7F) {
+            fputc(c, out);
+        }
+        else {
+            fprintf(out, "\\%03o", c);
+        }
+    }
+    fputc('"', out);
+}
+
+// Writes a constant operand as a Value initializer. Strings are filled in by load_strings.
+static void emitc_value(FILE *out, Value value) {
+    switch (value.type) {
+        case VAL_INTEGER:
+            fprintf(out, "{.type = VAL_INTEGER, .as.integer = %d}", value.as.integer);
+            break;
+        case VAL_FLOAT:
+            if (isnan(value.as.floating)) {
+                fprintf(out, "{.type = VAL_FLOAT, .as.floating = __builtin_nan(\"\")}");
+            }
+            else if (isinf(value.as.floating)) {
+                fprintf(out, "{.type = VAL_FLOAT, .as.floating = %s__builtin_inf()}", value.as.floating < 0 ? "-" : "");
+            }
+            else {
+                // Hex floats round-trip exactly
+                fprintf(out, "{.type = VAL_FLOAT, .as.floating = %a}", value.as.floating);
+            }
+            break;
+        case VAL_BOOL:
+            fprintf(out, "{.type = VAL_BOOL, .as.boolean = %s}", value.as.boolean ? "true" : "false");
+            break;
+        case VAL_STRING:
+            fprintf(out, "{.type = VAL_STRING}");
+            break;
+        default:
+            emitc_error("Only numbers, bools and strings can be constants");
+    }
+}
+
+static bool emitc_is_jump(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_JMP_IF || opCode == OP_JMP_IF_FALSE;
+}
+
+// Returns the C operator of an arithmetic or comparison opcode's generic form, or NULL
+static const char *emitc_operator(OpCode opCode) {
+    switch (opCode) {
+        case OP_ADD: case OP_ADD_II: case OP_ADD_FF: return "+";
+        case OP_SUB: case OP_SUB_II: case OP_SUB_FF: return "-";
+        case OP_MUL: case OP_MUL_II: case OP_MUL_FF: return "*";
+        case OP_EQ: case OP_EQ_II: case OP_EQ_FF: return "==";
+        case OP_NEQ: case OP_NEQ_II: case OP_NEQ_FF: return "!=";
+        case OP_LT: case OP_LT_II: case OP_LT_FF: return "<";
+        case OP_LTE: case OP_LTE_II: case OP_LTE_FF: return "<=";
+        case OP_GT: case OP_GT_II: case OP_GT_FF: return ">";
+        case OP_GTE: case OP_GTE_II: case OP_GTE_FF: return ">=";
+        default: return NULL;
+    }
+}
+
+static bool emitc_is_comparison(OpCode opCode) {
+    const char *op = emitc_operator(opCode);
+    return op && strcmp(op, "+") != 0 && strcmp(op, "-") != 0 && strcmp(op, "*") != 0;
+}
+
+// Writes the statement for instruction pc of the run function
+static void emitc_instruction(FILE *out, Instruction *code, size_t count, size_t pc) {
+    Instruction insn = code[pc];
+    int operand = insn.operand.as.integer;
+
+    // The verifier guarantees jumps are always right after the push of their address
+    if (insn.opCode == OP_PUSH && pc + 1 < count && emitc_is_jump(code[pc + 1].opCode)) {
+        switch (code[pc + 1].opCode) {
+            case OP_JMP:
+                fprintf(out, "goto pc_%d;", operand);
+                break;
+            case OP_JMP_IF:
+                fprintf(out, "CHECK_CONDITION(); if (vm->stack.values[--vm->sp].as.boolean) goto pc_%d;", operand);
+                break;
+            default:
+                fprintf(out, "CHECK_CONDITION(); if (!vm->stack.values[--vm->sp].as.boolean) goto pc_%d;", operand);
+                break;
+        }
+        return;
+    }
+
+    const char *op = emitc_operator(insn.opCode);
+    switch (insn.opCode) {
+        case OP_PUSH:
+            fprintf(out, "PUSH(program_code[%zu].operand);", pc);
+            break;
+        case OP_JMP:
+        case OP_JMP_IF:
+        case OP_JMP_IF_FALSE:
+            // Already emitted with the push before it
+            fprintf(out, ";");
+            break;
+        case OP_DISCARD:
+            fprintf(out, "vm->sp--;");
+            break;
+        case OP_DUP:
+            fprintf(out, "PUSH(AT(1));");
+            break;
+        case OP_SWAP:
+            fprintf(out, "{ Value a = AT(1); AT(1) = AT(2); AT(2) = a; }");
+            break;
+        case OP_LOAD_LOCAL:
+            fprintf(out, "PUSH(vm->stack.values[vm->fp + %d]);", operand);
+            break;
+        case OP_STORE_LOCAL:
+            fprintf(out, "vm->stack.values[vm->fp + %d] = AT(1);", operand);
+            break;
+        case OP_LOAD_VAR:
+            fprintf(out, "PUSH(vm->globals.values[%d]);", operand);
+            break;
+        case OP_STORE_VAR:
+            fprintf(out, "vm->globals.values[%d] = AT(1);", operand);
+            break;
+        case OP_SLIDE:
+            fprintf(out, "AT(%d) = AT(1); vm->sp -= %d;", operand + 1, operand);
+            break;
+        case OP_ADD_II: case OP_SUB_II: case OP_MUL_II:
+            fprintf(out, "INT_OP(%s);", op);
+            break;
+        case OP_EQ_II: case OP_NEQ_II: case OP_LT_II: case OP_LTE_II: case OP_GT_II: case OP_GTE_II:
+            fprintf(out, "INT_COMPARE(%s);", op);
+            break;
+        case OP_ADD_FF: case OP_SUB_FF: case OP_MUL_FF:
+            fprintf(out, "FLOAT_OP(%s);", op);
+            break;
+        case OP_EQ_FF: case OP_NEQ_FF: case OP_LT_FF: case OP_LTE_FF: case OP_GT_FF: case OP_GTE_FF:
+            fprintf(out, "FLOAT_COMPARE(%s);", op);
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_EQ: case OP_NEQ: case OP_LT: case OP_LTE: case OP_GT: case OP_GTE:
+            // Integers inline, everything else (promotion, type errors) in the runtime
+            fprintf(out, "if (BOTH_INTEGERS()) %s(%s); else STEP(%zu);",
+                emitc_is_comparison(insn.opCode) ? "INT_COMPARE" : "INT_OP", op, pc);
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+        case OP_RET:
+            fprintf(out, "STEP(%zu); goto *labels[vm->pc];", pc);
+            break;
+        case OP_HALT:
+            fprintf(out, "vm->pc = %zu; return;", pc + 1);
+            break;
+        default:
+            fprintf(out, "STEP(%zu);", pc);
+            break;
+    }
+}
+
+void emitc_program(BytecodeBuf *bbuf, FILE *out) {
+#ifdef VM_SOA_STACK
+    // The generated code indexes vm->stack as an array of Values
+    emitc_error("Compiling to C needs the default stack layout; rebuild without VM_SOA_STACK");
+#endif
+    VerifyResult result;
+    if (!bytecode_verify(bbuf->instructions, bbuf->count, bbuf->functions, bbuf->function_count, &result)) {
+        emitc_error("Bytecode doesn't pass the verifier, so it can't be compiled to C");
+    }
+
+    Instruction *code = malloc(sizeof(Instruction) * bbuf->count);
+    for (size_t i = 0; i < bbuf->count; i++) {
+        code[i] = bbuf->instructions[i];
+        code[i].opCode = instruction_unquickened(code[i].opCode);
+    }
+
+    fprintf(out, "// Generated by lvm --emit-c. Build with: gcc -O2 -I src <this file> build/liblvm.a -lm\n");
+    fprintf(out, "#include \"vm.h\"\n\n");
+    fprintf(out, "#include <stdbool.h>\n\n");
+    fprintf(out, "#define AT(n) (vm->stack.values[vm->sp - (n)]) // AT(1) is the top of the stack\n");
+    fprintf(out, "#define PUSH(value) (vm->stack.values[vm->sp++] = (value))\n");
+    fprintf(out, "#define BOTH_INTEGERS() (AT(1).type == VAL_INTEGER && AT(2).type == VAL_INTEGER)\n");
+    fprintf(out, "#define INT_OP(op) (AT(2).as.integer = AT(2).as.integer op AT(1).as.integer, vm->sp--)\n");
+    fprintf(out, "#define FLOAT_OP(op) (AT(2).as.floating = AT(2).as.floating op AT(1).as.floating, vm->sp--)\n");
+    fprintf(out, "#define INT_COMPARE(op) (AT(2) = (Value){.type = VAL_BOOL, .as.boolean = AT(2).as.integer op AT(1).as.integer}, vm->sp--)\n");
+    fprintf(out, "#define FLOAT_COMPARE(op) (AT(2) = (Value){.type = VAL_BOOL, .as.boolean = AT(2).as.floating op AT(1).as.floating}, vm->sp--)\n");
+    fprintf(out, "#define CHECK_CONDITION() if (AT(1).type != VAL_BOOL) runtime_error(\"Conditional jump failed: wrong condition type (should be boolean)\")\n");
+    fprintf(out, "#define STEP(address) (vm->pc = (address) + 1, vm_step_verified(vm, &program_code[address]))\n\n");
+
+    fprintf(out, "#define PROGRAM_LENGTH (%zu)\n", bbuf->count);
+    fprintf(out, "#define FUNCTION_COUNT (%d)\n\n", bbuf->function_count);
+
+    fprintf(out, "static Instruction program_code[PROGRAM_LENGTH] = {\n");
+    for (size_t i = 0; i < bbuf->count; i++) {
+        fprintf(out, "    /* %zu */ {%s, ", i, opcode_name(code[i].opCode));
+        emitc_value(out, code[i].operand);
+        fprintf(out, "},\n");
+    }
+    fprintf(out, "};\n\n");
+
+    if (bbuf->function_count > 0) {
+        fprintf(out, "static FunctionProto program_functions[FUNCTION_COUNT] = {\n");
+        for (int i = 0; i < bbuf->function_count; i++) {
+            FunctionProto *function = &bbuf->functions[i];
+            fprintf(out, "    {%d, %d, %d},\n", function->entry, function->arity, function->capture_count);
+        }
+        fprintf(out, "};\n\n");
+    }
+    else {
+        fprintf(out, "static FunctionProto *program_functions = NULL;\n\n");
+    }
+
+    // String constants are created at startup and freed at exit, like the ones codegen makes
+    fprintf(out, "static void load_strings(void) {\n");
+    for (size_t i = 0; i < bbuf->count; i++) {
+        if (code[i].operand.type == VAL_STRING) {
+            fprintf(out, "    program_code[%zu].operand.as.string = string_create_from(", i);
+            emitc_string_literal(out, code[i].operand.as.string);
+            fprintf(out, ");\n");
+        }
+    }
+    fprintf(out, "}\n\n");
+    fprintf(out, "static void free_strings(void) {\n");
+    for (size_t i = 0; i < bbuf->count; i++) {
+        if (code[i].operand.type == VAL_STRING) {
+            fprintf(out, "    string_free(program_code[%zu].operand.as.string);\n", i);
+        }
+    }
+    fprintf(out, "}\n\n");
+
+    // Every instruction has a label, so calls and returns can continue at any address
+    fprintf(out, "static void run(VM *vm) {\n");
+    fprintf(out, "    static void *const labels[PROGRAM_LENGTH] = {\n");
+    for (size_t i = 0; i < bbuf->count; i++) {
+        fprintf(out, "        &&pc_%zu,\n", i);
+    }
+    fprintf(out, "    };\n");
+    fprintf(out, "    goto *labels[vm->pc];\n\n");
+    for (size_t i = 0; i < bbuf->count; i++) {
+        fprintf(out, "pc_%zu: ", i);
+        emitc_instruction(out, code, bbuf->count, i);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    load_strings();\n");
+    fprintf(out, "    VM *vm = vm_create();\n");
+    fprintf(out, "    vm_load_code(vm, program_code, PROGRAM_LENGTH, program_functions, FUNCTION_COUNT);\n");
+    fprintf(out, "    if (vm->verified) {\n");
+    fprintf(out, "        run(vm);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    else {\n");
+    fprintf(out, "        vm_execute(vm);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    free_strings();\n");
+    fprintf(out, "    vm_free(vm);\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    free(code);
+}
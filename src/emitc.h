@@ -0,0 +1,22 @@
+#ifndef EMITC_H
+#define EMITC_H
+
+#include <stdio.h>
+
+#include "codegen.h"
+
+/**
+ * Translates compiled bytecode into a standalone C program that runs it without the
+ * interpreter loop. The output includes vm.h and links against the runtime library
+ * (build/liblvm.a, see `make runtime`), which it calls into for everything beyond
+ * stack shuffling, locals, globals, specialized arithmetic and jumps:
+ *
+ *     gcc -O2 -I src program.c build/liblvm.a -lm
+ *
+ * The bytecode must pass the verifier, since the translation relies on jumps always
+ * following the push of their address. Exits with an error if it doesn't, or if lvm
+ * was built with VM_SOA_STACK.
+ */
+void emitc_program(BytecodeBuf *bbuf, FILE *out);
+
+#endif // EMITC_H
@@ -0,0 +1,363 @@
+#include "heapsnap.h"
+#include "probes.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEAP_WRITER_BUFFER (8192)
+#define HEAP_SIGNAL_PATH_MAX (64)
+
+// Buffers writes to a file descriptor itself, since stdio would allocate
+typedef struct {
+    int fd;
+    bool ok;
+    size_t used;
+    unsigned char buffer[HEAP_WRITER_BUFFER];
+} HeapWriter;
+
+static void writer_flush(HeapWriter *writer) {
+    size_t done = 0;
+    while (writer->ok && done < writer->used) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written <= 0) {
+            writer->ok = false;
+        }
+        else {
+            done += written;
+        }
+    }
+    writer->used = 0;
+}
+
+static void writer_bytes(HeapWriter *writer, const void *bytes, size_t length) {
+    const unsigned char *from = bytes;
+    while (length > 0) {
+        if (writer->used == HEAP_WRITER_BUFFER) {
+            writer_flush(writer);
+        }
+        size_t chunk = HEAP_WRITER_BUFFER - writer->used;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(writer->buffer + writer->used, from, chunk);
+        writer->used += chunk;
+        from += chunk;
+        length -= chunk;
+    }
+}
+
+static void writer_u8(HeapWriter *writer, uint8_t value) {
+    writer_bytes(writer, &value, sizeof(value));
+}
+
+static void writer_u32(HeapWriter *writer, uint32_t value) {
+    writer_bytes(writer, &value, sizeof(value));
+}
+
+static void writer_u64(HeapWriter *writer, uint64_t value) {
+    writer_bytes(writer, &value, sizeof(value));
+}
+
+static void writer_value(HeapWriter *writer, Value value) {
+    uint64_t payload = 0;
+    switch (value.type) {
+        case VAL_INTEGER:
+            payload = (uint64_t)(int64_t)value.as.integer;
+            break;
+        case VAL_FLOAT:
+            memcpy(&payload, &value.as.floating, sizeof(payload));
+            break;
+        case VAL_BOOL:
+            payload = value.as.boolean;
+            break;
+        case VAL_STRING:
+            payload = (uint64_t)(uintptr_t)value.as.string;
+            break;
+        case VAL_LIST:
+            payload = (uint64_t)(uintptr_t)value.as.list;
+            break;
+        case VAL_CLOSURE:
+            payload = (uint64_t)(uintptr_t)value.as.closure;
+            break;
+    }
+    writer_u8(writer, (uint8_t)value.type);
+    writer_u64(writer, payload);
+}
+
+static bool is_reference(ValueType type) {
+    return type == VAL_STRING || type == VAL_LIST || type == VAL_CLOSURE;
+}
+
+static void writer_root(HeapWriter *writer, bool global, int index, Value value) {
+    if (!is_reference(value.type)) {
+        return;
+    }
+    writer_u8(writer, 'R');
+    writer_u8(writer, global);
+    writer_u32(writer, (uint32_t)index);
+    writer_value(writer, value);
+}
+
+bool heap_snapshot_write(VM *vm, const char *path) {
+    PROBE_HEAP_SNAPSHOT_START(path);
+    HeapWriter writer;
+    writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer.fd < 0) {
+        PROBE_HEAP_SNAPSHOT_DONE(path, 0);
+        return false;
+    }
+    writer.ok = true;
+    writer.used = 0;
+    writer_bytes(&writer, HEAP_SNAPSHOT_MAGIC, strlen(HEAP_SNAPSHOT_MAGIC));
+
+    for (size_t i = 0; i < vm->strings_count; i++) {
+        String *s = vm->strings[i];
+        writer_u8(&writer, 'S');
+        writer_u64(&writer, (uint64_t)(uintptr_t)s);
+        writer_u64(&writer, sizeof(String) + s->cap);
+        writer_u32(&writer, (uint32_t)s->len);
+        writer_bytes(&writer, s->data, s->len);
+    }
+
+    for (size_t i = 0; i < vm->allocated_lists_count; i++) {
+        List *list = vm->allocated_lists[i];
+        writer_u8(&writer, 'L');
+        writer_u64(&writer, (uint64_t)(uintptr_t)list);
+        writer_u64(&writer, sizeof(List) + sizeof(Value) * list->capacity);
+        writer_u32(&writer, (uint32_t)list->count);
+        for (size_t e = 0; e < list->count; e++) {
+            writer_value(&writer, list->elements[e]);
+        }
+    }
+
+    for (size_t i = 0; i < vm->allocated_closures_count; i++) {
+        Closure *closure = vm->allocated_closures[i];
+        writer_u8(&writer, 'C');
+        writer_u64(&writer, (uint64_t)(uintptr_t)closure);
+        writer_u64(&writer, sizeof(Closure) + sizeof(Value) * closure->capture_count);
+        writer_u32(&writer, (uint32_t)closure->function);
+        writer_u32(&writer, (uint32_t)closure->capture_count);
+        for (int c = 0; c < closure->capture_count; c++) {
+            writer_value(&writer, closure->captures[c]);
+        }
+    }
+
+    for (int i = 0; i < vm->sp; i++) {
+        writer_root(&writer, false, i, vm_stack_get(vm, i));
+    }
+    for (size_t i = 0; i < vm->globals_cap; i++) {
+        writer_root(&writer, true, (int)i, vm_globals_get(vm, (int)i));
+    }
+
+    writer_u8(&writer, 'E');
+    writer_flush(&writer);
+    bool written = close(writer.fd) == 0 && writer.ok;
+    PROBE_HEAP_SNAPSHOT_DONE(path, written);
+    return written;
+}
+
+// The VM SIGUSR1 snapshots
+static VM *volatile signal_vm = NULL;
+static int signal_snapshots = 0;
+
+// Only asks for a snapshot, which the VM writes at its next safe point
+static void heap_snapshot_handle_signal(int signal) {
+    (void)signal;
+    VM *vm = signal_vm;
+    if (vm) {
+        vm->snapshot_requested = 1;
+    }
+}
+
+void heap_snapshot_take_requested(VM *vm) {
+    vm->snapshot_requested = 0;
+
+    char path[HEAP_SIGNAL_PATH_MAX];
+    snprintf(path, sizeof(path), "lvm-%ld-%d.heap", (long)getpid(), ++signal_snapshots);
+    if (heap_snapshot_write(vm, path)) {
+        fprintf(stderr, "Heap snapshot written to %s\n", path);
+    }
+    else {
+        fprintf(stderr, "Unable to write heap snapshot %s\n", path);
+    }
+}
+
+void heap_snapshot_on_signal(VM *vm) {
+    signal_vm = vm;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = heap_snapshot_handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+// Reads from a snapshot in memory, failing once anything would run past its end
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+    bool ok;
+} HeapReader;
+
+static void reader_bytes(HeapReader *reader, void *to, size_t length) {
+    if (!reader->ok || reader->size - reader->offset < length) {
+        reader->ok = false;
+        memset(to, 0, length);
+        return;
+    }
+    memcpy(to, reader->data + reader->offset, length);
+    reader->offset += length;
+}
+
+static uint8_t reader_u8(HeapReader *reader) {
+    uint8_t value;
+    reader_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t reader_u32(HeapReader *reader) {
+    uint32_t value;
+    reader_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t reader_u64(HeapReader *reader) {
+    uint64_t value;
+    reader_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static HeapValue reader_value(HeapReader *reader) {
+    HeapValue value;
+    value.type = (ValueType)reader_u8(reader);
+    value.payload = reader_u64(reader);
+    return value;
+}
+
+// Reads count values, each at least 9 bytes, after checking the file has room for them
+static HeapValue *reader_values(HeapReader *reader, uint32_t count) {
+    if (!reader->ok || (reader->size - reader->offset) / 9 < count) {
+        reader->ok = false;
+        return NULL;
+    }
+    HeapValue *values = malloc(sizeof(HeapValue) * (count > 0 ? count : 1));
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = reader_value(reader);
+    }
+    return values;
+}
+
+static HeapObject *snapshot_add_object(HeapSnapshot *snapshot, size_t *capacity) {
+    if (snapshot->object_count == *capacity) {
+        *capacity *= 2;
+        snapshot->objects = realloc(snapshot->objects, sizeof(HeapObject) * *capacity);
+    }
+    HeapObject *object = &snapshot->objects[snapshot->object_count++];
+    memset(object, 0, sizeof(HeapObject));
+    return object;
+}
+
+HeapSnapshot *heap_snapshot_read(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    size_t got = fread(data, 1, size, file);
+    fclose(file);
+
+    HeapReader reader = {data, got, 0, true};
+    char magic[sizeof(HEAP_SNAPSHOT_MAGIC)] = {0};
+    reader_bytes(&reader, magic, strlen(HEAP_SNAPSHOT_MAGIC));
+    if (!reader.ok || strcmp(magic, HEAP_SNAPSHOT_MAGIC) != 0) {
+        free(data);
+        return NULL;
+    }
+
+    HeapSnapshot *snapshot = calloc(1, sizeof(HeapSnapshot));
+    size_t object_cap = 64;
+    size_t root_cap = 64;
+    snapshot->objects = malloc(sizeof(HeapObject) * object_cap);
+    snapshot->roots = malloc(sizeof(HeapRoot) * root_cap);
+
+    bool ended = false;
+    while (reader.ok && !ended) {
+        uint8_t tag = reader_u8(&reader);
+        switch (tag) {
+            case 'S': {
+                HeapObject *object = snapshot_add_object(snapshot, &object_cap);
+                object->kind = HEAP_STRING;
+                object->address = reader_u64(&reader);
+                object->bytes = reader_u64(&reader);
+                object->count = reader_u32(&reader);
+                if (reader.ok && reader.size - reader.offset < object->count) {
+                    reader.ok = false;
+                    break;
+                }
+                object->text = malloc(object->count + 1);
+                reader_bytes(&reader, object->text, object->count);
+                object->text[object->count] = '\0';
+                break;
+            }
+            case 'L':
+            case 'C': {
+                HeapObject *object = snapshot_add_object(snapshot, &object_cap);
+                object->kind = tag == 'L' ? HEAP_LIST : HEAP_CLOSURE;
+                object->address = reader_u64(&reader);
+                object->bytes = reader_u64(&reader);
+                if (tag == 'C') {
+                    object->function = (int)reader_u32(&reader);
+                }
+                object->count = reader_u32(&reader);
+                object->values = reader_values(&reader, object->count);
+                break;
+            }
+            case 'R': {
+                if (snapshot->root_count == root_cap) {
+                    root_cap *= 2;
+                    snapshot->roots = realloc(snapshot->roots, sizeof(HeapRoot) * root_cap);
+                }
+                HeapRoot *root = &snapshot->roots[snapshot->root_count++];
+                root->global = reader_u8(&reader) != 0;
+                root->index = reader_u32(&reader);
+                root->value = reader_value(&reader);
+                break;
+            }
+            case 'E':
+                ended = true;
+                break;
+            default:
+                reader.ok = false;
+                break;
+        }
+    }
+
+    free(data);
+    if (!reader.ok) {
+        heap_snapshot_free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void heap_snapshot_free(HeapSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    for (size_t i = 0; i < snapshot->object_count; i++) {
+        free(snapshot->objects[i].text);
+        free(snapshot->objects[i].values);
+    }
+    free(snapshot->objects);
+    free(snapshot->roots);
+    free(snapshot);
+}
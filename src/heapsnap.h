@@ -0,0 +1,104 @@
+#ifndef HEAPSNAP_H
+#define HEAPSNAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/**
+ * Heap snapshots: every string, list and closure a VM has made, and the stack slots and
+ * global variables that refer to them, written to a file for build/heapstat to analyze.
+ *
+ * The file is the magic HEAP_SNAPSHOT_MAGIC followed by records, each starting with a tag
+ * byte, in the byte order of the machine that wrote it. Values are a type byte (a ValueType)
+ * and 8 payload bytes: the object's address for strings, lists and closures, else the value.
+ *
+ *     'S' address:8 bytes:8 length:4 characters:length
+ *     'L' address:8 bytes:8 count:4 values:count
+ *     'C' address:8 bytes:8 function:4 count:4 values:count   (a closure's captures)
+ *     'R' kind:1 index:4 value                               (kind 0 for the stack, 1 for globals)
+ *     'E'                                                    (end of the snapshot)
+ *
+ * Objects the VM still holds but nothing refers to are written too; since the VM has no
+ * garbage collector they stay allocated until it's freed.
+ */
+
+#define HEAP_SNAPSHOT_MAGIC ("LVMHEAP1")
+
+typedef enum {
+    HEAP_STRING,
+    HEAP_LIST,
+    HEAP_CLOSURE
+} HeapObjectKind;
+
+/**
+ * A value as it was written: object references are addresses
+ */
+typedef struct {
+    ValueType type;
+    uint64_t payload;
+} HeapValue;
+
+typedef struct {
+    HeapObjectKind kind;
+    uint64_t address;
+    uint64_t bytes; // The object and its storage
+    uint32_t count; // Characters of a string, elements of a list, captures of a closure
+    int function; // A closure's function
+    char *text; // A string's characters, null terminated
+    HeapValue *values; // A list's elements or a closure's captures
+} HeapObject;
+
+typedef struct {
+    bool global; // Else a stack slot
+    uint32_t index;
+    HeapValue value;
+} HeapRoot;
+
+/**
+ * A snapshot read back from a file
+ */
+typedef struct {
+    HeapObject *objects;
+    size_t object_count;
+    HeapRoot *roots; // Only the roots that refer to objects
+    size_t root_count;
+} HeapSnapshot;
+
+/**
+ * Writes a snapshot of the VM's heap to a file. Allocates nothing, so the snapshot doesn't
+ * change the heap it describes.
+ * @returns false if the file can't be written
+ */
+bool heap_snapshot_write(VM *vm, const char *path);
+
+/**
+ * Makes SIGUSR1 write a snapshot of the VM's heap to lvm-<pid>-<n>.heap in the current
+ * directory, where n counts the snapshots taken, and say so on stderr. The signal can land
+ * in the middle of an instruction, with the heap being grown and the stack pointer in a
+ * register, so the handler only sets vm->snapshot_requested. Every way of running code
+ * writes the snapshot at its next call, backward jump or instruction handed to
+ * vm_step_verified, where the stack is back in the VM.
+ */
+void heap_snapshot_on_signal(VM *vm);
+
+/**
+ * Writes the snapshot SIGUSR1 asked for and clears vm->snapshot_requested.
+ * Only call it where vm->sp is up to date.
+ */
+void heap_snapshot_take_requested(VM *vm);
+
+/**
+ * Reads a snapshot written by heap_snapshot_write
+ * @returns The snapshot, or NULL if the file can't be read or isn't a snapshot
+ */
+HeapSnapshot *heap_snapshot_read(const char *path);
+
+/**
+ * Frees a snapshot read by heap_snapshot_read
+ */
+void heap_snapshot_free(HeapSnapshot *snapshot);
+
+#endif // HEAPSNAP_H
@@ -0,0 +1,790 @@
+#include "jit.h"
+#include "perfmap.h"
+#include "heapsnap.h"
+
+#if defined(__x86_64__) && !defined(VM_SOA_STACK)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+_Static_assert(sizeof(Value) == 16, "JIT templates assume 16-byte values");
+_Static_assert(sizeof(int) == 4, "JIT templates assume 32-bit integers");
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#define PAYLOAD ((int)offsetof(Value, as))
+#define MAX_TEMPLATE_SIZE (160) // Machine code budgeted per instruction; code that outgrows the buffer isn't run
+
+// x86-64 register numbers
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+// Registers the compiled code keeps its state in (all callee-saved):
+//   RBX  the VM
+//   R12  vm->stack
+//   R13  pointer to the first free stack slot (vm->stack + vm->sp)
+//   R14  pointer to the frame's first slot (vm->stack + vm->fp)
+//   R15  table of machine code addresses by bytecode pc, for returns and closure calls
+#define REG_VM RBX
+#define REG_STACK R12
+#define REG_TOP R13
+#define REG_FRAME R14
+#define REG_TABLE R15
+
+// Condition codes, as used by jcc and setcc
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_AE = 0x3, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB,
+    CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+typedef struct {
+    size_t at; // Offset of the rel32 to fill in
+    int target; // Bytecode address it jumps to
+} JitPatch;
+
+typedef struct {
+    unsigned char *code;
+    size_t size;
+    size_t capacity;
+    bool overflowed; // Set if the code didn't fit in the buffer, which then fails the compilation
+
+    size_t *labels; // Machine code offset of each bytecode instruction
+
+    JitPatch *patches; // Jumps to bytecode addresses, filled in once all labels are known
+    int patch_count;
+    int patch_capacity;
+} JitBuilder;
+
+typedef void (*JitFunction)(VM *vm, void **table);
+
+//////////////////////////////////////////////////////////
+///////////////////// Code emission //////////////////////
+//////////////////////////////////////////////////////////
+
+// Checks that n more bytes fit in the buffer. Once something doesn't, nothing more is written.
+static bool emit_reserve(JitBuilder *b, size_t n) {
+    if (b->overflowed || b->size + n > b->capacity) {
+        b->overflowed = true;
+        return false;
+    }
+    return true;
+}
+
+static void emit_byte(JitBuilder *b, int byte) {
+    if (emit_reserve(b, 1)) {
+        b->code[b->size++] = (unsigned char)byte;
+    }
+}
+
+static void emit_u32(JitBuilder *b, uint32_t value) {
+    if (emit_reserve(b, 4)) {
+        memcpy(&b->code[b->size], &value, 4);
+        b->size += 4;
+    }
+}
+
+static void emit_u64(JitBuilder *b, uint64_t value) {
+    if (emit_reserve(b, 8)) {
+        memcpy(&b->code[b->size], &value, 8);
+        b->size += 8;
+    }
+}
+
+// Fills in the rel32 at offset at so the jump it ends goes to offset target
+static void patch_rel32(JitBuilder *b, size_t at, size_t target) {
+    if (!b->overflowed) {
+        uint32_t rel = (uint32_t)(target - (at + 4));
+        memcpy(&b->code[at], &rel, 4);
+    }
+}
+
+// REX prefix, left out when it would be empty
+static void emit_rex(JitBuilder *b, bool wide, int reg, int base) {
+    int rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (rex != 0x40) {
+        emit_byte(b, rex);
+    }
+}
+
+// ModRM (and SIB and displacement) for a [base + disp] memory operand
+static void emit_mem(JitBuilder *b, int reg, int base, int disp) {
+    bool short_disp = disp >= -128 && disp <= 127;
+    emit_byte(b, (short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit_byte(b, 0x24); // SIB with no index
+    }
+    if (short_disp) {
+        emit_byte(b, disp & 0xFF);
+    }
+    else {
+        emit_u32(b, (uint32_t)disp);
+    }
+}
+
+// op reg, [base + disp] (or the reverse direction, depending on the opcode)
+static void emit_op_mem(JitBuilder *b, bool wide, int opcode, int reg, int base, int disp) {
+    emit_rex(b, wide, reg, base);
+    if (opcode > 0xFF) {
+        emit_byte(b, opcode >> 8);
+    }
+    emit_byte(b, opcode & 0xFF);
+    emit_mem(b, reg, base, disp);
+}
+
+// SSE op xmm, [base + disp] with a mandatory prefix
+static void emit_sse_mem(JitBuilder *b, int prefix, int opcode, int xmm, int base, int disp) {
+    emit_byte(b, prefix);
+    emit_rex(b, false, xmm, base);
+    emit_byte(b, 0x0F);
+    emit_byte(b, opcode);
+    emit_mem(b, xmm, base, disp);
+}
+
+// Copies a whole Value between memory locations through xmm0
+static void emit_copy_value(JitBuilder *b, int dst_base, int dst_disp, int src_base, int src_disp) {
+    emit_sse_mem(b, 0xF3, 0x6F, 0, src_base, src_disp); // movdqu xmm0, [src]
+    emit_sse_mem(b, 0xF3, 0x7F, 0, dst_base, dst_disp); // movdqu [dst], xmm0
+}
+
+// add/sub reg, imm32 on a 64-bit register
+static void emit_add_imm(JitBuilder *b, int reg, int imm) {
+    emit_rex(b, true, 0, reg);
+    emit_byte(b, 0x81);
+    emit_byte(b, 0xC0 | (imm < 0 ? 5 << 3 : 0) | (reg & 7));
+    emit_u32(b, (uint32_t)(imm < 0 ? -imm : imm));
+}
+
+// mov dword [base + disp], imm32
+static void emit_store_imm32(JitBuilder *b, int base, int disp, uint32_t imm) {
+    emit_op_mem(b, false, 0xC7, 0, base, disp);
+    emit_u32(b, imm);
+}
+
+// mov reg, imm64
+static void emit_mov_imm64(JitBuilder *b, int reg, uint64_t imm) {
+    emit_rex(b, true, 0, reg);
+    emit_byte(b, 0xB8 | (reg & 7));
+    emit_u64(b, imm);
+}
+
+// Emits a jump with a 32-bit displacement and returns where the displacement goes
+static size_t emit_jump(JitBuilder *b, int cc) {
+    if (cc < 0) {
+        emit_byte(b, 0xE9);
+    }
+    else {
+        emit_byte(b, 0x0F);
+        emit_byte(b, 0x80 | cc);
+    }
+    size_t at = b->size;
+    emit_u32(b, 0);
+    return at;
+}
+
+// Points a jump emitted by emit_jump at the current position
+static void patch_here(JitBuilder *b, size_t at) {
+    patch_rel32(b, at, b->size);
+}
+
+// Jumps (cc < 0 for always) to the machine code of a bytecode instruction
+static void emit_jump_to_pc(JitBuilder *b, int cc, int target) {
+    size_t at = emit_jump(b, cc);
+    if (b->patch_count >= b->patch_capacity) {
+        b->patch_capacity *= 2;
+        b->patches = realloc(b->patches, sizeof(JitPatch) * b->patch_capacity);
+    }
+    b->patches[b->patch_count++] = (JitPatch){at, target};
+}
+
+// Stores R13 back into vm->sp
+static void emit_save_sp(JitBuilder *b) {
+    emit_byte(b, 0x4C); emit_byte(b, 0x89); emit_byte(b, 0xE8); // mov rax, r13
+    emit_byte(b, 0x4C); emit_byte(b, 0x29); emit_byte(b, 0xE0); // sub rax, r12
+    emit_byte(b, 0x48); emit_byte(b, 0xC1); emit_byte(b, 0xE8); emit_byte(b, 4); // shr rax, 4
+    emit_op_mem(b, false, 0x89, RAX, REG_VM, offsetof(VM, sp)); // mov [rbx + sp], eax
+}
+
+// Loads a stack index field of the VM (sp or fp) as a pointer into the stack
+static void emit_load_stack_pointer(JitBuilder *b, int reg, int field_offset) {
+    emit_op_mem(b, true, 0x63, RAX, REG_VM, field_offset); // movsxd rax, [rbx + field]
+    emit_byte(b, 0x48); emit_byte(b, 0xC1); emit_byte(b, 0xE0); emit_byte(b, 4); // shl rax, 4
+    // lea reg, [r12 + rax]
+    emit_rex(b, true, reg, REG_STACK);
+    emit_byte(b, 0x8D);
+    emit_byte(b, ((reg & 7) << 3) | 4);
+    emit_byte(b, 0x04);
+}
+
+// Jumps to the machine code for vm->pc, through the table in R15
+static void emit_dispatch_pc(JitBuilder *b) {
+    emit_op_mem(b, true, 0x63, RAX, REG_VM, offsetof(VM, pc)); // movsxd rax, [rbx + pc]
+    emit_byte(b, 0x41); emit_byte(b, 0xFF); emit_byte(b, 0x24); emit_byte(b, 0xC7); // jmp [r15 + rax*8]
+}
+
+// Runs one instruction through the interpreter. Control flow instructions
+// continue wherever the interpreter left vm->pc.
+static void emit_helper_call(JitBuilder *b, Instruction *insn, int pc, bool changes_control) {
+    emit_save_sp(b);
+    emit_store_imm32(b, REG_VM, offsetof(VM, pc), (uint32_t)(pc + 1));
+    emit_byte(b, 0x48); emit_byte(b, 0x89); emit_byte(b, 0xDF); // mov rdi, rbx
+    emit_mov_imm64(b, RSI, (uint64_t)(uintptr_t)insn);
+    emit_mov_imm64(b, RAX, (uint64_t)(uintptr_t)vm_step_verified);
+    emit_byte(b, 0xFF); emit_byte(b, 0xD0); // call rax
+    if (changes_control) {
+        // Calls can grow the stack, moving it
+        emit_op_mem(b, true, 0x8B, REG_STACK, REG_VM, offsetof(VM, stack.values)); // mov r12, [rbx + stack]
+    }
+    emit_load_stack_pointer(b, REG_TOP, offsetof(VM, sp));
+
+    if (changes_control) {
+        emit_load_stack_pointer(b, REG_FRAME, offsetof(VM, fp));
+        emit_dispatch_pc(b);
+    }
+}
+
+// At a loop's backward jump, writes the heap snapshot SIGUSR1 asked for, if it has
+static void emit_safe_point(JitBuilder *b) {
+    emit_op_mem(b, false, 0x83, 7, REG_VM, offsetof(VM, snapshot_requested)); // cmp dword [rbx + snapshot_requested], 0
+    emit_byte(b, 0);
+    size_t none = emit_jump(b, CC_E);
+    emit_save_sp(b);
+    emit_byte(b, 0x48); emit_byte(b, 0x89); emit_byte(b, 0xDF); // mov rdi, rbx
+    emit_mov_imm64(b, RAX, (uint64_t)(uintptr_t)heap_snapshot_take_requested);
+    emit_byte(b, 0xFF); emit_byte(b, 0xD0); // call rax
+    patch_here(b, none);
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////// Templates ////////////////////////
+//////////////////////////////////////////////////////////
+
+// Integer binary operation on the top two values, in place: b = b op a
+static void emit_integer_op(JitBuilder *b, OpCode opCode) {
+    int b_payload = -2 * VALUE_SIZE + PAYLOAD;
+    int a_payload = -VALUE_SIZE + PAYLOAD;
+
+    emit_op_mem(b, false, 0x8B, RAX, REG_TOP, b_payload); // mov eax, [b]
+    switch (opCode) {
+        case OP_ADD:
+            emit_op_mem(b, false, 0x03, RAX, REG_TOP, a_payload); // add eax, [a]
+            break;
+        case OP_SUB:
+            emit_op_mem(b, false, 0x2B, RAX, REG_TOP, a_payload); // sub eax, [a]
+            break;
+        case OP_MUL:
+            emit_op_mem(b, false, 0x0FAF, RAX, REG_TOP, a_payload); // imul eax, [a]
+            break;
+        default: {
+            int cc;
+            switch (opCode) {
+                case OP_EQ: cc = CC_E; break;
+                case OP_NEQ: cc = CC_NE; break;
+                case OP_LT: cc = CC_L; break;
+                case OP_LTE: cc = CC_LE; break;
+                case OP_GT: cc = CC_G; break;
+                default: cc = CC_GE; break;
+            }
+            emit_op_mem(b, false, 0x3B, RAX, REG_TOP, a_payload); // cmp eax, [a]
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | cc); emit_byte(b, 0xC1); // setcc cl
+            emit_store_imm32(b, REG_TOP, -2 * VALUE_SIZE, VAL_BOOL);
+            emit_op_mem(b, false, 0x88, RCX, REG_TOP, b_payload); // mov [b], cl
+            emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+            return;
+        }
+    }
+    emit_op_mem(b, false, 0x89, RAX, REG_TOP, b_payload); // mov [b], eax
+    emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+}
+
+// Float binary operation on the top two values, in place: b = b op a
+static void emit_float_op(JitBuilder *b, OpCode opCode) {
+    int b_payload = -2 * VALUE_SIZE + PAYLOAD;
+    int a_payload = -VALUE_SIZE + PAYLOAD;
+
+    emit_sse_mem(b, 0xF2, 0x10, 0, REG_TOP, b_payload); // movsd xmm0, [b]
+    switch (opCode) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            emit_sse_mem(b, 0xF2, opCode == OP_ADD ? 0x58 : opCode == OP_SUB ? 0x5C : 0x59, 0, REG_TOP, a_payload);
+            emit_sse_mem(b, 0xF2, 0x11, 0, REG_TOP, b_payload); // movsd [b], xmm0
+            emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+            return;
+        default:
+            break;
+    }
+
+    // Comparisons use ucomisd, where "above" is false for NaN just like C's < and >
+    emit_sse_mem(b, 0xF2, 0x10, 1, REG_TOP, a_payload); // movsd xmm1, [a]
+    bool swap = opCode == OP_LT || opCode == OP_LTE;
+    emit_byte(b, 0x66); emit_byte(b, 0x0F); emit_byte(b, 0x2E);
+    emit_byte(b, swap ? 0xC8 : 0xC1); // ucomisd xmm1, xmm0 / ucomisd xmm0, xmm1
+    switch (opCode) {
+        case OP_LT:
+        case OP_GT:
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_A); emit_byte(b, 0xC1); // seta cl
+            break;
+        case OP_LTE:
+        case OP_GTE:
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_AE); emit_byte(b, 0xC1); // setae cl
+            break;
+        case OP_EQ:
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_E); emit_byte(b, 0xC1); // sete cl
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_NP); emit_byte(b, 0xC2); // setnp dl
+            emit_byte(b, 0x20); emit_byte(b, 0xD1); // and cl, dl
+            break;
+        default:
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_NE); emit_byte(b, 0xC1); // setne cl
+            emit_byte(b, 0x0F); emit_byte(b, 0x90 | CC_P); emit_byte(b, 0xC2); // setp dl
+            emit_byte(b, 0x08); emit_byte(b, 0xD1); // or cl, dl
+            break;
+    }
+    emit_store_imm32(b, REG_TOP, -2 * VALUE_SIZE, VAL_BOOL);
+    emit_op_mem(b, false, 0x88, RCX, REG_TOP, b_payload); // mov [b], cl
+    emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+}
+
+// Generic arithmetic or comparison: native code when both values are integers,
+// otherwise the interpreter's handler (which also promotes to float or reports errors)
+static void emit_guarded_integer_op(JitBuilder *b, Instruction *insn, int pc) {
+    emit_op_mem(b, false, 0x83, 7, REG_TOP, -2 * VALUE_SIZE); // cmp dword [b.type], VAL_INTEGER
+    emit_byte(b, VAL_INTEGER);
+    size_t b_not_integer = emit_jump(b, CC_NE);
+    emit_op_mem(b, false, 0x83, 7, REG_TOP, -VALUE_SIZE); // cmp dword [a.type], VAL_INTEGER
+    emit_byte(b, VAL_INTEGER);
+    size_t a_not_integer = emit_jump(b, CC_NE);
+
+    emit_integer_op(b, insn->opCode);
+    size_t done = emit_jump(b, -1);
+
+    patch_here(b, b_not_integer);
+    patch_here(b, a_not_integer);
+    emit_helper_call(b, insn, pc, false);
+    patch_here(b, done);
+}
+
+static void jit_bad_condition() {
+    runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
+}
+
+// A jump whose address the OP_PUSH at pc pushes. The address is never pushed.
+static void emit_static_jump(JitBuilder *b, OpCode opCode, int target) {
+    if (opCode == OP_JMP) {
+        emit_jump_to_pc(b, -1, target);
+        return;
+    }
+
+    emit_op_mem(b, false, 0x83, 7, REG_TOP, -VALUE_SIZE); // cmp dword [cond.type], VAL_BOOL
+    emit_byte(b, VAL_BOOL);
+    size_t is_bool = emit_jump(b, CC_E);
+    emit_mov_imm64(b, RAX, (uint64_t)(uintptr_t)jit_bad_condition);
+    emit_byte(b, 0xFF); emit_byte(b, 0xD0); // call rax
+    patch_here(b, is_bool);
+
+    emit_op_mem(b, false, 0x0FB6, RAX, REG_TOP, -VALUE_SIZE + PAYLOAD); // movzx eax, byte [cond]
+    emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+    emit_byte(b, 0x84); emit_byte(b, 0xC0); // test al, al
+    emit_jump_to_pc(b, opCode == OP_JMP_IF ? CC_NE : CC_E, target);
+}
+
+static bool is_jump(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_JMP_IF || opCode == OP_JMP_IF_FALSE;
+}
+
+// Instructions with straight-line machine code and no type checks to make.
+// Returns false for anything else.
+static bool emit_native(JitBuilder *b, Instruction *insn) {
+    int operand = insn->operand.as.integer;
+
+    switch (insn->opCode) {
+        case OP_PUSH: {
+            uint64_t payload;
+            memcpy(&payload, &insn->operand.as, sizeof(payload));
+            emit_store_imm32(b, REG_TOP, 0, insn->operand.type);
+            emit_mov_imm64(b, RAX, payload);
+            emit_op_mem(b, true, 0x89, RAX, REG_TOP, PAYLOAD); // mov [top + payload], rax
+            emit_add_imm(b, REG_TOP, VALUE_SIZE);
+            return true;
+        }
+        case OP_DISCARD:
+            emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+            return true;
+        case OP_DUP:
+            emit_copy_value(b, REG_TOP, 0, REG_TOP, -VALUE_SIZE);
+            emit_add_imm(b, REG_TOP, VALUE_SIZE);
+            return true;
+        case OP_SWAP:
+            emit_sse_mem(b, 0xF3, 0x6F, 0, REG_TOP, -VALUE_SIZE); // movdqu xmm0, [a]
+            emit_sse_mem(b, 0xF3, 0x6F, 1, REG_TOP, -2 * VALUE_SIZE); // movdqu xmm1, [b]
+            emit_sse_mem(b, 0xF3, 0x7F, 0, REG_TOP, -2 * VALUE_SIZE);
+            emit_sse_mem(b, 0xF3, 0x7F, 1, REG_TOP, -VALUE_SIZE);
+            return true;
+        case OP_LOAD_LOCAL:
+            emit_copy_value(b, REG_TOP, 0, REG_FRAME, operand * VALUE_SIZE);
+            emit_add_imm(b, REG_TOP, VALUE_SIZE);
+            return true;
+        case OP_STORE_LOCAL:
+            emit_copy_value(b, REG_FRAME, operand * VALUE_SIZE, REG_TOP, -VALUE_SIZE);
+            return true;
+        case OP_LOAD_VAR:
+            emit_op_mem(b, true, 0x8B, RDX, REG_VM, offsetof(VM, globals.values)); // mov rdx, [rbx + globals]
+            emit_copy_value(b, REG_TOP, 0, RDX, operand * VALUE_SIZE);
+            emit_add_imm(b, REG_TOP, VALUE_SIZE);
+            return true;
+        case OP_STORE_VAR:
+            emit_op_mem(b, true, 0x8B, RDX, REG_VM, offsetof(VM, globals.values));
+            emit_copy_value(b, RDX, operand * VALUE_SIZE, REG_TOP, -VALUE_SIZE);
+            return true;
+        case OP_SLIDE:
+            emit_sse_mem(b, 0xF3, 0x6F, 0, REG_TOP, -VALUE_SIZE); // movdqu xmm0, [top]
+            emit_add_imm(b, REG_TOP, -operand * VALUE_SIZE);
+            emit_sse_mem(b, 0xF3, 0x7F, 0, REG_TOP, -VALUE_SIZE);
+            return true;
+        case OP_ADD_II: emit_integer_op(b, OP_ADD); return true;
+        case OP_SUB_II: emit_integer_op(b, OP_SUB); return true;
+        case OP_MUL_II: emit_integer_op(b, OP_MUL); return true;
+        case OP_EQ_II: emit_integer_op(b, OP_EQ); return true;
+        case OP_NEQ_II: emit_integer_op(b, OP_NEQ); return true;
+        case OP_LT_II: emit_integer_op(b, OP_LT); return true;
+        case OP_LTE_II: emit_integer_op(b, OP_LTE); return true;
+        case OP_GT_II: emit_integer_op(b, OP_GT); return true;
+        case OP_GTE_II: emit_integer_op(b, OP_GTE); return true;
+        case OP_ADD_FF: emit_float_op(b, OP_ADD); return true;
+        case OP_SUB_FF: emit_float_op(b, OP_SUB); return true;
+        case OP_MUL_FF: emit_float_op(b, OP_MUL); return true;
+        case OP_EQ_FF: emit_float_op(b, OP_EQ); return true;
+        case OP_NEQ_FF: emit_float_op(b, OP_NEQ); return true;
+        case OP_LT_FF: emit_float_op(b, OP_LT); return true;
+        case OP_LTE_FF: emit_float_op(b, OP_LTE); return true;
+        case OP_GT_FF: emit_float_op(b, OP_GT); return true;
+        case OP_GTE_FF: emit_float_op(b, OP_GTE); return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_generic_number_op(OpCode opCode) {
+    switch (opCode) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LT:
+        case OP_LTE:
+        case OP_GT:
+        case OP_GTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Restores the registers saved on entry and returns to the caller
+static void emit_epilogue(JitBuilder *b) {
+    emit_byte(b, 0x41); emit_byte(b, 0x5F); // pop r15
+    emit_byte(b, 0x41); emit_byte(b, 0x5E); // pop r14
+    emit_byte(b, 0x41); emit_byte(b, 0x5D); // pop r13
+    emit_byte(b, 0x41); emit_byte(b, 0x5C); // pop r12
+    emit_byte(b, 0x5B); // pop rbx
+    emit_byte(b, 0xC3); // ret
+}
+
+static void emit_instruction(JitBuilder *b, Instruction *code, size_t count, int pc) {
+    Instruction *insn = &code[pc];
+
+    // The verifier guarantees jumps are always right after the push of their address
+    if (insn->opCode == OP_PUSH && (size_t)pc + 1 < count && is_jump(code[pc + 1].opCode)) {
+        if (code[pc + 1].opCode == OP_JMP && insn->operand.as.integer <= pc) {
+            emit_safe_point(b);
+        }
+        emit_static_jump(b, code[pc + 1].opCode, insn->operand.as.integer);
+        return;
+    }
+    if (is_jump(insn->opCode)) {
+        // Already emitted with the push before it
+        return;
+    }
+    if (is_generic_number_op(insn->opCode)) {
+        emit_guarded_integer_op(b, insn, pc);
+        return;
+    }
+    if (emit_native(b, insn)) {
+        return;
+    }
+
+    switch (insn->opCode) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+        case OP_RET:
+            emit_helper_call(b, insn, pc, true);
+            break;
+        case OP_HALT:
+            emit_save_sp(b);
+            emit_store_imm32(b, REG_VM, offsetof(VM, pc), (uint32_t)(pc + 1));
+            emit_epilogue(b);
+            break;
+        default:
+            emit_helper_call(b, insn, pc, false);
+            break;
+    }
+}
+
+// Saves the registers and loads the VM state into them
+static void emit_enter(JitBuilder *b) {
+    emit_byte(b, 0x53); // push rbx
+    emit_byte(b, 0x41); emit_byte(b, 0x54); // push r12
+    emit_byte(b, 0x41); emit_byte(b, 0x55); // push r13
+    emit_byte(b, 0x41); emit_byte(b, 0x56); // push r14
+    emit_byte(b, 0x41); emit_byte(b, 0x57); // push r15
+    emit_byte(b, 0x48); emit_byte(b, 0x89); emit_byte(b, 0xFB); // mov rbx, rdi
+    emit_byte(b, 0x49); emit_byte(b, 0x89); emit_byte(b, 0xF7); // mov r15, rsi
+    emit_op_mem(b, true, 0x8B, REG_STACK, REG_VM, offsetof(VM, stack.values)); // mov r12, [rbx + stack]
+    emit_load_stack_pointer(b, REG_TOP, offsetof(VM, sp));
+    emit_load_stack_pointer(b, REG_FRAME, offsetof(VM, fp));
+}
+
+// Maps a writable buffer with room for the machine code of count instructions
+static bool jit_builder_init(JitBuilder *b, size_t count) {
+    long page_size = 4096;
+    b->capacity = ((count + 1) * MAX_TEMPLATE_SIZE + page_size - 1) / page_size * page_size;
+    b->code = mmap(NULL, b->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->code == MAP_FAILED) {
+        return false;
+    }
+    b->size = 0;
+    b->overflowed = false;
+    b->labels = malloc(sizeof(size_t) * count);
+    b->patch_count = 0;
+    b->patch_capacity = 16;
+    b->patches = malloc(sizeof(JitPatch) * b->patch_capacity);
+    return true;
+}
+
+// Fills in the jumps to bytecode addresses and makes the buffer executable
+// @returns false if the code didn't fit or can't be made executable, so it mustn't be run
+static bool jit_builder_finish(JitBuilder *b) {
+    for (int i = 0; i < b->patch_count; i++) {
+        patch_rel32(b, b->patches[i].at, b->labels[b->patches[i].target]);
+    }
+    free(b->labels);
+    free(b->patches);
+    return !b->overflowed && mprotect(b->code, b->capacity, PROT_READ | PROT_EXEC) == 0;
+}
+
+static JitFunction jit_entry(unsigned char *code) {
+    JitFunction function;
+    void *entry = code;
+    memcpy(&function, &entry, sizeof(function));
+    return function;
+}
+
+bool jit_execute(VM *vm) {
+    if (!vm->verified || vm->code_count == 0) {
+        return false;
+    }
+    size_t count = vm->code_count;
+
+    // Compile from a copy where quickened instructions are back in their generic form;
+    // the templates specialize by themselves and the helpers are passed these copies.
+    Instruction *code = malloc(sizeof(Instruction) * count);
+    for (size_t i = 0; i < count; i++) {
+        code[i] = vm->code[i];
+        code[i].opCode = instruction_unquickened(code[i].opCode);
+    }
+
+    JitBuilder b;
+    if (!jit_builder_init(&b, count)) {
+        free(code);
+        return false;
+    }
+
+    emit_enter(&b);
+    emit_dispatch_pc(&b);
+    for (size_t pc = 0; pc < count; pc++) {
+        b.labels[pc] = b.size;
+        emit_instruction(&b, code, count, (int)pc);
+    }
+
+    void **table = malloc(sizeof(void*) * count);
+    for (size_t pc = 0; pc < count; pc++) {
+        table[pc] = b.code + b.labels[pc];
+    }
+
+    if (vm->perf && !b.overflowed) {
+        perf_map_code(vm->perf, b.code, b.labels, b.size);
+    }
+
+    bool ran = jit_builder_finish(&b);
+    if (ran) {
+        vm->stats.jit_runs++;
+        jit_entry(b.code)(vm, table);
+    }
+
+    munmap(b.code, b.capacity);
+    free(table);
+    free(code);
+    return ran;
+}
+
+//////////////////////////////////////////////////////////
+///////////////////////// Traces /////////////////////////
+//////////////////////////////////////////////////////////
+
+// Adds the count of trace steps run to the VM's instruction count, as if the interpreter ran them
+static void emit_count_steps(JitBuilder *b, int steps) {
+    if (steps > 0) {
+        emit_op_mem(b, true, 0x81, 0, REG_VM, offsetof(VM, stats.dispatches)); // add qword [dispatches], steps
+        emit_u32(b, (uint32_t)steps);
+    }
+}
+
+// Leaves the trace for the interpreter, which continues at exit_pc. The first
+// executed steps of this iteration ran before the exit.
+static void emit_side_exit(JitBuilder *b, int exit_pc, int executed) {
+    emit_count_steps(b, executed);
+    emit_save_sp(b);
+    emit_store_imm32(b, REG_VM, offsetof(VM, pc), (uint32_t)exit_pc);
+    emit_op_mem(b, true, 0x83, 0, REG_VM, offsetof(VM, stats.side_exits)); // add qword [side_exits], 1
+    emit_byte(b, 1);
+    emit_epilogue(b);
+}
+
+// Side exits unless the value at [top + disp] has the given type
+static void emit_type_guard(JitBuilder *b, int disp, ValueType type, int exit_pc, int executed) {
+    emit_op_mem(b, false, 0x83, 7, REG_TOP, disp); // cmp dword [value.type], type
+    emit_byte(b, type);
+    size_t ok = emit_jump(b, CC_E);
+    emit_side_exit(b, exit_pc, executed);
+    patch_here(b, ok);
+}
+
+// A conditional jump recorded at step, with its address pushed by the step before, which is
+// step index of the iteration. The trace continues the way the recording went and side exits the other way.
+static void emit_trace_branch(JitBuilder *b, TraceStep *push, TraceStep *step, int index) {
+    int target = push->insn.operand.as.integer;
+    int fallthrough = step->pc + 1;
+
+    // The interpreter reports the error if the condition isn't a bool
+    emit_type_guard(b, -VALUE_SIZE, VAL_BOOL, push->pc, index);
+    emit_op_mem(b, false, 0x0FB6, RAX, REG_TOP, -VALUE_SIZE + PAYLOAD); // movzx eax, byte [cond]
+    emit_add_imm(b, REG_TOP, -VALUE_SIZE);
+    if (target == fallthrough) {
+        return;
+    }
+
+    bool taken = step->next_pc == target;
+    bool condition = (step->insn.opCode == OP_JMP_IF) == taken;
+    emit_byte(b, 0x84); emit_byte(b, 0xC0); // test al, al
+    size_t ok = emit_jump(b, condition ? CC_NE : CC_E);
+    emit_side_exit(b, taken ? fallthrough : target, index + 2);
+    patch_here(b, ok);
+}
+
+// A generic number operation specialized to the types it saw while recording, at step index
+// of the iteration. Its guards exit before it runs, so the interpreter runs it instead.
+static void emit_trace_number_op(JitBuilder *b, TraceStep *step, int index) {
+    if (step->a_type == VAL_INTEGER && step->b_type == VAL_INTEGER) {
+        emit_type_guard(b, -2 * VALUE_SIZE, VAL_INTEGER, step->pc, index);
+        emit_type_guard(b, -VALUE_SIZE, VAL_INTEGER, step->pc, index);
+        emit_integer_op(b, step->insn.opCode);
+    }
+    else if (step->a_type == VAL_FLOAT && step->b_type == VAL_FLOAT) {
+        emit_type_guard(b, -2 * VALUE_SIZE, VAL_FLOAT, step->pc, index);
+        emit_type_guard(b, -VALUE_SIZE, VAL_FLOAT, step->pc, index);
+        emit_float_op(b, step->insn.opCode);
+    }
+    else {
+        emit_helper_call(b, &step->insn, step->pc, false);
+    }
+}
+
+JitTrace *jit_compile_trace(TraceStep *steps, int count) {
+    JitTrace *trace = malloc(sizeof(JitTrace));
+    trace->steps = malloc(sizeof(TraceStep) * count);
+    memcpy(trace->steps, steps, sizeof(TraceStep) * count);
+    trace->step_count = count;
+
+    // Guards make a recorded step take up to two side exits more than its template
+    JitBuilder b;
+    if (!jit_builder_init(&b, (size_t)count * 2)) {
+        free(trace->steps);
+        free(trace);
+        return NULL;
+    }
+
+    emit_enter(&b);
+    size_t loop = b.size;
+    for (int i = 0; i < count; i++) {
+        TraceStep *step = &trace->steps[i];
+
+        if (step->insn.opCode == OP_PUSH && i + 1 < count && is_jump(trace->steps[i + 1].insn.opCode)) {
+            // The recording already followed unconditional jumps
+            if (trace->steps[i + 1].insn.opCode != OP_JMP) {
+                emit_trace_branch(&b, step, &trace->steps[i + 1], i);
+            }
+            i++;
+        }
+        else if (is_generic_number_op(step->insn.opCode)) {
+            emit_trace_number_op(&b, step, i);
+        }
+        else if (!emit_native(&b, &step->insn)) {
+            emit_helper_call(&b, &step->insn, step->pc, false);
+        }
+    }
+
+    // The last step went back to the loop header, where the trace starts over
+    emit_count_steps(&b, count);
+    emit_safe_point(&b);
+    size_t back = emit_jump(&b, -1);
+    patch_rel32(&b, back, loop);
+
+    trace->code = b.code;
+    trace->capacity = b.capacity;
+    trace->size = b.size;
+    if (!jit_builder_finish(&b)) {
+        jit_free_trace(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void jit_run_trace(JitTrace *trace, VM *vm) {
+    jit_entry(trace->code)(vm, NULL);
+}
+
+void jit_free_trace(JitTrace *trace) {
+    munmap(trace->code, trace->capacity);
+    free(trace->steps);
+    free(trace);
+}
+
+#else
+
+bool jit_execute(VM *vm) {
+    (void)vm;
+    return false;
+}
+
+JitTrace *jit_compile_trace(TraceStep *steps, int count) {
+    (void)steps;
+    (void)count;
+    return NULL;
+}
+
+void jit_run_trace(JitTrace *trace, VM *vm) {
+    (void)trace;
+    (void)vm;
+}
+
+void jit_free_trace(JitTrace *trace) {
+    (void)trace;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+
+#include "vm.h"
+#include "trace.h"
+
+/**
+ * Translates the VM's loaded code into x86-64 machine code and runs it from vm->pc
+ * until OP_HALT, leaving the VM in the same state the interpreter would.
+ *
+ * Stack shuffling, locals, globals, integer arithmetic and comparisons and jumps get
+ * their own machine code; everything else (lists, strings, calls, type errors) calls
+ * back into the interpreter's handler for that one instruction.
+ *
+ * Only verified code can be compiled, since the machine code has no stack checks.
+ * @returns false without running anything if the code can't be compiled (not verified,
+ *          not on x86-64, or built with VM_SOA_STACK), so the caller should interpret it instead
+ */
+bool jit_execute(VM *vm);
+
+/**
+ * A recorded loop iteration compiled to machine code
+ */
+typedef struct JitTrace {
+    unsigned char *code;
+    size_t capacity; // Size of the mapping code points to
+    size_t size; // Bytes of machine code in it
+    TraceStep *steps; // Copy of the recorded steps; helper calls point into it
+    int step_count;
+} JitTrace;
+
+/**
+ * Compiles a recorded loop iteration that ends back at its first step into straight-line
+ * machine code that repeats it. Each number operation gets the types it saw while recording
+ * and each conditional jump the direction it took, behind guards that side exit to the
+ * interpreter when they don't hold.
+ * @returns the trace, or NULL if it can't be compiled (not on x86-64, or built with VM_SOA_STACK)
+ */
+JitTrace *jit_compile_trace(TraceStep *steps, int count);
+
+/**
+ * Runs a compiled trace from the top of the loop until a guard side exits,
+ * leaving vm->pc at the instruction the interpreter should continue with
+ */
+void jit_run_trace(JitTrace *trace, VM *vm);
+
+/**
+ * Frees a compiled trace
+ */
+void jit_free_trace(JitTrace *trace);
+
+#endif // JIT_H
@@ -20,9 +20,25 @@ Lexer* lexer_create(char *input) {
     Lexer *lexer = malloc(sizeof(Lexer));
     lexer->input = input;
     lexer->pos = 0;
+    lexer->line = 1;
+    lexer->line_start = 0;
+    lexer->counted = 0;
     return lexer;
 }
 
+// Returns the line and column of the current position. Newlines are counted here,
+// from wherever the last call got to, rather than everywhere the lexer moves forward.
+static SourcePos lexer_position(Lexer *lexer) {
+    while (lexer->counted < lexer->pos) {
+        if (lexer->input[lexer->counted] == '\n') {
+            lexer->line++;
+            lexer->line_start = lexer->counted + 1;
+        }
+        lexer->counted++;
+    }
+    return (SourcePos){.line = lexer->line, .col = lexer->pos - lexer->line_start + 1};
+}
+
 void skip_whitespace(Lexer *lexer) {
     while (isspace(lexer->input[lexer->pos])) {
         lexer->pos++;
@@ -44,10 +60,14 @@ void lexer_error(char *msg) {
 
 Token lexer_next_token(Lexer *lexer) {
     skip_whitespace(lexer);
-    skip_comments(lexer);
-    skip_whitespace(lexer);
+    while (lexer->input[lexer->pos] == ';') {
+        // Consecutive comment lines
+        skip_comments(lexer);
+        skip_whitespace(lexer);
+    }
 
     Token token;
+    token.pos = lexer_position(lexer);
     char current = lexer->input[lexer->pos];
 
     if (current == '\0') {
@@ -94,7 +114,8 @@ Token lexer_next_token(Lexer *lexer) {
             lexer->input[lexer->pos] != '\0' &&
             !isspace(lexer->input[lexer->pos]) &&
             lexer->input[lexer->pos] != LPAREN_CHAR &&
-            lexer->input[lexer->pos] != RPAREN_CHAR
+            lexer->input[lexer->pos] != RPAREN_CHAR &&
+            lexer->input[lexer->pos] != CLOSE_LIST_CHAR
         ) {
             lexer_error("Invalid number format: unexpected character after number! Did you forget a space?");
         }
@@ -235,6 +256,8 @@ Token lexer_next_token(Lexer *lexer) {
         !isspace(lexer->input[lexer->pos]) &&
         lexer->input[lexer->pos] != LPAREN_CHAR &&
         lexer->input[lexer->pos] != RPAREN_CHAR &&
+        lexer->input[lexer->pos] != OPEN_LIST_CHAR &&
+        lexer->input[lexer->pos] != CLOSE_LIST_CHAR &&
         lexer->input[lexer->pos] != QUOTE_CHAR &&
         lexer->input[lexer->pos] != '\0'
     ) {
@@ -254,3 +277,22 @@ void lexer_free(Lexer *lexer) {
     if (!lexer) return;
     free(lexer);
 }
+
+void source_print_line(const char *source, int line, FILE *out) {
+    const char *start = source;
+    for (int i = 1; i < line && start; i++) {
+        start = strchr(start, '\n');
+        if (start) {
+            start++;
+        }
+    }
+    if (!start) {
+        return;
+    }
+    while (*start == ' ' || *start == '\t') {
+        start++;
+    }
+    const char *end = strchr(start, '\n');
+    int length = end ? (int)(end - start) : (int)strlen(start);
+    fprintf(out, "%.*s", length, start);
+}
@@ -2,6 +2,7 @@
 #define LEXER_H
 
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "vmstring.h"
 
@@ -18,8 +19,17 @@ typedef enum {
     TOKEN_EOF
 } TokenType;
 
+/**
+ * A position in the source text. Lines and columns count from 1; line 0 means unknown.
+ */
+typedef struct {
+    int line;
+    int col;
+} SourcePos;
+
 typedef struct {
     TokenType type;
+    SourcePos pos; // Where the token starts
     union {
         int integer;
         double floating;
@@ -32,6 +42,10 @@ typedef struct {
 typedef struct {
     char *input;
     int pos;
+
+    int line; // Line of input[counted]
+    int line_start; // Offset of the first character of that line
+    int counted; // Offset up to which newlines have been counted
 } Lexer;
 
 /**
@@ -49,4 +63,10 @@ Token lexer_next_token(Lexer *lexer);
  */
 void lexer_free(Lexer *lexer);
 
+/**
+ * Writes the given line (counting from 1) of a source text, without its leading
+ * whitespace or newline. Writes nothing if the text is shorter than that.
+ */
+void source_print_line(const char *source, int line, FILE *out);
+
 #endif // LEXER_H
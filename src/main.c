@@ -3,33 +3,288 @@
 #include "parser.h"
 #include "vmstring.h"
 #include "codegen.h"
+#include "emitc.h"
+#include "disasm.h"
+#include "profile.h"
+#include "allocprofile.h"
+#include "heapsnap.h"
+#include "sampler.h"
+#include "perfmap.h"
 #include "file_util.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+// Milliseconds on a monotonic clock, for timing the phases of a run
+static double now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+// Lexes the whole source and throws the tokens away. The parser lexes as it goes, so
+// this is how --stats times lexing on its own.
+static void lex_only(char *source) {
+    Lexer *lexer = lexer_create(source);
+    Token token;
+    do {
+        token = lexer_next_token(lexer);
+        if (token.type == TOKEN_STRING || token.type == TOKEN_SYMBOL) {
+            string_free(token.as.string);
+        }
+    } while (token.type != TOKEN_EOF);
+    lexer_free(lexer);
+}
+
+// Shows where the program paused and asks what to do next.
+// Returns false if the user chose to stop the program.
+static bool debug_prompt(VM *vm) {
+    fflush(stdout); // Show the program's output so far first
+    fprintf(stderr, "Breakpoint at pc %d\n", vm->pc);
+    vm_debug_print(vm, stderr);
+    vm_debug_print_stack(vm, stderr);
+    while (true) {
+        fprintf(stderr, "(c)ontinue, (t)race and continue, (q)uit> ");
+        char line[64];
+        if (!fgets(line, sizeof(line), stdin)) {
+            return true;
+        }
+        switch (line[0]) {
+            case 'c':
+            case '\n':
+                return true;
+            case 't':
+                vm->debug = true;
+                return true;
+            case 'q':
+                return false;
+        }
+    }
+}
+
+static void print_usage(char *program) {
+    printf("Usage: %s [--stats] [--stats-json <path>] [--jit] [--trace] [--emit-c] [--disasm] [--regvm] [--debug] [--break <pc>]... [--profile] [--profile-json <path>] [--sample <path>] [--alloc-profile] [--perf-map] <filepath>\n", program);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <filepath>\n", argv[0]);
+    char *path = NULL;
+    bool print_stats = false;
+    char *stats_json = NULL;
+    bool jit = false;
+    bool trace = false;
+    bool emit_c = false;
+    bool disasm = false;
+    bool regvm = false;
+    bool debug = false;
+    bool profile = false;
+    char *profile_json = NULL;
+    char *sample_path = NULL;
+    bool alloc_profile = false;
+    bool perf_map = false;
+    int *breakpoints = malloc(sizeof(int) * argc);
+    int breakpoint_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        }
+        else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            trace = true;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = true;
+        }
+        else if (strcmp(argv[i], "--disasm") == 0) {
+            disasm = true;
+        }
+        else if (strcmp(argv[i], "--regvm") == 0) {
+            regvm = true;
+        }
+        else if (strcmp(argv[i], "--debug") == 0) {
+            debug = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        }
+        else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profile = true;
+            profile_json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--alloc-profile") == 0) {
+            alloc_profile = true;
+        }
+        else if (strcmp(argv[i], "--perf-map") == 0) {
+            perf_map = true;
+        }
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+            char *end;
+            long pc = strtol(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || pc < 0 || pc > INT_MAX) {
+                printf("Error: --break needs an instruction's pc, not %s\n", argv[i]);
+                print_usage(argv[0]);
+                free(breakpoints);
+                return 1;
+            }
+            breakpoints[breakpoint_count++] = (int)pc;
+        }
+        else {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL) {
+        print_usage(argv[0]);
+        free(breakpoints);
         return 1;
     }
 
-    char *source = file_read_all(argv[1]);
+    char *source = file_read_all(path);
     if (!source) {
-        printf("Error: Unable to read file %s\n", argv[1]);
+        printf("Error: Unable to read file %s\n", path);
+        free(breakpoints);
         return 1;
     }
 
+    VMStats phases = {0};
+    double start = now_ms();
+    if (print_stats || stats_json) {
+        lex_only(source);
+        phases.lex_ms = now_ms() - start;
+        start = now_ms();
+    }
     Lexer *lexer = lexer_create(source);
     Parser *parser = parser_create(lexer);
     ASTProgram *program = parser_parse(parser);
+    phases.parse_ms = now_ms() - start;
+
+    start = now_ms();
     BytecodeBuf *bbuf = bytecode_create();
     SymbolTable *symtable = symbol_table_create();
     codegen_compile(program, bbuf, symtable);
+    phases.codegen_ms = now_ms() - start;
+
+    // Print the program as C or as annotated bytecode instead of running it
+    if (emit_c || disasm) {
+        if (emit_c) {
+            emitc_program(bbuf, stdout);
+        }
+        else {
+            disasm_print(bbuf, source, stdout);
+        }
+        astprogram_free(program);
+        bytecode_free(bbuf);
+        symbol_table_free(symtable);
+        parser_free(parser);
+        lexer_free(lexer);
+        free(source);
+        free(breakpoints);
+        return 0;
+    }
 
     VM *vm = vm_create();
-    vm->code = bbuf->instructions;
+    vm->jit = jit;
+    vm->trace = trace;
+    vm->regvm = regvm;
+    vm->debug = debug;
+    start = now_ms();
+    vm_load_code(vm, bbuf->instructions, bbuf->count, bbuf->functions, bbuf->function_count);
+    vm->stats.load_ms = now_ms() - start;
+    vm->stats.lex_ms = phases.lex_ms;
+    vm->stats.parse_ms = phases.parse_ms;
+    vm->stats.codegen_ms = phases.codegen_ms;
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (!vm_set_breakpoint(vm, breakpoints[i])) {
+            printf("Error: No instruction at pc %d to break at, the program's pcs run from 0 to %zu\n", breakpoints[i], vm->code_count - 1);
+            print_usage(argv[0]);
+            vm_free(vm);
+            astprogram_free(program);
+            bytecode_free(bbuf);
+            symbol_table_free(symtable);
+            parser_free(parser);
+            lexer_free(lexer);
+            free(source);
+            free(breakpoints);
+            return 1;
+        }
+    }
+    free(breakpoints);
+    if (profile) {
+        vm->profile = profile_create(vm->code_count);
+    }
+    if (alloc_profile) {
+        vm->allocs = alloc_profile_create(vm->code_count);
+    }
+    if (perf_map) {
+        vm->perf = perf_map_create(bbuf, path);
+        if (!vm->perf) {
+            printf("Error: Unable to write /tmp/perf-<pid>.map\n");
+            return 1;
+        }
+    }
+    heap_snapshot_on_signal(vm);
+    Sampler *sampler = NULL;
+    if (sample_path) {
+        sampler = sampler_start(vm, SAMPLER_HZ);
+        if (!sampler) {
+            printf("Error: Unable to start the sampling profiler\n");
+            return 1;
+        }
+    }
+
+    // Only the runs between breakpoints count, not the time spent waiting at the prompt
+    start = now_ms();
     vm_execute(vm);
+    vm->stats.execute_ms = now_ms() - start;
+    while (vm->paused && debug_prompt(vm)) {
+        start = now_ms();
+        vm_execute(vm);
+        vm->stats.execute_ms += now_ms() - start;
+    }
+
+    if (sampler) {
+        sampler_stop(sampler);
+        FILE *folded = fopen(sample_path, "w");
+        if (folded) {
+            sampler_write_folded(sampler, bbuf, folded);
+            fclose(folded);
+        }
+        else {
+            printf("Error: Unable to write samples to %s\n", sample_path);
+        }
+        sampler_print_lines(sampler, bbuf, source, stderr);
+        sampler_free(sampler);
+    }
+
+    if (print_stats) {
+        vm_print_stats(vm, stderr);
+    }
+    if (stats_json && !vm_write_stats_json(vm, stats_json)) {
+        printf("Error: Unable to write stats to %s\n", stats_json);
+    }
+    if (vm->profile) {
+        profile_print(vm->profile, vm, stderr);
+        if (profile_json && !profile_write_json(vm->profile, vm, profile_json)) {
+            printf("Error: Unable to write profile to %s\n", profile_json);
+        }
+        profile_free(vm->profile);
+    }
+    perf_map_free(vm->perf);
+    if (vm->allocs) {
+        alloc_profile_print(vm->allocs, vm, bbuf, source, stderr);
+        alloc_profile_free(vm->allocs);
+    }
 
     astprogram_free(program);
     bytecode_free(bbuf);
@@ -43,13 +298,13 @@ int main(int argc, char *argv[]) {
 // TODO:
 /*
 Todo list (in order of priority):
-- Implement local variables: (let [var1 val1 var2 val2] expr)
+- Implement local variables: (let [var1 val1 var2 val2] expr)    [DONE]
 - Implement control flow:
     - (if cond then else)   [DONE]
     - (while bool expr)     [DONE]
     - (repeat n expr)
     - (for var start end expr)  -- Make sure var is a local variable, scope is within the loop only.
-- Implement functions: (defun name [args] body) and (name params)
+- Implement functions: (defun name [args] body) and (name params)    [DONE]
 - Implement (import "xyz")  <-- need to ensure argument is a string literal (variables can't work since imports not @ runtime)
     - Also (soft-import) that just returns false if file not found instead of erroring out.
 - Implement REPL: make it so if you run lvm with no args it goes into REPL mode. Should be really easy.
@@ -5,7 +5,7 @@
 #include "vmstring.h"
 
 // Forward declaration
-ASTNode* parse_expr(Parser *parser);
+int parse_expr(Parser *parser);
 
 void parser_error(char *msg) {
     printf("Parser error: %s\n", msg);
@@ -16,6 +16,10 @@ Parser* parser_create(Lexer *lexer) {
     Parser *parser = malloc(sizeof(Parser));
     parser->lexer = lexer;
     parser->debug = false;
+    parser->program = NULL;
+    parser->pending_count = 0;
+    parser->pending_capacity = 16;
+    parser->pending = malloc(sizeof(int) * parser->pending_capacity);
     parser->current_token = lexer_next_token(lexer);
     return parser;
 }
@@ -24,34 +28,104 @@ void parser_advance(Parser *parser) {
     parser->current_token = lexer_next_token(parser->lexer);
 }
 
-ASTNode* parse_atom(Parser *parser) {
+// Appends a new node to the program and returns its index
+static int ast_add_node(ASTProgram *program, ASTNodeType type, SourcePos pos) {
+    if (program->node_count >= program->node_capacity) {
+        program->node_capacity *= 2;
+        unsigned char *tmp_types = realloc(
+            program->types,
+            sizeof(unsigned char) * program->node_capacity
+        );
+        ASTPayload *tmp_payloads = realloc(
+            program->payloads,
+            sizeof(ASTPayload) * program->node_capacity
+        );
+        SourcePos *tmp_positions = realloc(
+            program->positions,
+            sizeof(SourcePos) * program->node_capacity
+        );
+        if (!tmp_types || !tmp_payloads || !tmp_positions) {
+            parser_error("Couldn't realloc node arrays for AST");
+        }
+        program->types = tmp_types;
+        program->payloads = tmp_payloads;
+        program->positions = tmp_positions;
+    }
+
+    program->types[program->node_count] = (unsigned char)type;
+    program->positions[program->node_count] = pos;
+    return program->node_count++;
+}
+
+// Remembers a child of the innermost open list until the list is closed
+static void parser_push_pending(Parser *parser, int node) {
+    if (parser->pending_count >= parser->pending_capacity) {
+        parser->pending_capacity *= 2;
+        int *tmp = realloc(parser->pending, sizeof(int) * parser->pending_capacity);
+        if (!tmp) {
+            parser_error("Couldn't realloc pending children array");
+        }
+        parser->pending = tmp;
+    }
+    parser->pending[parser->pending_count++] = node;
+}
+
+// Moves the pending children from pending_start onwards into the program's
+// children buffer, as one contiguous range belonging to the given node
+static void parser_close_list(Parser *parser, int node, int pending_start) {
+    ASTProgram *program = parser->program;
+    int count = parser->pending_count - pending_start;
+
+    if (program->children_count + count > program->children_capacity) {
+        while (program->children_count + count > program->children_capacity) {
+            program->children_capacity *= 2;
+        }
+        int *tmp = realloc(program->children, sizeof(int) * program->children_capacity);
+        if (!tmp) {
+            parser_error("Couldn't realloc children array for AST");
+        }
+        program->children = tmp;
+    }
+
+    for (int i = 0; i < count; i++) {
+        program->children[program->children_count + i] = parser->pending[pending_start + i];
+    }
+    program->payloads[node].children.first = program->children_count;
+    program->payloads[node].children.count = count;
+    program->children_count += count;
+    parser->pending_count = pending_start;
+}
+
+int parse_atom(Parser *parser) {
     Token token = parser->current_token;
-    ASTNode *node = malloc(sizeof(ASTNode));
+    ASTProgram *program = parser->program;
+    int node = -1;
 
+    // String and symbol tokens hand their String over to the AST
     switch (token.type) {
         case TOKEN_INTEGER: {
-            node->type = AST_INTEGER;
-            node->integer = token.as.integer;
+            node = ast_add_node(program, AST_INTEGER, token.pos);
+            program->payloads[node].integer = token.as.integer;
             break;
         }
         case TOKEN_FLOAT: {
-            node->type = AST_FLOAT;
-            node->floating = token.as.floating;
+            node = ast_add_node(program, AST_FLOAT, token.pos);
+            program->payloads[node].floating = token.as.floating;
             break;
         }
         case TOKEN_BOOL: {
-            node->type = AST_BOOL;
-            node->boolean = token.as.boolean;
+            node = ast_add_node(program, AST_BOOL, token.pos);
+            program->payloads[node].boolean = token.as.boolean;
             break;
         }
         case TOKEN_STRING: {
-            node->type = AST_STRING;
-            node->string = string_copy(token.as.string);
+            node = ast_add_node(program, AST_STRING, token.pos);
+            program->payloads[node].string = token.as.string;
             break;
         }
         case TOKEN_SYMBOL: {
-            node->type = AST_SYMBOL;
-            node->symbol = string_copy(token.as.symbol);
+            node = ast_add_node(program, AST_SYMBOL, token.pos);
+            program->payloads[node].symbol = token.as.symbol;
             break;
         }
         default: {
@@ -64,18 +138,16 @@ ASTNode* parse_atom(Parser *parser) {
     return node;
 }
 
-ASTNode* parse_list(Parser *parser) {
+int parse_list(Parser *parser) {
     if (parser->current_token.type != TOKEN_LPAREN) {
         parser_error("Expected '(' at start of expression");
     }
+    SourcePos pos = parser->current_token.pos;
     parser_advance(parser); // consume '('
 
-    // Create list node
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_LIST;
-    node->list.count = 0;
-    node->list.capacity = 4;
-    node->list.children = malloc(sizeof(ASTNode*) * node->list.capacity);
+    // Create list node; its children get the following indices
+    int node = ast_add_node(parser->program, AST_LIST, pos);
+    int pending_start = parser->pending_count;
 
     // Parse children until ')'
     while (parser->current_token.type != TOKEN_RPAREN) {
@@ -83,39 +155,25 @@ ASTNode* parse_list(Parser *parser) {
             parser_error("Unexpected EOF while parsing expression");
         }
 
-        // Make space for new child if needed
-        if (node->list.count >= node->list.capacity) {
-            node->list.capacity *= 2;
-            ASTNode **tmp = realloc(
-                node->list.children,
-                sizeof(ASTNode*) * node->list.capacity
-            );
-            if (!tmp) {
-                parser_error("Couldn't realloc children array for AST list");
-            }
-            node->list.children = tmp;
-        }
-
         // Parse children recursively
-        node->list.children[node->list.count++] = parse_expr(parser);
+        parser_push_pending(parser, parse_expr(parser));
     }
 
+    parser_close_list(parser, node, pending_start);
     parser_advance(parser); // consume ')'
     return node;
 }
 
-ASTNode* parse_list_literal(Parser *parser) {
+int parse_list_literal(Parser *parser) {
     if (parser->current_token.type != TOKEN_LIST_OPEN) {
         parser_error("Expected '[' at start of list literal");
     }
+    SourcePos pos = parser->current_token.pos;
     parser_advance(parser); // consume '['
 
-    // Create list literal node
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_LITERAL_LIST;
-    node->list_literal.count = 0;
-    node->list_literal.capacity = 4;
-    node->list_literal.children = malloc(sizeof(ASTNode*) * node->list_literal.capacity);
+    // Create list literal node; its children get the following indices
+    int node = ast_add_node(parser->program, AST_LITERAL_LIST, pos);
+    int pending_start = parser->pending_count;
 
     // Parse children until ']'
     while (parser->current_token.type != TOKEN_LIST_CLOSE) {
@@ -123,29 +181,17 @@ ASTNode* parse_list_literal(Parser *parser) {
             parser_error("Unexpected EOF while parsing list literal");
         }
 
-        // Make space for new child if needed
-        if (node->list_literal.count >= node->list_literal.capacity) {
-            node->list_literal.capacity *= 2;
-            ASTNode **tmp = realloc(
-                node->list_literal.children,
-                sizeof(ASTNode*) * node->list_literal.capacity
-            );
-            if (!tmp) {
-                parser_error("Couldn't realloc children array for AST list literal");
-            }
-            node->list_literal.children = tmp;
-        }
-
         // Parse children recursively
-        node->list_literal.children[node->list_literal.count++] = parse_expr(parser);
+        parser_push_pending(parser, parse_expr(parser));
     }
 
+    parser_close_list(parser, node, pending_start);
     parser_advance(parser); // consume ']'
     return node;
 }
 
 // Parse a single expression (atom or list)
-ASTNode* parse_expr(Parser *parser) {
+int parse_expr(Parser *parser) {
     if (parser->debug) {
         printf("\nToken details: ");
         switch (parser->current_token.type) {
@@ -203,9 +249,19 @@ ASTNode* parse_expr(Parser *parser) {
 
 ASTProgram* parser_parse(Parser *parser) {
     ASTProgram *program = malloc(sizeof(ASTProgram));
+    program->node_count = 0;
+    program->node_capacity = 64;
+    program->types = malloc(sizeof(unsigned char) * program->node_capacity);
+    program->payloads = malloc(sizeof(ASTPayload) * program->node_capacity);
+    program->positions = malloc(sizeof(SourcePos) * program->node_capacity);
+    program->children_count = 0;
+    program->children_capacity = 64;
+    program->children = malloc(sizeof(int) * program->children_capacity);
     program->count = 0;
     program->capacity = 4;
-    program->expressions = malloc(sizeof(ASTNode*) * program->capacity);
+    program->expressions = malloc(sizeof(int) * program->capacity);
+    program->value_types = NULL;
+    parser->program = program;
 
     while (parser->current_token.type != TOKEN_EOF) {
         if (parser->current_token.type == TOKEN_RPAREN) {
@@ -213,12 +269,12 @@ ASTProgram* parser_parse(Parser *parser) {
             parser_error("Unmatched ')'");
         }
 
-        // Make space for new ASTProgram if needed
+        // Make space for new expression if needed
         if (program->count >= program->capacity) {
             program->capacity *= 2;
-            ASTNode **tmp = realloc(
+            int *tmp = realloc(
                 program->expressions,
-                sizeof(ASTNode*) * program->capacity
+                sizeof(int) * program->capacity
             );
             if (!tmp) {
                 parser_error("Couldn't realloc program array for AST");
@@ -230,63 +286,59 @@ ASTProgram* parser_parse(Parser *parser) {
         program->expressions[program->count++] = parse_expr(parser);
     }
 
+    parser->program = NULL;
     return program;
 }
 
-void astnode_free(ASTNode *node) {
-    if (!node) return;
-
-    if (node->type == AST_STRING) {
-        string_free(node->string);
-    } else if (node->type == AST_SYMBOL) {
-        string_free(node->symbol);
-    } else if (node->type == AST_LIST) {
-        for (int i = 0; i < node->list.count; i++) {
-            astnode_free(node->list.children[i]);
-        }
-        free(node->list.children);
-    }
-    free(node);
-}
-
 void astprogram_free(ASTProgram *program) {
     if (!program) return;
 
-    for (int i = 0; i < program->count; i++) {
-        astnode_free(program->expressions[i]);
+    for (int i = 0; i < program->node_count; i++) {
+        if (program->types[i] == AST_STRING) {
+            string_free(program->payloads[i].string);
+        } else if (program->types[i] == AST_SYMBOL) {
+            string_free(program->payloads[i].symbol);
+        }
     }
+    free(program->types);
+    free(program->payloads);
+    free(program->positions);
+    free(program->children);
     free(program->expressions);
+    free(program->value_types);
     free(program);
 }
 
 void parser_free(Parser *parser) {
+    if (!parser) return;
+    free(parser->pending);
     free(parser);
 }
 
-void astnode_print(ASTNode *node) {
-    if (!node) return;
+void astnode_print(ASTProgram *program, int node) {
+    ASTPayload *payload = ast_payload(program, node);
 
-    switch (node->type) {
+    switch (ast_type(program, node)) {
         case AST_INTEGER:
-            printf("%d", node->integer);
+            printf("%d", payload->integer);
             break;
         case AST_FLOAT:
-            printf("%f", node->floating);
+            printf("%f", payload->floating);
             break;
         case AST_BOOL:
-            printf("%s", node->boolean ? "true" : "false");
+            printf("%s", payload->boolean ? "true" : "false");
             break;
         case AST_STRING:
-            printf("\"%s\"", node->string->data);
+            printf("\"%s\"", payload->string->data);
             break;
         case AST_SYMBOL:
-            printf("%s", node->symbol->data);
+            printf("%s", payload->symbol->data);
             break;
         case AST_LITERAL_LIST:
             printf("[");
-            for (int i = 0; i < node->list_literal.count; i++) {
-                astnode_print(node->list_literal.children[i]);
-                if (i < node->list_literal.count - 1) {
+            for (int i = 0; i < ast_child_count(program, node); i++) {
+                astnode_print(program, ast_child(program, node, i));
+                if (i < ast_child_count(program, node) - 1) {
                     printf(" ");
                 }
             }
@@ -294,9 +346,9 @@ void astnode_print(ASTNode *node) {
             break;
         case AST_LIST:
             printf("(");
-            for (int i = 0; i < node->list.count; i++) {
-                astnode_print(node->list.children[i]);
-                if (i < node->list.count - 1) {
+            for (int i = 0; i < ast_child_count(program, node); i++) {
+                astnode_print(program, ast_child(program, node, i));
+                if (i < ast_child_count(program, node) - 1) {
                     printf(" ");
                 }
             }
@@ -309,7 +361,7 @@ void astprogram_print(ASTProgram *program) {
     printf("AST Program:\n");
     for (int i = 0; i < program->count; i++) {
         printf("Expression %d: ", i);
-        astnode_print(program->expressions[i]);
+        astnode_print(program, program->expressions[i]);
         printf("\n");
     }
 }
@@ -14,37 +14,55 @@ typedef enum {
     AST_LIST    // "List" = anything in parenthesis; (+ 1 2) is a list
 } ASTNodeType;
 
-typedef struct ASTNode {
-    ASTNodeType type;
-    union {
-        int integer;
-        double floating;
-        bool boolean;
-        String *string;
-        String *symbol;
-        struct {
-            struct ASTNode **children;
-            int count;
-            int capacity;
-        } list;
-        struct {
-            struct ASTNode **children;
-            int count;
-            int capacity;
-        } list_literal;
-    };
-} ASTNode;
+/**
+ * Payload of a single AST node. Which member is valid depends on the node's type.
+ */
+typedef union {
+    int integer;
+    double floating;
+    bool boolean;
+    String *string;
+    String *symbol;
+    struct {
+        int first; // Index into ASTProgram.children of the first child
+        int count;
+    } children; // Used by AST_LIST and AST_LITERAL_LIST
+} ASTPayload;
 
+/**
+ * A parsed program, stored as a flat struct-of-arrays.
+ * Nodes are referred to by their index and are numbered in the order the parser
+ * visits them (pre-order), so walking the tree mostly walks these arrays forwards.
+ * The children of a list are a contiguous range of node indices in `children`.
+ */
 typedef struct {
-    ASTNode **expressions;
+    unsigned char *types; // ASTNodeType of each node
+    ASTPayload *payloads;
+    SourcePos *positions; // Where each node starts in the source
+    int node_count;
+    int node_capacity;
+
+    int *children; // Child node indices, grouped per list
+    int children_count;
+    int children_capacity;
+
+    int *expressions; // Node indices of the top-level expressions
     int count;
     int capacity;
+
+    unsigned char *value_types; // StaticType of each node, or NULL until typeinfer_program has run
 } ASTProgram;
 
 typedef struct {
     Lexer *lexer;
     Token current_token;
     bool debug;
+
+    ASTProgram *program; // Program currently being filled
+
+    int *pending; // Child indices of the lists that are still open
+    int pending_count;
+    int pending_capacity;
 } Parser;
 
 /**
@@ -63,7 +81,7 @@ ASTProgram* parser_parse(Parser *parser);
 void parser_free(Parser *parser);
 
 /**
- * Frees an ASTProgram and all its contained ASTNodes
+ * Frees an ASTProgram and all of its nodes
  */
 void astprogram_free(ASTProgram *program);
 
@@ -73,5 +91,40 @@ void astprogram_free(ASTProgram *program);
  */
 void astprogram_print(ASTProgram *program);
 
+/**
+ * Returns the type of the given node
+ */
+static inline ASTNodeType ast_type(ASTProgram *program, int node) {
+    return (ASTNodeType)program->types[node];
+}
+
+/**
+ * Returns the payload of the given node
+ */
+static inline ASTPayload *ast_payload(ASTProgram *program, int node) {
+    return &program->payloads[node];
+}
+
+/**
+ * Returns where the given node starts in the source
+ */
+static inline SourcePos ast_position(ASTProgram *program, int node) {
+    return program->positions[node];
+}
+
+/**
+ * Returns the number of children of a list or list literal node
+ */
+static inline int ast_child_count(ASTProgram *program, int node) {
+    return program->payloads[node].children.count;
+}
+
+/**
+ * Returns the node index of the i-th child of a list or list literal node
+ */
+static inline int ast_child(ASTProgram *program, int node, int i) {
+    return program->children[program->payloads[node].children.first + i];
+}
+
 
 #endif // PARSER_H
@@ -0,0 +1,102 @@
+#include "perfmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PERF_MAP_NAME_SIZE (256) // Longest symbol name written, cut off beyond that
+
+// The name bytecode_function_name gives a function. That lives with the compiler, which
+// the runtime library that JIT code links against leaves out.
+static const char *function_name(BytecodeBuf *bbuf, int function) {
+    if (function < 0) {
+        return "main";
+    }
+    return bbuf->function_names[function] ? bbuf->function_names[function]->data : "lambda";
+}
+
+PerfMap *perf_map_create(BytecodeBuf *bbuf, const char *script) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return NULL;
+    }
+
+    const char *slash = strrchr(script, '/');
+    const char *file_name = slash ? slash + 1 : script;
+
+    PerfMap *map = malloc(sizeof(PerfMap));
+    map->file = file;
+    map->pc_count = bbuf->count;
+    map->names = malloc(sizeof(char*) * (bbuf->count + 1));
+    // The source map is in order of pc, so walk it alongside the code
+    int e = 0;
+    SourceMapEntry *previous = NULL;
+    for (size_t pc = 0; pc < bbuf->count; pc++) {
+        while (e + 1 < bbuf->source_map_count && bbuf->source_map[e + 1].pc <= (int)pc) {
+            e++;
+        }
+        SourceMapEntry *entry = &bbuf->source_map[e];
+        // Instructions codegen adds between expressions have no line, so go with the one before them
+        if (previous && previous->function == entry->function &&
+            (previous->pos.line == entry->pos.line || entry->pos.line == 0)) {
+            map->names[pc] = map->names[pc - 1];
+        }
+        else {
+            char name[PERF_MAP_NAME_SIZE];
+            snprintf(name, sizeof(name), "lvm:%s:%s:%d", function_name(bbuf, entry->function), file_name, entry->pos.line);
+            map->names[pc] = strdup(name);
+        }
+        previous = entry;
+    }
+    return map;
+}
+
+void perf_map_free(PerfMap *map) {
+    if (!map) {
+        return;
+    }
+    for (size_t pc = 0; pc < map->pc_count; pc++) {
+        if (pc == 0 || map->names[pc] != map->names[pc - 1]) {
+            free(map->names[pc]);
+        }
+    }
+    free(map->names);
+    fclose(map->file);
+    free(map);
+}
+
+// Writes a line of the map: start address and size in hex, then the name
+static void perf_map_write(PerfMap *map, unsigned char *start, size_t size, const char *name) {
+    if (size > 0) {
+        fprintf(map->file, "%lx %zx %s\n", (unsigned long)(uintptr_t)start, size, name);
+    }
+}
+
+void perf_map_code(PerfMap *map, unsigned char *code, size_t *labels, size_t size) {
+    if (map->pc_count == 0) {
+        return;
+    }
+    // The prologue and dispatch on vm->pc come before the first instruction
+    perf_map_write(map, code, labels[0], "lvm:jit-entry");
+
+    size_t run = 0;
+    for (size_t pc = 1; pc <= map->pc_count; pc++) {
+        if (pc < map->pc_count && map->names[pc] == map->names[run]) {
+            continue;
+        }
+        size_t end = pc < map->pc_count ? labels[pc] : size;
+        perf_map_write(map, code + labels[run], end - labels[run], map->names[run]);
+        run = pc;
+    }
+    fflush(map->file);
+}
+
+void perf_map_trace(PerfMap *map, unsigned char *code, size_t size, int header) {
+    char name[PERF_MAP_NAME_SIZE];
+    snprintf(name, sizeof(name), "lvm:trace:%s", map->names[header] + strlen("lvm:"));
+    perf_map_write(map, code, size, name);
+    fflush(map->file);
+}
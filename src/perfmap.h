@@ -0,0 +1,49 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "vm.h"
+#include "codegen.h"
+
+/**
+ * Symbols for the machine code the JITs make, written to /tmp/perf-<pid>.map as they make it,
+ * where Linux perf looks for symbols of code it can't find in a file. Each run of instructions
+ * compiled from the same source line is named lvm:<function>:<script>:<line>, and each compiled
+ * trace lvm:trace:<function>:<script>:<line> after its loop header.
+ *
+ * The interpreters run every script from the same C functions, so their time can't be split up
+ * this way; sample them with --sample instead.
+ */
+struct PerfMap {
+    FILE *file;
+    char **names; // Symbol of each instruction; instructions in a run share the run's name
+    size_t pc_count; // Number of instructions in the code
+};
+
+/**
+ * Opens /tmp/perf-<pid>.map and names every instruction of the code after its source line
+ * @param script The path of the program, of which the file name goes in the symbols
+ * @returns The map, or NULL if the file can't be written
+ */
+PerfMap *perf_map_create(BytecodeBuf *bbuf, const char *script);
+
+/**
+ * Frees a perf map, closing its file (which is left for perf to read)
+ */
+void perf_map_free(PerfMap *map);
+
+/**
+ * Writes the symbols of code compiled from the whole program
+ * @param labels Offset in the code of each instruction's machine code
+ * @param size Bytes of machine code, so where the last instruction's ends
+ */
+void perf_map_code(PerfMap *map, unsigned char *code, size_t *labels, size_t size);
+
+/**
+ * Writes the symbol of a compiled trace of the loop at the given address
+ */
+void perf_map_trace(PerfMap *map, unsigned char *code, size_t size, int header);
+
+#endif // PERFMAP_H
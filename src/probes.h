@@ -0,0 +1,35 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * USDT probes for tracing tools (perf probe, bpftrace, SystemTap). They're built in with
+ * `make USDT=1`, which needs <sys/sdt.h> (systemtap-sdt-dev); each is a nop instruction until
+ * a tool attaches to it, and without USDT=1 they compile to nothing.
+ *
+ *     lvm:function__entry(function, pc, depth)  A call is entering the function at pc, with depth frames on the call stack
+ *     lvm:function__return(depth)               OP_RET is leaving a function, with depth frames before it returns
+ *     lvm:heap__snapshot__start(path)           heap_snapshot_write is starting to write to path
+ *     lvm:heap__snapshot__done(path, written)   And has finished, written is 1 if it succeeded
+ *
+ * The VM has no garbage collector to probe; writing a heap snapshot is the only time it walks the heap.
+ */
+
+#ifdef LVM_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE_FUNCTION_ENTRY(function, pc, depth) DTRACE_PROBE3(lvm, function__entry, function, pc, depth)
+#define PROBE_FUNCTION_RETURN(depth) DTRACE_PROBE1(lvm, function__return, depth)
+#define PROBE_HEAP_SNAPSHOT_START(path) DTRACE_PROBE1(lvm, heap__snapshot__start, path)
+#define PROBE_HEAP_SNAPSHOT_DONE(path, written) DTRACE_PROBE2(lvm, heap__snapshot__done, path, written)
+
+#else
+
+#define PROBE_FUNCTION_ENTRY(function, pc, depth) ((void)0)
+#define PROBE_FUNCTION_RETURN(depth) ((void)0)
+#define PROBE_HEAP_SNAPSHOT_START(path) ((void)0)
+#define PROBE_HEAP_SNAPSHOT_DONE(path, written) ((void)0)
+
+#endif // LVM_USDT
+
+#endif // PROBES_H
@@ -0,0 +1,140 @@
+#include "profile.h"
+
+#include <stdlib.h>
+
+Profile *profile_create(size_t code_count) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    profile->pc_hits = calloc(code_count, sizeof(unsigned long));
+    profile->pc_count = code_count;
+    return profile;
+}
+
+void profile_free(Profile *profile) {
+    if (!profile) {
+        return;
+    }
+    free(profile->pc_hits);
+    free(profile);
+}
+
+static unsigned long profile_total_count(Profile *profile) {
+    unsigned long total = 0;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        total += profile->counts[op];
+    }
+    return total;
+}
+
+static uint64_t profile_total_time(Profile *profile) {
+    uint64_t total = 0;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        total += profile->time[op];
+    }
+    return total;
+}
+
+static double percent(double part, double whole) {
+    return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+// qsort can't take the profile, so the comparators read it from here
+static Profile *sorting;
+
+static int compare_opcodes_by_time(const void *a, const void *b) {
+    uint64_t time_a = sorting->time[*(const int *)a];
+    uint64_t time_b = sorting->time[*(const int *)b];
+    return (time_a < time_b) - (time_a > time_b);
+}
+
+static int compare_pcs_by_hits(const void *a, const void *b) {
+    unsigned long hits_a = sorting->pc_hits[*(const int *)a];
+    unsigned long hits_b = sorting->pc_hits[*(const int *)b];
+    return (hits_a < hits_b) - (hits_a > hits_b);
+}
+
+void profile_print(Profile *profile, VM *vm, FILE *out) {
+    unsigned long total_count = profile_total_count(profile);
+    uint64_t total_time = profile_total_time(profile);
+
+    int opcodes[OPCODE_COUNT];
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        opcodes[op] = op;
+    }
+    sorting = profile;
+    qsort(opcodes, OPCODE_COUNT, sizeof(int), compare_opcodes_by_time);
+
+    fprintf(out, "Profile: %lu instructions, %llu %s\n",
+        total_count, (unsigned long long)total_time, PROFILE_CLOCK_UNIT);
+    fprintf(out, "%-20s %14s %7s %16s %7s %12s\n",
+        "opcode", "count", "%", PROFILE_CLOCK_UNIT, "%", "per insn");
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        int op = opcodes[i];
+        if (profile->counts[op] == 0) {
+            continue;
+        }
+        fprintf(out, "%-20s %14lu %6.2f%% %16llu %6.2f%% %12.1f\n",
+            opcode_name((OpCode)op),
+            profile->counts[op], percent(profile->counts[op], total_count),
+            (unsigned long long)profile->time[op], percent(profile->time[op], total_time),
+            (double)profile->time[op] / profile->counts[op]);
+    }
+
+    int *pcs = malloc(sizeof(int) * profile->pc_count);
+    int hit_count = 0;
+    for (size_t pc = 0; pc < profile->pc_count; pc++) {
+        if (profile->pc_hits[pc] > 0) {
+            pcs[hit_count++] = (int)pc;
+        }
+    }
+    qsort(pcs, hit_count, sizeof(int), compare_pcs_by_hits);
+
+    fprintf(out, "\nHottest instructions:\n");
+    fprintf(out, "%8s  %-20s %14s %7s\n", "pc", "opcode", "hits", "%");
+    for (int i = 0; i < hit_count && i < PROFILE_TOP_PCS; i++) {
+        int pc = pcs[i];
+        fprintf(out, "%8d  %-20s %14lu %6.2f%%\n",
+            pc, opcode_name(vm->code[pc].opCode),
+            profile->pc_hits[pc], percent(profile->pc_hits[pc], total_count));
+    }
+    free(pcs);
+}
+
+bool profile_write_json(Profile *profile, VM *vm, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"clock\": \"%s\",\n", PROFILE_CLOCK_UNIT);
+    fprintf(out, "  \"instructions\": %lu,\n", profile_total_count(profile));
+    fprintf(out, "  \"time\": %llu,\n", (unsigned long long)profile_total_time(profile));
+
+    fprintf(out, "  \"opcodes\": [");
+    bool first = true;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        if (profile->counts[op] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    {\"opcode\": \"%s\", \"count\": %lu, \"time\": %llu}",
+            first ? "" : ",", opcode_name((OpCode)op),
+            profile->counts[op], (unsigned long long)profile->time[op]);
+        first = false;
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"pcs\": [");
+    first = true;
+    for (size_t pc = 0; pc < profile->pc_count; pc++) {
+        if (profile->pc_hits[pc] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    {\"pc\": %zu, \"opcode\": \"%s\", \"hits\": %lu}",
+            first ? "" : ",", pc, opcode_name(vm->code[pc].opCode), profile->pc_hits[pc]);
+        first = false;
+    }
+    fprintf(out, "\n  ]\n");
+    fprintf(out, "}\n");
+
+    return fclose(out) == 0;
+}
@@ -0,0 +1,67 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK_UNIT "cycles"
+#else
+#include <time.h>
+#define PROFILE_CLOCK_UNIT "ns"
+#endif
+
+#define PROFILE_TOP_PCS (20) // Instructions listed in the report's hottest instructions table
+
+/**
+ * Execution counts and time per opcode and per instruction, recorded by the
+ * instrumented interpreter loop while vm->profile is set
+ */
+struct Profile {
+    unsigned long counts[OPCODE_COUNT]; // Instructions run, by opcode (quickened forms separately)
+    uint64_t time[OPCODE_COUNT]; // Time spent running them, in PROFILE_CLOCK_UNIT
+    unsigned long *pc_hits; // Times each instruction ran, by address
+    size_t pc_count; // Number of instructions in the code
+};
+
+/**
+ * Creates an empty profile for code of the given length
+ */
+Profile *profile_create(size_t code_count);
+
+/**
+ * Frees a profile
+ */
+void profile_free(Profile *profile);
+
+/**
+ * Reads the profiler's clock: the time stamp counter where there is one, else a
+ * monotonic clock in nanoseconds
+ */
+static inline uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * Writes a report of the profile: opcodes sorted by time spent, then the hottest instructions
+ * @param vm The VM the profile was recorded on, for the opcodes of its instructions
+ */
+void profile_print(Profile *profile, VM *vm, FILE *out);
+
+/**
+ * Writes the profile to a file as JSON: every opcode and every instruction that ran
+ * @returns false if the file can't be written
+ */
+bool profile_write_json(Profile *profile, VM *vm, const char *path);
+
+#endif // PROFILE_H
@@ -0,0 +1,491 @@
+#include "regvm.h"
+#include "verifier.h"
+#include "heapsnap.h"
+
+#include <stdlib.h>
+
+//////////////////////////////////////////////////////////
+/////////////////////// Translation //////////////////////
+//////////////////////////////////////////////////////////
+
+// State of one translation. The abstract stack records, for each value of the current
+// frame, the operand it can be read from. A value that isn't in its own slot yet
+// (a constant, a global, or a copy of a lower slot) is only written there when
+// something needs the real stack: a branch, a label, or an instruction without a
+// register form. A slot operand always refers to a lower, already written slot.
+typedef struct {
+    RegProgram *program;
+    FunctionProto *functions;
+    RegOperand *stack;
+    int depth;
+    int last_result; // Last emitted instruction whose result is the top slot, or -1
+} Translator;
+
+static RegOperand slot_operand(int index) {
+    return (RegOperand){REG_SLOT, index};
+}
+
+static bool same_operand(RegOperand a, RegOperand b) {
+    return a.kind == b.kind && a.index == b.index;
+}
+
+static RegOperand constant_operand(RegProgram *program, Value value) {
+    if (program->constant_count >= program->constant_capacity) {
+        program->constant_capacity *= 2;
+        if (!value_array_resize(&program->constants, program->constant_capacity)) {
+            runtime_error("Unable to allocate register VM constants");
+        }
+    }
+    value_array_set(program->constants, program->constant_count, value);
+    return (RegOperand){REG_CONST, program->constant_count++};
+}
+
+static int emit(Translator *t, RegInstruction insn) {
+    RegProgram *program = t->program;
+    if (program->count >= program->capacity) {
+        program->capacity *= 2;
+        program->code = realloc(program->code, sizeof(RegInstruction) * program->capacity);
+    }
+    program->code[program->count] = insn;
+    t->last_result = -1;
+    return program->count++;
+}
+
+// Writes the value at position p of the abstract stack into its own slot
+static void materialize(Translator *t, int p) {
+    if (!same_operand(t->stack[p], slot_operand(p))) {
+        emit(t, (RegInstruction){.op = ROP_MOVE, .dst = slot_operand(p), .left = t->stack[p]});
+        t->stack[p] = slot_operand(p);
+    }
+}
+
+// Writes every value into its own slot, so the stack is what the stack VM would have
+static void flush(Translator *t) {
+    for (int p = 0; p < t->depth; p++) {
+        materialize(t, p);
+    }
+}
+
+// Before the given operand is overwritten, saves the values still read from it
+static void save_readers(Translator *t, RegOperand target) {
+    for (int p = 0; p < t->depth; p++) {
+        if (same_operand(t->stack[p], target)) {
+            materialize(t, p);
+        }
+    }
+}
+
+// True if any value other than the top is read from the given operand
+static bool has_readers(Translator *t, RegOperand target) {
+    for (int p = 0; p < t->depth - 1; p++) {
+        if (same_operand(t->stack[p], target) && !same_operand(target, slot_operand(p))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void push(Translator *t, RegOperand operand) {
+    t->stack[t->depth++] = operand;
+}
+
+// Resets the abstract stack to the given depth with every value in its own slot
+static void reset_stack(Translator *t, int depth) {
+    t->depth = depth;
+    for (int p = 0; p < depth; p++) {
+        t->stack[p] = slot_operand(p);
+    }
+    t->last_result = -1;
+}
+
+static void translate_binary(Translator *t, RegOpCode op, int pc) {
+    RegOperand right = t->stack[--t->depth];
+    RegOperand left = t->stack[--t->depth];
+    int result_slot = t->depth;
+    int index = emit(t, (RegInstruction){
+        .op = op,
+        .dst = slot_operand(result_slot),
+        .left = left,
+        .right = right,
+        .depth = result_slot + 2,
+        .stack_pc = pc
+    });
+    push(t, slot_operand(result_slot));
+    t->last_result = index;
+}
+
+// Stores the top value into target (a local or global), keeping it on top.
+// If the top was just computed, the computation writes to target directly instead.
+static void translate_store(Translator *t, RegOperand target) {
+    int top = t->depth - 1;
+    if (t->last_result >= 0 && same_operand(t->stack[top], slot_operand(top)) && !has_readers(t, target)) {
+        t->program->code[t->last_result].dst = target;
+        t->stack[top] = target;
+        t->last_result = -1;
+    }
+    else {
+        save_readers(t, target);
+        if (!same_operand(t->stack[top], target)) {
+            emit(t, (RegInstruction){.op = ROP_MOVE, .dst = target, .left = t->stack[top]});
+        }
+    }
+    if (target.kind == REG_SLOT) {
+        t->stack[target.index] = target;
+    }
+}
+
+// Runs an instruction without a register form on the real stack
+static void translate_on_stack(Translator *t, Instruction insn, int pc, RegOpCode op) {
+    flush(t);
+    emit(t, (RegInstruction){.op = op, .depth = t->depth, .stack_pc = pc});
+    reset_stack(t, t->depth + instruction_stack_effect(insn, t->functions));
+}
+
+static RegOpCode binary_op(OpCode opCode) {
+    switch (instruction_unquickened(opCode)) {
+        case OP_ADD: case OP_ADD_II: case OP_ADD_FF: return ROP_ADD;
+        case OP_SUB: case OP_SUB_II: case OP_SUB_FF: return ROP_SUB;
+        case OP_MUL: case OP_MUL_II: case OP_MUL_FF: return ROP_MUL;
+        case OP_EQ: case OP_EQ_II: case OP_EQ_FF: return ROP_EQ;
+        case OP_NEQ: case OP_NEQ_II: case OP_NEQ_FF: return ROP_NEQ;
+        case OP_LT: case OP_LT_II: case OP_LT_FF: return ROP_LT;
+        case OP_LTE: case OP_LTE_II: case OP_LTE_FF: return ROP_LTE;
+        case OP_GT: case OP_GT_II: case OP_GT_FF: return ROP_GT;
+        case OP_GTE: case OP_GTE_II: case OP_GTE_FF: return ROP_GTE;
+        default: return ROP_HALT;
+    }
+}
+
+static bool is_jump(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_JMP_IF || opCode == OP_JMP_IF_FALSE;
+}
+
+// Finds the stack addresses register code can be entered at: jump targets, function
+// entries and the return addresses of calls
+static bool *find_labels(Instruction *code, size_t count, FunctionProto *functions, int function_count) {
+    bool *labels = calloc(count, sizeof(bool));
+    labels[0] = true;
+    for (int i = 0; i < function_count; i++) {
+        labels[functions[i].entry] = true;
+    }
+    for (size_t pc = 0; pc < count; pc++) {
+        OpCode opCode = code[pc].opCode;
+        if (opCode == OP_PUSH && pc + 1 < count && is_jump(code[pc + 1].opCode)) {
+            labels[code[pc].operand.as.integer] = true;
+        }
+        if ((opCode == OP_CALL || opCode == OP_CALL_CLOSURE) && pc + 1 < count) {
+            labels[pc + 1] = true;
+        }
+    }
+    return labels;
+}
+
+// Deepest stack of any frame, which bounds the abstract stack
+static int max_depth(int *depths, size_t count) {
+    int max = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (depths[i] > max) {
+            max = depths[i];
+        }
+    }
+    return max;
+}
+
+RegProgram *regvm_translate(VM *vm) {
+    size_t count = vm->code_count;
+    if (!vm->verified || count == 0) {
+        return NULL;
+    }
+    int function_count = vm->function_count;
+
+    RegProgram *program = malloc(sizeof(RegProgram));
+    program->stack_code = malloc(sizeof(Instruction) * count);
+    for (size_t pc = 0; pc < count; pc++) {
+        program->stack_code[pc] = vm->code[pc];
+        program->stack_code[pc].opCode = instruction_unquickened(vm->code[pc].opCode);
+    }
+    Instruction *code = program->stack_code;
+
+    int *depths = malloc(sizeof(int) * count);
+    if (!bytecode_stack_depths(code, count, vm->functions, function_count, depths)) {
+        free(depths);
+        free(program->stack_code);
+        free(program);
+        return NULL;
+    }
+
+    program->capacity = 16;
+    program->count = 0;
+    program->code = malloc(sizeof(RegInstruction) * program->capacity);
+    program->constant_capacity = 16;
+    program->constant_count = 0;
+    program->constants = (ValueArray){0};
+    value_array_resize(&program->constants, program->constant_capacity);
+    program->pc_map = malloc(sizeof(int) * count);
+
+    bool *labels = find_labels(code, count, vm->functions, function_count);
+    Translator t;
+    t.program = program;
+    t.functions = vm->functions;
+    t.stack = malloc(sizeof(RegOperand) * (max_depth(depths, count) + 2));
+    reset_stack(&t, 0);
+    bool live = false; // Whether the previous instruction falls through to this one
+
+    for (size_t pc = 0; pc < count; pc++) {
+        if (depths[pc] < 0) {
+            program->pc_map[pc] = program->count;
+            continue;
+        }
+        if (labels[pc] || !live) {
+            if (live) {
+                flush(&t);
+            }
+            reset_stack(&t, depths[pc]);
+        }
+        program->pc_map[pc] = program->count;
+        live = true;
+
+        Instruction insn = code[pc];
+        int operand = insn.operand.as.integer;
+
+        // The verifier guarantees jumps are always right after the push of their address
+        if (insn.opCode == OP_PUSH && pc + 1 < count && is_jump(code[pc + 1].opCode)) {
+            OpCode jump = code[pc + 1].opCode;
+            RegOperand condition = {REG_SLOT, 0};
+            if (jump != OP_JMP) {
+                condition = t.stack[--t.depth];
+            }
+            flush(&t);
+            emit(&t, (RegInstruction){
+                .op = jump == OP_JMP ? ROP_JMP : jump == OP_JMP_IF ? ROP_JMP_IF : ROP_JMP_IF_FALSE,
+                .left = condition,
+                .target = operand,
+                .depth = t.depth,
+                .stack_pc = (int)pc
+            });
+            pc++;
+            program->pc_map[pc] = program->count;
+            live = jump != OP_JMP;
+            continue;
+        }
+
+        RegOpCode op = binary_op(insn.opCode);
+        if (op != ROP_HALT) {
+            translate_binary(&t, op, (int)pc);
+            continue;
+        }
+
+        switch (insn.opCode) {
+            case OP_PUSH:
+                push(&t, constant_operand(program, insn.operand));
+                break;
+            case OP_LOAD_LOCAL:
+                push(&t, t.stack[operand]);
+                break;
+            case OP_LOAD_VAR:
+                push(&t, (RegOperand){REG_GLOBAL, operand});
+                break;
+            case OP_STORE_LOCAL:
+                translate_store(&t, slot_operand(operand));
+                break;
+            case OP_STORE_VAR:
+                translate_store(&t, (RegOperand){REG_GLOBAL, operand});
+                break;
+            case OP_DUP:
+                push(&t, t.stack[t.depth - 1]);
+                break;
+            case OP_DISCARD:
+                t.depth--;
+                break;
+            case OP_SLIDE: {
+                RegOperand top = t.stack[t.depth - 1];
+                t.depth -= operand + 1;
+                push(&t, top);
+                // A slot at or above the new position can be overwritten by the next push
+                if (top.kind == REG_SLOT && top.index >= t.depth - 1) {
+                    emit(&t, (RegInstruction){.op = ROP_MOVE, .dst = slot_operand(t.depth - 1), .left = top});
+                    t.stack[t.depth - 1] = slot_operand(t.depth - 1);
+                }
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_CALL_CLOSURE:
+            case OP_TAIL_CALL_CLOSURE:
+            case OP_RET:
+                flush(&t);
+                emit(&t, (RegInstruction){.op = ROP_STACK_CONTROL, .depth = t.depth, .stack_pc = (int)pc});
+                live = insn.opCode == OP_CALL || insn.opCode == OP_CALL_CLOSURE;
+                break;
+            case OP_HALT:
+                flush(&t);
+                emit(&t, (RegInstruction){.op = ROP_HALT, .depth = t.depth, .stack_pc = (int)pc});
+                live = false;
+                break;
+            default:
+                translate_on_stack(&t, insn, (int)pc, ROP_STACK);
+                break;
+        }
+    }
+
+    // Jump targets were stack addresses until every instruction had its register address
+    for (int i = 0; i < program->count; i++) {
+        RegOpCode op = program->code[i].op;
+        if (op == ROP_JMP || op == ROP_JMP_IF || op == ROP_JMP_IF_FALSE) {
+            program->code[i].target = program->pc_map[program->code[i].target];
+        }
+    }
+
+    free(t.stack);
+    free(labels);
+    free(depths);
+    return program;
+}
+
+void regvm_program_free(RegProgram *program) {
+    free(program->code);
+    value_array_free(&program->constants);
+    free(program->pc_map);
+    free(program->stack_code);
+    free(program);
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////// Execution ////////////////////////
+//////////////////////////////////////////////////////////
+
+// Runs an instruction's stack form, after putting the stack where the stack VM would have it
+static void regvm_step_on_stack(VM *vm, RegProgram *program, RegInstruction *insn) {
+    vm->sp = vm->fp + insn->depth;
+    vm->pc = insn->stack_pc + 1;
+    vm_step_verified(vm, &program->stack_code[insn->stack_pc]);
+}
+
+// Runs a binary operation whose operand types have no fast path (mixed numbers, errors)
+// through the stack VM, with its operands where the stack form expects them
+static void regvm_binary_on_stack(VM *vm, RegProgram *program, ValueArray *bases, RegInstruction *insn) {
+    Value left = value_array_get(bases[insn->left.kind], insn->left.index);
+    Value right = value_array_get(bases[insn->right.kind], insn->right.index);
+    int base = vm->fp + insn->depth - 2;
+    vm_stack_set(vm, base, left);
+    vm_stack_set(vm, base + 1, right);
+    regvm_step_on_stack(vm, program, insn);
+    value_array_set(bases[insn->dst.kind], insn->dst.index, vm_stack_get(vm, vm->sp - 1));
+}
+
+#define LOAD(o) value_array_get(bases[(o).kind], (o).index)
+#define STORE(o, value) value_array_set(bases[(o).kind], (o).index, value)
+
+#define ARITHMETIC(op) { \
+    Value left = LOAD(insn->left); \
+    Value right = LOAD(insn->right); \
+    if (left.type == VAL_INTEGER && right.type == VAL_INTEGER) { \
+        int result = left.as.integer op right.as.integer; \
+        STORE(insn->dst, ((Value){.type = VAL_INTEGER, .as.integer = result})); \
+    } \
+    else if (left.type == VAL_FLOAT && right.type == VAL_FLOAT) { \
+        double result = left.as.floating op right.as.floating; \
+        STORE(insn->dst, ((Value){.type = VAL_FLOAT, .as.floating = result})); \
+    } \
+    else { \
+        regvm_binary_on_stack(vm, program, bases, insn); \
+    } \
+    break; \
+}
+
+#define COMPARISON(op) { \
+    Value left = LOAD(insn->left); \
+    Value right = LOAD(insn->right); \
+    if (left.type == VAL_INTEGER && right.type == VAL_INTEGER) { \
+        bool result = left.as.integer op right.as.integer; \
+        STORE(insn->dst, ((Value){.type = VAL_BOOL, .as.boolean = result})); \
+    } \
+    else if (left.type == VAL_FLOAT && right.type == VAL_FLOAT) { \
+        bool result = left.as.floating op right.as.floating; \
+        STORE(insn->dst, ((Value){.type = VAL_BOOL, .as.boolean = result})); \
+    } \
+    else { \
+        regvm_binary_on_stack(vm, program, bases, insn); \
+    } \
+    break; \
+}
+
+static void regvm_run(VM *vm, RegProgram *program) {
+    // Operands index one of these by kind. Only the frame moves, on calls and returns.
+    ValueArray bases[3];
+    bases[REG_SLOT] = value_array_slice(vm->stack, vm->fp);
+    bases[REG_GLOBAL] = vm->globals;
+    bases[REG_CONST] = program->constants;
+
+    RegInstruction *code = program->code;
+    int pc = program->pc_map[vm->pc];
+    unsigned long dispatches = 0;
+
+    while (true) {
+        RegInstruction *insn = &code[pc++];
+        dispatches++;
+
+        switch (insn->op) {
+            case ROP_MOVE:
+                STORE(insn->dst, LOAD(insn->left));
+                break;
+            case ROP_ADD: ARITHMETIC(+)
+            case ROP_SUB: ARITHMETIC(-)
+            case ROP_MUL: ARITHMETIC(*)
+            case ROP_EQ: COMPARISON(==)
+            case ROP_NEQ: COMPARISON(!=)
+            case ROP_LT: COMPARISON(<)
+            case ROP_LTE: COMPARISON(<=)
+            case ROP_GT: COMPARISON(>)
+            case ROP_GTE: COMPARISON(>=)
+            case ROP_JMP:
+                pc = insn->target;
+                // Loops come back through here, with the stack flushed to the frame
+                if (vm->snapshot_requested) {
+                    vm->sp = vm->fp + insn->depth;
+                    heap_snapshot_take_requested(vm);
+                }
+                break;
+            case ROP_JMP_IF:
+            case ROP_JMP_IF_FALSE: {
+                Value condition = LOAD(insn->left);
+                if (condition.type != VAL_BOOL) {
+                    runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
+                }
+                if (condition.as.boolean == (insn->op == ROP_JMP_IF)) {
+                    pc = insn->target;
+                }
+                break;
+            }
+            case ROP_STACK:
+                regvm_step_on_stack(vm, program, insn);
+                break;
+            case ROP_STACK_CONTROL:
+                regvm_step_on_stack(vm, program, insn);
+                pc = program->pc_map[vm->pc];
+                bases[REG_SLOT] = value_array_slice(vm->stack, vm->fp);
+                break;
+            case ROP_HALT:
+                vm->sp = vm->fp + insn->depth;
+                vm->pc = insn->stack_pc + 1;
+                vm->stats.dispatches += dispatches;
+                return;
+        }
+    }
+}
+
+#undef LOAD
+#undef STORE
+#undef ARITHMETIC
+#undef COMPARISON
+
+bool regvm_execute(VM *vm) {
+    RegProgram *program = regvm_translate(vm);
+    if (!program) {
+        return false;
+    }
+    vm->stats.regvm_runs++;
+    regvm_run(vm, program);
+    regvm_program_free(program);
+    return true;
+}
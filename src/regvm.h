@@ -0,0 +1,95 @@
+#ifndef REGVM_H
+#define REGVM_H
+
+#include <stdbool.h>
+
+#include "vm.h"
+
+/**
+ * Where a register instruction reads or writes a value
+ */
+typedef enum {
+    REG_SLOT,   // A frame slot: vm->stack[vm->fp + index]
+    REG_GLOBAL, // A global variable: vm->globals[index]
+    REG_CONST   // A constant: RegProgram.constants at index
+} RegOperandKind;
+
+typedef struct {
+    RegOperandKind kind;
+    int index;
+} RegOperand;
+
+/**
+ * OpCodes of the register instruction set. Arithmetic and comparisons are three-address:
+ * dst = left op right, where each operand can be a frame slot, a global or a constant.
+ */
+typedef enum {
+    ROP_MOVE,       // dst = left
+    ROP_ADD,        // dst = left + right
+    ROP_SUB,        // dst = left - right
+    ROP_MUL,        // dst = left * right
+    ROP_EQ,         // dst = left == right
+    ROP_NEQ,        // dst = left != right
+    ROP_LT,         // dst = left < right
+    ROP_LTE,        // dst = left <= right
+    ROP_GT,         // dst = left > right
+    ROP_GTE,        // dst = left >= right
+    ROP_JMP,        // Jump to target
+    ROP_JMP_IF,     // Jump to target if left is true
+    ROP_JMP_IF_FALSE, // Jump to target if left is false
+    ROP_STACK,      // Run stack instruction stack_pc with the stack depth set to depth
+    ROP_STACK_CONTROL, // Like ROP_STACK for calls and returns, then continue wherever it went
+    ROP_HALT        // Stop execution, leaving depth values on the stack
+} RegOpCode;
+
+/**
+ * A register VM instruction
+ */
+typedef struct {
+    RegOpCode op;
+    RegOperand dst;
+    RegOperand left;
+    RegOperand right;
+    int target; // Jump target (register address)
+    int depth; // Stack depth (relative to the frame) of the stack instruction this came from
+    int stack_pc; // Address of the stack instruction this came from
+} RegInstruction;
+
+/**
+ * Register code translated from a VM's stack code
+ */
+typedef struct {
+    RegInstruction *code;
+    int count;
+    int capacity;
+
+    ValueArray constants;
+    int constant_count;
+    int constant_capacity;
+
+    int *pc_map; // Register address of each stack address, for calls and returns
+    Instruction *stack_code; // The stack code in generic form, for the instructions it still runs
+} RegProgram;
+
+/**
+ * Translates the VM's loaded (verified) stack code into register code. Values stay in their
+ * stack slots, but loads of locals, globals and constants are folded into the operands of the
+ * instructions that use them, and results go straight to the local or global they're stored in.
+ * Instructions without a register form (strings, lists, calls...) still run on the stack.
+ * @returns the program, or NULL if the code isn't verified
+ */
+RegProgram *regvm_translate(VM *vm);
+
+/**
+ * Frees a translated program
+ */
+void regvm_program_free(RegProgram *program);
+
+/**
+ * Translates the VM's loaded code to register code and runs it, leaving the VM
+ * in the same state the stack interpreter would
+ * @returns false without running anything if the code can't be translated (not verified)
+ */
+bool regvm_execute(VM *vm);
+
+#endif // REGVM_H
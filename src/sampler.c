@@ -0,0 +1,233 @@
+#include "sampler.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define SAMPLER_FRAME_NAME_MAX (96) // Longest frame name written to a folded stack
+
+// The sampler the signal handler records into
+static Sampler *volatile active_sampler = NULL;
+static struct sigaction previous_action;
+
+// Runs on SIGPROF, between any two instructions (or in the middle of one), so it only
+// reads the VM and writes into storage allocated beforehand
+static void sampler_handle_signal(int signal) {
+    (void)signal;
+    Sampler *sampler = active_sampler;
+    if (!sampler) {
+        return;
+    }
+    VM *vm = sampler->vm;
+
+    int depth = vm->frame_count + 1;
+    if (depth > SAMPLER_MAX_DEPTH) {
+        depth = SAMPLER_MAX_DEPTH;
+    }
+    if (sampler->used + depth + 1 > sampler->capacity) {
+        sampler->dropped++;
+        return;
+    }
+
+    // The loops move vm->pc past an instruction when they fetch it, so the running one
+    // is just before it (except right after a jump), and calls are just before their
+    // return addresses
+    int *sample = &sampler->data[sampler->used];
+    sample[0] = depth;
+    sample[1] = vm->pc > 0 ? vm->pc - 1 : 0;
+    for (int i = 1; i < depth; i++) {
+        sample[i + 1] = vm->frames[vm->frame_count - i].return_pc - 1;
+    }
+    sampler->used += depth + 1;
+    sampler->samples++;
+}
+
+Sampler *sampler_start(VM *vm, int hz) {
+    if (active_sampler) {
+        return NULL;
+    }
+
+    Sampler *sampler = malloc(sizeof(Sampler));
+    sampler->vm = vm;
+    sampler->capacity = SAMPLER_CAPACITY;
+    sampler->data = malloc(sizeof(int) * sampler->capacity);
+    sampler->used = 0;
+    sampler->samples = 0;
+    sampler->dropped = 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sampler_handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+        sampler_free(sampler);
+        return NULL;
+    }
+
+    active_sampler = sampler;
+    vm->sampling = true;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        active_sampler = NULL;
+        vm->sampling = false;
+        sigaction(SIGPROF, &previous_action, NULL);
+        sampler_free(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void sampler_stop(Sampler *sampler) {
+    if (active_sampler != sampler) {
+        return;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    active_sampler = NULL;
+    sampler->vm->sampling = false;
+    sigaction(SIGPROF, &previous_action, NULL);
+}
+
+// Writes the name of the frame at pc, function:line (or just the function if the
+// line isn't known)
+static void sampler_frame_name(BytecodeBuf *bbuf, int pc, char *buffer, size_t size) {
+    SourceMapEntry *entry = bytecode_source(bbuf, pc);
+    if (!entry) {
+        snprintf(buffer, size, "?");
+    }
+    else if (entry->pos.line == 0) {
+        snprintf(buffer, size, "%s", bytecode_function_name(bbuf, entry->function));
+    }
+    else {
+        snprintf(buffer, size, "%s:%d", bytecode_function_name(bbuf, entry->function), entry->pos.line);
+    }
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void sampler_write_folded(Sampler *sampler, BytecodeBuf *bbuf, FILE *out) {
+    char **stacks = malloc(sizeof(char*) * (sampler->samples + 1));
+    size_t count = 0;
+
+    // Each sample's frames, outermost first and separated by semicolons
+    size_t offset = 0;
+    while (offset < sampler->used) {
+        int depth = sampler->data[offset];
+        int *pcs = &sampler->data[offset + 1];
+        char *stack = malloc((size_t)depth * (SAMPLER_FRAME_NAME_MAX + 1) + 1);
+        size_t length = 0;
+        for (int i = depth - 1; i >= 0; i--) {
+            char name[SAMPLER_FRAME_NAME_MAX];
+            sampler_frame_name(bbuf, pcs[i], name, sizeof(name));
+            length += sprintf(&stack[length], "%s%s", name, i > 0 ? ";" : "");
+        }
+        stacks[count++] = stack;
+        offset += depth + 1;
+    }
+
+    // Identical stacks end up next to each other
+    qsort(stacks, count, sizeof(char*), compare_strings);
+    size_t run_start = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if (i == count || strcmp(stacks[i], stacks[run_start]) != 0) {
+            fprintf(out, "%s %zu\n", stacks[run_start], i - run_start);
+            run_start = i;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+}
+
+// Line of the instruction at pc, or 0 if it isn't known
+static int sampler_line(BytecodeBuf *bbuf, int pc) {
+    SourceMapEntry *entry = bytecode_source(bbuf, pc);
+    return entry ? entry->pos.line : 0;
+}
+
+// qsort can't take the counts, so the comparator reads them from here
+static unsigned long *sorting_self;
+
+static int compare_lines_by_self(const void *a, const void *b) {
+    unsigned long self_a = sorting_self[*(const int *)a];
+    unsigned long self_b = sorting_self[*(const int *)b];
+    return (self_a < self_b) - (self_a > self_b);
+}
+
+void sampler_print_lines(Sampler *sampler, BytecodeBuf *bbuf, const char *source, FILE *out) {
+    int line_count = 1;
+    for (int i = 0; i < bbuf->source_map_count; i++) {
+        if (bbuf->source_map[i].pos.line >= line_count) {
+            line_count = bbuf->source_map[i].pos.line + 1;
+        }
+    }
+    unsigned long *self = calloc(line_count, sizeof(unsigned long));
+    unsigned long *total = calloc(line_count, sizeof(unsigned long));
+    unsigned long *seen = calloc(line_count, sizeof(unsigned long)); // Last sample that counted each line in total
+
+    unsigned long sample_index = 0;
+    size_t offset = 0;
+    while (offset < sampler->used) {
+        int depth = sampler->data[offset];
+        int *pcs = &sampler->data[offset + 1];
+        sample_index++;
+
+        self[sampler_line(bbuf, pcs[0])]++;
+        for (int i = 0; i < depth; i++) {
+            // Recursion puts a line on the stack more than once
+            int line = sampler_line(bbuf, pcs[i]);
+            if (seen[line] != sample_index) {
+                seen[line] = sample_index;
+                total[line]++;
+            }
+        }
+        offset += depth + 1;
+    }
+
+    int *lines = malloc(sizeof(int) * line_count);
+    for (int line = 0; line < line_count; line++) {
+        lines[line] = line;
+    }
+    sorting_self = self;
+    qsort(lines, line_count, sizeof(int), compare_lines_by_self);
+
+    double samples = sampler->samples > 0 ? (double)sampler->samples : 1.0;
+    fprintf(out, "Samples: %lu (%lu dropped)\n", sampler->samples, sampler->dropped);
+    fprintf(out, "%6s %7s %7s  %s\n", "line", "self", "total", "source");
+    for (int i = 0; i < line_count && i < SAMPLER_TOP_LINES; i++) {
+        int line = lines[i];
+        if (self[line] == 0) {
+            break;
+        }
+        if (line == 0) {
+            fprintf(out, "%6s %6.2f%% %6.2f%%  (no source)\n", "?", 100.0 * self[line] / samples, 100.0 * total[line] / samples);
+            continue;
+        }
+        fprintf(out, "%6d %6.2f%% %6.2f%%  ", line, 100.0 * self[line] / samples, 100.0 * total[line] / samples);
+        source_print_line(source, line, out);
+        fprintf(out, "\n");
+    }
+
+    free(lines);
+    free(seen);
+    free(total);
+    free(self);
+}
+
+void sampler_free(Sampler *sampler) {
+    if (!sampler) {
+        return;
+    }
+    free(sampler->data);
+    free(sampler);
+}
@@ -0,0 +1,63 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "vm.h"
+#include "codegen.h"
+
+#define SAMPLER_HZ (1000) // Samples per second of CPU time taken by lvm --sample
+#define SAMPLER_MAX_DEPTH (128) // Innermost frames kept per sample; deeper ones are cut off
+#define SAMPLER_CAPACITY (1 << 22) // Ints of sample storage, allocated up front
+#define SAMPLER_TOP_LINES (20) // Lines listed by sampler_print_lines
+
+/**
+ * A sampling profiler. A SIGPROF timer interrupts the program at a fixed rate of
+ * CPU time, and the signal handler records the VM's pc and the return address of
+ * every call frame. The pcs are only turned into source positions afterwards.
+ */
+typedef struct {
+    VM *vm;
+    int *data; // Samples one after another: the frame count, then the pc of each frame, innermost first
+    size_t used;
+    size_t capacity;
+    unsigned long samples; // Samples recorded
+    unsigned long dropped; // Samples that didn't fit in data
+} Sampler;
+
+/**
+ * Starts sampling the given VM, which should then be run with vm_execute. Only one
+ * sampler can run at a time. Samples come from vm->pc, which only the interpreter loops
+ * keep up to date, so while the sampler runs vm_execute interprets even with vm->jit,
+ * vm->trace or vm->regvm set. A sample taken right after a jump lands on the instruction
+ * before its target.
+ * @returns the sampler, or NULL if the timer couldn't be set up
+ */
+Sampler *sampler_start(VM *vm, int hz);
+
+/**
+ * Stops the timer. The samples stay in the sampler.
+ */
+void sampler_stop(Sampler *sampler);
+
+/**
+ * Writes the samples as folded stacks, one line per distinct stack with its sample
+ * count, which flamegraph.pl and similar tools read. Frames are named function:line.
+ * @param bbuf The bytecode the VM ran, for its source map
+ */
+void sampler_write_folded(Sampler *sampler, BytecodeBuf *bbuf, FILE *out);
+
+/**
+ * Writes the source lines with the most samples, with the share of samples where the
+ * line was running (self) and where it was anywhere on the call stack (total)
+ * @param source The program's source text, to show the lines
+ */
+void sampler_print_lines(Sampler *sampler, BytecodeBuf *bbuf, const char *source, FILE *out);
+
+/**
+ * Frees a stopped sampler
+ */
+void sampler_free(Sampler *sampler);
+
+#endif // SAMPLER_H
@@ -0,0 +1,118 @@
+#include "trace.h"
+#include "jit.h"
+#include "perfmap.h"
+
+#include <stdlib.h>
+
+static TraceCache *trace_cache_create(size_t count) {
+    TraceCache *cache = malloc(sizeof(TraceCache));
+    cache->counters = calloc(count, sizeof(int));
+    cache->traces = calloc(count, sizeof(JitTrace*));
+    cache->count = count;
+    cache->recording = false;
+    return cache;
+}
+
+void trace_cache_free(TraceCache *cache) {
+    if (!cache) {
+        return;
+    }
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->traces[i]) {
+            jit_free_trace(cache->traces[i]);
+        }
+    }
+    free(cache->traces);
+    free(cache->counters);
+    free(cache);
+}
+
+// Calls, returns and halting leave the loop's straight line, so traces stop there
+static bool trace_can_record(OpCode opCode) {
+    switch (opCode) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+        case OP_RET:
+        case OP_HALT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Interprets one iteration of the loop at header, recording it. Returns the number of
+// steps recorded if execution made it back to the header, or 0 if recording was aborted.
+// Either way, the VM is left wherever the interpreter got to.
+static int trace_record(VM *vm, int header, TraceStep *steps) {
+    int count = 0;
+    while (count < TRACE_MAX_LENGTH) {
+        Instruction insn = vm->code[vm->pc];
+        if (!trace_can_record(insn.opCode)) {
+            return 0;
+        }
+
+        // Run the generic form, so a quickened instruction that deoptimizes isn't run twice
+        TraceStep *step = &steps[count++];
+        step->pc = vm->pc;
+        step->insn = insn;
+        step->insn.opCode = instruction_unquickened(insn.opCode);
+        step->a_type = vm->sp >= 1 ? value_array_type(vm->stack, vm->sp - 1) : VAL_INTEGER;
+        step->b_type = vm->sp >= 2 ? value_array_type(vm->stack, vm->sp - 2) : VAL_INTEGER;
+
+        vm->pc++;
+        vm->stats.dispatches++;
+        vm_step_verified(vm, &step->insn);
+        step->next_pc = vm->pc;
+
+        if (vm->pc == header) {
+            return count;
+        }
+        if (vm->pc < step->pc && step->insn.opCode == OP_JMP) {
+            // A different loop (an inner one) closed first
+            return 0;
+        }
+    }
+    return 0;
+}
+
+void trace_backedge(VM *vm) {
+    if (!vm->traces) {
+        vm->traces = trace_cache_create(vm->code_count);
+    }
+    TraceCache *cache = vm->traces;
+    if (cache->recording) {
+        return;
+    }
+
+    int header = vm->pc;
+    if (cache->traces[header]) {
+        jit_run_trace(cache->traces[header], vm);
+        return;
+    }
+    if (cache->counters[header] < 0 || ++cache->counters[header] < TRACE_HOT_LOOP) {
+        return;
+    }
+
+    TraceStep *steps = malloc(sizeof(TraceStep) * TRACE_MAX_LENGTH);
+    cache->recording = true;
+    int count = trace_record(vm, header, steps);
+    cache->recording = false;
+
+    if (count > 0) {
+        cache->traces[header] = jit_compile_trace(steps, count);
+    }
+    if (cache->traces[header]) {
+        vm->stats.traces_compiled++;
+        if (vm->perf) {
+            perf_map_trace(vm->perf, cache->traces[header]->code, cache->traces[header]->size, header);
+        }
+    }
+    else {
+        // Loops that leave the straight line once usually do every time, so don't retry
+        cache->counters[header] = -1;
+        vm->stats.trace_aborts++;
+    }
+    free(steps);
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+#include "vm.h"
+
+#define TRACE_HOT_LOOP (50) // Back-edges to a loop header before its next iteration is recorded
+#define TRACE_MAX_LENGTH (512) // Longest iteration that is recorded, in instructions
+
+/**
+ * One instruction of a recorded loop iteration, with the types it saw
+ */
+typedef struct {
+    int pc; // Address of the instruction
+    Instruction insn; // The instruction, in its generic form if it was quickened
+    ValueType a_type; // Type of the top value of the stack before it ran (if any)
+    ValueType b_type; // Type of the value below that (if any)
+    int next_pc; // Where execution went after it, so the direction of conditional jumps
+} TraceStep;
+
+/**
+ * Hot loop counters and compiled traces of a VM, by loop header address
+ */
+struct TraceCache {
+    int *counters; // Back-edges seen per address, or -1 if the loop there can't be traced
+    struct JitTrace **traces; // Compiled trace per address, or NULL
+    size_t count; // Number of instructions in the code
+    bool recording; // True while an iteration is being recorded
+};
+
+/**
+ * Called by the interpreter after a backward OP_JMP to vm->pc, only for verified code.
+ * Runs the loop's compiled trace if it has one, which leaves vm->pc at the instruction
+ * where the trace exited. Otherwise counts the back-edge, and once the loop is hot
+ * interprets one iteration while recording it and compiles that into a trace.
+ */
+void trace_backedge(VM *vm);
+
+/**
+ * Frees a VM's trace cache and its compiled traces
+ */
+void trace_cache_free(TraceCache *cache);
+
+#endif // TRACE_H
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "typeinfer.h"
+
+// A variable that is visible while walking the program
+typedef struct {
+    String *name;
+    int binding_node; // Name node of the let binding, or -1 for function parameters
+} ScopeEntry;
+
+typedef struct {
+    ASTProgram *program;
+
+    ScopeEntry *scope;
+    int scope_count;
+    int scope_capacity;
+
+    String **global_names;
+    StaticType *global_types;
+    bool *global_seen; // Whether a global has been read or assigned yet, walking in source order
+    int global_count;
+    int global_capacity;
+
+    String **function_names; // Top-level defuns, which shadow builtins the same way codegen does
+    int function_count;
+    int function_capacity;
+
+    int conditional; // Depth of function bodies, loops and ifs being walked, whose code may not run
+    bool changed; // Whether any variable's type changed during the current pass
+} TypeInferrer;
+
+// Combines the types of two values that may end up in the same place
+static StaticType type_join(StaticType a, StaticType b) {
+    if (a == TYPE_NONE) return b;
+    if (b == TYPE_NONE) return a;
+    return a == b ? a : TYPE_UNKNOWN;
+}
+
+static int typeinfer_find_global(TypeInferrer *inferrer, String *name) {
+    for (int i = 0; i < inferrer->global_count; i++) {
+        if (strcmp(inferrer->global_names[i]->data, name->data) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Adds a global with no type yet
+static int typeinfer_add_global(TypeInferrer *inferrer, String *name) {
+    if (inferrer->global_count >= inferrer->global_capacity) {
+        inferrer->global_capacity *= 2;
+        inferrer->global_names = realloc(inferrer->global_names, sizeof(String*) * inferrer->global_capacity);
+        inferrer->global_types = realloc(inferrer->global_types, sizeof(StaticType) * inferrer->global_capacity);
+        inferrer->global_seen = realloc(inferrer->global_seen, sizeof(bool) * inferrer->global_capacity);
+    }
+    int global = inferrer->global_count++;
+    inferrer->global_names[global] = name;
+    inferrer->global_types[global] = TYPE_NONE;
+    inferrer->global_seen[global] = false;
+    return global;
+}
+
+// Joins a type into a global's
+static void typeinfer_join_global(TypeInferrer *inferrer, int global, StaticType type) {
+    StaticType joined = type_join(inferrer->global_types[global], type);
+    if (joined != inferrer->global_types[global]) {
+        inferrer->global_types[global] = joined;
+        inferrer->changed = true;
+    }
+}
+
+// Records the first time a global is read or assigned. Unless that's a define at the top level
+// that always runs, the global can be read before it's assigned, when it holds integer 0.
+static void typeinfer_first_use(TypeInferrer *inferrer, int global, bool defined) {
+    if (inferrer->global_seen[global]) {
+        return;
+    }
+    inferrer->global_seen[global] = true;
+    if (!defined || inferrer->conditional > 0) {
+        typeinfer_join_global(inferrer, global, TYPE_INTEGER);
+    }
+}
+
+static bool typeinfer_is_function(TypeInferrer *inferrer, String *name) {
+    for (int i = 0; i < inferrer->function_count; i++) {
+        if (strcmp(inferrer->function_names[i]->data, name->data) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static ScopeEntry* typeinfer_find_local(TypeInferrer *inferrer, String *name) {
+    for (int i = inferrer->scope_count - 1; i >= 0; i--) {
+        if (strcmp(inferrer->scope[i].name->data, name->data) == 0) {
+            return &inferrer->scope[i];
+        }
+    }
+    return NULL;
+}
+
+static void typeinfer_push_local(TypeInferrer *inferrer, String *name, int binding_node) {
+    if (inferrer->scope_count >= inferrer->scope_capacity) {
+        inferrer->scope_capacity *= 2;
+        inferrer->scope = realloc(inferrer->scope, sizeof(ScopeEntry) * inferrer->scope_capacity);
+    }
+    inferrer->scope[inferrer->scope_count++] = (ScopeEntry){name, binding_node};
+}
+
+static StaticType typeinfer_variable_type(TypeInferrer *inferrer, String *name) {
+    ScopeEntry *local = typeinfer_find_local(inferrer, name);
+    if (local != NULL) {
+        return local->binding_node == -1 ? TYPE_UNKNOWN : inferrer->program->value_types[local->binding_node];
+    }
+
+    // A defun name used as a value is a closure
+    if (typeinfer_is_function(inferrer, name)) {
+        return TYPE_UNKNOWN;
+    }
+
+    int global = typeinfer_find_global(inferrer, name);
+    if (global == -1) {
+        global = typeinfer_add_global(inferrer, name);
+    }
+    typeinfer_first_use(inferrer, global, false);
+    return inferrer->global_types[global];
+}
+
+// Records that a value of the given type is assigned to the variable
+static void typeinfer_assign(TypeInferrer *inferrer, String *name, StaticType type) {
+    unsigned char *slot;
+
+    ScopeEntry *local = typeinfer_find_local(inferrer, name);
+    if (local != NULL) {
+        if (local->binding_node == -1) {
+            return; // Parameters are always unknown
+        }
+        slot = &inferrer->program->value_types[local->binding_node];
+        StaticType joined = type_join(*slot, type);
+        if (joined != *slot) {
+            *slot = joined;
+            inferrer->changed = true;
+        }
+        return;
+    }
+
+    int global = typeinfer_find_global(inferrer, name);
+    if (global == -1) {
+        global = typeinfer_add_global(inferrer, name);
+    }
+    typeinfer_first_use(inferrer, global, true);
+    typeinfer_join_global(inferrer, global, type);
+}
+
+// Result of +, - and *: integer if all operands are integers, float if any is a float
+static StaticType arithmetic_type(StaticType *operand_types, int count) {
+    StaticType result = TYPE_INTEGER;
+    for (int i = 0; i < count; i++) {
+        if (operand_types[i] == TYPE_NONE) {
+            return TYPE_NONE;
+        }
+        if (operand_types[i] == TYPE_FLOAT) {
+            result = TYPE_FLOAT;
+        }
+        else if (operand_types[i] != TYPE_INTEGER) {
+            return TYPE_UNKNOWN;
+        }
+    }
+    return result;
+}
+
+// Result types of builtins that always return the same type
+static const struct {
+    char *name;
+    StaticType type;
+} builtin_types[] = {
+    {"%", TYPE_INTEGER}, {"strlen", TYPE_INTEGER}, {"list-length", TYPE_INTEGER}, {"float2int", TYPE_INTEGER},
+    {"/", TYPE_FLOAT}, {"int2float", TYPE_FLOAT},
+    {"and", TYPE_BOOL}, {"or", TYPE_BOOL}, {"not", TYPE_BOOL}, {"str=", TYPE_BOOL},
+    {"=", TYPE_BOOL}, {"==", TYPE_BOOL}, {"!=", TYPE_BOOL},
+    {"<", TYPE_BOOL}, {"<=", TYPE_BOOL}, {">", TYPE_BOOL}, {">=", TYPE_BOOL},
+    {"while", TYPE_BOOL}, {"defun", TYPE_BOOL}, {"heap-snapshot", TYPE_BOOL},
+    {"concat", TYPE_STRING}, {"substr", TYPE_STRING}, {"char-at", TYPE_STRING},
+    {"list", TYPE_LIST}, {"list-append", TYPE_LIST}, {"list-sublist", TYPE_LIST},
+    {"list-remove", TYPE_LIST}, {"list-set", TYPE_LIST},
+};
+
+static StaticType typeinfer_expr(TypeInferrer *inferrer, int node);
+
+// Infers the children of a node starting at the given index and returns the type of the last one
+static StaticType typeinfer_children(TypeInferrer *inferrer, int node, int start) {
+    StaticType last = TYPE_UNKNOWN;
+    for (int i = start; i < ast_child_count(inferrer->program, node); i++) {
+        last = typeinfer_expr(inferrer, ast_child(inferrer->program, node, i));
+    }
+    return last;
+}
+
+// Infers the body of a defun or lambda with its parameters in scope
+static void typeinfer_function(TypeInferrer *inferrer, int node, int params_index) {
+    ASTProgram *program = inferrer->program;
+    int outer_scope_count = inferrer->scope_count;
+
+    if (params_index < ast_child_count(program, node)) {
+        int params_node = ast_child(program, node, params_index);
+        if (ast_type(program, params_node) == AST_LITERAL_LIST) {
+            for (int i = 0; i < ast_child_count(program, params_node); i++) {
+                int param = ast_child(program, params_node, i);
+                if (ast_type(program, param) == AST_SYMBOL) {
+                    typeinfer_push_local(inferrer, ast_payload(program, param)->symbol, -1);
+                }
+            }
+        }
+    }
+
+    // The body runs when the function is called, which could be before or after anything else
+    inferrer->conditional++;
+    typeinfer_children(inferrer, node, params_index + 1);
+    inferrer->conditional--;
+    inferrer->scope_count = outer_scope_count;
+}
+
+// Infers a call or special form
+static StaticType typeinfer_list(TypeInferrer *inferrer, int node) {
+    ASTProgram *program = inferrer->program;
+    int count = ast_child_count(program, node);
+    if (count == 0) {
+        return TYPE_UNKNOWN;
+    }
+
+    int head = ast_child(program, node, 0);
+    if (ast_type(program, head) != AST_SYMBOL) {
+        typeinfer_children(inferrer, node, 0);
+        return TYPE_UNKNOWN;
+    }
+
+    // Locals and defuns shadow builtins, and their return types are not tracked
+    String *name = ast_payload(program, head)->symbol;
+    if (typeinfer_find_local(inferrer, name) != NULL || typeinfer_is_function(inferrer, name)) {
+        typeinfer_children(inferrer, node, 1);
+        return TYPE_UNKNOWN;
+    }
+
+    if (strcmp(name->data, "define") == 0) {
+        StaticType type = typeinfer_children(inferrer, node, 2);
+        if (count == 3 && ast_type(program, ast_child(program, node, 1)) == AST_SYMBOL) {
+            typeinfer_assign(inferrer, ast_payload(program, ast_child(program, node, 1))->symbol, type);
+        }
+        return type;
+    }
+
+    if (strcmp(name->data, "let") == 0) {
+        int outer_scope_count = inferrer->scope_count;
+
+        int bindings_node = count > 1 ? ast_child(program, node, 1) : -1;
+        if (bindings_node != -1 && ast_type(program, bindings_node) == AST_LITERAL_LIST) {
+            for (int i = 0; i + 1 < ast_child_count(program, bindings_node); i += 2) {
+                int name_node = ast_child(program, bindings_node, i);
+                StaticType type = typeinfer_expr(inferrer, ast_child(program, bindings_node, i + 1));
+                if (ast_type(program, name_node) != AST_SYMBOL) {
+                    continue;
+                }
+
+                // The binding's type lives in its name node and also collects later defines
+                StaticType joined = type_join(program->value_types[name_node], type);
+                if (joined != program->value_types[name_node]) {
+                    program->value_types[name_node] = joined;
+                    inferrer->changed = true;
+                }
+                typeinfer_push_local(inferrer, ast_payload(program, name_node)->symbol, name_node);
+            }
+        }
+
+        StaticType type = typeinfer_children(inferrer, node, 2);
+        inferrer->scope_count = outer_scope_count;
+        return type;
+    }
+
+    if (strcmp(name->data, "defun") == 0) {
+        typeinfer_function(inferrer, node, 2);
+        return TYPE_BOOL;
+    }
+
+    if (strcmp(name->data, "lambda") == 0) {
+        typeinfer_function(inferrer, node, 1);
+        return TYPE_UNKNOWN;
+    }
+
+    if (strcmp(name->data, "if") == 0) {
+        // Only the condition always runs
+        if (count > 1) {
+            typeinfer_expr(inferrer, ast_child(program, node, 1));
+        }
+        inferrer->conditional++;
+        typeinfer_children(inferrer, node, 2);
+        inferrer->conditional--;
+        if (count != 4) {
+            return TYPE_UNKNOWN;
+        }
+        return type_join(
+            program->value_types[ast_child(program, node, 2)],
+            program->value_types[ast_child(program, node, 3)]
+        );
+    }
+
+    if (
+        strcmp(name->data, "do") == 0 ||
+        strcmp(name->data, "print") == 0 ||
+        strcmp(name->data, "println") == 0
+    ) {
+        return typeinfer_children(inferrer, node, 1);
+    }
+
+    if (
+        strcmp(name->data, "+") == 0 ||
+        strcmp(name->data, "-") == 0 ||
+        strcmp(name->data, "*") == 0
+    ) {
+        typeinfer_children(inferrer, node, 1);
+
+        StaticType operand_types[count];
+        for (int i = 1; i < count; i++) {
+            operand_types[i - 1] = program->value_types[ast_child(program, node, i)];
+        }
+        return arithmetic_type(operand_types, count - 1);
+    }
+
+    // A loop body may run no times
+    bool loop = strcmp(name->data, "while") == 0;
+    inferrer->conditional += loop;
+    typeinfer_children(inferrer, node, 1);
+    inferrer->conditional -= loop;
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (strcmp(name->data, builtin_types[i].name) == 0) {
+            return builtin_types[i].type;
+        }
+    }
+    return TYPE_UNKNOWN;
+}
+
+static StaticType typeinfer_expr(TypeInferrer *inferrer, int node) {
+    ASTProgram *program = inferrer->program;
+    StaticType type;
+
+    switch (ast_type(program, node)) {
+        case AST_INTEGER:
+            type = TYPE_INTEGER;
+            break;
+        case AST_FLOAT:
+            type = TYPE_FLOAT;
+            break;
+        case AST_BOOL:
+            type = TYPE_BOOL;
+            break;
+        case AST_STRING:
+            type = TYPE_STRING;
+            break;
+        case AST_SYMBOL:
+            type = typeinfer_variable_type(inferrer, ast_payload(program, node)->symbol);
+            break;
+        case AST_LITERAL_LIST:
+            typeinfer_children(inferrer, node, 0);
+            type = TYPE_LIST;
+            break;
+        case AST_LIST:
+            type = typeinfer_list(inferrer, node);
+            break;
+        default:
+            type = TYPE_UNKNOWN;
+            break;
+    }
+
+    program->value_types[node] = type;
+    return type;
+}
+
+void typeinfer_program(ASTProgram *program) {
+    free(program->value_types);
+    program->value_types = calloc(program->node_count > 0 ? program->node_count : 1, sizeof(unsigned char));
+
+    TypeInferrer inferrer;
+    inferrer.program = program;
+    inferrer.scope_count = 0;
+    inferrer.scope_capacity = 16;
+    inferrer.scope = malloc(sizeof(ScopeEntry) * inferrer.scope_capacity);
+    inferrer.global_count = 0;
+    inferrer.global_capacity = 16;
+    inferrer.global_names = malloc(sizeof(String*) * inferrer.global_capacity);
+    inferrer.global_types = malloc(sizeof(StaticType) * inferrer.global_capacity);
+    inferrer.global_seen = malloc(sizeof(bool) * inferrer.global_capacity);
+    inferrer.conditional = 0;
+    inferrer.function_count = 0;
+    inferrer.function_capacity = 16;
+    inferrer.function_names = malloc(sizeof(String*) * inferrer.function_capacity);
+
+    for (int i = 0; i < program->count; i++) {
+        int expr = program->expressions[i];
+        if (
+            ast_type(program, expr) == AST_LIST &&
+            ast_child_count(program, expr) >= 2 &&
+            ast_type(program, ast_child(program, expr, 0)) == AST_SYMBOL &&
+            strcmp(ast_payload(program, ast_child(program, expr, 0))->symbol->data, "defun") == 0 &&
+            ast_type(program, ast_child(program, expr, 1)) == AST_SYMBOL
+        ) {
+            if (inferrer.function_count >= inferrer.function_capacity) {
+                inferrer.function_capacity *= 2;
+                inferrer.function_names = realloc(inferrer.function_names, sizeof(String*) * inferrer.function_capacity);
+            }
+            inferrer.function_names[inferrer.function_count++] = ast_payload(program, ast_child(program, expr, 1))->symbol;
+        }
+    }
+
+    // Variable types only ever grow (none -> one type -> unknown), so this settles after a few passes.
+    // Uses are optimistic while a variable has no type yet; the final pass sees every assignment.
+    do {
+        inferrer.changed = false;
+        for (int i = 0; i < program->count; i++) {
+            typeinfer_expr(&inferrer, program->expressions[i]);
+        }
+    } while (inferrer.changed);
+
+    free(inferrer.scope);
+    free(inferrer.global_names);
+    free(inferrer.global_types);
+    free(inferrer.global_seen);
+    free(inferrer.function_names);
+}
+
+StaticType typeinfer_node_type(ASTProgram *program, int node) {
+    if (program->value_types == NULL) {
+        return TYPE_UNKNOWN;
+    }
+
+    StaticType type = program->value_types[node];
+    return type == TYPE_NONE ? TYPE_UNKNOWN : type;
+}
@@ -0,0 +1,34 @@
+#ifndef TYPEINFER_H
+#define TYPEINFER_H
+
+#include "parser.h"
+
+/**
+ * Static type of an expression's value, as far as it can be proven before running
+ */
+typedef enum {
+    TYPE_NONE,    // No value seen yet (only used while inferring; treat as unknown afterwards)
+    TYPE_INTEGER,
+    TYPE_FLOAT,
+    TYPE_BOOL,
+    TYPE_STRING,
+    TYPE_LIST,
+    TYPE_UNKNOWN  // Could be more than one type
+} StaticType;
+
+/**
+ * Infers the static type of every expression in the program and stores them in
+ * program->value_types. Variables get the type of all values ever assigned to them
+ * (their initial value and every define) if those all have the same type. A global that can
+ * be read before a top-level define assigns it (one assigned only in functions, loops or ifs)
+ * also has the integer 0 unset globals hold.
+ * For the name nodes of let bindings, the entry holds the type of that local variable.
+ */
+void typeinfer_program(ASTProgram *program);
+
+/**
+ * Returns the inferred type of the given node, or TYPE_UNKNOWN if types weren't inferred
+ */
+StaticType typeinfer_node_type(ASTProgram *program, int node);
+
+#endif // TYPEINFER_H
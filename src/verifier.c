@@ -0,0 +1,260 @@
+#include "verifier.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define VERIFY_STACK_LIMIT ((size_t)1 << 24) // Larger frames are left to the checked interpreter
+
+// State of one verification run
+typedef struct {
+    Instruction *code;
+    size_t count;
+    FunctionProto *functions;
+    int function_count;
+
+    int *depths; // Stack depth before each instruction (relative to its frame), or -1 if not reached yet
+    int *regions; // Function each instruction belongs to, or -1 for the top-level code
+    bool *targets; // Whether each instruction is the target of a jump or a function entry
+
+    int *worklist; // Reached instructions whose successors haven't been visited yet
+    int worklist_count;
+} Verifier;
+
+static bool is_jump(OpCode opCode) {
+    return opCode == OP_JMP || opCode == OP_JMP_IF || opCode == OP_JMP_IF_FALSE;
+}
+
+// Records that an instruction is reached with the given depth, failing if another path disagrees
+static bool verify_reach(Verifier *verifier, long target, int depth, int region) {
+    if (target < 0 || (size_t)target >= verifier->count) {
+        return false;
+    }
+    if (verifier->depths[target] == -1) {
+        verifier->depths[target] = depth;
+        verifier->regions[target] = region;
+        verifier->worklist[verifier->worklist_count++] = (int)target;
+        return true;
+    }
+    return verifier->depths[target] == depth && verifier->regions[target] == region;
+}
+
+// Checks the operand of an instruction, before its stack effect is computed
+static bool verify_operand(Verifier *verifier, Instruction insn, int depth, int region, size_t *global_count) {
+    Value operand = insn.operand;
+    switch (insn.opCode) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_MAKE_CLOSURE:
+            if (operand.type != VAL_INTEGER || operand.as.integer < 0 || operand.as.integer >= verifier->function_count) {
+                return false;
+            }
+            // Direct calls run without a closure, so their target can't use captures
+            return insn.opCode == OP_MAKE_CLOSURE || verifier->functions[operand.as.integer].capture_count == 0;
+        case OP_MAKE_LIST:
+        case OP_SLIDE:
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+            return operand.type == VAL_INTEGER && operand.as.integer >= 0;
+        case OP_LOAD_VAR:
+        case OP_STORE_VAR:
+            if (operand.type != VAL_INTEGER || operand.as.integer < 0) {
+                return false;
+            }
+            if ((size_t)operand.as.integer + 1 > *global_count) {
+                *global_count = (size_t)operand.as.integer + 1;
+            }
+            return true;
+        case OP_LOAD_LOCAL:
+        case OP_STORE_LOCAL:
+            return operand.type == VAL_INTEGER && operand.as.integer >= 0 && operand.as.integer < depth;
+        case OP_LOAD_CAPTURE:
+            return region != -1 &&
+                operand.type == VAL_INTEGER &&
+                operand.as.integer >= 0 &&
+                operand.as.integer < verifier->functions[region].capture_count;
+        default:
+            return true;
+    }
+}
+
+// Visits every instruction reachable from the worklist. Tracks the deepest stack of each region.
+static bool verify_flow(Verifier *verifier, int *max_depths, size_t *global_count) {
+    while (verifier->worklist_count > 0) {
+        int pc = verifier->worklist[--verifier->worklist_count];
+        Instruction insn = verifier->code[pc];
+        int depth = verifier->depths[pc];
+        int region = verifier->regions[pc];
+
+        if (!verify_operand(verifier, insn, depth, region, global_count)) {
+            return false;
+        }
+
+        int inputs = instruction_stack_inputs(insn, verifier->functions);
+        if (inputs > depth) {
+            return false;
+        }
+        int next_depth = depth - inputs + instruction_stack_outputs(insn.opCode);
+
+        int *max_depth = &max_depths[region + 1];
+        if (next_depth > *max_depth) {
+            *max_depth = next_depth;
+        }
+
+        if (is_jump(insn.opCode)) {
+            // The address must be a constant pushed right before the jump
+            Instruction push = pc > 0 ? verifier->code[pc - 1] : (Instruction){OP_HALT, {0}};
+            if (push.opCode != OP_PUSH || push.operand.type != VAL_INTEGER) {
+                return false;
+            }
+            if (!verify_reach(verifier, push.operand.as.integer, next_depth, region)) {
+                return false;
+            }
+            verifier->targets[push.operand.as.integer] = true;
+            if (insn.opCode != OP_JMP && !verify_reach(verifier, pc + 1, next_depth, region)) {
+                return false;
+            }
+            continue;
+        }
+
+        switch (insn.opCode) {
+            case OP_RET:
+            case OP_TAIL_CALL:
+            case OP_TAIL_CALL_CLOSURE:
+                // These need a frame to return from or replace
+                if (region == -1) {
+                    return false;
+                }
+                break;
+            case OP_HALT:
+                break;
+            default:
+                // Calls continue here too, once the callee returns its result
+                if (!verify_reach(verifier, pc + 1, next_depth, region)) {
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+// Runs the verifier, optionally copying out the stack depth it found before each instruction
+static bool verify(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    VerifyResult *result,
+    int *depths,
+    int *frame_depths
+) {
+    if (count == 0) {
+        return false;
+    }
+
+    Verifier verifier;
+    verifier.code = code;
+    verifier.count = count;
+    verifier.functions = functions;
+    verifier.function_count = function_count;
+    verifier.depths = malloc(sizeof(int) * count);
+    verifier.regions = malloc(sizeof(int) * count);
+    verifier.targets = calloc(count, sizeof(bool));
+    verifier.worklist = malloc(sizeof(int) * count);
+    verifier.worklist_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        verifier.depths[i] = -1;
+    }
+
+    // Slot 0 is the top-level code, then one per function
+    int *max_depths = calloc((size_t)function_count + 1, sizeof(int));
+    size_t global_count = 0;
+
+    bool ok = verify_reach(&verifier, 0, 0, -1);
+    for (int i = 0; ok && i < function_count; i++) {
+        if (functions[i].arity < 0) {
+            ok = false;
+            break;
+        }
+        ok = verify_reach(&verifier, functions[i].entry, functions[i].arity, i);
+        if (ok) {
+            verifier.targets[functions[i].entry] = true;
+            max_depths[i + 1] = functions[i].arity;
+        }
+    }
+    ok = ok && verify_flow(&verifier, max_depths, &global_count);
+
+    // A jump's address is only known if nothing can jump straight to the jump itself
+    for (size_t i = 0; ok && i < count; i++) {
+        if (verifier.targets[i] && is_jump(code[i].opCode)) {
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        // Each nested call can add at most one frame (plus its closure) on top of the top-level code.
+        // The VM makes room for a frame at each call, so only one is counted here.
+        size_t max_frame = 0;
+        for (int i = 0; i < function_count; i++) {
+            if ((size_t)max_depths[i + 1] + 1 > max_frame) {
+                max_frame = (size_t)max_depths[i + 1] + 1;
+            }
+        }
+        if (max_frame > VERIFY_STACK_LIMIT || (size_t)max_depths[0] > VERIFY_STACK_LIMIT) {
+            ok = false;
+        }
+        else {
+            result->max_stack = (size_t)max_depths[0] + max_frame;
+            result->max_frame = max_frame;
+            result->global_count = global_count;
+        }
+    }
+
+    if (ok && depths) {
+        for (size_t i = 0; i < count; i++) {
+            depths[i] = verifier.depths[i];
+        }
+    }
+    if (ok && frame_depths) {
+        memcpy(frame_depths, max_depths, sizeof(int) * ((size_t)function_count + 1));
+    }
+
+    free(verifier.depths);
+    free(verifier.regions);
+    free(verifier.targets);
+    free(verifier.worklist);
+    free(max_depths);
+    return ok;
+}
+
+bool bytecode_verify(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    VerifyResult *result
+) {
+    return verify(code, count, functions, function_count, result, NULL, NULL);
+}
+
+bool bytecode_verify_frames(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    VerifyResult *result,
+    int *frame_depths
+) {
+    return verify(code, count, functions, function_count, result, NULL, frame_depths);
+}
+
+bool bytecode_stack_depths(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    int *depths
+) {
+    VerifyResult result;
+    return verify(code, count, functions, function_count, &result, depths, NULL);
+}
@@ -0,0 +1,67 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+/**
+ * What the verifier proved about a program
+ */
+typedef struct {
+    size_t max_stack; // Most values the top-level code and one call on top of it can hold
+    size_t max_frame; // Most values any one call can add: its function's deepest frame and its closure
+    size_t global_count; // One more than the highest global variable location used
+} VerifyResult;
+
+/**
+ * Walks every path through the code, starting at address 0 and at each function's entry,
+ * and checks that the stack depth at every instruction is the same on all paths and never
+ * goes below what the instruction pops. Also checks that jump targets, function indices,
+ * local slots, captures and global locations are in range.
+ *
+ * Jump addresses must be pushed by the OP_PUSH right before the jump (as codegen does),
+ * so code with computed jumps can't be verified.
+ * @param result Filled in if the code was verified
+ * @returns true if the code is safe to run without stack and bounds checks
+ */
+bool bytecode_verify(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    VerifyResult *result
+);
+
+/**
+ * Verifies the code like bytecode_verify, and if it passes also fills in the deepest the
+ * stack gets in the top-level code and then in each function's frame, relative to its
+ * frame pointer
+ * @param frame_depths Array of function_count + 1 ints to fill in
+ * @returns true if the code was verified
+ */
+bool bytecode_verify_frames(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    VerifyResult *result,
+    int *frame_depths
+);
+
+/**
+ * Verifies the code like bytecode_verify, and if it passes fills in the stack depth
+ * before each instruction, relative to its frame pointer (-1 for unreachable code)
+ * @param depths Array of count ints to fill in
+ * @returns true if the code was verified
+ */
+bool bytecode_stack_depths(
+    Instruction *code,
+    size_t count,
+    FunctionProto *functions,
+    int function_count,
+    int *depths
+);
+
+#endif // VERIFIER_H
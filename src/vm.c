@@ -1,30 +1,91 @@
 #include "vm.h"
+#include "verifier.h"
+#include "jit.h"
+#include "trace.h"
+#include "regvm.h"
+#include "profile.h"
+#include "allocprofile.h"
+#include "heapsnap.h"
+#include "probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
 #include <limits.h>
 
 #define EPSILON (1e-12)
+// Must be inlined even in a function as big as the interpreter loop, so constant checked flags fold away
+#define VM_INLINE static inline __attribute__((always_inline))
+#define QUICKEN_DEOPT_LIMIT (4) // Deopts after which a site is no longer quickened
+#define DEBUG_TOP_VALUES (3) // Values from the top of the stack shown in each trace line
+#define DEBUG_VALUE_WIDTH (48) // Longest a value is shown by the debugger, including the terminator
+
+// Grows the globals to the given capacity. New globals read as integer 0 until they're
+// stored to, so nothing (like a heap snapshot) mistakes leftover memory for a reference.
+static bool vm_grow_globals(VM *vm, size_t capacity) {
+    if (!value_array_resize(&vm->globals, capacity)) {
+        return false;
+    }
+    for (size_t i = vm->globals_cap; i < capacity; i++) {
+        vm_globals_set(vm, (int)i, (Value){.type = VAL_INTEGER, .as.integer = 0});
+    }
+    vm->globals_cap = capacity;
+    vm->stats.globals_growths++;
+    return true;
+}
 
 VM* vm_create() {
     VM *vm = malloc(sizeof(VM));
 
     vm->stack_cap = 256;
-    vm->stack = malloc(sizeof(Value) * vm->stack_cap);
+    vm->max_frame = 0;
+    vm->frame_depths = NULL;
+    vm->stack = (ValueArray){0};
+    value_array_resize(&vm->stack, vm->stack_cap);
     vm->sp = 0;
+    vm->fp = 0;
     
-    vm->globals_cap = 8;
-    vm->globals = malloc(sizeof(Value) * vm->globals_cap);
+    vm->globals_cap = 0;
+    vm->globals = (ValueArray){0};
+    vm_grow_globals(vm, 8);
 
     vm->allocated_lists_cap = 8;
     vm->allocated_lists_count = 0;
     vm->allocated_lists = malloc(sizeof(List*) * vm->allocated_lists_cap);
 
+    vm->allocated_closures_cap = 8;
+    vm->allocated_closures_count = 0;
+    vm->allocated_closures = malloc(sizeof(Closure*) * vm->allocated_closures_cap);
+
+    vm->code = NULL;
+    vm->code_count = 0;
+    vm->owns_code = false;
+    vm->verified = false;
+    vm->jit = false;
+    vm->trace = false;
+    vm->regvm = false;
+    vm->sampling = false;
+    vm->traces = NULL;
     vm->pc = 0;
+
+    vm->functions = NULL;
+    vm->function_count = 0;
+    vm->frames = malloc(sizeof(CallFrame) * CALL_STACK_MAX);
+    vm->frame_count = 0;
+    vm->closure = NULL;
     
     vm->debug = false;
+    vm->debug_out = stderr;
+    vm->breakpoints = NULL;
+    vm->paused = false;
+    vm->profile = NULL;
+    vm->allocs = NULL;
+    vm->snapshot_requested = 0;
+    vm->perf = NULL;
+    vm->stats = (VMStats){0};
     
     vm->strings_cap = 8;
     vm->strings_count = 0;
@@ -34,13 +95,8 @@ VM* vm_create() {
 }
 
 void vm_free(VM *vm) {
-    if (vm->debug) {
-        printf("Freeing VM\n");
-    }
-
     // Cleanup strings
     for (size_t i = 0; i < vm->strings_count; i++) {
-        printf("String i: %d\n", (int)i);
         string_free(vm->strings[i]);
     }
 
@@ -50,32 +106,130 @@ void vm_free(VM *vm) {
         free(vm->allocated_lists[i]);
     }
     free(vm->allocated_lists);
+
+    // Cleanup closures
+    for (size_t i = 0; i < vm->allocated_closures_count; i++) {
+        free(vm->allocated_closures[i]);
+    }
+    free(vm->allocated_closures);
     
     free(vm->strings);
-    free(vm->globals);
+    value_array_free(&vm->globals);
+    free(vm->frames);
+    if (vm->owns_code) {
+        free(vm->code);
+    }
+    trace_cache_free(vm->traces);
+    free(vm->breakpoints);
+    free(vm->frame_depths);
 
-    free(vm->stack);
+    value_array_free(&vm->stack);
     free(vm);
 }
 
+void vm_load_code(VM *vm, Instruction *code, size_t count, FunctionProto *functions, int function_count) {
+    if (vm->owns_code) {
+        free(vm->code);
+    }
+    vm->code = malloc(sizeof(Instruction) * count);
+    memcpy(vm->code, code, sizeof(Instruction) * count);
+    vm->owns_code = true;
+    vm->code_count = count;
+    trace_cache_free(vm->traces);
+    vm->traces = NULL;
+    free(vm->breakpoints);
+    vm->breakpoints = NULL;
+    vm->paused = false;
+    vm->pc = 0;
+    vm->functions = functions;
+    vm->function_count = function_count;
+
+    // Verified code runs without stack checks, so make room for the top-level code and one call
+    // up front. Each call then makes room for the frame of the next one.
+    VerifyResult result;
+    free(vm->frame_depths);
+    vm->frame_depths = malloc(sizeof(int) * ((size_t)function_count + 1));
+    vm->verified = bytecode_verify_frames(vm->code, count, functions, function_count, &result, vm->frame_depths);
+    if (!vm->verified) {
+        return;
+    }
+    vm->max_frame = result.max_frame;
+    if (result.max_stack > vm->stack_cap) {
+        if (!value_array_resize(&vm->stack, result.max_stack)) {
+            vm->verified = false;
+            return;
+        }
+        vm->stack_cap = result.max_stack;
+        vm->stats.stack_growths++;
+    }
+    if (result.global_count > vm->globals_cap) {
+        if (!vm_grow_globals(vm, result.global_count)) {
+            vm->verified = false;
+            return;
+        }
+    }
+}
+
+bool value_array_resize(ValueArray *array, size_t capacity) {
+#ifdef VM_SOA_STACK
+    uint8_t *types = realloc(array->types, capacity * sizeof *types);
+    if (!types) {
+        return false;
+    }
+    array->types = types;
+    ValuePayload *payloads = realloc(array->payloads, capacity * sizeof *payloads);
+    if (!payloads) {
+        return false;
+    }
+    array->payloads = payloads;
+#else
+    Value *values = realloc(array->values, capacity * sizeof *values);
+    if (!values) {
+        return false;
+    }
+    array->values = values;
+#endif
+    return true;
+}
+
+void value_array_free(ValueArray *array) {
+#ifdef VM_SOA_STACK
+    free(array->types);
+    free(array->payloads);
+#else
+    free(array->values);
+#endif
+    *array = (ValueArray){0};
+}
+
 void runtime_error(char *msg) {
     printf("Runtime error: %s\n", msg);
     exit(1);
 }
 
+// Grows the stack, doubling it, until it holds at least capacity values
+static void vm_grow_stack(VM *vm, size_t capacity) {
+    size_t new_cap = vm->stack_cap * 2;
+    while (new_cap < capacity) {
+        new_cap *= 2;
+    }
+    if (!value_array_resize(&vm->stack, new_cap)) {
+        runtime_error("Unable to allocate space for stack growth");
+    }
+    vm->stack_cap = new_cap;
+    vm->stats.stack_growths++;
+}
+
 void stack_push_value(VM *vm, Value value) {
     if (vm->sp >= (int)vm->stack_cap) {
-        size_t new_cap = vm->stack_cap * 2;
-        Value *tmp = realloc(vm->stack, new_cap * sizeof *vm->stack);
-        if (!tmp) {
-            runtime_error("Unable to allocate space for stack growth");
-        }
-        vm->stack = tmp;
-        vm->stack_cap = new_cap;
+        vm_grow_stack(vm, vm->stack_cap + 1);
     }
 
-    vm->stack[vm->sp] = value;
+    vm_stack_set(vm, vm->sp, value);
     vm->sp++;
+    if ((unsigned long)vm->sp > vm->stats.max_stack_depth) {
+        vm->stats.max_stack_depth = vm->sp;
+    }
 }
 
 void globals_store(VM *vm, int location, Value value) {
@@ -89,16 +243,13 @@ void globals_store(VM *vm, int location, Value value) {
         while ((size_t)location >= new_cap) {
             new_cap *= 2;
         }
-        Value *tmp = realloc(vm->globals, new_cap * sizeof *vm->globals);
-        if (!tmp) {
+        if (!vm_grow_globals(vm, new_cap)) {
             runtime_error("Unable to allocate space for globals growth");
         }
-        vm->globals = tmp;
-        vm->globals_cap = new_cap;
     }
 
     // Store the value
-    vm->globals[location] = value;
+    vm_globals_set(vm, location, value);
 }
 
 Value globals_load(VM *vm, int location) {
@@ -106,7 +257,7 @@ Value globals_load(VM *vm, int location) {
         runtime_error("Global variable location out of bounds");
     }
 
-    return vm->globals[location];
+    return vm_globals_get(vm, location);
 }
 
 void stack_push_integer(VM *vm, int num) {
@@ -142,7 +293,7 @@ Value stack_pop(VM *vm) {
         runtime_error("Stack underflow!");
     }
     vm->sp--;
-    return vm->stack[vm->sp];
+    return vm_stack_get(vm, vm->sp);
 }
 
 Instruction code_get_next(VM *vm) {
@@ -151,7 +302,8 @@ Instruction code_get_next(VM *vm) {
     return insn;
 }
 
-String *vm_string_new(VM *vm) {
+// Adds a string made by the VM to the ones it frees, and to the allocation profile
+static void vm_register_string(VM *vm, String *s) {
     if (vm->strings_count == vm->strings_cap) {
         size_t new_cap = vm->strings_cap * 2;
         String **tmp = realloc(vm->strings, new_cap * sizeof *vm->strings);
@@ -161,17 +313,21 @@ String *vm_string_new(VM *vm) {
         vm->strings = tmp;
         vm->strings_cap = new_cap;
     }
+    vm->strings[vm->strings_count] = s;
+    vm->strings_count++;
+    vm->stats.strings_allocated++;
+
+    if (vm->allocs) {
+        alloc_profile_record(vm->allocs, vm->pc - 1, ALLOC_STRING, sizeof(String) + s->cap);
+    }
+}
 
+String *vm_string_new(VM *vm) {
     String *s = string_create();
     if (!s) {
         runtime_error("Unable to create new string");
     }
-    vm->strings[vm->strings_count] = s;
-    if (vm->debug) {
-        printf("Allocated string at index %d\n", (int)vm->strings_count);
-    }
-    vm->strings_count++;
-
+    vm_register_string(vm, s);
     return s;
 }
 
@@ -196,6 +352,9 @@ void print_list(List *list) {
             case VAL_LIST:
                 print_list(val.as.list);
                 break;
+            case VAL_CLOSURE:
+                printf("<function>");
+                break;
         }
         if (i < list->count - 1) {
             printf(" ");
@@ -218,6 +377,28 @@ void vm_register_list(VM *vm, List *list) {
     }
     vm->allocated_lists[vm->allocated_lists_count] = list;
     vm->allocated_lists_count++;
+    vm->stats.lists_allocated++;
+
+    if (vm->allocs) {
+        alloc_profile_record(vm->allocs, vm->pc - 1, ALLOC_LIST, sizeof(List) + sizeof(Value) * list->capacity);
+    }
+}
+
+void vm_register_closure(VM *vm, Closure *closure) {
+    if (vm->allocated_closures_count >= vm->allocated_closures_cap) {
+        vm->allocated_closures_cap *= 2;
+        Closure **tmp = realloc(
+            vm->allocated_closures,
+            sizeof(Closure*) * vm->allocated_closures_cap
+        );
+        if (tmp == NULL) {
+            runtime_error("Failed to reallocate allocated closures!");
+        }
+        vm->allocated_closures = tmp;
+    }
+    vm->allocated_closures[vm->allocated_closures_count] = closure;
+    vm->allocated_closures_count++;
+    vm->stats.closures_allocated++;
 }
 
 List *list_copy(List *source) {
@@ -232,728 +413,2103 @@ List *list_copy(List *source) {
     return copy;
 }
 
-void vm_execute(VM *vm) {
-    while (true) {
-        if (vm->debug) {
-            printf("=> PC: %d\n", vm->pc);
-        }
-        // Get the current instruction and increment the PC
-        Instruction instruction = code_get_next(vm);
-
-        if (vm->debug) {
-            printf("insn num: %d\n", instruction.opCode);
-        }
+// list_copy for instructions that make a new list from another, counting what it copies
+static List *vm_list_copy(VM *vm, List *source) {
+    vm->stats.list_copy_bytes += sizeof(Value) * source->count;
+    return list_copy(source);
+}
 
-        switch (instruction.opCode) {
-            case OP_PUSH: {
-                stack_push_value(vm, instruction.operand);
-                break;
-            }
-            case OP_LOAD_VAR: {
-                // Load a value from a global variable and push it onto the stack
-                if (instruction.operand.type != VAL_INTEGER) {
-                    runtime_error("Variable location must be an integer!");
-                }
-                int location = instruction.operand.as.integer;
-                Value val = globals_load(vm, location);
-                stack_push_value(vm, val);
-                break;
-            }
-            case OP_STORE_VAR: {
-                // Store a value into a global variable
-                if (instruction.operand.type != VAL_INTEGER) {
-                    runtime_error("Variable location must be an integer!");
-                }
-                int location = instruction.operand.as.integer;
-                Value val = stack_pop(vm);
-                globals_store(vm, location, val);
+// string_copy for instructions that make a new string from another, counting what it copies
+static String *vm_string_copy(VM *vm, String *source) {
+    vm->stats.string_copy_bytes += source->len;
+    return string_copy(source);
+}
 
-                // Also push it back onto the stack as a return value
-                stack_push_value(vm, val);
-                break;
-            }
-            case OP_MAKE_LIST: {
-                if (instruction.operand.type != VAL_INTEGER) {
-                    runtime_error("Make list operand must be an integer!");
-                }
-                int count = instruction.operand.as.integer;
-                
-                List *list = malloc(sizeof(List));
-                list->count = (size_t)count;
-                list->capacity = (size_t)count;
-                if (list->capacity < 8) {
-                    list->capacity = 8;
-                }
-                list->elements = malloc(sizeof(Value) * list->capacity);
+int instruction_stack_effect(Instruction insn, FunctionProto *functions) {
+    switch (insn.opCode) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 1 - functions[insn.operand.as.integer].arity;
+        case OP_CALL_CLOSURE:
+        case OP_TAIL_CALL_CLOSURE:
+            return -insn.operand.as.integer;
+        case OP_MAKE_CLOSURE:
+            return 1 - functions[insn.operand.as.integer].capture_count;
+        case OP_PUSH:
+        case OP_LOAD_VAR:
+        case OP_LOAD_LOCAL:
+        case OP_LOAD_CAPTURE:
+        case OP_DUP:
+            return 1;
+        case OP_MAKE_LIST:
+            return 1 - insn.operand.as.integer;
+        case OP_SLIDE:
+            return -insn.operand.as.integer;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_LOGIC_AND:
+        case OP_LOGIC_OR:
+        case OP_CONCATSTR:
+        case OP_DISCARD:
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LT:
+        case OP_LTE:
+        case OP_GT:
+        case OP_GTE:
+        case OP_STR_EQ:
+        case OP_JMP:
+        case OP_RET:
+        case OP_ADD_II:
+        case OP_ADD_FF:
+        case OP_SUB_II:
+        case OP_SUB_FF:
+        case OP_MUL_II:
+        case OP_MUL_FF:
+        case OP_EQ_II:
+        case OP_EQ_FF:
+        case OP_NEQ_II:
+        case OP_NEQ_FF:
+        case OP_LT_II:
+        case OP_LT_FF:
+        case OP_LTE_II:
+        case OP_LTE_FF:
+        case OP_GT_II:
+        case OP_GT_FF:
+        case OP_GTE_II:
+        case OP_GTE_FF:
+        case OP_LIST_APPEND:
+        case OP_LIST_REMOVE:
+        case OP_LIST_GET:
+        case OP_QADD_II:
+        case OP_QADD_FF:
+        case OP_QSUB_II:
+        case OP_QSUB_FF:
+        case OP_QMUL_II:
+        case OP_QMUL_FF:
+        case OP_QEQ_II:
+        case OP_QEQ_FF:
+        case OP_QNEQ_II:
+        case OP_QNEQ_FF:
+        case OP_QLT_II:
+        case OP_QLT_FF:
+        case OP_QLTE_II:
+        case OP_QLTE_FF:
+        case OP_QGT_II:
+        case OP_QGT_FF:
+        case OP_QGTE_II:
+        case OP_QGTE_FF:
+        case OP_QLIST_GET:
+            return -1;
+        case OP_SUBSTR:
+        case OP_JMP_IF:
+        case OP_JMP_IF_FALSE:
+        case OP_LIST_SUBLIST:
+        case OP_LIST_SET:
+            return -2;
+        default:
+            return 0;
+    }
+}
 
-                // Pop from stack in reverse order so that the first element ends up at the front of the list
-                for (size_t i = 0; i < list->count; i++) {
-                    list->elements[list->count - 1 - i] = stack_pop(vm);
-                }
+int instruction_stack_outputs(OpCode opCode) {
+    switch (opCode) {
+        case OP_DISCARD:
+        case OP_JMP:
+        case OP_JMP_IF:
+        case OP_JMP_IF_FALSE:
+        case OP_RET:
+        case OP_HALT:
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALL_CLOSURE:
+            return 0;
+        case OP_DUP:
+        case OP_SWAP:
+            return 2;
+        default:
+            return 1;
+    }
+}
 
-                // Add to allocated lists for cleanup later
-                vm_register_list(vm, list);
+int instruction_stack_inputs(Instruction insn, FunctionProto *functions) {
+    switch (insn.opCode) {
+        case OP_TAIL_CALL:
+            return functions[insn.operand.as.integer].arity;
+        case OP_TAIL_CALL_CLOSURE:
+            return insn.operand.as.integer + 1;
+        default:
+            return instruction_stack_outputs(insn.opCode) - instruction_stack_effect(insn, functions);
+    }
+}
 
-                // Push the list onto the stack
-                Value val;
-                val.type = VAL_LIST;
-                val.as.list = list;
-                stack_push_value(vm, val);
+OpCode instruction_unquickened(OpCode opCode) {
+    switch (opCode) {
+        case OP_QADD_II: case OP_QADD_FF: return OP_ADD;
+        case OP_QSUB_II: case OP_QSUB_FF: return OP_SUB;
+        case OP_QMUL_II: case OP_QMUL_FF: return OP_MUL;
+        case OP_QEQ_II: case OP_QEQ_FF: return OP_EQ;
+        case OP_QNEQ_II: case OP_QNEQ_FF: return OP_NEQ;
+        case OP_QLT_II: case OP_QLT_FF: return OP_LT;
+        case OP_QLTE_II: case OP_QLTE_FF: return OP_LTE;
+        case OP_QGT_II: case OP_QGT_FF: return OP_GT;
+        case OP_QGTE_II: case OP_QGTE_FF: return OP_GTE;
+        case OP_QLIST_GET: return OP_LIST_GET;
+        default: return opCode;
+    }
+}
 
-                break;
-            }
-            case OP_ADD: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+static const char *opcode_names[OPCODE_COUNT] = {
+    [OP_PUSH] = "OP_PUSH",
+    [OP_STORE_VAR] = "OP_STORE_VAR",
+    [OP_LOAD_VAR] = "OP_LOAD_VAR",
+    [OP_MAKE_LIST] = "OP_MAKE_LIST",
+    [OP_LOAD_LOCAL] = "OP_LOAD_LOCAL",
+    [OP_STORE_LOCAL] = "OP_STORE_LOCAL",
+    [OP_SLIDE] = "OP_SLIDE",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CALL_CLOSURE] = "OP_CALL_CLOSURE",
+    [OP_TAIL_CALL_CLOSURE] = "OP_TAIL_CALL_CLOSURE",
+    [OP_MAKE_CLOSURE] = "OP_MAKE_CLOSURE",
+    [OP_LOAD_CAPTURE] = "OP_LOAD_CAPTURE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUB] = "OP_SUB",
+    [OP_MUL] = "OP_MUL",
+    [OP_DIV] = "OP_DIV",
+    [OP_MOD] = "OP_MOD",
+    [OP_LOGIC_AND] = "OP_LOGIC_AND",
+    [OP_LOGIC_OR] = "OP_LOGIC_OR",
+    [OP_LOGIC_NOT] = "OP_LOGIC_NOT",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_PRINTLN] = "OP_PRINTLN",
+    [OP_CONCATSTR] = "OP_CONCATSTR",
+    [OP_SUBSTR] = "OP_SUBSTR",
+    [OP_DISCARD] = "OP_DISCARD",
+    [OP_DUP] = "OP_DUP",
+    [OP_SWAP] = "OP_SWAP",
+    [OP_EQ] = "OP_EQ",
+    [OP_NEQ] = "OP_NEQ",
+    [OP_LT] = "OP_LT",
+    [OP_LTE] = "OP_LTE",
+    [OP_GT] = "OP_GT",
+    [OP_GTE] = "OP_GTE",
+    [OP_STR_EQ] = "OP_STR_EQ",
+    [OP_STRLEN] = "OP_STRLEN",
+    [OP_JMP] = "OP_JMP",
+    [OP_JMP_IF] = "OP_JMP_IF",
+    [OP_JMP_IF_FALSE] = "OP_JMP_IF_FALSE",
+    [OP_INT2FLOAT] = "OP_INT2FLOAT",
+    [OP_FLOAT2INT] = "OP_FLOAT2INT",
+    [OP_LIST_APPEND] = "OP_LIST_APPEND",
+    [OP_LIST_SUBLIST] = "OP_LIST_SUBLIST",
+    [OP_LIST_REMOVE] = "OP_LIST_REMOVE",
+    [OP_LIST_SET] = "OP_LIST_SET",
+    [OP_LIST_GET] = "OP_LIST_GET",
+    [OP_LIST_LEN] = "OP_LIST_LEN",
+    [OP_HEAP_SNAPSHOT] = "OP_HEAP_SNAPSHOT",
+    [OP_RET] = "OP_RET",
+    [OP_HALT] = "OP_HALT",
+    [OP_ADD_II] = "OP_ADD_II",
+    [OP_ADD_FF] = "OP_ADD_FF",
+    [OP_SUB_II] = "OP_SUB_II",
+    [OP_SUB_FF] = "OP_SUB_FF",
+    [OP_MUL_II] = "OP_MUL_II",
+    [OP_MUL_FF] = "OP_MUL_FF",
+    [OP_EQ_II] = "OP_EQ_II",
+    [OP_EQ_FF] = "OP_EQ_FF",
+    [OP_NEQ_II] = "OP_NEQ_II",
+    [OP_NEQ_FF] = "OP_NEQ_FF",
+    [OP_LT_II] = "OP_LT_II",
+    [OP_LT_FF] = "OP_LT_FF",
+    [OP_LTE_II] = "OP_LTE_II",
+    [OP_LTE_FF] = "OP_LTE_FF",
+    [OP_GT_II] = "OP_GT_II",
+    [OP_GT_FF] = "OP_GT_FF",
+    [OP_GTE_II] = "OP_GTE_II",
+    [OP_GTE_FF] = "OP_GTE_FF",
+    [OP_QADD_II] = "OP_QADD_II",
+    [OP_QADD_FF] = "OP_QADD_FF",
+    [OP_QSUB_II] = "OP_QSUB_II",
+    [OP_QSUB_FF] = "OP_QSUB_FF",
+    [OP_QMUL_II] = "OP_QMUL_II",
+    [OP_QMUL_FF] = "OP_QMUL_FF",
+    [OP_QEQ_II] = "OP_QEQ_II",
+    [OP_QEQ_FF] = "OP_QEQ_FF",
+    [OP_QNEQ_II] = "OP_QNEQ_II",
+    [OP_QNEQ_FF] = "OP_QNEQ_FF",
+    [OP_QLT_II] = "OP_QLT_II",
+    [OP_QLT_FF] = "OP_QLT_FF",
+    [OP_QLTE_II] = "OP_QLTE_II",
+    [OP_QLTE_FF] = "OP_QLTE_FF",
+    [OP_QGT_II] = "OP_QGT_II",
+    [OP_QGT_FF] = "OP_QGT_FF",
+    [OP_QGTE_II] = "OP_QGTE_II",
+    [OP_QGTE_FF] = "OP_QGTE_FF",
+    [OP_QLIST_GET] = "OP_QLIST_GET",
+};
+
+const char *opcode_name(OpCode opCode) {
+    if ((size_t)opCode >= sizeof(opcode_names) / sizeof(opcode_names[0]) || !opcode_names[opCode]) {
+        return "OP_UNKNOWN";
+    }
+    return opcode_names[opCode];
+}
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot perform arithmetic on non-number!");
-                }
-                
-                if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
-                    stack_push_integer(vm, a.as.integer + b.as.integer);
-                }
-                else {
-                    double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                    double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+// Stack and global accessors for the interpreter loop. With checked unset, the verifier has
+// proven the stack never underflows, the stack was preallocated to its maximum depth,
+// and every global location fits, so they skip straight to the access.
+VM_INLINE Value vm_pop(VM *vm, const bool checked) {
+    if (checked) {
+        return stack_pop(vm);
+    }
+    return vm_stack_get(vm, --vm->sp);
+}
 
-                    stack_push_float(vm, anum + bnum);
-                }
+VM_INLINE void vm_push_value(VM *vm, Value value, const bool checked) {
+    if (checked) {
+        stack_push_value(vm, value);
+        return;
+    }
+    vm_stack_set(vm, vm->sp++, value);
+}
 
-                break;
-            }
-            case OP_SUB: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+VM_INLINE void vm_push_integer(VM *vm, int num, const bool checked) {
+    vm_push_value(vm, (Value){.type = VAL_INTEGER, .as.integer = num}, checked);
+}
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot perform arithmetic on non-number!");
-                }
+VM_INLINE void vm_push_float(VM *vm, double num, const bool checked) {
+    vm_push_value(vm, (Value){.type = VAL_FLOAT, .as.floating = num}, checked);
+}
 
-                // second - first
-                if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
-                    stack_push_integer(vm, b.as.integer - a.as.integer); 
-                }
-                else {
-                    double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                    double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+VM_INLINE void vm_push_string(VM *vm, String *st, const bool checked) {
+    vm_push_value(vm, (Value){.type = VAL_STRING, .as.string = st}, checked);
+}
 
-                    stack_push_float(vm, bnum - anum);
-                }
-                
-                break;
-            }
-            case OP_MUL: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+VM_INLINE void vm_push_bool(VM *vm, bool b, const bool checked) {
+    vm_push_value(vm, (Value){.type = VAL_BOOL, .as.boolean = b}, checked);
+}
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot perform arithmetic on non-number!");
-                }
+VM_INLINE Value vm_global_load(VM *vm, int location, const bool checked) {
+    if (checked) {
+        return globals_load(vm, location);
+    }
+    return vm_globals_get(vm, location);
+}
 
-                if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
-                    stack_push_integer(vm, a.as.integer * b.as.integer);
-                }
-                else {
-                    double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                    double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+VM_INLINE void vm_global_store(VM *vm, int location, Value value, const bool checked) {
+    if (checked) {
+        globals_store(vm, location, value);
+        return;
+    }
+    vm_globals_set(vm, location, value);
+}
 
-                    stack_push_float(vm, anum * bnum);
-                }
-                break;
-            }
-            case OP_DIV: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+// True if the two values on top of the stack both have the given type
+static bool vm_top_two_are(VM *vm, ValueType type) {
+    return vm->sp >= 2 && value_array_type(vm->stack, vm->sp - 1) == type &&
+        value_array_type(vm->stack, vm->sp - 2) == type;
+}
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot perform arithmetic on non-number!");
-                }
+// Rewrites the instruction that is running into a quickened variant.
+// Sites that have deoptimized too often stay generic. The JIT runs generic
+// instructions whose site may already be quickened, so those are left alone.
+static void vm_quicken(VM *vm, OpCode quickened) {
+    Instruction *insn = &vm->code[vm->pc - 1];
+    if (insn->opCode == quickened || insn->operand.as.integer >= QUICKEN_DEOPT_LIMIT) {
+        return;
+    }
+    insn->opCode = quickened;
+    vm->stats.quickenings++;
+}
 
-                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+// Quickens a binary number operation if both operands were integers or both were floats
+static void vm_quicken_binary(VM *vm, Value a, Value b, OpCode integers, OpCode floats) {
+    if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
+        vm_quicken(vm, integers);
+    }
+    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
+        vm_quicken(vm, floats);
+    }
+}
 
-                if (fabs(bnum) < EPSILON) {
-                    runtime_error("Division by 0!");
-                }
+// Called by a quickened instruction whose guard failed: turns it back into the
+// generic instruction and runs that instead. The generic forms have no operand,
+// so it counts how often this site deoptimized.
+static void vm_deoptimize(VM *vm, OpCode generic) {
+    Instruction *insn = &vm->code[vm->pc - 1];
+    insn->opCode = generic;
+    insn->operand.as.integer++;
+    vm->stats.deopts++;
+    vm->pc--;
+}
 
-                // second / first
-                stack_push_float(vm, bnum / anum);
-                
-                break;
-            }
-            case OP_MOD: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+void vm_print_stats(VM *vm, FILE *out) {
+    VMStats *stats = &vm->stats;
+    fprintf(out, "Bytecode verified: %s\n", vm->verified ? "yes" : "no");
+    fprintf(out, "Quickened instructions: %lu\n", stats->quickenings);
+    fprintf(out, "Deoptimized instructions: %lu\n", stats->deopts);
+    fprintf(out, "JIT compiled runs: %lu\n", stats->jit_runs);
+    fprintf(out, "Register VM runs: %lu\n", stats->regvm_runs);
+    fprintf(out, "Traces compiled: %lu\n", stats->traces_compiled);
+    fprintf(out, "Traces aborted: %lu\n", stats->trace_aborts);
+    fprintf(out, "Trace side exits: %lu\n", stats->side_exits);
+    // JIT-compiled code doesn't count what it runs, and register code runs other instructions
+    if (stats->jit_runs > 0 || stats->regvm_runs > 0) {
+        fprintf(out, "Instructions dispatched: n/a\n");
+    }
+    else {
+        fprintf(out, "Instructions dispatched: %lu\n", stats->dispatches);
+    }
+    fprintf(out, "Max stack depth: %lu\n", stats->max_stack_depth);
+    fprintf(out, "Max call depth: %lu\n", stats->max_call_depth);
+    fprintf(out, "Stack reallocations: %lu (capacity %zu)\n", stats->stack_growths, vm->stack_cap);
+    fprintf(out, "Globals reallocations: %lu (capacity %zu)\n", stats->globals_growths, vm->globals_cap);
+    fprintf(out, "Lists allocated: %lu\n", stats->lists_allocated);
+    fprintf(out, "Strings allocated: %lu\n", stats->strings_allocated);
+    fprintf(out, "Closures allocated: %lu\n", stats->closures_allocated);
+    fprintf(out, "Bytes copied by list_copy: %lu\n", stats->list_copy_bytes);
+    fprintf(out, "Bytes copied by string_copy: %lu\n", stats->string_copy_bytes);
+    fprintf(out, "Lex time: %.3f ms\n", stats->lex_ms);
+    fprintf(out, "Parse time (with lexing): %.3f ms\n", stats->parse_ms);
+    fprintf(out, "Codegen time: %.3f ms\n", stats->codegen_ms);
+    fprintf(out, "Load time (with verification): %.3f ms\n", stats->load_ms);
+    fprintf(out, "Execute time: %.3f ms\n", stats->execute_ms);
+}
 
-                if (a.type != VAL_INTEGER || b.type != VAL_INTEGER) {
-                    runtime_error("Cannot perform modulo on non-integer!");
-                }
+bool vm_write_stats_json(VM *vm, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+    VMStats *stats = &vm->stats;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"verified\": %s,\n", vm->verified ? "true" : "false");
+    fprintf(out, "  \"quickenings\": %lu,\n", stats->quickenings);
+    fprintf(out, "  \"deopts\": %lu,\n", stats->deopts);
+    fprintf(out, "  \"jit_runs\": %lu,\n", stats->jit_runs);
+    fprintf(out, "  \"regvm_runs\": %lu,\n", stats->regvm_runs);
+    fprintf(out, "  \"traces_compiled\": %lu,\n", stats->traces_compiled);
+    fprintf(out, "  \"trace_aborts\": %lu,\n", stats->trace_aborts);
+    fprintf(out, "  \"side_exits\": %lu,\n", stats->side_exits);
+    if (stats->jit_runs > 0 || stats->regvm_runs > 0) {
+        fprintf(out, "  \"instructions\": null,\n");
+    }
+    else {
+        fprintf(out, "  \"instructions\": %lu,\n", stats->dispatches);
+    }
+    fprintf(out, "  \"max_stack_depth\": %lu,\n", stats->max_stack_depth);
+    fprintf(out, "  \"max_call_depth\": %lu,\n", stats->max_call_depth);
+    fprintf(out, "  \"stack_growths\": %lu,\n", stats->stack_growths);
+    fprintf(out, "  \"stack_capacity\": %zu,\n", vm->stack_cap);
+    fprintf(out, "  \"globals_growths\": %lu,\n", stats->globals_growths);
+    fprintf(out, "  \"globals_capacity\": %zu,\n", vm->globals_cap);
+    fprintf(out, "  \"lists_allocated\": %lu,\n", stats->lists_allocated);
+    fprintf(out, "  \"strings_allocated\": %lu,\n", stats->strings_allocated);
+    fprintf(out, "  \"closures_allocated\": %lu,\n", stats->closures_allocated);
+    fprintf(out, "  \"list_copy_bytes\": %lu,\n", stats->list_copy_bytes);
+    fprintf(out, "  \"string_copy_bytes\": %lu,\n", stats->string_copy_bytes);
+    fprintf(out, "  \"phases_ms\": {\"lex\": %.3f, \"parse\": %.3f, \"codegen\": %.3f, \"load\": %.3f, \"execute\": %.3f}\n",
+        stats->lex_ms, stats->parse_ms, stats->codegen_ms, stats->load_ms, stats->execute_ms);
+    fprintf(out, "}\n");
+    return fclose(out) == 0;
+}
 
-                if (a.as.integer == 0) {
-                    runtime_error("Modulo by 0!");
-                }
+// Writes the heap snapshot SIGUSR1 asked for, if it has. Called at calls and backward
+// jumps, where vm->sp is up to date in every loop, and which every running program reaches.
+VM_INLINE void vm_safe_point(VM *vm) {
+    if (vm->snapshot_requested) {
+        heap_snapshot_take_requested(vm);
+    }
+}
 
-                // second % first
-                stack_push_integer(vm, b.as.integer % a.as.integer);
-                break;
-            }
-            case OP_LOGIC_AND: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+// Verified code doesn't check its pushes, so a call makes sure the stack has room for the
+// deepest frame any function can have. Tail calls reuse a frame, so they don't need to.
+VM_INLINE void vm_reserve_frame(VM *vm, bool checked) {
+    if (!checked && (size_t)vm->fp + vm->max_frame > vm->stack_cap) {
+        vm_grow_stack(vm, (size_t)vm->fp + vm->max_frame);
+    }
+}
 
-                if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
-                    runtime_error("Cannot perform boolean algebra on non-boolean!");
-                }
+// Records how deep the stack and the calls can get in the frame of the function just
+// entered (-1 for the top-level code), if that's the deepest yet. Verified code doesn't check
+// its pushes, so its frames count as deep as the verifier found they get; checked code counts
+// its pushes as it makes them.
+VM_INLINE void vm_note_depth(VM *vm, int function) {
+    unsigned long depth = vm->verified ? (unsigned long)(vm->fp + vm->frame_depths[function + 1]) : (unsigned long)vm->sp;
+    if (depth > vm->stats.max_stack_depth) {
+        vm->stats.max_stack_depth = depth;
+    }
+    if ((unsigned long)vm->frame_count > vm->stats.max_call_depth) {
+        vm->stats.max_call_depth = vm->frame_count;
+    }
+}
 
-                stack_push_bool(vm, a.as.boolean && b.as.boolean);
-                break;
+// Runs a single instruction whose pc has already been advanced past it.
+// Returns false once the program halts.
+VM_INLINE bool vm_step(VM *vm, Instruction instruction, const bool checked) {
+    switch (instruction.opCode) {
+        case OP_PUSH: {
+            vm_push_value(vm, instruction.operand, checked);
+            break;
+        }
+        case OP_LOAD_VAR: {
+            // Load a value from a global variable and push it onto the stack
+            if (checked && instruction.operand.type != VAL_INTEGER) {
+                runtime_error("Variable location must be an integer!");
             }
-            case OP_LOGIC_OR: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
-
-                if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
-                    runtime_error("Cannot perform boolean algebra on non-boolean!");
-                }
-
-                stack_push_bool(vm, a.as.boolean || b.as.boolean);
-                break;
+            int location = instruction.operand.as.integer;
+            Value val = vm_global_load(vm, location, checked);
+            vm_push_value(vm, val, checked);
+            break;
+        }
+        case OP_STORE_VAR: {
+            // Store a value into a global variable
+            if (checked && instruction.operand.type != VAL_INTEGER) {
+                runtime_error("Variable location must be an integer!");
             }
-            case OP_LOGIC_NOT: {
-                Value a = stack_pop(vm);
+            int location = instruction.operand.as.integer;
+            Value val = vm_pop(vm, checked);
+            vm_global_store(vm, location, val, checked);
 
-                if (a.type != VAL_BOOL) {
-                    runtime_error("Cannot perform boolean algebra on non-boolean!");
-                }
-
-                stack_push_bool(vm, !a.as.boolean);
-                break;
+            // Also push it back onto the stack as a return value
+            vm_push_value(vm, val, checked);
+            break;
+        }
+        case OP_LOAD_LOCAL: {
+            // Locals live in the stack itself, so no bounds check needed
+            vm_push_value(vm, vm_stack_get(vm, vm->fp + instruction.operand.as.integer), checked);
+            break;
+        }
+        case OP_STORE_LOCAL: {
+            // Store into a frame slot; the value stays on the stack as a return value
+            vm_stack_set(vm, vm->fp + instruction.operand.as.integer, vm_stack_get(vm, vm->sp - 1));
+            break;
+        }
+        case OP_SLIDE: {
+            // Drop n values from under the top of the stack (e.g. locals going out of scope)
+            Value top = vm_pop(vm, checked);
+            int n = instruction.operand.as.integer;
+            if (checked && n > vm->sp) {
+                runtime_error("Stack underflow!");
             }
-            case OP_PRINT: {
-                Value val = stack_pop(vm);
-                switch (val.type) {
-                    case VAL_INTEGER:
-                        printf("%d", val.as.integer);
-                        break;
-                    case VAL_FLOAT:
-                        printf("%f", val.as.floating);
-                        break;
-                    case VAL_BOOL:
-                        printf(val.as.boolean == true ? "true" : "false");
-                        break;
-                    case VAL_STRING:
-                        printf("%s", val.as.string->data);
-                        break;
-                    case VAL_LIST:
-                        print_list(val.as.list);
-                        break;
-                }
-                
-                // Push it back as a return value
-                stack_push_value(vm, val);
-
-                break;
+            vm->sp -= n;
+            vm_push_value(vm, top, checked);
+            break;
+        }
+        case OP_CALL: {
+            FunctionProto *function = &vm->functions[instruction.operand.as.integer];
+            if (vm->frame_count >= CALL_STACK_MAX) {
+                runtime_error("Call stack overflow!");
             }
-            case OP_PRINTLN: {
-                Value val = stack_pop(vm);
-                switch (val.type) {
-                    case VAL_INTEGER:
-                        printf("%d\n", val.as.integer);
-                        break;
-                    case VAL_FLOAT:
-                        printf("%f\n", val.as.floating);
-                        break;
-                    case VAL_BOOL:
-                        printf(val.as.boolean == true ? "true\n" : "false\n");
-                        break;
-                    case VAL_STRING:
-                        printf("%s\n", val.as.string->data);
-                        break;
-                    case VAL_LIST:
-                        print_list(val.as.list);
-                        printf("\n");
-                        break;
-                }
-                
-                // Push it back as a return value
-                stack_push_value(vm, val);
 
-                break;
+            // The arguments stay where they are and become the callee's first slots
+            CallFrame *frame = &vm->frames[vm->frame_count++];
+            frame->return_pc = vm->pc;
+            frame->fp = vm->fp;
+            frame->closure = vm->closure;
+            vm->fp = vm->sp - function->arity;
+            vm->closure = NULL;
+            vm->pc = function->entry;
+            vm_reserve_frame(vm, checked);
+            vm_note_depth(vm, instruction.operand.as.integer);
+            vm_safe_point(vm);
+            PROBE_FUNCTION_ENTRY(instruction.operand.as.integer, vm->pc, vm->frame_count);
+            break;
+        }
+        case OP_TAIL_CALL: {
+            FunctionProto *function = &vm->functions[instruction.operand.as.integer];
+
+            // Move the arguments down over the current frame (including its closure) and reuse the frame
+            int base = vm->closure ? vm->fp - 1 : vm->fp;
+            int args = vm->sp - function->arity;
+            for (int i = 0; i < function->arity; i++) {
+                vm_stack_set(vm, base + i, vm_stack_get(vm, args + i));
+            }
+            vm->sp = base + function->arity;
+            vm->fp = base;
+            vm->closure = NULL;
+            vm->pc = function->entry;
+            vm_note_depth(vm, instruction.operand.as.integer);
+            vm_safe_point(vm);
+            PROBE_FUNCTION_ENTRY(instruction.operand.as.integer, vm->pc, vm->frame_count);
+            break;
+        }
+        case OP_CALL_CLOSURE: {
+            int arg_count = instruction.operand.as.integer;
+            Value callee = vm_stack_get(vm, vm->sp - arg_count - 1);
+            if (callee.type != VAL_CLOSURE) {
+                runtime_error("Cannot call a non-function!");
+            }
+            FunctionProto *function = &vm->functions[callee.as.closure->function];
+            if (function->arity != arg_count) {
+                runtime_error("Wrong number of arguments in function call!");
+            }
+            if (vm->frame_count >= CALL_STACK_MAX) {
+                runtime_error("Call stack overflow!");
             }
-            case OP_CONCATSTR: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
 
-                if (a.type != VAL_STRING || b.type != VAL_STRING) {
-                    runtime_error("Cannot concatenate non-strings!");
-                }
-                
-                String *new = string_copy(b.as.string);
-                bool success = string_append(new, a.as.string->data);
+            // The closure stays on the stack just below the callee's frame
+            CallFrame *frame = &vm->frames[vm->frame_count++];
+            frame->return_pc = vm->pc;
+            frame->fp = vm->fp;
+            frame->closure = vm->closure;
+            vm->fp = vm->sp - arg_count;
+            vm->closure = callee.as.closure;
+            vm->pc = function->entry;
+            vm_reserve_frame(vm, checked);
+            vm_note_depth(vm, callee.as.closure->function);
+            vm_safe_point(vm);
+            PROBE_FUNCTION_ENTRY(callee.as.closure->function, vm->pc, vm->frame_count);
+            break;
+        }
+        case OP_TAIL_CALL_CLOSURE: {
+            int arg_count = instruction.operand.as.integer;
+            Value callee = vm_stack_get(vm, vm->sp - arg_count - 1);
+            if (callee.type != VAL_CLOSURE) {
+                runtime_error("Cannot call a non-function!");
+            }
+            FunctionProto *function = &vm->functions[callee.as.closure->function];
+            if (function->arity != arg_count) {
+                runtime_error("Wrong number of arguments in function call!");
+            }
 
-                if (!success) {
-                    runtime_error("String append failed!");
-                }
+            // Move the closure and arguments down over the current frame and reuse the frame
+            int base = vm->closure ? vm->fp - 1 : vm->fp;
+            int moved = vm->sp - arg_count - 1;
+            for (int i = 0; i <= arg_count; i++) {
+                vm_stack_set(vm, base + i, vm_stack_get(vm, moved + i));
+            }
+            vm->sp = base + arg_count + 1;
+            vm->fp = base + 1;
+            vm->closure = callee.as.closure;
+            vm->pc = function->entry;
+            vm_note_depth(vm, callee.as.closure->function);
+            vm_safe_point(vm);
+            PROBE_FUNCTION_ENTRY(callee.as.closure->function, vm->pc, vm->frame_count);
+            break;
+        }
+        case OP_MAKE_CLOSURE: {
+            int function_index = instruction.operand.as.integer;
+            int capture_count = vm->functions[function_index].capture_count;
 
-                stack_push_string(vm, new);
+            Closure *closure = malloc(sizeof(Closure) + sizeof(Value) * capture_count);
+            if (!closure) {
+                runtime_error("Unable to allocate closure!");
+            }
+            closure->function = function_index;
+            closure->capture_count = capture_count;
 
-                break;
+            // Captured values were pushed in capture index order
+            for (int i = capture_count - 1; i >= 0; i--) {
+                closure->captures[i] = vm_pop(vm, checked);
             }
-            case OP_SUBSTR: {
-                Value length = stack_pop(vm);
-                Value start = stack_pop(vm);
-                Value s = stack_pop(vm);
+            vm_register_closure(vm, closure);
 
-                if (s.type != VAL_STRING) {
-                    runtime_error("Cannot take substring of non-string!");
-                }
+            Value val;
+            val.type = VAL_CLOSURE;
+            val.as.closure = closure;
+            vm_push_value(vm, val, checked);
+            break;
+        }
+        case OP_LOAD_CAPTURE: {
+            vm_push_value(vm, vm->closure->captures[instruction.operand.as.integer], checked);
+            break;
+        }
+        case OP_RET: {
+            Value result = vm_pop(vm, checked);
+            if (checked && vm->frame_count <= 0) {
+                runtime_error("Return outside of a function!");
+            }
 
-                if (start.type != VAL_INTEGER || length.type != VAL_INTEGER) {
-                    runtime_error("Start and length of substring must be integers!");
-                }
+            PROBE_FUNCTION_RETURN(vm->frame_count);
 
-                if (start.as.integer < 0 || length.as.integer < 0) {
-                    runtime_error("Start and length of substring may not be negative!");
-                }
+            // Drop the arguments and locals, and the closure if there is one
+            CallFrame *frame = &vm->frames[--vm->frame_count];
+            vm->sp = vm->closure ? vm->fp - 1 : vm->fp;
+            vm->fp = frame->fp;
+            vm->closure = frame->closure;
+            vm->pc = frame->return_pc;
+            vm_push_value(vm, result, checked);
+            break;
+        }
+        case OP_MAKE_LIST: {
+            if (checked && instruction.operand.type != VAL_INTEGER) {
+                runtime_error("Make list operand must be an integer!");
+            }
+            int count = instruction.operand.as.integer;
+            
+            List *list = malloc(sizeof(List));
+            list->count = (size_t)count;
+            list->capacity = (size_t)count;
+            if (list->capacity < 8) {
+                list->capacity = 8;
+            }
+            list->elements = malloc(sizeof(Value) * list->capacity);
 
-                String *new = string_copy(s.as.string);
-                bool success = string_substr(new, (size_t)start.as.integer, (size_t)length.as.integer);
+            // Pop from stack in reverse order so that the first element ends up at the front of the list
+            for (size_t i = 0; i < list->count; i++) {
+                list->elements[list->count - 1 - i] = vm_pop(vm, checked);
+            }
 
-                if (!success) {
-                    runtime_error("String substring failed!");
-                }
+            // Add to allocated lists for cleanup later
+            vm_register_list(vm, list);
 
-                stack_push_string(vm, new);
+            // Push the list onto the stack
+            Value val;
+            val.type = VAL_LIST;
+            val.as.list = list;
+            vm_push_value(vm, val, checked);
 
-                break;
-            }
-            case OP_DISCARD: {
-                stack_pop(vm);
-                break;
+            break;
+        }
+        case OP_ADD: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot perform arithmetic on non-number!");
             }
-            case OP_DUP: {
-                Value a = stack_pop(vm);
-                if (a.type == VAL_STRING) {
-                    String *new = string_copy(a.as.string);
-                    stack_push_value(vm, a);
-                    stack_push_string(vm, new);
-                }
-                else {
-                    stack_push_value(vm, a);
-                    stack_push_value(vm, a);
-                }
-                break;
+            vm_quicken_binary(vm, a, b, OP_QADD_II, OP_QADD_FF);
+            
+            if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
+                vm_push_integer(vm, a.as.integer + b.as.integer, checked);
             }
-            case OP_SWAP: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+            else {
+                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
 
-                stack_push_value(vm, a);
-                stack_push_value(vm, b);
-                break;
+                vm_push_float(vm, anum + bnum, checked);
             }
-            case OP_EQ: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
+            break;
+        }
+        case OP_SUB: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot perform arithmetic on non-number!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QSUB_II, OP_QSUB_FF);
 
+            // second - first
+            if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
+                vm_push_integer(vm, b.as.integer - a.as.integer, checked); 
+            }
+            else {
                 double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
                 double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
 
-                stack_push_bool(vm, anum == bnum);
-                break;
+                vm_push_float(vm, bnum - anum, checked);
             }
-            case OP_NEQ: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
-
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
+            
+            break;
+        }
+        case OP_MUL: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot perform arithmetic on non-number!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QMUL_II, OP_QMUL_FF);
 
+            if (a.type == VAL_INTEGER && b.type == VAL_INTEGER) {
+                vm_push_integer(vm, a.as.integer * b.as.integer, checked);
+            }
+            else {
                 double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
                 double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
 
-                stack_push_bool(vm, anum != bnum);
-                break;
+                vm_push_float(vm, anum * bnum, checked);
+            }
+            break;
+        }
+        case OP_DIV: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) || 
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot perform arithmetic on non-number!");
             }
-            case OP_LT: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
-
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
 
-                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
 
-                stack_push_bool(vm, bnum < anum);
-                break;
+            if (fabs(bnum) < EPSILON) {
+                runtime_error("Division by 0!");
             }
-            case OP_LTE: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
+            // second / first
+            vm_push_float(vm, bnum / anum, checked);
+            
+            break;
+        }
+        case OP_MOD: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
 
-                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+            if (a.type != VAL_INTEGER || b.type != VAL_INTEGER) {
+                runtime_error("Cannot perform modulo on non-integer!");
+            }
 
-                stack_push_bool(vm, bnum <= anum);
-                break;
+            if (a.as.integer == 0) {
+                runtime_error("Modulo by 0!");
             }
-            case OP_GT: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
+            // second % first
+            vm_push_integer(vm, b.as.integer % a.as.integer, checked);
+            break;
+        }
+        case OP_LOGIC_AND: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
 
-                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+            if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
+                runtime_error("Cannot perform boolean algebra on non-boolean!");
+            }
 
-                stack_push_bool(vm, bnum > anum);
-                break;
+            vm_push_bool(vm, a.as.boolean && b.as.boolean, checked);
+            break;
+        }
+        case OP_LOGIC_OR: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
+                runtime_error("Cannot perform boolean algebra on non-boolean!");
             }
-            case OP_GTE: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
 
-                if (
-                    (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
-                    (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
-                ) {
-                    runtime_error("Cannot compare equality of non-numbers!");
-                }
+            vm_push_bool(vm, a.as.boolean || b.as.boolean, checked);
+            break;
+        }
+        case OP_LOGIC_NOT: {
+            Value a = vm_pop(vm, checked);
 
-                double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
-                double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+            if (a.type != VAL_BOOL) {
+                runtime_error("Cannot perform boolean algebra on non-boolean!");
+            }
 
-                stack_push_bool(vm, bnum >= anum);
-                break;
+            vm_push_bool(vm, !a.as.boolean, checked);
+            break;
+        }
+        case OP_PRINT: {
+            Value val = vm_pop(vm, checked);
+            switch (val.type) {
+                case VAL_INTEGER:
+                    printf("%d", val.as.integer);
+                    break;
+                case VAL_FLOAT:
+                    printf("%f", val.as.floating);
+                    break;
+                case VAL_BOOL:
+                    printf(val.as.boolean == true ? "true" : "false");
+                    break;
+                case VAL_STRING:
+                    printf("%s", val.as.string->data);
+                    break;
+                case VAL_LIST:
+                    print_list(val.as.list);
+                    break;
+                case VAL_CLOSURE:
+                    printf("<function>");
+                    break;
             }
-            case OP_STR_EQ: {
-                Value a = stack_pop(vm);
-                Value b = stack_pop(vm);
+            
+            // Push it back as a return value
+            vm_push_value(vm, val, checked);
 
-                if (a.type != VAL_STRING || b.type != VAL_STRING) {
-                    runtime_error("Tried to check string equivalence of non-strings!");
-                }
+            break;
+        }
+        case OP_PRINTLN: {
+            Value val = vm_pop(vm, checked);
+            switch (val.type) {
+                case VAL_INTEGER:
+                    printf("%d\n", val.as.integer);
+                    break;
+                case VAL_FLOAT:
+                    printf("%f\n", val.as.floating);
+                    break;
+                case VAL_BOOL:
+                    printf(val.as.boolean == true ? "true\n" : "false\n");
+                    break;
+                case VAL_STRING:
+                    printf("%s\n", val.as.string->data);
+                    break;
+                case VAL_LIST:
+                    print_list(val.as.list);
+                    printf("\n");
+                    break;
+                case VAL_CLOSURE:
+                    printf("<function>\n");
+                    break;
+            }
+            
+            // Push it back as a return value
+            vm_push_value(vm, val, checked);
 
-                bool equiv;
-                bool success = string_equal(a.as.string, b.as.string, &equiv);
+            break;
+        }
+        case OP_CONCATSTR: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
 
-                if (!success) {
-                    runtime_error("String equal failed! Strings were probably not initialized.");
-                }
+            if (a.type != VAL_STRING || b.type != VAL_STRING) {
+                runtime_error("Cannot concatenate non-strings!");
+            }
+            
+            String *new = vm_string_copy(vm, b.as.string);
+            bool success = string_append(new, a.as.string->data);
 
-                stack_push_bool(vm, equiv);
-                break;
+            if (!success) {
+                runtime_error("String append failed!");
             }
-            case OP_STRLEN: {
-                Value a = stack_pop(vm);
 
-                if (a.type != VAL_STRING) {
-                    runtime_error("Tried to get string length of non-string!");
-                }
+            vm_register_string(vm, new);
+            vm_push_string(vm, new, checked);
 
-                int len;
-                bool success = string_length(a.as.string, &len);
+            break;
+        }
+        case OP_SUBSTR: {
+            Value length = vm_pop(vm, checked);
+            Value start = vm_pop(vm, checked);
+            Value s = vm_pop(vm, checked);
 
-                if (!success) {
-                    runtime_error("String length failed! String was probably not initialized.");
-                }
+            if (s.type != VAL_STRING) {
+                runtime_error("Cannot take substring of non-string!");
+            }
 
-                stack_push_integer(vm, len);
-                break;
+            if (start.type != VAL_INTEGER || length.type != VAL_INTEGER) {
+                runtime_error("Start and length of substring must be integers!");
             }
-            case OP_JMP: {
-                Value a = stack_pop(vm);
 
-                if (a.type != VAL_INTEGER) {
-                    runtime_error("Cannot jump to non-integer address!");
-                }
-                if (a.as.integer < 0) {
-                    runtime_error("Cannot jump to negative address!");
-                }
+            if (start.as.integer < 0 || length.as.integer < 0) {
+                runtime_error("Start and length of substring may not be negative!");
+            }
 
-                // Jump there. Don't have to worry about PC increasing, since that happens at the
-                // beginning of the loop AFTER grabbing the instruction
-                vm->pc = a.as.integer;
-                break;
+            String *new = vm_string_copy(vm, s.as.string);
+            bool success = string_substr(new, (size_t)start.as.integer, (size_t)length.as.integer);
+
+            if (!success) {
+                runtime_error("String substring failed!");
             }
-            case OP_JMP_IF: {
-                Value a = stack_pop(vm);
-                Value condition = stack_pop(vm);
 
-                if (a.type != VAL_INTEGER) {
-                    runtime_error("Cannot jump to non-integer address!");
-                }
-                if (a.as.integer < 0) {
-                    runtime_error("Cannot jump to negative address!");
-                }
-                if (condition.type != VAL_BOOL) {
-                    runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
-                }
+            vm_register_string(vm, new);
+            vm_push_string(vm, new, checked);
 
-                if (condition.as.boolean) {
-                    vm->pc = a.as.integer;
-                }
-                break;
+            break;
+        }
+        case OP_DISCARD: {
+            vm_pop(vm, checked);
+            break;
+        }
+        case OP_DUP: {
+            Value a = vm_pop(vm, checked);
+            if (a.type == VAL_STRING) {
+                String *new = vm_string_copy(vm, a.as.string);
+                vm_register_string(vm, new);
+                vm_push_value(vm, a, checked);
+                vm_push_string(vm, new, checked);
+            }
+            else {
+                vm_push_value(vm, a, checked);
+                vm_push_value(vm, a, checked);
             }
-            case OP_JMP_IF_FALSE: {
-                Value a = stack_pop(vm);
-                Value condition = stack_pop(vm);
+            break;
+        }
+        case OP_SWAP: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
 
-                if (a.type != VAL_INTEGER) {
-                    runtime_error("Cannot jump to non-integer address!");
-                }
-                if (a.as.integer < 0) {
-                    runtime_error("Cannot jump to negative address!");
-                }
-                if (condition.type != VAL_BOOL) {
-                    runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
-                }
+            vm_push_value(vm, a, checked);
+            vm_push_value(vm, b, checked);
+            break;
+        }
+        case OP_EQ: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QEQ_II, OP_QEQ_FF);
 
-                if (!condition.as.boolean) {
-                    vm->pc = a.as.integer;
-                }
-                break;
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+
+            vm_push_bool(vm, anum == bnum, checked);
+            break;
+        }
+        case OP_NEQ: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
             }
-            case OP_INT2FLOAT: {
-                Value a = stack_pop(vm);
+            vm_quicken_binary(vm, a, b, OP_QNEQ_II, OP_QNEQ_FF);
 
-                if (a.type == VAL_FLOAT) {
-                    stack_push_float(vm, a.as.floating);
-                }
-                else if (a.type == VAL_INTEGER) {
-                    stack_push_float(vm, (double)a.as.integer);
-                }
-                else {
-                    runtime_error("Cannot convert non-number to float!");
-                }
-                
-                break;
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+
+            vm_push_bool(vm, anum != bnum, checked);
+            break;
+        }
+        case OP_LT: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QLT_II, OP_QLT_FF);
+
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+
+            vm_push_bool(vm, bnum < anum, checked);
+            break;
+        }
+        case OP_LTE: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QLTE_II, OP_QLTE_FF);
+
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+
+            vm_push_bool(vm, bnum <= anum, checked);
+            break;
+        }
+        case OP_GT: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
             }
-            case OP_FLOAT2INT: {
-                Value a = stack_pop(vm);
+            vm_quicken_binary(vm, a, b, OP_QGT_II, OP_QGT_FF);
+
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
 
-                if (a.type == VAL_INTEGER) {
-                    stack_push_integer(vm, a.as.integer);
+            vm_push_bool(vm, bnum > anum, checked);
+            break;
+        }
+        case OP_GTE: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (
+                (a.type != VAL_INTEGER && a.type != VAL_FLOAT) ||
+                (b.type != VAL_INTEGER && b.type != VAL_FLOAT)
+            ) {
+                runtime_error("Cannot compare equality of non-numbers!");
+            }
+            vm_quicken_binary(vm, a, b, OP_QGTE_II, OP_QGTE_FF);
+
+            double anum = (a.type == VAL_INTEGER) ? (double)a.as.integer : a.as.floating;
+            double bnum = (b.type == VAL_INTEGER) ? (double)b.as.integer : b.as.floating;
+
+            vm_push_bool(vm, bnum >= anum, checked);
+            break;
+        }
+        case OP_STR_EQ: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+
+            if (a.type != VAL_STRING || b.type != VAL_STRING) {
+                runtime_error("Tried to check string equivalence of non-strings!");
+            }
+
+            bool equiv;
+            bool success = string_equal(a.as.string, b.as.string, &equiv);
+
+            if (!success) {
+                runtime_error("String equal failed! Strings were probably not initialized.");
+            }
+
+            vm_push_bool(vm, equiv, checked);
+            break;
+        }
+        case OP_STRLEN: {
+            Value a = vm_pop(vm, checked);
+
+            if (a.type != VAL_STRING) {
+                runtime_error("Tried to get string length of non-string!");
+            }
+
+            int len;
+            bool success = string_length(a.as.string, &len);
+
+            if (!success) {
+                runtime_error("String length failed! String was probably not initialized.");
+            }
+
+            vm_push_integer(vm, len, checked);
+            break;
+        }
+        case OP_JMP: {
+            Value a = vm_pop(vm, checked);
+
+            // Verified code only jumps to addresses pushed as constants, which the verifier checked
+            if (checked && a.type != VAL_INTEGER) {
+                runtime_error("Cannot jump to non-integer address!");
+            }
+            if (checked && a.as.integer < 0) {
+                runtime_error("Cannot jump to negative address!");
+            }
+
+            // Jump there. Don't have to worry about PC increasing, since that happens at the
+            // beginning of the loop AFTER grabbing the instruction
+            int from = vm->pc - 1;
+            vm->pc = a.as.integer;
+
+            // Backward jumps close loops, which the tracing JIT counts to find hot ones
+            if (vm->pc <= from) {
+                vm_safe_point(vm);
+                if (!checked && vm->trace) {
+                    trace_backedge(vm);
                 }
-                else if (a.type == VAL_FLOAT) {
-                    if ((INT_MIN <= a.as.floating) && (a.as.floating <= INT_MAX)) {
-                        stack_push_integer(vm, (int)a.as.floating);
-                    }
-                    else {
-                        runtime_error("This float is too big for integer conversion!");
-                    }
+            }
+            break;
+        }
+        case OP_JMP_IF: {
+            Value a = vm_pop(vm, checked);
+            Value condition = vm_pop(vm, checked);
+
+            if (checked && a.type != VAL_INTEGER) {
+                runtime_error("Cannot jump to non-integer address!");
+            }
+            if (checked && a.as.integer < 0) {
+                runtime_error("Cannot jump to negative address!");
+            }
+            if (condition.type != VAL_BOOL) {
+                runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
+            }
+
+            if (condition.as.boolean) {
+                vm->pc = a.as.integer;
+            }
+            break;
+        }
+        case OP_JMP_IF_FALSE: {
+            Value a = vm_pop(vm, checked);
+            Value condition = vm_pop(vm, checked);
+
+            if (checked && a.type != VAL_INTEGER) {
+                runtime_error("Cannot jump to non-integer address!");
+            }
+            if (checked && a.as.integer < 0) {
+                runtime_error("Cannot jump to negative address!");
+            }
+            if (condition.type != VAL_BOOL) {
+                runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
+            }
+
+            if (!condition.as.boolean) {
+                vm->pc = a.as.integer;
+            }
+            break;
+        }
+        case OP_INT2FLOAT: {
+            Value a = vm_pop(vm, checked);
+
+            if (a.type == VAL_FLOAT) {
+                vm_push_float(vm, a.as.floating, checked);
+            }
+            else if (a.type == VAL_INTEGER) {
+                vm_push_float(vm, (double)a.as.integer, checked);
+            }
+            else {
+                runtime_error("Cannot convert non-number to float!");
+            }
+            
+            break;
+        }
+        case OP_FLOAT2INT: {
+            Value a = vm_pop(vm, checked);
+
+            if (a.type == VAL_INTEGER) {
+                vm_push_integer(vm, a.as.integer, checked);
+            }
+            else if (a.type == VAL_FLOAT) {
+                if ((INT_MIN <= a.as.floating) && (a.as.floating <= INT_MAX)) {
+                    vm_push_integer(vm, (int)a.as.floating, checked);
                 }
                 else {
-                    runtime_error("Cannot convert non-number to integer!");
+                    runtime_error("This float is too big for integer conversion!");
                 }
-                break;
             }
-            case OP_LIST_APPEND: {
-                Value source_list = stack_pop(vm);
-                Value the_val = stack_pop(vm);
+            else {
+                runtime_error("Cannot convert non-number to integer!");
+            }
+            break;
+        }
+        case OP_LIST_APPEND: {
+            Value source_list = vm_pop(vm, checked);
+            Value the_val = vm_pop(vm, checked);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot append to non-list!");
-                }
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot append to non-list!");
+            }
+
+            List *new_list = vm_list_copy(vm, source_list.as.list);
 
-                List *new_list = list_copy(source_list.as.list);
-                vm_register_list(vm, new_list);
-
-                // Grow new list if needed
-                if (new_list->count + 1 >= new_list->capacity) {
-                    new_list->capacity *= 2;
-                    Value *tmp = realloc(new_list->elements, sizeof(Value) * new_list->capacity);
-                    if (!tmp) {
-                        runtime_error("Unable to allocate space for list append!");
-                    }
-                    new_list->elements = tmp;
+            // Grow new list if needed
+            if (new_list->count + 1 >= new_list->capacity) {
+                new_list->capacity *= 2;
+                Value *tmp = realloc(new_list->elements, sizeof(Value) * new_list->capacity);
+                if (!tmp) {
+                    runtime_error("Unable to allocate space for list append!");
                 }
+                new_list->elements = tmp;
+            }
 
-                // Add value to end of new list
-                new_list->elements[new_list->count] = the_val;
-                new_list->count++;
+            // Add value to end of new list
+            new_list->elements[new_list->count] = the_val;
+            new_list->count++;
+            vm_register_list(vm, new_list);
 
-                // Push the new list onto the stack
-                Value val;
-                val.type = VAL_LIST;
-                val.as.list = new_list;
-                stack_push_value(vm, val);
+            // Push the new list onto the stack
+            Value val;
+            val.type = VAL_LIST;
+            val.as.list = new_list;
+            vm_push_value(vm, val, checked);
 
-                break;
+            break;
+        }
+        case OP_LIST_SUBLIST: {
+            Value length_val = vm_pop(vm, checked);
+            Value start_val = vm_pop(vm, checked);
+            Value source_list = vm_pop(vm, checked);
+
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot take sublist of non-list!");
+            }
+            if (start_val.type != VAL_INTEGER || length_val.type != VAL_INTEGER) {
+                runtime_error("Start and length of sublist must be integers!");
+            }
+            if (start_val.as.integer < 0 || length_val.as.integer < 0) {
+                runtime_error("Start and length of sublist may not be negative!");
+            }
+            if ((size_t)start_val.as.integer >= source_list.as.list->count) {
+                runtime_error("Sublist start index out of bounds!");
+            }
+            if ((size_t)(start_val.as.integer + length_val.as.integer) > source_list.as.list->count) {
+                runtime_error("Sublist length goes out of bounds!");
             }
-            case OP_LIST_SUBLIST: {
-                Value length_val = stack_pop(vm);
-                Value start_val = stack_pop(vm);
-                Value source_list = stack_pop(vm);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot take sublist of non-list!");
-                }
-                if (start_val.type != VAL_INTEGER || length_val.type != VAL_INTEGER) {
-                    runtime_error("Start and length of sublist must be integers!");
-                }
-                if (start_val.as.integer < 0 || length_val.as.integer < 0) {
-                    runtime_error("Start and length of sublist may not be negative!");
-                }
-                if ((size_t)start_val.as.integer >= source_list.as.list->count) {
-                    runtime_error("Sublist start index out of bounds!");
-                }
-                if ((size_t)(start_val.as.integer + length_val.as.integer) > source_list.as.list->count) {
-                    runtime_error("Sublist length goes out of bounds!");
-                }
+            List *new_list = vm_list_copy(vm, source_list.as.list);
+            vm_register_list(vm, new_list);
+            new_list->count = (size_t)length_val.as.integer;
+            for (size_t i = 0; i < new_list->count; i++) {
+                new_list->elements[i] = source_list.as.list->elements[(size_t)start_val.as.integer + i];
+            }
 
-                List *new_list = list_copy(source_list.as.list);
-                vm_register_list(vm, new_list);
-                new_list->count = (size_t)length_val.as.integer;
-                for (size_t i = 0; i < new_list->count; i++) {
-                    new_list->elements[i] = source_list.as.list->elements[(size_t)start_val.as.integer + i];
-                }
+            // Push the new list onto the stack
+            Value val;
+            val.type = VAL_LIST;
+            val.as.list = new_list;
+            vm_push_value(vm, val, checked);
 
-                // Push the new list onto the stack
-                Value val;
-                val.type = VAL_LIST;
-                val.as.list = new_list;
-                stack_push_value(vm, val);
+            break;
+        }
+        case OP_LIST_REMOVE: {
+            Value index_val = vm_pop(vm, checked);
+            Value source_list = vm_pop(vm, checked);
 
-                break;
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot remove from non-list!");
+            }
+            if (index_val.type != VAL_INTEGER) {
+                runtime_error("Index of list element to remove must be an integer!");
+            }
+            if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
+                runtime_error("Index of list element to remove is out of bounds!");
             }
-            case OP_LIST_REMOVE: {
-                Value index_val = stack_pop(vm);
-                Value source_list = stack_pop(vm);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot remove from non-list!");
-                }
-                if (index_val.type != VAL_INTEGER) {
-                    runtime_error("Index of list element to remove must be an integer!");
+            List *new_list = vm_list_copy(vm, source_list.as.list);
+            vm_register_list(vm, new_list);
+            size_t index = (size_t)index_val.as.integer;
+            for (size_t i = 0; i < source_list.as.list->count; i++) {
+                if (i < index) {
+                    new_list->elements[i] = source_list.as.list->elements[i];
                 }
-                if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
-                    runtime_error("Index of list element to remove is out of bounds!");
+                else if (i > index) {
+                    new_list->elements[i - 1] = source_list.as.list->elements[i];
                 }
+            }
+            new_list->count--;
 
-                List *new_list = list_copy(source_list.as.list);
-                vm_register_list(vm, new_list);
-                size_t index = (size_t)index_val.as.integer;
-                for (size_t i = 0; i < source_list.as.list->count; i++) {
-                    if (i < index) {
-                        new_list->elements[i] = source_list.as.list->elements[i];
-                    }
-                    else if (i > index) {
-                        new_list->elements[i - 1] = source_list.as.list->elements[i];
-                    }
-                }
-                new_list->count--;
+            // Push the new list onto the stack
+            Value val;
+            val.type = VAL_LIST;
+            val.as.list = new_list;
+            vm_push_value(vm, val, checked);
 
-                // Push the new list onto the stack
-                Value val;
-                val.type = VAL_LIST;
-                val.as.list = new_list;
-                stack_push_value(vm, val);
+            break;
+        }
+        case OP_LIST_SET: {
+            Value the_val = vm_pop(vm, checked);
+            Value index_val = vm_pop(vm, checked);
+            Value source_list = vm_pop(vm, checked);
 
-                break;
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot list-set element of non-list!");
+            }
+            if (index_val.type != VAL_INTEGER) {
+                runtime_error("Index of list element to set must be an integer!");
+            }
+            if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
+                runtime_error("Index of list element to set is out of bounds!");
             }
-            case OP_LIST_SET: {
-                Value the_val = stack_pop(vm);
-                Value index_val = stack_pop(vm);
-                Value source_list = stack_pop(vm);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot list-set element of non-list!");
-                }
-                if (index_val.type != VAL_INTEGER) {
-                    runtime_error("Index of list element to set must be an integer!");
-                }
-                if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
-                    runtime_error("Index of list element to set is out of bounds!");
-                }
+            List *new_list = vm_list_copy(vm, source_list.as.list);
+            vm_register_list(vm, new_list);
+            new_list->elements[(size_t)index_val.as.integer] = the_val;
 
-                List *new_list = list_copy(source_list.as.list);
-                vm_register_list(vm, new_list);
-                new_list->elements[(size_t)index_val.as.integer] = the_val;
+            // Push the new list onto the stack
+            Value val;
+            val.type = VAL_LIST;
+            val.as.list = new_list;
+            vm_push_value(vm, val, checked);
 
-                // Push the new list onto the stack
-                Value val;
-                val.type = VAL_LIST;
-                val.as.list = new_list;
-                stack_push_value(vm, val);
+            break;
+        }
+        case OP_LIST_GET: {
+            Value index_val = vm_pop(vm, checked);
+            Value source_list = vm_pop(vm, checked);
 
-                break;
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot list-get element of non-list!");
+            }
+            if (index_val.type != VAL_INTEGER) {
+                runtime_error("Index of list element to get must be an integer!");
+            }
+            vm_quicken(vm, OP_QLIST_GET);
+            if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
+                runtime_error("Index of list element to get is out of bounds!");
             }
-            case OP_LIST_GET: {
-                Value index_val = stack_pop(vm);
-                Value source_list = stack_pop(vm);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot list-get element of non-list!");
-                }
-                if (index_val.type != VAL_INTEGER) {
-                    runtime_error("Index of list element to get must be an integer!");
-                }
-                if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
-                    runtime_error("Index of list element to get is out of bounds!");
-                }
+            Value val = source_list.as.list->elements[(size_t)index_val.as.integer];
+            vm_push_value(vm, val, checked);
+
+            break;
+        }
+        case OP_LIST_LEN: {
+            Value source_list = vm_pop(vm, checked);
 
-                Value val = source_list.as.list->elements[(size_t)index_val.as.integer];
-                stack_push_value(vm, val);
+            if (source_list.type != VAL_LIST) {
+                runtime_error("Cannot get length of non-list!");
+            }
+
+            int len = (int)source_list.as.list->count;
+            vm_push_integer(vm, len, checked);
+
+            break;
+        }
+        case OP_HEAP_SNAPSHOT: {
+            Value path = vm_pop(vm, checked);
+
+            if (path.type != VAL_STRING) {
+                runtime_error("Heap snapshot path must be a string!");
+            }
+
+            vm_push_bool(vm, heap_snapshot_write(vm, path.as.string->data), checked);
 
+            break;
+        }
+        case OP_ADD_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_integer(vm, b.as.integer + a.as.integer, checked);
+            break;
+        }
+        case OP_ADD_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_float(vm, b.as.floating + a.as.floating, checked);
+            break;
+        }
+        case OP_SUB_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_integer(vm, b.as.integer - a.as.integer, checked);
+            break;
+        }
+        case OP_SUB_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_float(vm, b.as.floating - a.as.floating, checked);
+            break;
+        }
+        case OP_MUL_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_integer(vm, b.as.integer * a.as.integer, checked);
+            break;
+        }
+        case OP_MUL_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_float(vm, b.as.floating * a.as.floating, checked);
+            break;
+        }
+        case OP_EQ_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer == a.as.integer, checked);
+            break;
+        }
+        case OP_EQ_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating == a.as.floating, checked);
+            break;
+        }
+        case OP_NEQ_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer != a.as.integer, checked);
+            break;
+        }
+        case OP_NEQ_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating != a.as.floating, checked);
+            break;
+        }
+        case OP_LT_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer < a.as.integer, checked);
+            break;
+        }
+        case OP_LT_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating < a.as.floating, checked);
+            break;
+        }
+        case OP_LTE_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer <= a.as.integer, checked);
+            break;
+        }
+        case OP_LTE_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating <= a.as.floating, checked);
+            break;
+        }
+        case OP_GT_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer > a.as.integer, checked);
+            break;
+        }
+        case OP_GT_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating > a.as.floating, checked);
+            break;
+        }
+        case OP_GTE_II: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.integer >= a.as.integer, checked);
+            break;
+        }
+        case OP_GTE_FF: {
+            Value a = vm_pop(vm, checked);
+            Value b = vm_pop(vm, checked);
+            vm_push_bool(vm, b.as.floating >= a.as.floating, checked);
+            break;
+        }
+        case OP_QADD_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_ADD);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->integer = b->integer + value_array_payload(vm->stack, vm->sp - 1)->integer;
+            vm->sp--;
+            break;
+        }
+        case OP_QADD_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_ADD);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->floating = b->floating + value_array_payload(vm->stack, vm->sp - 1)->floating;
+            vm->sp--;
+            break;
+        }
+        case OP_QSUB_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_SUB);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->integer = b->integer - value_array_payload(vm->stack, vm->sp - 1)->integer;
+            vm->sp--;
+            break;
+        }
+        case OP_QSUB_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_SUB);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->floating = b->floating - value_array_payload(vm->stack, vm->sp - 1)->floating;
+            vm->sp--;
+            break;
+        }
+        case OP_QMUL_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_MUL);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->integer = b->integer * value_array_payload(vm->stack, vm->sp - 1)->integer;
+            vm->sp--;
+            break;
+        }
+        case OP_QMUL_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_MUL);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            b->floating = b->floating * value_array_payload(vm->stack, vm->sp - 1)->floating;
+            vm->sp--;
+            break;
+        }
+        case OP_QEQ_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_EQ);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer == value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QEQ_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_EQ);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating == value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QNEQ_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_NEQ);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer != value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QNEQ_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_NEQ);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating != value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QLT_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_LT);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer < value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QLT_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_LT);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating < value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QLTE_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_LTE);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer <= value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QLTE_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_LTE);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating <= value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QGT_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_GT);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer > value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QGT_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_GT);
                 break;
             }
-            case OP_LIST_LEN: {
-                Value source_list = stack_pop(vm);
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating > value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QGTE_II: {
+            if (!vm_top_two_are(vm, VAL_INTEGER)) {
+                vm_deoptimize(vm, OP_GTE);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->integer >= value_array_payload(vm->stack, vm->sp - 1)->integer;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QGTE_FF: {
+            if (!vm_top_two_are(vm, VAL_FLOAT)) {
+                vm_deoptimize(vm, OP_GTE);
+                break;
+            }
+            ValuePayload *b = value_array_payload(vm->stack, vm->sp - 2);
+            bool result = b->floating >= value_array_payload(vm->stack, vm->sp - 1)->floating;
+            value_array_set_type(vm->stack, vm->sp - 2, VAL_BOOL);
+            b->boolean = result;
+            vm->sp--;
+            break;
+        }
+        case OP_QLIST_GET: {
+            if (
+                vm->sp < 2 ||
+                value_array_type(vm->stack, vm->sp - 2) != VAL_LIST ||
+                value_array_type(vm->stack, vm->sp - 1) != VAL_INTEGER
+            ) {
+                vm_deoptimize(vm, OP_LIST_GET);
+                break;
+            }
+            Value index_val = vm_pop(vm, checked);
+            Value source_list = vm_pop(vm, checked);
 
-                if (source_list.type != VAL_LIST) {
-                    runtime_error("Cannot get length of non-list!");
-                }
+            if (index_val.as.integer < 0 || (size_t)index_val.as.integer >= source_list.as.list->count) {
+                runtime_error("Index of list element to get is out of bounds!");
+            }
+
+            vm_push_value(vm, source_list.as.list->elements[(size_t)index_val.as.integer], checked);
+            break;
+        }
+        case OP_HALT: {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The interpreter loop. vm_execute inlines it twice: with checked set, and without for
+// code the verifier has proven safe, where the stack and bounds checks compile away.
+VM_INLINE void vm_run(VM *vm, const bool checked) {
+    unsigned long dispatches = 0; // Kept in a register, so counting costs next to nothing
+    while (true) {
+        dispatches++;
+        // Get the current instruction and increment the PC
+        Instruction instruction = code_get_next(vm);
+
+        if (!vm_step(vm, instruction, checked)) {
+            vm->stats.dispatches += dispatches;
+            return;
+        }
+    }
+}
+
+bool vm_step_verified(VM *vm, Instruction *instruction) {
+    // Callers write the stack pointer back first, so this is a safe point for the compiled paths
+    vm_safe_point(vm);
+    return vm_step(vm, *instruction, false);
+}
+
+// Top-of-stack caching for verified code. vm_run_cached keeps up to two of the topmost
+// stack values in locals, which the compiler keeps in registers, so the intermediate
+// results of expressions don't go through memory (or vm->sp) on every push and pop.
+// The number of values cached is the cache state, and each handler below takes it as a
+// constant so vm_run_cached can dispatch on the state and opcode together, running a
+// copy of the handler specialized for that state.
+typedef struct {
+    // The cached values are kept as their type and the raw bits of their payload: the compiler
+    // only keeps a union in registers if it's always accessed as the same member
+    ValueType top_type; // The top of the stack, if state >= 1
+    uint64_t top_bits;
+    ValueType second_type; // The value under it, if state == 2
+    uint64_t second_bits;
+    int state; // Number of values cached
+    ValueArray stack; // vm->stack, with the values that aren't cached
+    int sp; // Number of values in stack; the logical stack pointer is sp + state
+    int fp; // vm->fp
+} TosCache;
+
+VM_INLINE uint64_t tos_bits(Value value) {
+    uint64_t bits;
+    memcpy(&bits, &value.as, sizeof(bits));
+    return bits;
+}
+
+VM_INLINE Value tos_value(ValueType type, uint64_t bits) {
+    Value value;
+    value.type = type;
+    memcpy(&value.as, &bits, sizeof(bits));
+    return value;
+}
+
+VM_INLINE Value tos_top(TosCache *c) {
+    return tos_value(c->top_type, c->top_bits);
+}
+
+VM_INLINE Value tos_second(TosCache *c) {
+    return tos_value(c->second_type, c->second_bits);
+}
+
+VM_INLINE void tos_set_top(TosCache *c, Value value) {
+    c->top_type = value.type;
+    c->top_bits = tos_bits(value);
+}
+
+VM_INLINE void tos_set_second(TosCache *c, Value value) {
+    c->second_type = value.type;
+    c->second_bits = tos_bits(value);
+}
+
+// Writes the cached values back to the stack
+VM_INLINE void tos_flush(TosCache *c, const int state) {
+    if (state == 2) {
+        value_array_set(c->stack, c->sp++, tos_second(c));
+    }
+    if (state >= 1) {
+        value_array_set(c->stack, c->sp++, tos_top(c));
+    }
+    c->state = 0;
+}
+
+// Pushes a value, spilling the older cached value if both are taken
+VM_INLINE void tos_push(TosCache *c, Value value, const int state) {
+    if (state == 2) {
+        value_array_set(c->stack, c->sp++, tos_second(c));
+    }
+    if (state >= 1) {
+        c->second_type = c->top_type;
+        c->second_bits = c->top_bits;
+    }
+    tos_set_top(c, value);
+    c->state = state == 2 ? 2 : state + 1;
+}
 
-                int len = (int)source_list.as.list->count;
-                stack_push_integer(vm, len);
+VM_INLINE Value tos_pop(TosCache *c, const int state) {
+    if (state == 0) {
+        return value_array_get(c->stack, --c->sp);
+    }
+    Value value = tos_top(c);
+    if (state == 2) {
+        c->top_type = c->second_type;
+        c->top_bits = c->second_bits;
+    }
+    c->state = state - 1;
+    return value;
+}
+
+// Returns the value depth places below the top of the stack (0 is the top)
+VM_INLINE Value tos_peek(TosCache *c, int depth, const int state) {
+    if (depth < state) {
+        return depth == 0 ? tos_top(c) : tos_second(c);
+    }
+    return value_array_get(c->stack, c->sp - 1 - (depth - state));
+}
+
+// Frame slots live in the stack, so the newest locals of a let can still be in the cache
+VM_INLINE Value tos_load_slot(TosCache *c, int index, const int state) {
+    if (state == 0 || index < c->sp) {
+        return value_array_get(c->stack, index);
+    }
+    if (state == 2 && index == c->sp) {
+        return tos_second(c);
+    }
+    return tos_top(c);
+}
+
+VM_INLINE void tos_store_slot(TosCache *c, int index, Value value, const int state) {
+    if (state == 0 || index < c->sp) {
+        value_array_set(c->stack, index, value);
+    }
+    else if (state == 2 && index == c->sp) {
+        tos_set_second(c, value);
+    }
+    else {
+        tos_set_top(c, value);
+    }
+}
+
+VM_INLINE void tos_slide(TosCache *c, int n, const int state) {
+    Value top = tos_pop(c, state);
+
+    // At most one value is left in the cache; drop it first
+    if (state == 2 && n > 0) {
+        c->state = 0;
+        n--;
+    }
+    c->sp -= n;
+    if (c->state == 1) {
+        tos_push(c, top, 1);
+    }
+    else {
+        tos_push(c, top, 0);
+    }
+}
+
+// A binary number operation on operands of the given type: one of the specialized forms,
+// or with guarded set, a quickened form, which deoptimizes if the operands differ
+VM_INLINE void tos_binary(VM *vm, TosCache *c, const OpCode generic, const ValueType type,
+        const bool guarded, const int state) {
+    if (guarded && (tos_peek(c, 0, state).type != type || tos_peek(c, 1, state).type != type)) {
+        tos_flush(c, state);
+        vm_deoptimize(vm, generic);
+        return;
+    }
+    Value a = tos_pop(c, state);
+    Value b = tos_pop(c, state > 0 ? state - 1 : 0);
+
+    // second op first, like the stack handlers
+    Value result;
+    if (type == VAL_INTEGER) {
+        int x = b.as.integer;
+        int y = a.as.integer;
+        switch (generic) {
+            case OP_ADD: result = (Value){.type = VAL_INTEGER, .as.integer = x + y}; break;
+            case OP_SUB: result = (Value){.type = VAL_INTEGER, .as.integer = x - y}; break;
+            case OP_MUL: result = (Value){.type = VAL_INTEGER, .as.integer = x * y}; break;
+            case OP_EQ:  result = (Value){.type = VAL_BOOL, .as.boolean = x == y}; break;
+            case OP_NEQ: result = (Value){.type = VAL_BOOL, .as.boolean = x != y}; break;
+            case OP_LT:  result = (Value){.type = VAL_BOOL, .as.boolean = x < y}; break;
+            case OP_LTE: result = (Value){.type = VAL_BOOL, .as.boolean = x <= y}; break;
+            case OP_GT:  result = (Value){.type = VAL_BOOL, .as.boolean = x > y}; break;
+            default:     result = (Value){.type = VAL_BOOL, .as.boolean = x >= y}; break;
+        }
+    }
+    else {
+        double x = b.as.floating;
+        double y = a.as.floating;
+        switch (generic) {
+            case OP_ADD: result = (Value){.type = VAL_FLOAT, .as.floating = x + y}; break;
+            case OP_SUB: result = (Value){.type = VAL_FLOAT, .as.floating = x - y}; break;
+            case OP_MUL: result = (Value){.type = VAL_FLOAT, .as.floating = x * y}; break;
+            case OP_EQ:  result = (Value){.type = VAL_BOOL, .as.boolean = x == y}; break;
+            case OP_NEQ: result = (Value){.type = VAL_BOOL, .as.boolean = x != y}; break;
+            case OP_LT:  result = (Value){.type = VAL_BOOL, .as.boolean = x < y}; break;
+            case OP_LTE: result = (Value){.type = VAL_BOOL, .as.boolean = x <= y}; break;
+            case OP_GT:  result = (Value){.type = VAL_BOOL, .as.boolean = x > y}; break;
+            default:     result = (Value){.type = VAL_BOOL, .as.boolean = x >= y}; break;
+        }
+    }
+    tos_push(c, result, 0);
+}
+
+// Jumps to the popped address. Loops come back through here without leaving the cache, so
+// this writes the cache back for a heap snapshot that was asked for.
+VM_INLINE void tos_jump(VM *vm, TosCache *c, const int state) {
+    vm->pc = tos_pop(c, state).as.integer;
+    if (vm->snapshot_requested) {
+        tos_flush(c, c->state);
+        vm->sp = c->sp;
+        heap_snapshot_take_requested(vm);
+    }
+}
+
+VM_INLINE void tos_jump_if(VM *vm, TosCache *c, const bool when, const int state) {
+    Value a = tos_pop(c, state);
+    Value condition = tos_pop(c, state > 0 ? state - 1 : 0);
+    if (condition.type != VAL_BOOL) {
+        runtime_error("Conditional jump failed: wrong condition type (should be boolean)");
+    }
+    if (condition.as.boolean == when) {
+        vm->pc = a.as.integer;
+    }
+}
 
+// Expands a handler once per cache state, with S set to the state.
+// Opcodes fit in 8 bits, so the state goes above them.
+#define TOS_CASES(op, handler) \
+    case (0 << 8) | (op): { const int S = 0; handler; break; } \
+    case (1 << 8) | (op): { const int S = 1; handler; break; } \
+    case (2 << 8) | (op): { const int S = 2; handler; break; }
+
+#define TOS_BINARY_CASES(generic, integers, floats, quick_integers, quick_floats) \
+    TOS_CASES(integers, tos_binary(vm, &c, generic, VAL_INTEGER, false, S)) \
+    TOS_CASES(floats, tos_binary(vm, &c, generic, VAL_FLOAT, false, S)) \
+    TOS_CASES(quick_integers, tos_binary(vm, &c, generic, VAL_INTEGER, true, S)) \
+    TOS_CASES(quick_floats, tos_binary(vm, &c, generic, VAL_FLOAT, true, S))
+
+// The interpreter loop for verified code, with top-of-stack caching. Loads, stores,
+// specialized and quickened arithmetic and jumps run on the cache; everything else
+// flushes it and runs through vm_step_verified, out of line so the cache keeps its registers.
+static void vm_run_cached(VM *vm) {
+    TosCache c = {.state = 0, .stack = vm->stack, .sp = vm->sp, .fp = vm->fp};
+    unsigned long dispatches = 0;
+    while (true) {
+        dispatches++;
+        Instruction *instruction = &vm->code[vm->pc++];
+        int operand = instruction->operand.as.integer;
+
+        switch ((c.state << 8) | instruction->opCode) {
+            TOS_CASES(OP_PUSH, tos_push(&c, instruction->operand, S))
+            TOS_CASES(OP_LOAD_VAR, tos_push(&c, vm_globals_get(vm, operand), S))
+            TOS_CASES(OP_STORE_VAR, vm_globals_set(vm, operand, tos_peek(&c, 0, S)))
+            TOS_CASES(OP_LOAD_LOCAL, tos_push(&c, tos_load_slot(&c, c.fp + operand, S), S))
+            TOS_CASES(OP_STORE_LOCAL, tos_store_slot(&c, c.fp + operand, tos_peek(&c, 0, S), S))
+            TOS_CASES(OP_LOAD_CAPTURE, tos_push(&c, vm->closure->captures[operand], S))
+            TOS_CASES(OP_SLIDE, tos_slide(&c, operand, S))
+            TOS_CASES(OP_DISCARD, tos_pop(&c, S))
+            TOS_CASES(OP_JMP, tos_jump(vm, &c, S))
+            TOS_CASES(OP_JMP_IF, tos_jump_if(vm, &c, true, S))
+            TOS_CASES(OP_JMP_IF_FALSE, tos_jump_if(vm, &c, false, S))
+            TOS_BINARY_CASES(OP_ADD, OP_ADD_II, OP_ADD_FF, OP_QADD_II, OP_QADD_FF)
+            TOS_BINARY_CASES(OP_SUB, OP_SUB_II, OP_SUB_FF, OP_QSUB_II, OP_QSUB_FF)
+            TOS_BINARY_CASES(OP_MUL, OP_MUL_II, OP_MUL_FF, OP_QMUL_II, OP_QMUL_FF)
+            TOS_BINARY_CASES(OP_EQ, OP_EQ_II, OP_EQ_FF, OP_QEQ_II, OP_QEQ_FF)
+            TOS_BINARY_CASES(OP_NEQ, OP_NEQ_II, OP_NEQ_FF, OP_QNEQ_II, OP_QNEQ_FF)
+            TOS_BINARY_CASES(OP_LT, OP_LT_II, OP_LT_FF, OP_QLT_II, OP_QLT_FF)
+            TOS_BINARY_CASES(OP_LTE, OP_LTE_II, OP_LTE_FF, OP_QLTE_II, OP_QLTE_FF)
+            TOS_BINARY_CASES(OP_GT, OP_GT_II, OP_GT_FF, OP_QGT_II, OP_QGT_FF)
+            TOS_BINARY_CASES(OP_GTE, OP_GTE_II, OP_GTE_FF, OP_QGTE_II, OP_QGTE_FF)
+            default: {
+                tos_flush(&c, c.state);
+                vm->sp = c.sp;
+                if (!vm_step_verified(vm, instruction)) {
+                    vm->stats.dispatches += dispatches;
+                    return;
+                }
+                // Calls and returns move the frame
+                c.stack = vm->stack;
+                c.sp = vm->sp;
+                c.fp = vm->fp;
                 break;
             }
-            case OP_HALT: {
+        }
+    }
+}
+
+// Formats a value the way the debugger shows it, cutting it off if it doesn't fit
+static void vm_debug_format_value(char *buf, size_t size, Value value) {
+    switch (value.type) {
+        case VAL_INTEGER:
+            snprintf(buf, size, "%d", value.as.integer);
+            break;
+        case VAL_FLOAT:
+            snprintf(buf, size, "%g", value.as.floating);
+            break;
+        case VAL_BOOL:
+            snprintf(buf, size, "%s", value.as.boolean ? "true" : "false");
+            break;
+        case VAL_STRING:
+            snprintf(buf, size, "\"%s\"", value.as.string->data);
+            break;
+        case VAL_LIST:
+            snprintf(buf, size, "<list of %zu>", value.as.list->count);
+            break;
+        case VAL_CLOSURE:
+            snprintf(buf, size, "<function>");
+            break;
+    }
+}
+
+void vm_debug_print(VM *vm, FILE *out) {
+    Instruction insn = vm->code[vm->pc];
+
+    // Only the opcodes before OP_ADD have operands
+    char operand[DEBUG_VALUE_WIDTH] = "";
+    if (insn.opCode == OP_PUSH) {
+        vm_debug_format_value(operand, sizeof(operand), insn.operand);
+    }
+    else if (insn.opCode < OP_ADD) {
+        snprintf(operand, sizeof(operand), "%d", insn.operand.as.integer);
+    }
+    fprintf(out, "%6d  %-20s %-12s depth %d", vm->pc, opcode_name(insn.opCode), operand, vm->sp);
+
+    int shown = vm->sp < DEBUG_TOP_VALUES ? vm->sp : DEBUG_TOP_VALUES;
+    for (int i = 1; i <= shown; i++) {
+        char value[DEBUG_VALUE_WIDTH];
+        vm_debug_format_value(value, sizeof(value), vm_stack_get(vm, vm->sp - i));
+        fprintf(out, "%s%s", i == 1 ? "  top: " : ", ", value);
+    }
+    fprintf(out, "\n");
+}
+
+void vm_debug_print_stack(VM *vm, FILE *out) {
+    fprintf(out, "Stack (%d values, frame at %d, %d calls deep):\n", vm->sp, vm->fp, vm->frame_count);
+    for (int i = vm->sp - 1; i >= 0; i--) {
+        char value[DEBUG_VALUE_WIDTH];
+        vm_debug_format_value(value, sizeof(value), vm_stack_get(vm, i));
+        fprintf(out, "  %4d%s %s\n", i, i == vm->fp ? " fp" : "   ", value);
+    }
+}
+
+bool vm_set_breakpoint(VM *vm, int pc) {
+    if (pc < 0 || (size_t)pc >= vm->code_count) {
+        return false;
+    }
+    if (!vm->breakpoints) {
+        vm->breakpoints = calloc(vm->code_count, sizeof(bool));
+    }
+    vm->breakpoints[pc] = true;
+    return true;
+}
+
+// The interpreter loop for debugging and profiling, which vm_execute runs instead of all
+// the others when any of them is on, so those never check for them. It runs every
+// instruction with checks, writes a trace line before each one if vm->debug is set,
+// records each one into vm->profile if set, and returns with vm->paused set when it
+// reaches a breakpoint.
+static void vm_run_instrumented(VM *vm) {
+    Profile *profile = vm->profile;
+
+    // Resuming from a breakpoint runs the instruction it paused at
+    bool resuming = vm->paused;
+    vm->paused = false;
+    while (true) {
+        if (vm->breakpoints && vm->breakpoints[vm->pc] && !resuming) {
+            vm->paused = true;
+            return;
+        }
+        resuming = false;
+        if (vm->debug) {
+            vm_debug_print(vm, vm->debug_out);
+        }
+
+        int pc = vm->pc;
+        Instruction instruction = code_get_next(vm);
+        vm->stats.dispatches++;
+        if (profile) {
+            uint64_t start = profile_clock();
+            bool running = vm_step(vm, instruction, true);
+            profile->time[instruction.opCode] += profile_clock() - start;
+            profile->counts[instruction.opCode]++;
+            profile->pc_hits[pc]++;
+            if (!running) {
                 return;
             }
         }
+        else if (!vm_step(vm, instruction, true)) {
+            return;
+        }
+    }
+}
+
+void vm_execute(VM *vm) {
+    // Calls note the frames they make; this is the top-level code's
+    if (vm->frame_count == 0) {
+        vm_note_depth(vm, -1);
+    }
+    if (vm->debug || vm->breakpoints || vm->profile) {
+        vm_run_instrumented(vm);
+        return;
+    }
+    // The compiled paths don't keep vm->pc up to date, which the allocation profiler and the sampler read
+    bool compiled = !vm->allocs && !vm->sampling;
+    if (vm->jit && compiled && jit_execute(vm)) {
+        return;
+    }
+    if (vm->regvm && compiled && regvm_execute(vm)) {
+        return;
+    }
+    if (vm->verified && (!vm->trace || !compiled)) {
+        vm_run_cached(vm);
+    }
+    else if (vm->verified) {
+        vm_run(vm, false);
+    }
+    else {
+        vm_run(vm, true);
     }
 }
@@ -3,10 +3,20 @@
 
 #include "vmstring.h"
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
-// Forward declaration
+#define CALL_STACK_MAX (65536) // Maximum number of nested function calls
+
+// Forward declarations
 typedef struct Value Value;
+typedef struct Closure Closure;
+typedef struct TraceCache TraceCache;
+typedef struct Profile Profile;
+typedef struct AllocProfile AllocProfile;
+typedef struct PerfMap PerfMap;
 
 /**
  * OpCodes supported by the VM
@@ -17,6 +27,15 @@ typedef enum {
     OP_STORE_VAR,   // Pop value and store in variable          (Operand is variable location)
     OP_LOAD_VAR,    // Load variable onto stack                 (Operand is variable location)
     OP_MAKE_LIST,   // Pop n values and make list               (Operand is number of elements)
+    OP_LOAD_LOCAL,  // Push a frame slot onto the stack          (Operand is slot relative to the frame pointer)
+    OP_STORE_LOCAL, // Pop value, store it in a frame slot, push it back (Operand is slot relative to the frame pointer)
+    OP_SLIDE,       // Pop a value, drop n more, push it back    (Operand is n)
+    OP_CALL,        // Call a function; its arguments are the top values of the stack (Operand is function index)
+    OP_TAIL_CALL,   // Like OP_CALL, but the callee replaces the current frame  (Operand is function index)
+    OP_CALL_CLOSURE,// Call the closure below the n arguments on top of the stack (Operand is n)
+    OP_TAIL_CALL_CLOSURE, // Like OP_CALL_CLOSURE, but the callee replaces the current frame (Operand is n)
+    OP_MAKE_CLOSURE,// Pop the function's captured values, push a closure of them (Operand is function index)
+    OP_LOAD_CAPTURE,// Push a value captured by the running closure (Operand is capture index)
 
     // Does not use operand //
     OP_ADD,         // Pop two, push sum
@@ -53,9 +72,55 @@ typedef enum {
     OP_LIST_SET,    // Pop a value, an integer, and a list. Push a new list with the element at that index set to the value
     OP_LIST_GET,    // Pop an integer and a list, push list element at that index
     OP_LIST_LEN,    // Pop a list, push its integer length
-    OP_HALT         // Stop execution
+    OP_HEAP_SNAPSHOT, // Pop a string path, write a heap snapshot there (see heapsnap.h), push whether it was written
+    OP_RET,         // Pop the return value, drop the frame's arguments and locals, return to the caller and push the value
+    OP_HALT,        // Stop execution
+
+    // Type-specialized forms, only emitted where codegen proved both operand types //
+    OP_ADD_II,      // Like OP_ADD, but both values are integers
+    OP_ADD_FF,      // Like OP_ADD, but both values are floats
+    OP_SUB_II,      // Like OP_SUB, but both values are integers
+    OP_SUB_FF,      // Like OP_SUB, but both values are floats
+    OP_MUL_II,      // Like OP_MUL, but both values are integers
+    OP_MUL_FF,      // Like OP_MUL, but both values are floats
+    OP_EQ_II,       // Like OP_EQ, but both values are integers
+    OP_EQ_FF,       // Like OP_EQ, but both values are floats
+    OP_NEQ_II,      // Like OP_NEQ, but both values are integers
+    OP_NEQ_FF,      // Like OP_NEQ, but both values are floats
+    OP_LT_II,       // Like OP_LT, but both values are integers
+    OP_LT_FF,       // Like OP_LT, but both values are floats
+    OP_LTE_II,      // Like OP_LTE, but both values are integers
+    OP_LTE_FF,      // Like OP_LTE, but both values are floats
+    OP_GT_II,       // Like OP_GT, but both values are integers
+    OP_GT_FF,       // Like OP_GT, but both values are floats
+    OP_GTE_II,      // Like OP_GTE, but both values are integers
+    OP_GTE_FF,      // Like OP_GTE, but both values are floats
+
+    // Quickened forms, rewritten in place by the generic instruction once it has seen its operand types.
+    // Each checks its types first and turns back into the generic instruction if they differ. //
+    OP_QADD_II,     // OP_ADD that has seen two integers
+    OP_QADD_FF,     // OP_ADD that has seen two floats
+    OP_QSUB_II,     // OP_SUB that has seen two integers
+    OP_QSUB_FF,     // OP_SUB that has seen two floats
+    OP_QMUL_II,     // OP_MUL that has seen two integers
+    OP_QMUL_FF,     // OP_MUL that has seen two floats
+    OP_QEQ_II,      // OP_EQ that has seen two integers
+    OP_QEQ_FF,      // OP_EQ that has seen two floats
+    OP_QNEQ_II,     // OP_NEQ that has seen two integers
+    OP_QNEQ_FF,     // OP_NEQ that has seen two floats
+    OP_QLT_II,      // OP_LT that has seen two integers
+    OP_QLT_FF,      // OP_LT that has seen two floats
+    OP_QLTE_II,     // OP_LTE that has seen two integers
+    OP_QLTE_FF,     // OP_LTE that has seen two floats
+    OP_QGT_II,      // OP_GT that has seen two integers
+    OP_QGT_FF,      // OP_GT that has seen two floats
+    OP_QGTE_II,     // OP_GTE that has seen two integers
+    OP_QGTE_FF,     // OP_GTE that has seen two floats
+    OP_QLIST_GET    // OP_LIST_GET that has seen a list and an integer
 } OpCode;
 
+#define OPCODE_COUNT (OP_QLIST_GET + 1) // Number of opcodes
+
 /**
  * List object for VM
  */
@@ -73,21 +138,54 @@ typedef enum {
     VAL_FLOAT,
     VAL_BOOL,
     VAL_STRING,
-    VAL_LIST
+    VAL_LIST,
+    VAL_CLOSURE
 } ValueType;
 
+/**
+ * The payload of a VM value; which member is set depends on the value's type
+ */
+typedef union {
+    int integer;
+    double floating;
+    bool boolean;
+    String *string;
+    List *list;
+    Closure *closure;
+} ValuePayload;
+
 /**
  * A VM value
  */
 struct Value {
     ValueType type;
-    union {
-        int integer;
-        double floating;
-        bool boolean;
-        String *string;
-        List *list;
-    } as;
+    ValuePayload as;
+};
+
+/**
+ * An array of values, as used for the VM's stack and globals. By default it's an array of
+ * Values; built with -DVM_SOA_STACK it's a struct of arrays instead, with all the types
+ * in one array and all the payloads in another. Use the accessors below, which work with both.
+ * The JIT, tracing JIT and --emit-c generate code for the default layout, so they're
+ * not available in VM_SOA_STACK builds.
+ */
+typedef struct {
+#ifdef VM_SOA_STACK
+    uint8_t *types;
+    ValuePayload *payloads;
+#else
+    Value *values;
+#endif
+} ValueArray;
+
+/**
+ * A function value: a function plus copies of the variables it captured
+ * from its enclosing functions when it was created
+ */
+struct Closure {
+    int function; // Index into the VM's function table
+    int capture_count;
+    Value captures[];
 };
 
 /**
@@ -98,25 +196,104 @@ typedef struct {
     Value operand;
 } Instruction;
 
+/**
+ * A compiled function
+ */
+typedef struct {
+    int entry; // Address of the first instruction of the body
+    int arity; // Number of arguments, which become the first slots of the frame
+    int capture_count; // Number of values copied into closures of this function
+} FunctionProto;
+
+/**
+ * A call stack record, saved by OP_CALL and restored by OP_RET
+ */
+typedef struct {
+    int return_pc;
+    int fp; // The caller's frame pointer
+    Closure *closure; // The caller's closure
+} CallFrame;
+
+/**
+ * Counters collected while the VM runs
+ */
+typedef struct {
+    unsigned long quickenings; // Instructions rewritten into a quickened form
+    unsigned long deopts; // Quickened instructions that saw other types and went back to the generic form
+    unsigned long jit_runs; // Times vm_execute ran the code as JIT-compiled machine code
+    unsigned long regvm_runs; // Times vm_execute ran the code as register code
+    unsigned long traces_compiled; // Hot loops compiled by the tracing JIT
+    unsigned long trace_aborts; // Hot loops whose recording left the loop's straight line, so they stay interpreted
+    unsigned long side_exits; // Times a compiled trace went back to the interpreter
+    unsigned long dispatches; // Instructions dispatched by the interpreter loops (stack or register)
+    unsigned long max_stack_depth; // Deepest the stack got: counted at pushes in checked code, and for verified code as deep as each frame entered can get
+    unsigned long max_call_depth; // Most calls in progress at once
+    unsigned long stack_growths; // Times the stack was reallocated to make room
+    unsigned long globals_growths; // Times the globals were reallocated to make room
+    unsigned long lists_allocated;
+    unsigned long strings_allocated;
+    unsigned long closures_allocated;
+    unsigned long list_copy_bytes; // Element bytes copied into lists made from other lists
+    unsigned long string_copy_bytes; // Characters copied into strings made from other strings
+
+    // Wall time of each phase of running a program, in milliseconds, filled in by whoever
+    // runs the phases (lvm's main); lexing is timed on its own, so parsing includes it again
+    double lex_ms;
+    double parse_ms;
+    double codegen_ms;
+    double load_ms; // Loading the code into the VM, which verifies it
+    double execute_ms;
+} VMStats;
+
 /**
  * The VM structure
  */
 typedef struct {
-    Value *stack; // The value stack
+    ValueArray stack; // The value stack
     size_t stack_cap;
+    size_t max_frame; // For verified code, the most values one call can add to the stack; each call makes room for that
+    int *frame_depths; // For verified code, the deepest the top-level code and then each function's frame get
     int sp; // Stack pointer
+    int fp; // Frame pointer; local variable slots are indexed from here
 
-    Value *globals; // Global variables
+    ValueArray globals; // Global variables
     size_t globals_cap; // Needs a cap but not a count since it doesn't behave like a stack
 
     List **allocated_lists; // Lists allocated by the VM (for cleanup purposes)
     size_t allocated_lists_count;
     size_t allocated_lists_cap;
+
+    Closure **allocated_closures; // Closures allocated by the VM (for cleanup purposes)
+    size_t allocated_closures_count;
+    size_t allocated_closures_cap;
     
-    Instruction *code;
+    Instruction *code; // Rewritten in place by quickening, see vm_load_code
+    size_t code_count; // Number of instructions in code, if loaded with vm_load_code
+    bool owns_code; // True if code was copied in by vm_load_code and is freed with the VM
+    bool verified; // True if the bytecode verifier accepted the code, so it runs without stack checks
     int pc; // Program counter
+
+    FunctionProto *functions; // Functions callable with OP_CALL, by index
+    int function_count;
+    CallFrame *frames; // The call stack, preallocated to CALL_STACK_MAX frames
+    int frame_count;
+    Closure *closure; // Closure of the running function, or NULL if it was called directly.
+                      // When set, the closure itself sits on the stack just below the frame pointer.
     
-    bool debug; // If true print debug info
+    bool debug; // If true vm_execute writes a trace line to debug_out before every instruction
+    FILE *debug_out; // Where the trace goes; stderr unless changed
+    bool *breakpoints; // Per-pc flags set with vm_set_breakpoint, or NULL if there are none
+    bool paused; // Set when vm_execute returned at a breakpoint rather than OP_HALT
+    Profile *profile; // If set, vm_execute records what runs into it, see profile.h. Not freed with the VM.
+    AllocProfile *allocs; // If set, every string and list the VM makes is recorded into it, see allocprofile.h. Not freed with the VM.
+    bool jit; // If true vm_execute compiles verified code to machine code, see jit.h
+    bool trace; // If true hot loops in verified code are compiled by the tracing JIT, see trace.h
+    bool regvm; // If true vm_execute translates verified code to register code and runs that, see regvm.h
+    bool sampling; // Set while a sampler reads vm->pc, so vm_execute keeps to the loops that update it, see sampler.h
+    TraceCache *traces; // Created at the first traced back-edge
+    volatile sig_atomic_t snapshot_requested; // Set by SIGUSR1, see heap_snapshot_on_signal
+    PerfMap *perf; // If set, the JITs write symbols for the machine code they make into it, see perfmap.h. Not freed with the VM.
+    VMStats stats;
     
     String **strings; // Strings in use by the VM
     size_t strings_count; // Number of strings in use
@@ -134,8 +311,209 @@ VM* vm_create();
 void vm_free(VM *vm);
 
 /**
- * Executes the code loaded in the given VM
+ * Gives the VM its own copy of the code to run, along with its functions. Quickening
+ * rewrites instructions while they run, so VMs must not share a code array.
+ * The code is also run through the bytecode verifier; if it passes, vm_execute
+ * uses the interpreter loop without stack and bounds checks.
+ * @param count Number of instructions in code
+ * @param function_count Number of entries in functions
+ */
+void vm_load_code(VM *vm, Instruction *code, size_t count, FunctionProto *functions, int function_count);
+
+/**
+ * Writes the VM's counters and phase times, one per line
+ */
+void vm_print_stats(VM *vm, FILE *out);
+
+/**
+ * Writes the VM's counters and phase times to a file as a JSON object
+ * @returns false if the file can't be written
+ */
+bool vm_write_stats_json(VM *vm, const char *path);
+
+/**
+ * Executes the code loaded in the given VM. With vm->debug, breakpoints or vm->profile set,
+ * it runs a separate instrumented loop (with checks, and without the JITs or register VM),
+ * so the other loops never test for any of them.
  */
 void vm_execute(VM *vm);
 
+/**
+ * Writes a trace line for the instruction at vm->pc: its address, opcode name and operand,
+ * the stack depth, and the values on top of the stack
+ */
+void vm_debug_print(VM *vm, FILE *out);
+
+/**
+ * Writes every value on the stack, from the top down, marking the frame pointer
+ */
+void vm_debug_print_stack(VM *vm, FILE *out);
+
+/**
+ * Makes vm_execute pause before running the instruction at pc: it returns with
+ * vm->paused set and vm->pc at the breakpoint, and calling it again resumes.
+ * Breakpoints are cleared when new code is loaded.
+ * @returns false if pc is outside the loaded code
+ */
+bool vm_set_breakpoint(VM *vm, int pc);
+
+/**
+ * Prints a runtime error and exits
+ */
+void runtime_error(char *msg);
+
+/**
+ * Pushes a value onto the VM's stack, growing the stack if it's full
+ */
+void stack_push_value(VM *vm, Value value);
+
+/**
+ * Copies a list into a new one with the same elements and capacity. The copy isn't
+ * registered with a VM, so the caller frees it.
+ * @returns The copy, or NULL if source is NULL
+ */
+List *list_copy(List *source);
+
+/**
+ * Runs a single instruction of verified code, with vm->pc already pointing past it.
+ * This is how JIT-compiled code runs the instructions it has no machine code for.
+ * @returns false if the instruction was OP_HALT
+ */
+bool vm_step_verified(VM *vm, Instruction *instruction);
+
+/**
+ * Returns the generic form of a quickened opcode, or the opcode itself if it isn't quickened
+ */
+OpCode instruction_unquickened(OpCode opCode);
+
+/**
+ * Returns the name of an opcode as written in this header, e.g. "OP_ADD"
+ */
+const char *opcode_name(OpCode opCode);
+
+/**
+ * Returns the net number of values the given instruction adds to the stack
+ * (negative if it removes values)
+ * @param functions The function table, needed for the arity of OP_CALL targets
+ */
+int instruction_stack_effect(Instruction insn, FunctionProto *functions);
+
+/**
+ * Returns the number of values the given instruction leaves for the instruction after it
+ * (none for jumps, returns and tail calls, which leave the block)
+ */
+int instruction_stack_outputs(OpCode opCode);
+
+/**
+ * Returns the number of values the given instruction pops. Its operand must be in range.
+ * @param functions The function table, needed for the arity of OP_CALL targets
+ */
+int instruction_stack_inputs(Instruction insn, FunctionProto *functions);
+
+/**
+ * Resizes a value array to hold capacity values
+ * @returns false if out of memory, leaving the array usable at its old capacity
+ */
+bool value_array_resize(ValueArray *array, size_t capacity);
+
+/**
+ * Frees the memory of a value array
+ */
+void value_array_free(ValueArray *array);
+
+/**
+ * Returns the value at the given index
+ */
+static inline Value value_array_get(ValueArray array, int index) {
+#ifdef VM_SOA_STACK
+    return (Value){.type = (ValueType)array.types[index], .as = array.payloads[index]};
+#else
+    return array.values[index];
+#endif
+}
+
+/**
+ * Sets the value at the given index
+ */
+static inline void value_array_set(ValueArray array, int index, Value value) {
+#ifdef VM_SOA_STACK
+    array.types[index] = (uint8_t)value.type;
+    array.payloads[index] = value.as;
+#else
+    array.values[index] = value;
+#endif
+}
+
+/**
+ * Returns the type of the value at the given index
+ */
+static inline ValueType value_array_type(ValueArray array, int index) {
+#ifdef VM_SOA_STACK
+    return (ValueType)array.types[index];
+#else
+    return array.values[index].type;
+#endif
+}
+
+/**
+ * Changes the type of the value at the given index, for updating a value in place
+ */
+static inline void value_array_set_type(ValueArray array, int index, ValueType type) {
+#ifdef VM_SOA_STACK
+    array.types[index] = (uint8_t)type;
+#else
+    array.values[index].type = type;
+#endif
+}
+
+/**
+ * Returns the payload of the value at the given index, which can be updated in place
+ */
+static inline ValuePayload *value_array_payload(ValueArray array, int index) {
+#ifdef VM_SOA_STACK
+    return &array.payloads[index];
+#else
+    return &array.values[index].as;
+#endif
+}
+
+/**
+ * Returns the part of a value array starting at the given index
+ */
+static inline ValueArray value_array_slice(ValueArray array, int start) {
+#ifdef VM_SOA_STACK
+    return (ValueArray){.types = array.types + start, .payloads = array.payloads + start};
+#else
+    return (ValueArray){.values = array.values + start};
+#endif
+}
+
+/**
+ * Returns the value at the given index of the VM's stack
+ */
+static inline Value vm_stack_get(VM *vm, int index) {
+    return value_array_get(vm->stack, index);
+}
+
+/**
+ * Sets the value at the given index of the VM's stack
+ */
+static inline void vm_stack_set(VM *vm, int index, Value value) {
+    value_array_set(vm->stack, index, value);
+}
+
+/**
+ * Returns the value of the given global variable
+ */
+static inline Value vm_globals_get(VM *vm, int location) {
+    return value_array_get(vm->globals, location);
+}
+
+/**
+ * Sets the value of the given global variable
+ */
+static inline void vm_globals_set(VM *vm, int location, Value value) {
+    value_array_set(vm->globals, location, value);
+}
+
 #endif // VM_H
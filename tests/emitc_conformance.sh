@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs every example, benchmark and runtime error program (tests/errors) with lvm
+# and as a native binary built with lvm --emit-c, and fails if their output or
+# exit status differ. Run with `make conformance`.
+
+BUILD_DIR=build
+OUT_DIR=$BUILD_DIR/conformance
+CC=${CC:-gcc}
+
+mkdir -p "$OUT_DIR"
+failed=0
+
+for source in examples/*.mslisp bench/*.mslisp tests/errors/*.mslisp; do
+    name=${source%.mslisp}
+    mkdir -p "$OUT_DIR/$(dirname "$source")"
+
+    "$BUILD_DIR/lvm" "$source" > "$OUT_DIR/$name.expected" 2>&1
+    expected_status=$?
+
+    if ! "$BUILD_DIR/lvm" --emit-c "$source" > "$OUT_DIR/$name.c"; then
+        echo "FAIL $name: lvm --emit-c failed"
+        failed=$((failed + 1))
+        continue
+    fi
+    if ! $CC -O2 -I src "$OUT_DIR/$name.c" "$BUILD_DIR/liblvm.a" -lm -o "$OUT_DIR/$name"; then
+        echo "FAIL $name: generated C doesn't compile"
+        failed=$((failed + 1))
+        continue
+    fi
+
+    "$OUT_DIR/$name" > "$OUT_DIR/$name.actual" 2>&1
+    actual_status=$?
+
+    if [ "$expected_status" -ne "$actual_status" ] || ! diff -q "$OUT_DIR/$name.expected" "$OUT_DIR/$name.actual" > /dev/null; then
+        echo "FAIL $name: output differs from lvm"
+        diff "$OUT_DIR/$name.expected" "$OUT_DIR/$name.actual" | head -20
+        failed=$((failed + 1))
+    else
+        echo "ok   $name"
+    fi
+done
+
+if [ "$failed" -ne 0 ]; then
+    echo "$failed program(s) failed"
+    exit 1
+fi
+echo "All programs match."
@@ -0,0 +1,91 @@
+#include "test_allocprofile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "allocprofile.h"
+#include "testutil.h"
+
+const char *TAG_ALLOCPROFILE = "TEST_ALLOCPROFILE";
+
+// Appends to a list 10 times on line 3 and concatenates strings 5 times on line 5
+static char *allocating_source =
+    "(define xs [])\n"
+    "(define i 0)\n"
+    "(while (< i 10) (define xs (list-append xs i)) (define i (+ i 1)))\n"
+    "(define s \"\")\n"
+    "(while (< i 15) (define s (concat s \"ab\")) (define i (+ i 1)))\n";
+
+// Address of the first instruction with the given opcode, or -1
+static int find_opcode(BytecodeBuf *bbuf, OpCode op) {
+    for (size_t i = 0; i < bbuf->count; i++) {
+        if (bbuf->instructions[i].opCode == op) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int test_sites(bool jit) {
+    int failed = 0;
+
+    CompiledSource compiled = compile_source(allocating_source);
+    BytecodeBuf *bbuf = compiled.bbuf;
+    VM *vm = compiled_source_load(&compiled);
+    vm->jit = jit;
+    vm->allocs = alloc_profile_create(vm->code_count);
+    vm_execute(vm);
+
+    int append = find_opcode(bbuf, OP_LIST_APPEND);
+    int concat = find_opcode(bbuf, OP_CONCATSTR);
+    int make_list = find_opcode(bbuf, OP_MAKE_LIST);
+    AllocSite *lists = vm->allocs->sites[ALLOC_LIST];
+    AllocSite *strings = vm->allocs->sites[ALLOC_STRING];
+    failed += test_assert(
+        lists[append].count == 10 && strings[concat].count == 5 && lists[make_list].count == 1,
+        TAG_ALLOCPROFILE,
+        jit ? "Allocations are counted by site with the JIT asked for" : "Allocations are counted by site"
+    );
+    failed += test_assert(
+        lists[append].bytes >= 10 * (sizeof(List) + 8 * sizeof(Value)) &&
+            strings[concat].bytes >= 5 * sizeof(String) + (3 + 5 + 7 + 9 + 11),
+        TAG_ALLOCPROFILE,
+        "Sites count the bytes of what they made, storage included"
+    );
+    failed += test_assert(
+        strings[append].count == 0 && lists[concat].count == 0 && vm->strings_count == 5,
+        TAG_ALLOCPROFILE,
+        "Sites only count their own kind, and the VM frees the strings it made"
+    );
+
+    FILE *report = tmpfile();
+    alloc_profile_print(vm->allocs, vm, bbuf, allocating_source, report);
+    char *text = read_back(report);
+    char *list_row = strstr(text, "OP_LIST_APPEND");
+    char *string_row = strstr(text, "OP_CONCATSTR");
+    failed += test_assert(
+        list_row && string_row && list_row < string_row &&
+            strstr(list_row, "3  (while (< i 10) (define xs (list-append xs i))") != NULL,
+        TAG_ALLOCPROFILE,
+        "The report lists the biggest sites first, with their source lines"
+    );
+    free(text);
+
+    alloc_profile_free(vm->allocs);
+    vm_free(vm);
+    compiled_source_free(&compiled);
+    return failed;
+}
+
+int run_allocprofile_tests() {
+    int failed = 0;
+    failed += test_sites(false);
+    failed += test_sites(true);
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_ALLOCPROFILE, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_ALLOCPROFILE_H
+#define TEST_ALLOCPROFILE_H
+
+extern const char *TAG_ALLOCPROFILE;
+
+int run_allocprofile_tests();
+
+#endif // TEST_ALLOCPROFILE_H
@@ -0,0 +1,368 @@
+#include "test_codegen.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#include "codegen.h"
+#include "vm.h"
+#include "testutil.h"
+
+const char *TAG_CODEGEN = "TEST_CODEGEN";
+
+// True if the program left exactly one value, the given integer, on the stack
+static bool result_is_integer(CompiledRun *run, int expected) {
+    return run->vm->sp == 1 &&
+        vm_stack_get(run->vm, 0).type == VAL_INTEGER &&
+        vm_stack_get(run->vm, 0).as.integer == expected;
+}
+
+static int test_stack_balance() {
+    int failed = 0;
+    CompiledRun run;
+
+    run = compiled_run("(define i 0) (while (< i 10) (define i (+ i 1)) i) (do 1 2 3)", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 3),
+        TAG_CODEGEN,
+        "while and do leave only the last value on the stack"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(if false 1 (if true 2 3))", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 2),
+        TAG_CODEGEN,
+        "Nested if leaves one value on the stack"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_let() {
+    int failed = 0;
+    CompiledRun run;
+
+    run = compiled_run("(let [a 1 b 2] (+ a b))", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 3),
+        TAG_CODEGEN,
+        "let binds two locals"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(let [a 5 b (* a 2)] b)", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 10),
+        TAG_CODEGEN,
+        "let bindings can use earlier bindings"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(define a 1) (+ a (let [a 10] (let [a 100] a)))", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 101),
+        TAG_CODEGEN,
+        "Inner locals shadow outer locals and globals"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(let [a 1] (define a 7) (+ a 1))", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 8),
+        TAG_CODEGEN,
+        "define on a local overwrites its slot"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(define total 0)"
+        "(let [i 0]"
+        "  (while (< i 5)"
+        "    (let [sq (* i i)] (define total (+ total sq)))"
+        "    (define i (+ i 1))))"
+        "total",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 30),
+        TAG_CODEGEN,
+        "let inside a while loop reuses the same slot every iteration"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_functions() {
+    int failed = 0;
+    CompiledRun run;
+
+    run = compiled_run(
+        "(defun fib [n] (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+        "(fib 15)",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 610) && run.vm->frame_count == 0,
+        TAG_CODEGEN,
+        "Recursive fib returns 610 and unwinds all frames"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(even? 10)"
+        "(defun even? [n] (if (= n 0) true (odd? (- n 1))))"
+        "(defun odd? [n] (if (= n 0) false (even? (- n 1))))"
+        "(if (odd? 7) 1 0)",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 1),
+        TAG_CODEGEN,
+        "Functions can be called before they are defined"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun sub3 [a b c] (let [ab (- a b)] (- ab c)))"
+        "(let [x 100] (+ x (sub3 10 2 3)))",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 105),
+        TAG_CODEGEN,
+        "Arguments and locals are addressed relative to the callee's frame"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_tail_calls() {
+    int failed = 0;
+    CompiledRun run;
+
+    // Far deeper than CALL_STACK_MAX, so this only works if the frame is reused
+    run = compiled_run(
+        "(defun count [n acc] (if (= n 0) acc (count (- n 1) (+ acc 1))))"
+        "(count 1000000 0)",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 1000000) && run.vm->frame_count == 0,
+        TAG_CODEGEN,
+        "Tail-recursive loop runs 1000000 deep in one frame"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun down [n] (do (+ 1 1) (let [m (- n 1)] (if (< m 0) 42 (down m)))))"
+        "(down 200000)",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 42) && run.vm->frame_count == 0,
+        TAG_CODEGEN,
+        "Calls at the end of do and let bodies are tail calls"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_closures() {
+    int failed = 0;
+    CompiledRun run;
+
+    run = compiled_run("((lambda [x y] (- x y)) 10 3)", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 7),
+        TAG_CODEGEN,
+        "Immediately called lambda"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun make-adder [n] (lambda [x] (+ x n)))"
+        "(let [add5 (make-adder 5) add7 (make-adder 7)] (+ (add5 1) (add7 1)))",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 14) && run.vm->frame_count == 0,
+        TAG_CODEGEN,
+        "Closures keep their captured values after the creating frame returns"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(let [a 1 b 2]"
+        "  (let [f (lambda [] (lambda [c] (+ a (+ b c))))]"
+        "    ((f) 3)))",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 6),
+        TAG_CODEGEN,
+        "Nested lambdas capture through the enclosing lambda"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun fold [f acc lst i]"
+        "  (if (< i (list-length lst)) (fold f (f acc (list-get lst i)) lst (+ i 1)) acc))"
+        "(defun add [a b] (+ a b))"
+        "(define scale 10)"
+        "(+ (fold add 0 [1 2 3] 0) (fold (lambda [a x] (+ a (* x scale))) 0 [1 2 3] 0))",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 66),
+        TAG_CODEGEN,
+        "Named functions and lambdas can be passed as values"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun run-n [f n] (if (= n 0) 0 (f f (- n 1))))"
+        "(run-n (lambda [self n] (if (= n 0) 99 (self self (- n 1)))) 200000)",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 99) && run.vm->frame_count == 0,
+        TAG_CODEGEN,
+        "Closure calls in tail position reuse the frame"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+// Counts how often an opcode appears in the compiled program
+static int count_opcode(CompiledRun *run, OpCode opCode) {
+    int count = 0;
+    for (size_t i = 0; i < run->compiled.bbuf->count; i++) {
+        if (run->compiled.bbuf->instructions[i].opCode == opCode) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int test_type_specialization() {
+    int failed = 0;
+    CompiledRun run;
+
+    run = compiled_run("(define i 0) (define acc 0) (while (< i 10) (define acc (+ acc i 1)) (define i (+ i 1))) acc", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 55) &&
+            count_opcode(&run, OP_LT_II) == 1 &&
+            count_opcode(&run, OP_ADD_II) == 3 &&
+            count_opcode(&run, OP_ADD) == 0,
+        TAG_CODEGEN,
+        "Arithmetic on integer globals uses the integer-only opcodes"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(let [x 1.5] (- (* x 2.0) (int2float 1)))", NULL);
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_FLOAT && vm_stack_get(run.vm, 0).as.floating == 2.0 &&
+            count_opcode(&run, OP_MUL_FF) == 1 &&
+            count_opcode(&run, OP_SUB_FF) == 1,
+        TAG_CODEGEN,
+        "Float locals and conversions use the float-only opcodes"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(define x 1) (define y (+ x 1)) (define x 2.5) (+ y 1)", NULL);
+    failed += test_assert(
+        result_is_integer(&run, 3) && count_opcode(&run, OP_ADD_II) == 0,
+        TAG_CODEGEN,
+        "Variables assigned more than one type stay generic"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run(
+        "(defun add [a b] (+ a b))"
+        "(defun get [lst i] (list-get lst i))"
+        "(let [x (add 1 2) y (add 0.5 0.25)] (+ (get [10 20] 1) (+ x (float2int (* y 4.0)))))",
+        NULL
+    );
+    failed += test_assert(
+        result_is_integer(&run, 26) &&
+            run.vm->stats.quickenings == 6 &&
+            run.vm->stats.deopts == 1,
+        TAG_CODEGEN,
+        "Arithmetic on parameters is quickened at runtime and deoptimized when types change"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+// Returns the address of the first instruction with the given opcode, or -1
+static int find_opcode(CompiledRun *run, OpCode opCode) {
+    for (size_t i = 0; i < run->compiled.bbuf->count; i++) {
+        if (run->compiled.bbuf->instructions[i].opCode == opCode) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int test_source_map() {
+    int failed = 0;
+    CompiledRun run = compiled_run("(defun sq [x]\n  (* x x))\n(sq\n  (+ 1 2))\n((lambda [y] y) 1)", NULL);
+    BytecodeBuf *bbuf = run.compiled.bbuf;
+
+    SourceMapEntry *mul = bytecode_source(bbuf, find_opcode(&run, OP_MUL));
+    SourceMapEntry *call = bytecode_source(bbuf, find_opcode(&run, OP_CALL));
+    SourceMapEntry *add = bytecode_source(bbuf, find_opcode(&run, OP_ADD_II));
+    failed += test_assert(
+        mul->pos.line == 2 && mul->pos.col == 3 &&
+            call->pos.line == 3 && call->pos.col == 1 &&
+            add->pos.line == 4 && add->pos.col == 3,
+        TAG_CODEGEN,
+        "Instructions map to the expression they were compiled from"
+    );
+    failed += test_assert(
+        strcmp(bytecode_function_name(bbuf, mul->function), "sq") == 0 &&
+            strcmp(bytecode_function_name(bbuf, call->function), "main") == 0 &&
+            strcmp(bytecode_function_name(bbuf, bytecode_source(bbuf, find_opcode(&run, OP_RET) + 1)->function), "main") == 0,
+        TAG_CODEGEN,
+        "Instructions map to the function whose body they are in"
+    );
+
+    int ret = find_opcode(&run, OP_MAKE_CLOSURE) - 1;
+    failed += test_assert(
+        bbuf->instructions[ret].opCode == OP_RET &&
+            strcmp(bytecode_function_name(bbuf, bytecode_source(bbuf, ret)->function), "lambda") == 0,
+        TAG_CODEGEN,
+        "Lambdas are named lambda"
+    );
+    failed += test_assert(
+        bbuf->source_map_count < (int)bbuf->count &&
+            bytecode_source(bbuf, (int)bbuf->count) == NULL,
+        TAG_CODEGEN,
+        "Runs of instructions from the same expression share an entry"
+    );
+
+    compiled_run_free(&run);
+    return failed;
+}
+
+int run_codegen_tests() {
+    int failed = 0;
+    failed += test_stack_balance();
+    failed += test_let();
+    failed += test_functions();
+    failed += test_tail_calls();
+    failed += test_closures();
+    failed += test_type_specialization();
+    failed += test_source_map();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_CODEGEN, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_CODEGEN_H
+#define TEST_CODEGEN_H
+
+extern const char *TAG_CODEGEN;
+
+int run_codegen_tests();
+
+#endif // TEST_CODEGEN_H
@@ -0,0 +1,76 @@
+#include "test_disasm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codegen.h"
+#include "disasm.h"
+#include "testutil.h"
+
+const char *TAG_DISASM = "TEST_DISASM";
+
+// A tail recursive function on line 1 and a loop that appends to a list on line 3
+static char *looping_source =
+    "(defun count-down [n] (if (< n 1) n (count-down (- n 1))))\n"
+    "(define xs [])\n"
+    "(while (< (list-length xs) 10) (define xs (list-append xs (count-down 3))))\n";
+
+static int test_disasm() {
+    int failed = 0;
+
+    CompiledSource compiled = compile_source(looping_source);
+    BytecodeBuf *bbuf = compiled.bbuf;
+
+    int count;
+    LoopCost *loops = disasm_loops(bbuf, &count);
+    failed += test_assert(
+        count == 2 && loops[0].function == 0 && loops[0].start == bbuf->functions[0].entry &&
+            loops[1].function == -1 && loops[1].start < loops[1].end,
+        TAG_DISASM,
+        "A tail call to the same function and a backward jump are found as loops"
+    );
+    failed += test_assert(
+        count == 2 && loops[1].allocations == 1 && loops[1].calls == 1 && loops[1].pushes == loops[1].pops &&
+            loops[1].instructions == loops[1].end - loops[1].start + 1,
+        TAG_DISASM,
+        "A loop's costs count its list-append, its call and balanced pushes and pops"
+    );
+    free(loops);
+
+    FILE *listing = tmpfile();
+    disasm_print(bbuf, looping_source, listing);
+    char *text = read_back(listing);
+    failed += test_assert(
+        strstr(text, "== count-down (#0, entry 2, 1 arguments, 0 captures) ==") != NULL &&
+            strstr(text, "OP_CALL              count-down (#0)") != NULL &&
+            strstr(text, "OP_JMP_IF_FALSE      -> ") != NULL,
+        TAG_DISASM,
+        "The listing names functions and decodes calls and jump targets"
+    );
+    failed += test_assert(
+        strstr(text, "B1: entry") != NULL && strstr(text, " from B") != NULL && strstr(text, " depth 0") != NULL,
+        TAG_DISASM,
+        "The listing marks basic blocks with their predecessors and stack depths"
+    );
+    failed += test_assert(
+        strstr(text, "; 3: (while (< (list-length xs) 10)") != NULL &&
+            strstr(text, "in main, line 3: ") != NULL && strstr(text, "(OP_LIST_APPEND)") != NULL,
+        TAG_DISASM,
+        "The listing shows source lines and the allocations of each loop"
+    );
+    free(text);
+
+    compiled_source_free(&compiled);
+    return failed;
+}
+
+int run_disasm_tests() {
+    int failed = 0;
+    failed += test_disasm();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_DISASM, failed);
+    }
+    return failed;
+}
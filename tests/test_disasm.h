@@ -0,0 +1,8 @@
+#ifndef TEST_DISASM_H
+#define TEST_DISASM_H
+
+extern const char *TAG_DISASM;
+
+int run_disasm_tests();
+
+#endif // TEST_DISASM_H
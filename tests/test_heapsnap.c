@@ -0,0 +1,183 @@
+#include "test_heapsnap.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "heapsnap.h"
+#include "testutil.h"
+
+const char *TAG_HEAPSNAP = "TEST_HEAPSNAP";
+
+// Makes a nested list in global 0 and the same string twice in globals 1 and 2, then
+// snapshots the heap to the path filled in for %s
+static char *snapshot_source =
+    "(define xs (list 1 2.5 (list true)))\n"
+    "(define s (concat \"he\" \"llo\"))\n"
+    "(define t (concat \"he\" \"llo\"))\n"
+    "(heap-snapshot \"%s\")\n";
+
+static HeapObject *find_object(HeapSnapshot *snapshot, HeapValue value) {
+    for (size_t i = 0; i < snapshot->object_count; i++) {
+        if (snapshot->objects[i].address == value.payload) {
+            return &snapshot->objects[i];
+        }
+    }
+    return NULL;
+}
+
+static HeapRoot *find_global(HeapSnapshot *snapshot, uint32_t index) {
+    for (size_t i = 0; i < snapshot->root_count; i++) {
+        if (snapshot->roots[i].global && snapshot->roots[i].index == index) {
+            return &snapshot->roots[i];
+        }
+    }
+    return NULL;
+}
+
+static int test_builtin() {
+    int failed = 0;
+
+    char path[] = "/tmp/lvm_heapsnap_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    char source[512];
+    snprintf(source, sizeof(source), snapshot_source, path);
+
+    CompiledSource compiled = compile_source(source);
+    VM *vm = compiled_source_load(&compiled);
+    vm_execute(vm);
+    failed += test_assert(
+        vm_stack_get(vm, vm->sp - 1).type == VAL_BOOL && vm_stack_get(vm, vm->sp - 1).as.boolean,
+        TAG_HEAPSNAP,
+        "heap-snapshot returns true once it's written the file"
+    );
+
+    HeapSnapshot *snapshot = heap_snapshot_read(path);
+    failed += test_assert(
+        snapshot != NULL && snapshot->object_count == vm->strings_count + vm->allocated_lists_count,
+        TAG_HEAPSNAP,
+        "The snapshot has every string and list the VM made"
+    );
+    if (!snapshot) {
+        vm_free(vm);
+        compiled_source_free(&compiled);
+        return failed;
+    }
+
+    HeapRoot *xs = find_global(snapshot, 0);
+    HeapObject *outer = xs ? find_object(snapshot, xs->value) : NULL;
+    HeapObject *inner = outer && outer->count == 3 ? find_object(snapshot, outer->values[2]) : NULL;
+    failed += test_assert(
+        outer && outer->kind == HEAP_LIST && outer->values[0].type == VAL_INTEGER && outer->values[0].payload == 1 &&
+            outer->values[1].type == VAL_FLOAT && outer->values[2].type == VAL_LIST,
+        TAG_HEAPSNAP,
+        "Globals are roots, and lists keep their element types and values"
+    );
+    failed += test_assert(
+        inner && inner->kind == HEAP_LIST && inner->count == 1 && inner->values[0].type == VAL_BOOL &&
+            inner->bytes >= sizeof(List) + sizeof(Value),
+        TAG_HEAPSNAP,
+        "References between lists point at the objects they refer to"
+    );
+
+    HeapRoot *s = find_global(snapshot, 1);
+    HeapRoot *t = find_global(snapshot, 2);
+    HeapObject *s_object = s ? find_object(snapshot, s->value) : NULL;
+    HeapObject *t_object = t ? find_object(snapshot, t->value) : NULL;
+    failed += test_assert(
+        s_object && t_object && s_object != t_object &&
+            strcmp(s_object->text, "hello") == 0 && strcmp(t_object->text, "hello") == 0,
+        TAG_HEAPSNAP,
+        "Strings are written with their text, each copy separately"
+    );
+
+    heap_snapshot_free(snapshot);
+    vm_free(vm);
+    compiled_source_free(&compiled);
+    remove(path);
+    return failed;
+}
+
+static int test_bad_files() {
+    int failed = 0;
+
+    char path[] = "/tmp/lvm_heapsnap_XXXXXX";
+    int fd = mkstemp(path);
+    // A list record that ends before its address does
+    ssize_t written = write(fd, HEAP_SNAPSHOT_MAGIC, strlen(HEAP_SNAPSHOT_MAGIC));
+    written += write(fd, "L1234", 5);
+    close(fd);
+    failed += test_assert(
+        written > 0 && heap_snapshot_read(path) == NULL && heap_snapshot_read("/nonexistent/file.heap") == NULL,
+        TAG_HEAPSNAP,
+        "Truncated or missing snapshots aren't read"
+    );
+
+    remove(path);
+    return failed;
+}
+
+// Keeps a string in stack slot 0 while it loops
+static char *signal_source = "(let [s \"kept\" i 0] (while (< i 3) (define i (+ i 1))))\n";
+
+static int test_signal() {
+    int failed = 0;
+    const char *messages[] = {
+        "SIGUSR1 writes a snapshot at the interpreter's next safe point, with the stack written back",
+        "SIGUSR1 writes a snapshot at the JIT's next safe point, with the stack written back",
+        "SIGUSR1 writes a snapshot at the register VM's next safe point, with the stack written back",
+        "SIGUSR1 writes a snapshot at the unverified interpreter's next safe point, with the stack written back"
+    };
+
+    for (int mode = 0; mode < 4; mode++) {
+        CompiledSource compiled = compile_source(signal_source);
+        VM *vm = compiled_source_load(&compiled);
+        vm->jit = mode == 1;
+        vm->regvm = mode == 2;
+        vm->trace = mode == 3;
+        heap_snapshot_on_signal(vm);
+        raise(SIGUSR1);
+        signal(SIGUSR1, SIG_DFL);
+
+        // The handler only asks for the snapshot, which the program writes once it's running
+        char path[64];
+        snprintf(path, sizeof(path), "lvm-%ld-%d.heap", (long)getpid(), mode + 1);
+        FILE *early = fopen(path, "r");
+        bool requested = vm->snapshot_requested;
+        vm_execute(vm);
+
+        HeapSnapshot *snapshot = heap_snapshot_read(path);
+        failed += test_assert(
+            !early && requested && !vm->snapshot_requested && snapshot != NULL && snapshot->root_count == 1 &&
+                !snapshot->roots[0].global && snapshot->roots[0].index == 0 &&
+                snapshot->roots[0].value.type == VAL_STRING,
+            TAG_HEAPSNAP,
+            messages[mode]
+        );
+
+        if (early) {
+            fclose(early);
+        }
+        heap_snapshot_free(snapshot);
+        remove(path);
+        vm_free(vm);
+        compiled_source_free(&compiled);
+    }
+    return failed;
+}
+
+int run_heapsnap_tests() {
+    int failed = 0;
+    failed += test_builtin();
+    failed += test_bad_files();
+    failed += test_signal();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_HEAPSNAP, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_HEAPSNAP_H
+#define TEST_HEAPSNAP_H
+
+extern const char *TAG_HEAPSNAP;
+
+int run_heapsnap_tests();
+
+#endif // TEST_HEAPSNAP_H
@@ -102,9 +102,110 @@ static int test_basic() {
     return failed;
 }
 
+static int test_list_brackets() {
+    int failed = 0;
+    Lexer *lexer = lexer_create("[a 1]");
+    Token token;
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_LIST_OPEN,
+        TAG_LEXER,
+        "Token 1 is LIST_OPEN"
+    );
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_SYMBOL &&
+        strcmp(token.as.symbol->data, "a") == 0,
+        TAG_LEXER,
+        "Token 2 is SYMBOL 'a'"
+    );
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_INTEGER &&
+        token.as.integer == 1,
+        TAG_LEXER,
+        "Token 3 is INTEGER 1, directly followed by ']'"
+    );
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_LIST_CLOSE,
+        TAG_LEXER,
+        "Token 4 is LIST_CLOSE"
+    );
+
+    lexer_free(lexer);
+    return failed;
+}
+
+static int test_comments() {
+    int failed = 0;
+    Lexer *lexer = lexer_create("; first\n  ; second\n42 ; trailing");
+    Token token;
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_INTEGER &&
+        token.as.integer == 42,
+        TAG_LEXER,
+        "Consecutive comment lines are skipped"
+    );
+
+    token = lexer_next_token(lexer);
+    failed += test_assert(
+        token.type == TOKEN_EOF,
+        TAG_LEXER,
+        "Trailing comment is skipped"
+    );
+
+    lexer_free(lexer);
+    return failed;
+}
+
+static int test_positions() {
+    int failed = 0;
+    Lexer *lexer = lexer_create("(a ; note\n  \"two\nlines\" b)\n\t42");
+    Token tokens[6];
+    for (int i = 0; i < 6; i++) {
+        tokens[i] = lexer_next_token(lexer);
+    }
+
+    failed += test_assert(
+        tokens[0].pos.line == 1 && tokens[0].pos.col == 1 &&
+        tokens[1].pos.line == 1 && tokens[1].pos.col == 2,
+        TAG_LEXER,
+        "Tokens on the first line start at column 1"
+    );
+    failed += test_assert(
+        tokens[2].type == TOKEN_STRING && tokens[2].pos.line == 2 && tokens[2].pos.col == 3,
+        TAG_LEXER,
+        "Comments and newlines move tokens to the next line"
+    );
+    failed += test_assert(
+        tokens[3].pos.line == 3 && tokens[3].pos.col == 8 &&
+        tokens[4].pos.line == 3 && tokens[4].pos.col == 9,
+        TAG_LEXER,
+        "Newlines inside strings are counted"
+    );
+    failed += test_assert(
+        tokens[5].type == TOKEN_INTEGER && tokens[5].pos.line == 4 && tokens[5].pos.col == 2,
+        TAG_LEXER,
+        "A tab counts as one column"
+    );
+
+    lexer_free(lexer);
+    return failed;
+}
+
 int run_lexer_tests() {
     int failed = 0;
     failed += test_basic();
+    failed += test_list_brackets();
+    failed += test_comments();
+    failed += test_positions();
 
     if (failed > 0) {
         printf("%s: Tests failed: %d\n", TAG_LEXER, failed);
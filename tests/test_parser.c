@@ -25,92 +25,92 @@ static int test_basic() {
 
     // Expression 1: (+ 3 "hi")
     failed += test_assert(
-        program->expressions[0]->type == AST_LIST,
+        ast_type(program, program->expressions[0]) == AST_LIST,
         TAG_PARSER,
         "First expression is a LIST"
     );
 
-    ASTNode *firstExpr = program->expressions[0];
+    int firstExpr = program->expressions[0];
     failed += test_assert(
-        firstExpr->list.count == 3,
+        ast_child_count(program, firstExpr) == 3,
         TAG_PARSER,
         "First expression has 3 children"
     );
 
     failed += test_assert(
-        firstExpr->list.children[0]->type == AST_SYMBOL &&
-        strcmp(firstExpr->list.children[0]->symbol->data, "+") == 0,
+        ast_type(program, ast_child(program, firstExpr, 0)) == AST_SYMBOL &&
+        strcmp(ast_payload(program, ast_child(program, firstExpr, 0))->symbol->data, "+") == 0,
         TAG_PARSER,
         "First child of first expression is SYMBOL '+'"
     );
     failed += test_assert(
-        firstExpr->list.children[1]->type == AST_INTEGER &&
-        firstExpr->list.children[1]->integer == 3,
+        ast_type(program, ast_child(program, firstExpr, 1)) == AST_INTEGER &&
+        ast_payload(program, ast_child(program, firstExpr, 1))->integer == 3,
         TAG_PARSER,
         "Second child of first expression is INTEGER 3"
     );
     failed += test_assert(
-        firstExpr->list.children[2]->type == AST_STRING &&
-        strcmp(firstExpr->list.children[2]->string->data, "hi") == 0,
+        ast_type(program, ast_child(program, firstExpr, 2)) == AST_STRING &&
+        strcmp(ast_payload(program, ast_child(program, firstExpr, 2))->string->data, "hi") == 0,
         TAG_PARSER,
         "Third child of first expression is STRING 'hi'"
     );
 
     // Expression 2: (foo bar (3.5 true ()))
     failed += test_assert(
-        program->expressions[1]->type == AST_LIST,
+        ast_type(program, program->expressions[1]) == AST_LIST,
         TAG_PARSER,
         "Second expression is a LIST"
     );
 
-    ASTNode *secondExpr = program->expressions[1];
+    int secondExpr = program->expressions[1];
     failed += test_assert(
-        secondExpr->list.count == 3,
+        ast_child_count(program, secondExpr) == 3,
         TAG_PARSER,
         "Second expression has 3 children"
     );
 
     failed += test_assert(
-        secondExpr->list.children[0]->type == AST_SYMBOL &&
-        strcmp(secondExpr->list.children[0]->symbol->data, "foo") == 0,
+        ast_type(program, ast_child(program, secondExpr, 0)) == AST_SYMBOL &&
+        strcmp(ast_payload(program, ast_child(program, secondExpr, 0))->symbol->data, "foo") == 0,
         TAG_PARSER,
         "First child of second expression is SYMBOL 'foo'"
     );
     failed += test_assert(
-        secondExpr->list.children[1]->type == AST_SYMBOL &&
-        strcmp(secondExpr->list.children[1]->symbol->data, "bar") == 0,
+        ast_type(program, ast_child(program, secondExpr, 1)) == AST_SYMBOL &&
+        strcmp(ast_payload(program, ast_child(program, secondExpr, 1))->symbol->data, "bar") == 0,
         TAG_PARSER,
         "Second child of second expression is SYMBOL 'bar'"
     );
     failed += test_assert(
-        secondExpr->list.children[2]->type == AST_LIST,
+        ast_type(program, ast_child(program, secondExpr, 2)) == AST_LIST,
         TAG_PARSER,
         "Third child of second expression is a LIST"
     );
 
     // Inner expression: (3.5 true ())
-    ASTNode *innerList = secondExpr->list.children[2];
+    int innerList = ast_child(program, secondExpr, 2);
     failed += test_assert(
-        innerList->list.count == 3,
+        ast_child_count(program, innerList) == 3,
         TAG_PARSER,
         "Inner list has 3 children"
     );
 
     failed += test_assert(
-        innerList->list.children[0]->type == AST_FLOAT &&
-        innerList->list.children[0]->floating == 3.5,
+        ast_type(program, ast_child(program, innerList, 0)) == AST_FLOAT &&
+        ast_payload(program, ast_child(program, innerList, 0))->floating == 3.5,
         TAG_PARSER,
         "First child of inner list is FLOAT 3.5"
     );
     failed += test_assert(
-        innerList->list.children[1]->type == AST_BOOL &&
-        innerList->list.children[1]->boolean == true,
+        ast_type(program, ast_child(program, innerList, 1)) == AST_BOOL &&
+        ast_payload(program, ast_child(program, innerList, 1))->boolean == true,
         TAG_PARSER,
         "Second child of inner list is BOOL true"
     );
     failed += test_assert(
-        innerList->list.children[2]->type == AST_LIST &&
-        innerList->list.children[2]->list.count == 0,
+        ast_type(program, ast_child(program, innerList, 2)) == AST_LIST &&
+        ast_child_count(program, ast_child(program, innerList, 2)) == 0,
         TAG_PARSER,
         "Third child of inner list is an empty LIST"
     );
@@ -122,9 +122,95 @@ static int test_basic() {
     return failed;
 }
 
+static int test_flat_layout() {
+    int failed = 0;
+
+    Lexer *lexer = lexer_create("(a [1 2 ] (b)) c");
+    Parser *parser = parser_create(lexer);
+    ASTProgram *program = parser_parse(parser);
+
+    // Nodes are numbered in pre-order:
+    // 0 = (a ...), 1 = a, 2 = [1 2 ], 3 = 1, 4 = 2, 5 = (b), 6 = b, 7 = c
+    failed += test_assert(
+        program->node_count == 8,
+        TAG_PARSER,
+        "Program has 8 nodes"
+    );
+
+    failed += test_assert(
+        program->expressions[0] == 0 && program->expressions[1] == 7,
+        TAG_PARSER,
+        "Top-level expressions are nodes 0 and 7"
+    );
+
+    failed += test_assert(
+        ast_child(program, 0, 0) == 1 &&
+        ast_child(program, 0, 1) == 2 &&
+        ast_child(program, 0, 2) == 5,
+        TAG_PARSER,
+        "Children of the outer list are nodes 1, 2 and 5"
+    );
+
+    failed += test_assert(
+        ast_type(program, 2) == AST_LITERAL_LIST &&
+        ast_child_count(program, 2) == 2 &&
+        ast_payload(program, ast_child(program, 2, 1))->integer == 2,
+        TAG_PARSER,
+        "List literal has 2 children, the second being INTEGER 2"
+    );
+
+    failed += test_assert(
+        ast_type(program, 7) == AST_SYMBOL &&
+        strcmp(ast_payload(program, 7)->symbol->data, "c") == 0,
+        TAG_PARSER,
+        "Last node is SYMBOL 'c'"
+    );
+
+    astprogram_free(program);
+    parser_free(parser);
+    lexer_free(lexer);
+
+    return failed;
+}
+
+static int test_positions() {
+    int failed = 0;
+
+    Lexer *lexer = lexer_create("(a\n  [1 2])\n(b)");
+    Parser *parser = parser_create(lexer);
+    ASTProgram *program = parser_parse(parser);
+
+    // 0 = (a ...), 1 = a, 2 = [1 2], 3 = 1, 4 = 2, 5 = (b), 6 = b
+    failed += test_assert(
+        ast_position(program, 0).line == 1 && ast_position(program, 0).col == 1 &&
+        ast_position(program, 1).line == 1 && ast_position(program, 1).col == 2,
+        TAG_PARSER,
+        "Lists start at their opening parenthesis"
+    );
+    failed += test_assert(
+        ast_position(program, 2).line == 2 && ast_position(program, 2).col == 3 &&
+        ast_position(program, 4).line == 2 && ast_position(program, 4).col == 6,
+        TAG_PARSER,
+        "List literals and their elements have their own positions"
+    );
+    failed += test_assert(
+        ast_position(program, 5).line == 3 && ast_position(program, 6).col == 2,
+        TAG_PARSER,
+        "Later top-level expressions are on later lines"
+    );
+
+    astprogram_free(program);
+    parser_free(parser);
+    lexer_free(lexer);
+
+    return failed;
+}
+
 int run_parser_tests() {
     int failed = 0;
     failed += test_basic();
+    failed += test_flat_layout();
+    failed += test_positions();
 
     if (failed > 0) {
         printf("%s: Tests failed: %d\n", TAG_PARSER, failed);
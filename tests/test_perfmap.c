@@ -0,0 +1,120 @@
+#include "test_perfmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "perfmap.h"
+#include "file_util.h"
+#include "testutil.h"
+
+const char *TAG_PERFMAP = "TEST_PERFMAP";
+
+// A function on line 1 and a hot loop on lines 3 and 4
+static char *mapped_source =
+    "(defun twice [n] (* n 2))\n"
+    "(define i (twice 0))\n"
+    "(while (< i 200)\n"
+    "    (define i (+ i 1)))\n";
+
+static void map_interpreted(CompiledRun *run) {
+    run->vm->perf = perf_map_create(run->compiled.bbuf, "scripts/mapped.mslisp");
+}
+
+static void map_jit(CompiledRun *run) {
+    run->vm->jit = true;
+    map_interpreted(run);
+}
+
+static void map_trace(CompiledRun *run) {
+    run->vm->trace = true;
+    map_interpreted(run);
+}
+
+// Runs the source with a perf map set up by setup, returning what the map file holds
+static char *run_mapped(RunSetup setup, PerfMap **names) {
+    CompiledRun run = compiled_run(mapped_source, setup);
+    fflush(run.vm->perf->file);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    char *text = file_read_all(path);
+    if (names) {
+        *names = run.vm->perf;
+    }
+    else {
+        perf_map_free(run.vm->perf);
+    }
+    remove(path);
+
+    compiled_run_free(&run);
+    return text;
+}
+
+static int test_names() {
+    int failed = 0;
+
+    PerfMap *map;
+    char *text = run_mapped(map_interpreted, &map);
+    failed += test_assert(
+        text && text[0] == '\0',
+        TAG_PERFMAP,
+        "The interpreters write no symbols"
+    );
+    failed += test_assert(
+        strcmp(map->names[0], "lvm:main:mapped.mslisp:1") == 0 &&
+            strcmp(map->names[2], "lvm:twice:mapped.mslisp:1") == 0 &&
+            map->names[2] == map->names[3] &&
+            strcmp(map->names[map->pc_count - 1], "lvm:main:mapped.mslisp:3") == 0,
+        TAG_PERFMAP,
+        "Instructions are named after their function, script file name and line, shared along a line"
+    );
+    free(text);
+    perf_map_free(map);
+    return failed;
+}
+
+static int test_jit_symbols() {
+    int failed = 0;
+
+    char *text = run_mapped(map_jit, NULL);
+    bool well_formed = text != NULL;
+    int lines = 0;
+    for (char *line = text; well_formed && *line; line = strchr(line, '\n') + 1) {
+        unsigned long start, size;
+        char name[128];
+        well_formed = strchr(line, '\n') && sscanf(line, "%lx %lx %127s", &start, &size, name) == 3 &&
+            start != 0 && size != 0 && strncmp(name, "lvm:", 4) == 0;
+        lines++;
+    }
+    failed += test_assert(
+        well_formed && lines > 4 &&
+            strstr(text, " lvm:jit-entry\n") && strstr(text, " lvm:twice:mapped.mslisp:1\n") &&
+            strstr(text, " lvm:main:mapped.mslisp:4\n"),
+        TAG_PERFMAP,
+        "The JIT writes a start, size and name for each line of the code it compiles"
+    );
+    free(text);
+
+    text = run_mapped(map_trace, NULL);
+    failed += test_assert(
+        text && strstr(text, " lvm:trace:main:mapped.mslisp:3\n") && strchr(text, '\n') == strrchr(text, '\n'),
+        TAG_PERFMAP,
+        "A compiled trace is named after its loop header"
+    );
+    free(text);
+    return failed;
+}
+
+int run_perfmap_tests() {
+    int failed = 0;
+    failed += test_names();
+    failed += test_jit_symbols();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_PERFMAP, failed);
+    }
+    return failed;
+}
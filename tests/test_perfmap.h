@@ -0,0 +1,8 @@
+#ifndef TEST_PERFMAP_H
+#define TEST_PERFMAP_H
+
+extern const char *TAG_PERFMAP;
+
+int run_perfmap_tests();
+
+#endif // TEST_PERFMAP_H
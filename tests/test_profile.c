@@ -0,0 +1,130 @@
+#include "test_profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "profile.h"
+#include "testutil.h"
+
+const char *TAG_PROFILE = "TEST_PROFILE";
+
+// Adds 1 to a counter three times, then halts
+static Instruction counting_loop[] = {
+    {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}},  // 0
+    {OP_DUP, {}},                                       // 1: loop
+    {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},  // 2
+    {OP_LT, {}},                                        // 3
+    {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 10}}, // 4
+    {OP_JMP_IF_FALSE, {}},                              // 5
+    {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},  // 6
+    {OP_ADD, {}},                                       // 7
+    {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},  // 8
+    {OP_JMP, {}},                                       // 9 (jumped over by 5)
+    {OP_HALT, {}}                                       // 10
+};
+
+static VM *run_profiled() {
+    VM *vm = vm_create();
+    int count = sizeof(counting_loop) / sizeof(counting_loop[0]);
+    vm_load_code(vm, counting_loop, count, NULL, 0);
+    vm->profile = profile_create(vm->code_count);
+    vm_execute(vm);
+    return vm;
+}
+
+static int test_counts() {
+    int failed = 0;
+    VM *vm = run_profiled();
+    Profile *profile = vm->profile;
+
+    failed += test_assert(
+        vm->sp == 1 && vm_stack_get(vm, 0).as.integer == 3,
+        TAG_PROFILE,
+        "Profiled code runs to the same result"
+    );
+    failed += test_assert(
+        profile->counts[OP_JMP] == 3 && profile->counts[OP_JMP_IF_FALSE] == 4 &&
+            profile->counts[OP_HALT] == 1,
+        TAG_PROFILE,
+        "Every opcode executed is counted, including the halt"
+    );
+    // Quickening rewrites them after their first run, so they show up as what actually ran
+    failed += test_assert(
+        profile->counts[OP_ADD] + profile->counts[OP_QADD_II] == 3 &&
+            profile->counts[OP_LT] + profile->counts[OP_QLT_II] == 4,
+        TAG_PROFILE,
+        "Quickened opcodes are counted under their quickened form"
+    );
+    failed += test_assert(
+        profile->pc_hits[0] == 1 && profile->pc_hits[1] == 4 && profile->pc_hits[7] == 3 &&
+            profile->pc_hits[10] == 1,
+        TAG_PROFILE,
+        "Hits are counted per instruction"
+    );
+    failed += test_assert(
+        profile->counts[OP_DUP] == profile->pc_hits[1] && profile->time[OP_CALL] == 0,
+        TAG_PROFILE,
+        "Opcodes that never ran have no time"
+    );
+
+    profile_free(profile);
+    vm_free(vm);
+    return failed;
+}
+
+static int test_reports() {
+    int failed = 0;
+    VM *vm = run_profiled();
+
+    FILE *report = tmpfile();
+    profile_print(vm->profile, vm, report);
+    long size = ftell(report);
+    char *text = calloc(size + 1, 1);
+    rewind(report);
+    fread(text, 1, size, report);
+    fclose(report);
+
+    failed += test_assert(
+        strstr(text, "34 instructions") && strstr(text, "OP_JMP_IF_FALSE") && strstr(text, "Hottest"),
+        TAG_PROFILE,
+        "The report shows totals, opcodes and hot instructions"
+    );
+    free(text);
+
+    char path[] = "/tmp/lvm_profile_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    bool written = profile_write_json(vm->profile, vm, path);
+
+    char json[4096] = "";
+    FILE *in = fopen(path, "r");
+    fread(json, 1, sizeof(json) - 1, in);
+    fclose(in);
+    remove(path);
+
+    failed += test_assert(
+        written && strstr(json, "\"instructions\": 34") &&
+            strstr(json, "{\"opcode\": \"OP_JMP\", \"count\": 3,") &&
+            strstr(json, "{\"pc\": 1, \"opcode\": \"OP_DUP\", \"hits\": 4}"),
+        TAG_PROFILE,
+        "The JSON has counts per opcode and hits per instruction"
+    );
+
+    profile_free(vm->profile);
+    vm_free(vm);
+    return failed;
+}
+
+int run_profile_tests() {
+    int failed = 0;
+    failed += test_counts();
+    failed += test_reports();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_PROFILE, failed);
+    }
+    return failed;
+}
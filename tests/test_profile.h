@@ -0,0 +1,8 @@
+#ifndef TEST_PROFILE_H
+#define TEST_PROFILE_H
+
+extern const char *TAG_PROFILE;
+
+int run_profile_tests();
+
+#endif // TEST_PROFILE_H
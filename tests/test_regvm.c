@@ -0,0 +1,124 @@
+#include "test_regvm.h"
+
+#include <stdio.h>
+
+#include "regvm.h"
+#include "vm.h"
+#include "testutil.h"
+
+const char *TAG_REGVM = "TEST_REGVM";
+
+// Compiles and runs the source, on the register VM if regvm is set.
+// Returns the VM, which the caller frees.
+static VM *run_source(char *source, bool regvm) {
+    CompiledSource compiled = compile_source(source);
+    VM *vm = compiled_source_load(&compiled);
+    vm->regvm = regvm;
+    vm_execute(vm);
+    compiled_source_free(&compiled);
+    return vm;
+}
+
+static bool same_value(Value a, Value b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_INTEGER: return a.as.integer == b.as.integer;
+        case VAL_FLOAT: return a.as.floating == b.as.floating;
+        case VAL_BOOL: return a.as.boolean == b.as.boolean;
+        case VAL_LIST: return a.as.list->count == b.as.list->count;
+        default: return true;
+    }
+}
+
+// True if the program leaves the same stack on both VMs, with fewer dispatches on the register VM
+static bool matches_stack_vm(char *source) {
+    VM *stack_vm = run_source(source, false);
+    VM *reg_vm = run_source(source, true);
+
+    bool same = stack_vm->sp == reg_vm->sp && reg_vm->stats.dispatches < stack_vm->stats.dispatches;
+    for (int i = 0; same && i < stack_vm->sp; i++) {
+        same = same_value(vm_stack_get(stack_vm, i), vm_stack_get(reg_vm, i));
+    }
+
+    vm_free(stack_vm);
+    vm_free(reg_vm);
+    return same;
+}
+
+static int test_same_results() {
+    int failed = 0;
+
+    failed += test_assert(
+        matches_stack_vm("(define i 0) (while (< i 10) (define i (+ i 1)) i) (do 1 2 3)"),
+        TAG_REGVM,
+        "Globals, while and do"
+    );
+
+    failed += test_assert(
+        matches_stack_vm("(let [a 5 b (* a 2)] (define a (+ a b)) (if (> a 10) (- a b) a))"),
+        TAG_REGVM,
+        "Let, local stores and if"
+    );
+
+    failed += test_assert(
+        matches_stack_vm("(let [x 1 y 2] (let [x y y x] (+ (* x 10) y)))"),
+        TAG_REGVM,
+        "Locals read before being overwritten keep their old values"
+    );
+
+    failed += test_assert(
+        matches_stack_vm(
+            "(defun fib [n] (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+            "(defun count [i acc] (if (= i 0) acc (count (- i 1) (+ acc 1))))"
+            "(defun adder [n] (lambda [x] (+ x n)))"
+            "(+ (fib 15) (count 100 0) ((adder 1) 2))"
+        ),
+        TAG_REGVM,
+        "Calls, tail calls and closures"
+    );
+
+    failed += test_assert(
+        matches_stack_vm("(define x 1) (define y (+ x 1)) (define x 2.5) (let [z (+ x y)] [z (* z 2.0) (= z 4.5)])"),
+        TAG_REGVM,
+        "Mixed numbers, floats and lists"
+    );
+
+    return failed;
+}
+
+static int test_translation() {
+    int failed = 0;
+
+    // (define z (+ x y)) is LOAD_VAR, LOAD_VAR, ADD, STORE_VAR on the stack VM
+    VM *vm = run_source("(define x 1) (define y 2) (define z (+ x y))", false);
+    RegProgram *program = regvm_translate(vm);
+    int adds = 0;
+    for (int i = 0; i < program->count; i++) {
+        RegInstruction insn = program->code[i];
+        if (insn.op == ROP_ADD && insn.dst.kind == REG_GLOBAL && insn.left.kind == REG_GLOBAL && insn.right.kind == REG_GLOBAL) {
+            adds++;
+        }
+    }
+    failed += test_assert(
+        adds == 1,
+        TAG_REGVM,
+        "Adding two globals into a third is one instruction"
+    );
+    regvm_program_free(program);
+    vm_free(vm);
+
+    return failed;
+}
+
+int run_regvm_tests() {
+    int failed = 0;
+    failed += test_same_results();
+    failed += test_translation();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_REGVM, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_REGVM_H
+#define TEST_REGVM_H
+
+extern const char *TAG_REGVM;
+
+int run_regvm_tests();
+
+#endif // TEST_REGVM_H
@@ -4,14 +4,44 @@
 #include "test_vm.h"
 #include "test_lexer.h"
 #include "test_parser.h"
+#include "test_codegen.h"
+#include "test_typeinfer.h"
+#include "test_verifier.h"
+#include "test_trace.h"
+#include "test_regvm.h"
+#include "test_profile.h"
+#include "test_sampler.h"
+#include "test_allocprofile.h"
+#include "test_heapsnap.h"
+#include "test_disasm.h"
+#include "test_perfmap.h"
 
 int main() {
     int failed = 0;
     
     failed += run_vm_string_tests();
-    failed += run_vm_tests();
+    failed += run_vm_tests(false);
+#ifndef VM_SOA_STACK
+    // The JITs only generate code for the default stack layout
+    failed += run_vm_tests(true);
+#endif
     failed += run_lexer_tests();
     failed += run_parser_tests();
+    failed += run_codegen_tests();
+    failed += run_typeinfer_tests();
+    failed += run_verifier_tests();
+#ifndef VM_SOA_STACK
+    failed += run_trace_tests();
+#endif
+    failed += run_regvm_tests();
+    failed += run_profile_tests();
+    failed += run_sampler_tests();
+    failed += run_allocprofile_tests();
+    failed += run_heapsnap_tests();
+    failed += run_disasm_tests();
+#ifndef VM_SOA_STACK
+    failed += run_perfmap_tests();
+#endif
 
     if (failed == 0) {
         printf("No asserts failed; all tests passed.\n");
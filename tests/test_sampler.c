@@ -0,0 +1,108 @@
+#include "test_sampler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codegen.h"
+#include "vm.h"
+#include "sampler.h"
+#include "testutil.h"
+
+const char *TAG_SAMPLER = "TEST_SAMPLER";
+
+// Spends a few tenths of a second of CPU time in a loop on line 3, called from line 5
+static char *spin_source =
+    "(defun spin [n]\n"
+    "  (let [i 0]\n"
+    "    (while (< i n) (define i (+ i 1)))\n"
+    "    i))\n"
+    "(spin 5000000)\n";
+
+static int test_sampling() {
+    int failed = 0;
+
+    CompiledSource compiled = compile_source(spin_source);
+    BytecodeBuf *bbuf = compiled.bbuf;
+    VM *vm = compiled_source_load(&compiled);
+    Sampler *sampler = sampler_start(vm, SAMPLER_HZ);
+    failed += test_assert(
+        sampler != NULL && sampler_start(vm, SAMPLER_HZ) == NULL,
+        TAG_SAMPLER,
+        "Only one sampler runs at a time"
+    );
+    vm_execute(vm);
+    sampler_stop(sampler);
+
+    failed += test_assert(
+        vm_stack_get(vm, 0).as.integer == 5000000 && sampler->samples > 0 && sampler->dropped == 0,
+        TAG_SAMPLER,
+        "The timer takes samples while the program runs"
+    );
+
+    FILE *folded = tmpfile();
+    sampler_write_folded(sampler, bbuf, folded);
+    char *stacks = read_back(folded);
+    failed += test_assert(
+        strstr(stacks, "main:5;spin:3 ") != NULL,
+        TAG_SAMPLER,
+        "Folded stacks name the caller first, then the function and line running"
+    );
+    free(stacks);
+
+    FILE *report = tmpfile();
+    sampler_print_lines(sampler, bbuf, spin_source, report);
+    char *lines = read_back(report);
+    failed += test_assert(
+        strstr(lines, "(while (< i n) (define i (+ i 1)))") != NULL,
+        TAG_SAMPLER,
+        "The line report shows the source of the busiest line"
+    );
+    free(lines);
+
+    sampler_free(sampler);
+    vm_free(vm);
+    compiled_source_free(&compiled);
+    return failed;
+}
+
+static int test_sampling_jit() {
+    int failed = 0;
+
+    CompiledSource compiled = compile_source(spin_source);
+    BytecodeBuf *bbuf = compiled.bbuf;
+    VM *vm = compiled_source_load(&compiled);
+    vm->jit = true;
+    Sampler *sampler = sampler_start(vm, SAMPLER_HZ);
+    vm_execute(vm);
+    sampler_stop(sampler);
+
+    FILE *folded = tmpfile();
+    sampler_write_folded(sampler, bbuf, folded);
+    char *stacks = read_back(folded);
+    failed += test_assert(
+        vm_stack_get(vm, 0).as.integer == 5000000 && vm->stats.jit_runs == 0 &&
+            strstr(stacks, "main:5;spin:3 ") != NULL,
+        TAG_SAMPLER,
+        "Sampling with the JIT on interprets, so samples still land on the running line"
+    );
+    free(stacks);
+
+    failed += test_assert(!vm->sampling, TAG_SAMPLER, "Stopping the sampler lets vm_execute compile again");
+
+    sampler_free(sampler);
+    vm_free(vm);
+    compiled_source_free(&compiled);
+    return failed;
+}
+
+int run_sampler_tests() {
+    int failed = 0;
+    failed += test_sampling();
+    failed += test_sampling_jit();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_SAMPLER, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_SAMPLER_H
+#define TEST_SAMPLER_H
+
+extern const char *TAG_SAMPLER;
+
+int run_sampler_tests();
+
+#endif // TEST_SAMPLER_H
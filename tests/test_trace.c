@@ -0,0 +1,107 @@
+#include "test_trace.h"
+
+#include <stdio.h>
+
+#include "vm.h"
+#include "testutil.h"
+
+const char *TAG_TRACE = "TEST_TRACE";
+
+static void enable_trace(CompiledRun *run) {
+    run->vm->trace = true;
+}
+
+static int test_hot_loops() {
+    int failed = 0;
+
+    CompiledRun run = compiled_run("(let [i 0 acc 0] (while (< i 1000) (define i (+ i 1)) (define acc (+ acc i))) acc)", enable_trace);
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_INTEGER && vm_stack_get(run.vm, 0).as.integer == 500500 &&
+            run.vm->stats.traces_compiled == 1 &&
+            run.vm->stats.side_exits == 1,
+        TAG_TRACE,
+        "Integer loop is traced and leaves through its loop condition"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(let [x 0.0] (while (< x 100.0) (define x (+ x 0.5))) x)", enable_trace);
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_FLOAT && vm_stack_get(run.vm, 0).as.floating == 100.0 &&
+            run.vm->stats.traces_compiled == 1,
+        TAG_TRACE,
+        "Float loop is traced"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(let [i 0 j 0 n 0] (while (< i 100) (define j 0) (while (< j 100) (define j (+ j 1)) (define n (+ n 1))) (define i (+ i 1))) n)", enable_trace);
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_INTEGER && vm_stack_get(run.vm, 0).as.integer == 10000 &&
+            run.vm->stats.traces_compiled >= 1,
+        TAG_TRACE,
+        "Nested loops get the right result"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_guards() {
+    int failed = 0;
+
+    // x turns into a float partway through, after the loop was traced with integers
+    CompiledRun run = compiled_run(
+        "(let [i 0 x 0] (while (< i 100) (if (= i 60) (define x 0.5) (define x x)) (define x (+ x 1)) (define i (+ i 1))) x)",
+        enable_trace
+    );
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_FLOAT && vm_stack_get(run.vm, 0).as.floating == 40.5 &&
+            run.vm->stats.traces_compiled == 1 &&
+            run.vm->stats.side_exits > 1,
+        TAG_TRACE,
+        "Type and branch guards side exit to the interpreter"
+    );
+    compiled_run_free(&run);
+
+    run = compiled_run("(defun inc [n] (+ n 1)) (let [i 0] (while (< i 100) (define i (inc i))) i)", enable_trace);
+    failed += test_assert(
+        run.vm->sp == 1 && vm_stack_get(run.vm, 0).type == VAL_INTEGER && vm_stack_get(run.vm, 0).as.integer == 100 &&
+            run.vm->stats.traces_compiled == 0 &&
+            run.vm->stats.trace_aborts == 1,
+        TAG_TRACE,
+        "Loops that call functions aren't traced"
+    );
+    compiled_run_free(&run);
+
+    return failed;
+}
+
+static int test_instruction_count() {
+    int failed = 0;
+
+    // Guard and branch side exits and whole iterations in the trace each count their steps
+    char *source = "(let [i 0 x 0] (while (< i 100) (if (= i 60) (define x 0.5) (define x x)) (define x (+ x 1)) (define i (+ i 1))) x)";
+    CompiledRun interpreted = compiled_run(source, NULL);
+    CompiledRun traced = compiled_run(source, enable_trace);
+    failed += test_assert(
+        traced.vm->stats.traces_compiled == 1 && traced.vm->stats.side_exits > 1 &&
+            traced.vm->stats.dispatches == interpreted.vm->stats.dispatches,
+        TAG_TRACE,
+        "Traced runs count the same instructions as the interpreter"
+    );
+    compiled_run_free(&interpreted);
+    compiled_run_free(&traced);
+
+    return failed;
+}
+
+int run_trace_tests() {
+    int failed = 0;
+    failed += test_hot_loops();
+    failed += test_guards();
+    failed += test_instruction_count();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_TRACE, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_TRACE_H
+#define TEST_TRACE_H
+
+extern const char *TAG_TRACE;
+
+int run_trace_tests();
+
+#endif // TEST_TRACE_H
@@ -0,0 +1,124 @@
+#include "test_typeinfer.h"
+
+#include <stdio.h>
+
+#include "typeinfer.h"
+#include "testutil.h"
+
+const char *TAG_TYPEINFER = "TEST_TYPEINFER";
+
+// Infers the types of a program and returns the type of its last top-level expression
+static StaticType last_expression_type(char *source) {
+    CompiledSource parsed = parse_source(source);
+    ASTProgram *program = parsed.program;
+
+    typeinfer_program(program);
+    StaticType type = typeinfer_node_type(program, program->expressions[program->count - 1]);
+    compiled_source_free(&parsed);
+    return type;
+}
+
+static int test_expressions() {
+    int failed = 0;
+
+    failed += test_assert(
+        last_expression_type("(+ 1 (* 2 3))") == TYPE_INTEGER,
+        TAG_TYPEINFER,
+        "Integer arithmetic is an integer"
+    );
+
+    failed += test_assert(
+        last_expression_type("(+ 1 2.5)") == TYPE_FLOAT,
+        TAG_TYPEINFER,
+        "Mixed arithmetic is a float"
+    );
+
+    failed += test_assert(
+        last_expression_type("(float2int (/ 7 2))") == TYPE_INTEGER &&
+            last_expression_type("(int2float 3)") == TYPE_FLOAT,
+        TAG_TYPEINFER,
+        "Conversions have the type they convert to"
+    );
+
+    failed += test_assert(
+        last_expression_type("(< 1 2)") == TYPE_BOOL &&
+            last_expression_type("(concat \"a\" \"b\")") == TYPE_STRING,
+        TAG_TYPEINFER,
+        "Comparisons are bools and concat is a string"
+    );
+
+    failed += test_assert(
+        last_expression_type("(if true 1 \"one\")") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "if with branches of different types is unknown"
+    );
+
+    failed += test_assert(
+        last_expression_type("(defun + [a b] \"sum\") (+ 1 2)") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "A defun that shadows a builtin is not treated as the builtin"
+    );
+
+    return failed;
+}
+
+static int test_variables() {
+    int failed = 0;
+
+    failed += test_assert(
+        last_expression_type("(define i 0) (while (< i 10) (define i (+ i 1))) i") == TYPE_INTEGER,
+        TAG_TYPEINFER,
+        "A global only ever assigned integers is an integer"
+    );
+
+    failed += test_assert(
+        last_expression_type("(define x 0) (define y x) (define x 1.5) y") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "Later assignments of another type make a global unknown everywhere"
+    );
+
+    failed += test_assert(
+        last_expression_type("(defun reset [] (define total \"none\")) (define total 0) total") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "Assignments inside function bodies count too"
+    );
+
+    failed += test_assert(
+        last_expression_type("(defun setup [] (define h 2.5)) (defun f [] (+ h 1.5)) (f) h") == TYPE_UNKNOWN &&
+            last_expression_type("(define x (+ x 0.5)) x") == TYPE_UNKNOWN &&
+            last_expression_type("(if false (define z 1.5) 0) z") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "A global that can be read before it's assigned may still hold the integer 0"
+    );
+
+    failed += test_assert(
+        last_expression_type("(define h 2.5) (defun f [] (+ h 1.5)) (defun g [] (define h 0.5)) h") == TYPE_FLOAT,
+        TAG_TYPEINFER,
+        "A global defined at the top level before any use keeps the type of its defines"
+    );
+
+    failed += test_assert(
+        last_expression_type("(let [a 1.0 b (* a 2.0)] (define a (+ a b)) a)") == TYPE_FLOAT,
+        TAG_TYPEINFER,
+        "Local variables get the type of their bindings and defines"
+    );
+
+    failed += test_assert(
+        last_expression_type("(defun f [n] (+ n 1)) (let [x (f 1)] x)") == TYPE_UNKNOWN,
+        TAG_TYPEINFER,
+        "Function parameters and results are unknown"
+    );
+
+    return failed;
+}
+
+int run_typeinfer_tests() {
+    int failed = 0;
+    failed += test_expressions();
+    failed += test_variables();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_TYPEINFER, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_TYPEINFER_H
+#define TEST_TYPEINFER_H
+
+extern const char *TAG_TYPEINFER;
+
+int run_typeinfer_tests();
+
+#endif // TEST_TYPEINFER_H
@@ -0,0 +1,220 @@
+#include "test_verifier.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "verifier.h"
+#include "vm.h"
+#include "testutil.h"
+
+const char *TAG_VERIFIER = "TEST_VERIFIER";
+
+#define CODE_LENGTH(code) (sizeof(code) / sizeof((code)[0]))
+
+// Compiles the source and runs the verifier on the result
+static bool verify_source(char *source, VerifyResult *result) {
+    CompiledSource compiled = compile_source(source);
+    BytecodeBuf *bbuf = compiled.bbuf;
+    bool verified = bytecode_verify(bbuf->instructions, bbuf->count, bbuf->functions, bbuf->function_count, result);
+    compiled_source_free(&compiled);
+    return verified;
+}
+
+static int test_compiled_code() {
+    int failed = 0;
+    VerifyResult result;
+
+    failed += test_assert(
+        verify_source("(define a 1) (define b [a 2 3]) (let [i 0] (while (< i 3) (define i (+ i 1))) (if (= i 3) b a))", &result) &&
+            result.global_count == 2 &&
+            result.max_stack == 3,
+        TAG_VERIFIER,
+        "Globals, lists, let, while and if verify"
+    );
+
+    failed += test_assert(
+        verify_source(
+            "(defun fib [n] (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+            "(defun count [i] (if (= i 0) 0 (count (- i 1))))"
+            "(defun adder [n] (lambda [x] (+ x n)))"
+            "(+ (fib 10) (count 5) ((adder 1) 2))",
+            &result
+        ) && result.max_frame > 0 && result.max_stack < 64,
+        TAG_VERIFIER,
+        "Functions, tail calls and closures verify, with room for the top-level code and one frame"
+    );
+
+    // A function with 300 parameters, called once
+    char wide[4096] = "(defun wide [";
+    for (int i = 0; i < 300; i++) {
+        snprintf(wide + strlen(wide), sizeof(wide) - strlen(wide), "p%d ", i);
+    }
+    strcat(wide, "] p299) (wide");
+    for (int i = 0; i < 300; i++) {
+        strcat(wide, " 1");
+    }
+    strcat(wide, ")");
+    failed += test_assert(
+        verify_source(wide, &result) && result.max_frame > 300 && result.max_stack < 1000,
+        TAG_VERIFIER,
+        "Wide frames verify without reserving room for the deepest call stack"
+    );
+
+    return failed;
+}
+
+static int test_rejected_code() {
+    int failed = 0;
+    VerifyResult result;
+
+    Instruction underflow[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_ADD, {}},
+        {OP_HALT, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(underflow, CODE_LENGTH(underflow), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Popping more values than the stack holds is rejected"
+    );
+
+    Instruction computed_jump[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_STORE_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_JMP, {}},
+        {OP_HALT, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(computed_jump, CODE_LENGTH(computed_jump), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Jumps to addresses that aren't constants are rejected"
+    );
+
+    Instruction depth_mismatch[] = {
+        {OP_PUSH, {.type = VAL_BOOL, .as.boolean = true}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 4}},
+        {OP_JMP_IF_FALSE, {}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_HALT, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(depth_mismatch, CODE_LENGTH(depth_mismatch), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Paths that reach an instruction with different stack depths are rejected"
+    );
+
+    Instruction jump_into_jump[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_JMP, {}},
+        {OP_JMP, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(jump_into_jump, CODE_LENGTH(jump_into_jump), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Jumping straight to a jump is rejected, since its address isn't known"
+    );
+
+    Instruction bad_operands[] = {
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_HALT, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(bad_operands, CODE_LENGTH(bad_operands), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Local slots outside the frame are rejected"
+    );
+
+    Instruction top_level_return[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_RET, {}}
+    };
+    failed += test_assert(
+        !bytecode_verify(top_level_return, CODE_LENGTH(top_level_return), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Returning outside of a function is rejected"
+    );
+
+    Instruction falls_off_end[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}}
+    };
+    failed += test_assert(
+        !bytecode_verify(falls_off_end, CODE_LENGTH(falls_off_end), NULL, 0, &result),
+        TAG_VERIFIER,
+        "Code that runs past its last instruction is rejected"
+    );
+
+    return failed;
+}
+
+static int test_vm_fallback() {
+    int failed = 0;
+    VM *vm;
+
+    Instruction verified_code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 40}},
+        {OP_STORE_VAR, {.type = VAL_INTEGER, .as.integer = 100}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_ADD, {}},
+        {OP_HALT, {}}
+    };
+    vm = vm_create();
+    vm_load_code(vm, verified_code, CODE_LENGTH(verified_code), NULL, 0);
+    vm_execute(vm);
+    failed += test_assert(
+        vm->verified && vm->globals_cap > 100 && vm->sp == 1 && vm_stack_get(vm, 0).as.integer == 42,
+        TAG_VERIFIER,
+        "Verified code runs unchecked, with globals allocated up front"
+    );
+    vm_free(vm);
+
+    // Jumps to an address loaded from a variable
+    Instruction unverified_code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 6}},
+        {OP_DUP, {}},
+        {OP_STORE_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_DISCARD, {}},
+        {OP_LOAD_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_JMP, {}},
+        {OP_HALT, {}}
+    };
+    vm = vm_create();
+    vm_load_code(vm, unverified_code, CODE_LENGTH(unverified_code), NULL, 0);
+    vm_execute(vm);
+    failed += test_assert(
+        !vm->verified && vm->pc == 7 && vm->sp == 1,
+        TAG_VERIFIER,
+        "Code the verifier rejects still runs on the checked path"
+    );
+    vm_free(vm);
+
+    // Recursion 5000 calls deep, well past the stack reserved at load
+    for (int jit = 0; jit <= 1; jit++) {
+        CompiledSource compiled = compile_source("(defun depth [n] (if (= n 0) 0 (+ 1 (depth (- n 1))))) (depth 5000)");
+        vm = compiled_source_load(&compiled);
+        vm->jit = jit;
+        size_t loaded_cap = vm->stack_cap;
+        vm_execute(vm);
+        failed += test_assert(
+            vm->verified && vm->sp == 1 && vm_stack_get(vm, 0).as.integer == 5000 && vm->stack_cap > loaded_cap,
+            TAG_VERIFIER,
+            jit ? "Verified code grows the stack at calls with the JIT asked for" : "Verified code grows the stack at calls"
+        );
+        vm_free(vm);
+        compiled_source_free(&compiled);
+    }
+
+    return failed;
+}
+
+int run_verifier_tests() {
+    int failed = 0;
+    failed += test_compiled_code();
+    failed += test_rejected_code();
+    failed += test_vm_fallback();
+
+    if (failed > 0) {
+        printf("%s: Tests failed: %d\n", TAG_VERIFIER, failed);
+    }
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_VERIFIER_H
+#define TEST_VERIFIER_H
+
+extern const char *TAG_VERIFIER;
+
+int run_verifier_tests();
+
+#endif // TEST_VERIFIER_H
@@ -9,6 +9,14 @@
 
 const char *TAG_VM = "TEST_VM";
 
+static bool use_jit = false; // Run the tests' code through the JIT instead of the interpreter
+
+// Loads test code into the VM, in JIT mode if the tests are run that way
+static void load_code(VM *vm, Instruction *code, size_t count, FunctionProto *functions, int function_count) {
+    vm->jit = use_jit;
+    vm_load_code(vm, code, count, functions, function_count);
+}
+
 static int test_push_pop() {
     int failed = 0;
 
@@ -17,7 +25,7 @@ static int test_push_pop() {
     String *s2 = string_create_from("hello");
     
     //vm->debug = true;
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_BOOL, .as.boolean = true}},
         {OP_PUSH, {.type = VAL_BOOL, .as.boolean = false}},
         {OP_PUSH, {.type = VAL_FLOAT, .as.floating = -25.0}},
@@ -30,52 +38,53 @@ static int test_push_pop() {
         {OP_PUSH, {.type = VAL_STRING, .as.string = s2}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_BOOL && vm->stack[0].as.boolean == true,
+        vm_stack_get(vm, 0).type == VAL_BOOL && vm_stack_get(vm, 0).as.boolean == true,
         TAG_VM,
         "Pushed true bool"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_BOOL && vm->stack[1].as.boolean == false,
+        vm_stack_get(vm, 1).type == VAL_BOOL && vm_stack_get(vm, 1).as.boolean == false,
         TAG_VM,
         "Pushed false bool"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_FLOAT && vm->stack[2].as.floating == -25.0,
+        vm_stack_get(vm, 2).type == VAL_FLOAT && vm_stack_get(vm, 2).as.floating == -25.0,
         TAG_VM,
         "Pushed -25 float"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_FLOAT && vm->stack[3].as.floating == 3.1415,
+        vm_stack_get(vm, 3).type == VAL_FLOAT && vm_stack_get(vm, 3).as.floating == 3.1415,
         TAG_VM,
         "Pushed 3.1415 float"
     );
 
     failed += test_assert(
-        vm->stack[4].type == VAL_INTEGER && vm->stack[4].as.integer == 0,
+        vm_stack_get(vm, 4).type == VAL_INTEGER && vm_stack_get(vm, 4).as.integer == 0,
         TAG_VM,
         "Popped second 3.1415 float, pushed 0 integer"
     );
 
     failed += test_assert(
-        vm->stack[5].type == VAL_INTEGER && vm->stack[5].as.integer == 600,
+        vm_stack_get(vm, 5).type == VAL_INTEGER && vm_stack_get(vm, 5).as.integer == 600,
         TAG_VM,
         "Pushed 600 integer"
     );
 
     failed += test_assert(
-        vm->stack[6].type == VAL_STRING && strcmp(vm->stack[6].as.string->data, "") == 0,
+        vm_stack_get(vm, 6).type == VAL_STRING && strcmp(vm_stack_get(vm, 6).as.string->data, "") == 0,
         TAG_VM,
         "Pushed empty string"
     );
 
     failed += test_assert(
-        vm->stack[7].type == VAL_STRING && strcmp(vm->stack[7].as.string->data, "hello") == 0,
+        vm_stack_get(vm, 7).type == VAL_STRING && strcmp(vm_stack_get(vm, 7).as.string->data, "hello") == 0,
         TAG_VM,
         "Pushed hello string"
     );
@@ -96,7 +105,7 @@ static int test_strings() {
     String *s4 = string_create_from("hello world");
     
     //vm->debug = true;
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_STRING, .as.string = s2}},
         {OP_PUSH, {.type = VAL_STRING, .as.string = s3}},
         {OP_PUSH, {.type = VAL_STRING, .as.string = s2}},
@@ -115,40 +124,41 @@ static int test_strings() {
         {OP_STRLEN, {}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_STRING && strcmp(vm->stack[0].as.string->data, " world") == 0,
+        vm_stack_get(vm, 0).type == VAL_STRING && strcmp(vm_stack_get(vm, 0).as.string->data, " world") == 0,
         TAG_VM,
         "First string world"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_STRING && strcmp(vm->stack[1].as.string->data, "hello world") == 0,
+        vm_stack_get(vm, 1).type == VAL_STRING && strcmp(vm_stack_get(vm, 1).as.string->data, "hello world") == 0,
         TAG_VM,
         "second string hello world"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_BOOL && vm->stack[2].as.boolean == true,
+        vm_stack_get(vm, 2).type == VAL_BOOL && vm_stack_get(vm, 2).as.boolean == true,
         TAG_VM,
         "STR_EQ returned true for equal"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_BOOL && vm->stack[3].as.boolean == false,
+        vm_stack_get(vm, 3).type == VAL_BOOL && vm_stack_get(vm, 3).as.boolean == false,
         TAG_VM,
         "STR_EQ returned false for non-equal"
     );
 
     failed += test_assert(
-        vm->stack[4].type == VAL_STRING && strcmp(vm->stack[4].as.string->data, "wo") == 0,
+        vm_stack_get(vm, 4).type == VAL_STRING && strcmp(vm_stack_get(vm, 4).as.string->data, "wo") == 0,
         TAG_VM,
         "substring from hello world to wo"
     );
 
     failed += test_assert(
-        vm->stack[5].type == VAL_INTEGER && vm->stack[5].as.integer == 11,
+        vm_stack_get(vm, 5).type == VAL_INTEGER && vm_stack_get(vm, 5).as.integer == 11,
         TAG_VM,
         "STRLEN returned correct length"
     );
@@ -168,7 +178,7 @@ static int test_logic() {
     String *s2 = string_create_from("same");
     String *s3 = string_create_from("different");
 
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
         {OP_EQ, {}},
@@ -200,64 +210,65 @@ static int test_logic() {
         {OP_GTE, {}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_BOOL && vm->stack[0].as.boolean == false,
+        vm_stack_get(vm, 0).type == VAL_BOOL && vm_stack_get(vm, 0).as.boolean == false,
         TAG_VM,
         "EQ returned false for non-equal"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_BOOL && vm->stack[1].as.boolean == true,
+        vm_stack_get(vm, 1).type == VAL_BOOL && vm_stack_get(vm, 1).as.boolean == true,
         TAG_VM,
         "STR_EQ returned true for equal"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_BOOL && vm->stack[2].as.boolean == false,
+        vm_stack_get(vm, 2).type == VAL_BOOL && vm_stack_get(vm, 2).as.boolean == false,
         TAG_VM,
         "STR_EQ returned false for non-equal"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_BOOL && vm->stack[3].as.boolean == false,
+        vm_stack_get(vm, 3).type == VAL_BOOL && vm_stack_get(vm, 3).as.boolean == false,
         TAG_VM,
         "LOGIC_AND returned false for false and true"
     );
 
     failed += test_assert(
-        vm->stack[4].type == VAL_BOOL && vm->stack[4].as.boolean == true,
+        vm_stack_get(vm, 4).type == VAL_BOOL && vm_stack_get(vm, 4).as.boolean == true,
         TAG_VM,
         "LOGIC_OR returned true for false or true"
     );
 
     failed += test_assert(
-        vm->stack[5].type == VAL_BOOL && vm->stack[5].as.boolean == false,
+        vm_stack_get(vm, 5).type == VAL_BOOL && vm_stack_get(vm, 5).as.boolean == false,
         TAG_VM,
         "LOGIC_NOT returned false for not true"
     );
 
     failed += test_assert(
-        vm->stack[6].type == VAL_BOOL && vm->stack[6].as.boolean == false,
+        vm_stack_get(vm, 6).type == VAL_BOOL && vm_stack_get(vm, 6).as.boolean == false,
         TAG_VM,
         "LT returned false for 2 < 1"
     );
 
     failed += test_assert(
-        vm->stack[7].type == VAL_BOOL && vm->stack[7].as.boolean == true,
+        vm_stack_get(vm, 7).type == VAL_BOOL && vm_stack_get(vm, 7).as.boolean == true,
         TAG_VM,
         "LT returned true for 1 < 2"
     );
 
     failed += test_assert(
-        vm->stack[8].type == VAL_BOOL && vm->stack[8].as.boolean == true,
+        vm_stack_get(vm, 8).type == VAL_BOOL && vm_stack_get(vm, 8).as.boolean == true,
         TAG_VM,
         "GTE returned true for 1 >= 1"
     );
 
     failed += test_assert(
-        vm->stack[9].type == VAL_BOOL && vm->stack[9].as.boolean == true,
+        vm_stack_get(vm, 9).type == VAL_BOOL && vm_stack_get(vm, 9).as.boolean == true,
         TAG_VM,
         "GTE returned true for 2 >= 1"
     );
@@ -274,7 +285,7 @@ static int test_math() {
     int failed = 0;
     VM *vm = vm_create();
 
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
         {OP_ADD, {}},
@@ -296,46 +307,47 @@ static int test_math() {
         {OP_FLOAT2INT, {}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_INTEGER && vm->stack[0].as.integer == 3,
+        vm_stack_get(vm, 0).type == VAL_INTEGER && vm_stack_get(vm, 0).as.integer == 3,
         TAG_VM,
         "1 + 2 = 3"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_INTEGER && vm->stack[1].as.integer == 3,
+        vm_stack_get(vm, 1).type == VAL_INTEGER && vm_stack_get(vm, 1).as.integer == 3,
         TAG_VM,
         "5 - 2 = 3"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_FLOAT && vm->stack[2].as.floating == 12.0,
+        vm_stack_get(vm, 2).type == VAL_FLOAT && vm_stack_get(vm, 2).as.floating == 12.0,
         TAG_VM,
         "4 * 3.0 = 12.0"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_FLOAT && vm->stack[3].as.floating == 5.0,
+        vm_stack_get(vm, 3).type == VAL_FLOAT && vm_stack_get(vm, 3).as.floating == 5.0,
         TAG_VM,
         "2.0 / 10.0 = 0.2"
     );
 
     failed += test_assert(
-        vm->stack[4].type == VAL_INTEGER && vm->stack[4].as.integer == 1,
+        vm_stack_get(vm, 4).type == VAL_INTEGER && vm_stack_get(vm, 4).as.integer == 1,
         TAG_VM,
         "10 mod 3 = 1"
     );
 
     failed += test_assert(
-        vm->stack[5].type == VAL_FLOAT && vm->stack[5].as.floating == 3.0,
+        vm_stack_get(vm, 5).type == VAL_FLOAT && vm_stack_get(vm, 5).as.floating == 3.0,
         TAG_VM,
         "int2float 3 = 3.0"
     );
 
     failed += test_assert(
-        vm->stack[6].type == VAL_INTEGER && vm->stack[6].as.integer == 2,
+        vm_stack_get(vm, 6).type == VAL_INTEGER && vm_stack_get(vm, 6).as.integer == 2,
         TAG_VM,
         "float2int 2.5 = 2"
     );
@@ -348,7 +360,7 @@ static int test_misc_ops() {
     int failed = 0;
     VM *vm = vm_create();
 
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
         {OP_SWAP, {}},
@@ -358,28 +370,29 @@ static int test_misc_ops() {
         {OP_DUP, {}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_INTEGER && vm->stack[0].as.integer == 2,
+        vm_stack_get(vm, 0).type == VAL_INTEGER && vm_stack_get(vm, 0).as.integer == 2,
         TAG_VM,
         "After swap, first value is 2"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_INTEGER && vm->stack[1].as.integer == 1,
+        vm_stack_get(vm, 1).type == VAL_INTEGER && vm_stack_get(vm, 1).as.integer == 1,
         TAG_VM,
         "After swap, second value is 1"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_INTEGER && vm->stack[2].as.integer == 4,
+        vm_stack_get(vm, 2).type == VAL_INTEGER && vm_stack_get(vm, 2).as.integer == 4,
         TAG_VM,
         "After discard, third value is 4"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_INTEGER && vm->stack[3].as.integer == 4,
+        vm_stack_get(vm, 3).type == VAL_INTEGER && vm_stack_get(vm, 3).as.integer == 4,
         TAG_VM,
         "After dup, fourth value is 4"
     );
@@ -392,7 +405,7 @@ static int test_control() {
     int failed = 0;
     VM *vm = vm_create();
 
-    vm->code = (Instruction[]){
+    Instruction code[] = {
         {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
         {OP_JMP, {}},
         {OP_PUSH, {.type = VAL_FLOAT, .as.floating = 1.0}},
@@ -409,28 +422,29 @@ static int test_control() {
         {OP_PUSH, {.type = VAL_FLOAT, .as.floating = 6.0}},
         {OP_HALT, {}}
     };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
     vm_execute(vm);
 
     failed += test_assert(
-        vm->stack[0].type == VAL_FLOAT && vm->stack[0].as.floating == 2.0,
+        vm_stack_get(vm, 0).type == VAL_FLOAT && vm_stack_get(vm, 0).as.floating == 2.0,
         TAG_VM,
         "After jump, first value is 2.0"
     );
 
     failed += test_assert(
-        vm->stack[1].type == VAL_FLOAT && vm->stack[1].as.floating == 4.0,
+        vm_stack_get(vm, 1).type == VAL_FLOAT && vm_stack_get(vm, 1).as.floating == 4.0,
         TAG_VM,
         "After conditional jump, next value is 4.0"
     );
 
     failed += test_assert(
-        vm->stack[2].type == VAL_FLOAT && vm->stack[2].as.floating == 5.0,
+        vm_stack_get(vm, 2).type == VAL_FLOAT && vm_stack_get(vm, 2).as.floating == 5.0,
         TAG_VM,
         "Conditional jump not triggered, next value is 5.0"
     );
 
     failed += test_assert(
-        vm->stack[3].type == VAL_FLOAT && vm->stack[3].as.floating == 6.0,
+        vm_stack_get(vm, 3).type == VAL_FLOAT && vm_stack_get(vm, 3).as.floating == 6.0,
         TAG_VM,
         "Final value is 6.0"
     );
@@ -439,14 +453,287 @@ static int test_control() {
     return failed;
 }
 
-int run_vm_tests() {
+static int test_loop_and_call() {
+    int failed = 0;
+    VM *vm = vm_create();
+
+    // x = 0; while (x < 10) x = inc(x); with inc as function 0
+    Instruction code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_STORE_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_DISCARD, {}},
+        {OP_LOAD_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 10}},
+        {OP_LT, {}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 14}},
+        {OP_JMP_IF_FALSE, {}},
+        {OP_LOAD_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_CALL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_STORE_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_DISCARD, {}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_JMP, {}},
+        {OP_LOAD_VAR, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_HALT, {}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_ADD, {}},
+        {OP_RET, {}}
+    };
+    FunctionProto functions[] = {{16, 1, 0}};
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), functions, 1);
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm->sp == 1 && vm_stack_get(vm, 0).type == VAL_INTEGER && vm_stack_get(vm, 0).as.integer == 10,
+        TAG_VM,
+        "Loop calling a function counts to 10"
+    );
+
+    failed += test_assert(
+        vm->verified && vm->stats.jit_runs == (use_jit ? 1 : 0),
+        TAG_VM,
+        "Verified code runs through the JIT only in JIT mode"
+    );
+
+    vm_free(vm);
+    return failed;
+}
+
+static int test_locals() {
+    int failed = 0;
+    VM *vm = vm_create();
+
+    // (let [a 2 b 3] (set b 5) (set a (* a b)) (+ a b)), where the locals are still
+    // on top of the stack (in the interpreter's top-of-stack cache) when they're used
+    Instruction code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 5}},
+        {OP_STORE_LOCAL, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_DISCARD, {}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_MUL_II, {}},
+        {OP_STORE_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_DISCARD, {}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_ADD_II, {}},
+        {OP_SLIDE, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_HALT, {}}
+    };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm->sp == 1 && vm_stack_get(vm, 0).type == VAL_INTEGER && vm_stack_get(vm, 0).as.integer == 15,
+        TAG_VM,
+        "Locals on top of the stack are loaded, stored and slid away"
+    );
+
+    vm_free(vm);
+    return failed;
+}
+
+static int test_quickening() {
+    int failed = 0;
+    VM *vm = vm_create();
+
+    Instruction code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_ADD, {}},
+        {OP_HALT, {}}
+    };
+    vm_load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm_stack_get(vm, 0).type == VAL_INTEGER && vm_stack_get(vm, 0).as.integer == 5 &&
+            vm->code[2].opCode == OP_QADD_II &&
+            vm->stats.quickenings == 1 &&
+            code[2].opCode == OP_ADD,
+        TAG_VM,
+        "OP_ADD on integers quickens its own copy of the code"
+    );
+
+    // Run the same code again with floats
+    vm->code[0].operand = (Value){.type = VAL_FLOAT, .as.floating = 0.5};
+    vm->code[1].operand = (Value){.type = VAL_FLOAT, .as.floating = 0.25};
+    vm->pc = 0;
+    vm->sp = 0;
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm_stack_get(vm, 0).type == VAL_FLOAT && vm_stack_get(vm, 0).as.floating == 0.75 &&
+            vm->code[2].opCode == OP_QADD_FF &&
+            vm->stats.deopts == 1 &&
+            vm->stats.quickenings == 2,
+        TAG_VM,
+        "Quickened OP_ADD deoptimizes when its operand types change"
+    );
+
+    // Mixed types keep the generic form
+    vm->code[1].operand = (Value){.type = VAL_INTEGER, .as.integer = 1};
+    vm->pc = 0;
+    vm->sp = 0;
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm_stack_get(vm, 0).type == VAL_FLOAT && vm_stack_get(vm, 0).as.floating == 1.5 &&
+            vm->code[2].opCode == OP_ADD &&
+            vm->stats.deopts == 2,
+        TAG_VM,
+        "Mixed int and float operands stay on the generic OP_ADD"
+    );
+
+    vm_free(vm);
+    return failed;
+}
+
+static int test_counters() {
+    int failed = 0;
+
+    VM *vm = vm_create();
+    String *ab = string_create_from("ab");
+    Instruction code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_MAKE_LIST, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_LIST_APPEND, {}},
+        {OP_PUSH, {.type = VAL_STRING, .as.string = ab}},
+        {OP_PUSH, {.type = VAL_STRING, .as.string = ab}},
+        {OP_CONCATSTR, {}},
+        {OP_PUSH, {.type = VAL_STRING, .as.string = ab}},
+        {OP_CALL, {.type = VAL_INTEGER, .as.integer = 0}},
+        {OP_CONCATSTR, {}},
+        {OP_HALT, {}},
+        {OP_LOAD_LOCAL, {.type = VAL_INTEGER, .as.integer = 0}}, // 12: function 0, returns its argument
+        {OP_RET, {}}
+    };
+    FunctionProto functions[] = {{12, 1, 0}};
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), functions, 1);
+    vm_execute(vm);
+
+    failed += test_assert(
+        vm->stats.lists_allocated == 2 && vm->stats.list_copy_bytes == 2 * sizeof(Value) &&
+            vm->stats.strings_allocated == 2 && vm->stats.string_copy_bytes == 6,
+        TAG_VM,
+        "Allocations and the bytes copied into new lists and strings are counted"
+    );
+    failed += test_assert(
+        vm->stats.max_call_depth == 1 && vm->stats.max_stack_depth == 4,
+        TAG_VM,
+        "The deepest stack (the callee's load on top of the caller's three values) and call depth are recorded"
+    );
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lvm_stats_%p.json", (void *)vm);
+    bool written = vm_write_stats_json(vm, path);
+    FILE *in = fopen(path, "r");
+    char text[2048] = {0};
+    size_t length = in ? fread(text, 1, sizeof(text) - 1, in) : 0;
+    failed += test_assert(
+        written && length > 0 && strstr(text, "\"lists_allocated\": 2,") && strstr(text, "\"phases_ms\": {"),
+        TAG_VM,
+        "Stats can be written as JSON"
+    );
+    if (in) {
+        fclose(in);
+    }
+    remove(path);
+
+    vm_free(vm);
+    string_free(ab);
+
+    // Verified code doesn't check its pushes, and this has no calls to count the stack at
+    vm = vm_create();
+    Instruction nested[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 1}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_ADD, {}},
+        {OP_ADD, {}},
+        {OP_HALT, {}}
+    };
+    load_code(vm, nested, sizeof(nested) / sizeof(nested[0]), NULL, 0);
+    vm_execute(vm);
+    failed += test_assert(
+        vm->verified && vm_stack_get(vm, 0).as.integer == 6 && vm->stats.max_stack_depth == 3,
+        TAG_VM,
+        "The deepest stack of verified code without calls is recorded"
+    );
+    vm_free(vm);
+    return failed;
+}
+
+static int test_debugging() {
+    int failed = 0;
+    VM *vm = vm_create();
+
+    Instruction code[] = {
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 2}},
+        {OP_PUSH, {.type = VAL_INTEGER, .as.integer = 3}},
+        {OP_ADD, {}},
+        {OP_HALT, {}}
+    };
+    load_code(vm, code, sizeof(code) / sizeof(code[0]), NULL, 0);
+    failed += test_assert(
+        vm_set_breakpoint(vm, 2) && !vm_set_breakpoint(vm, 4),
+        TAG_VM,
+        "Breakpoints can only be set inside the code"
+    );
+
+    vm_execute(vm);
+    failed += test_assert(
+        vm->paused && vm->pc == 2 && vm->sp == 2,
+        TAG_VM,
+        "Execution pauses before the instruction at a breakpoint"
+    );
+
+    // Trace the rest
+    FILE *trace = tmpfile();
+    vm->debug = true;
+    vm->debug_out = trace;
+    vm_execute(vm);
+
+    char line[128] = "";
+    rewind(trace);
+    bool traced = fgets(line, sizeof(line), trace) != NULL;
+    fclose(trace);
+
+    failed += test_assert(
+        !vm->paused && vm->sp == 1 && vm_stack_get(vm, 0).as.integer == 5,
+        TAG_VM,
+        "Execution resumes from a breakpoint"
+    );
+    failed += test_assert(
+        traced && strstr(line, "OP_ADD") && strstr(line, "depth 2") && strstr(line, "top: 3, 2"),
+        TAG_VM,
+        "Trace lines show the opcode, stack depth and top values"
+    );
+
+    vm_free(vm);
+    return failed;
+}
+
+int run_vm_tests(bool jit) {
     int failed = 0;
+    use_jit = jit;
+    TAG_VM = jit ? "TEST_VM_JIT" : "TEST_VM";
     failed += test_push_pop();
     failed += test_strings();
     failed += test_logic();
     failed += test_math();
     failed += test_misc_ops();
     failed += test_control();
+    failed += test_loop_and_call();
+    failed += test_locals();
+    failed += test_quickening();
+    failed += test_counters();
+    failed += test_debugging();
 
     if (failed > 0) {
         printf("%s: Tests failed: %d\n", TAG_VM, failed);
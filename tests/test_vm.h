@@ -1,8 +1,13 @@
 #ifndef TEST_VM_H
 #define TEST_VM_H
 
+#include <stdbool.h>
+
 extern const char *TAG_VM;
 
-int run_vm_tests();
+/**
+ * Runs the VM tests with the interpreter, or with the JIT if jit is set
+ */
+int run_vm_tests(bool jit);
 
 #endif // TEST_VM_H
@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 int test_assert(bool passed, const char *tag, const char *testPurpose) {
     if (passed) {
@@ -11,3 +12,65 @@ int test_assert(bool passed, const char *tag, const char *testPurpose) {
     printf("- %s: TEST FAILED: %s\n", tag, testPurpose);
     return 1;
 }
+
+CompiledSource parse_source(char *source) {
+    CompiledSource compiled;
+    compiled.lexer = lexer_create(source);
+    compiled.parser = parser_create(compiled.lexer);
+    compiled.program = parser_parse(compiled.parser);
+    compiled.symtable = NULL;
+    compiled.bbuf = NULL;
+    return compiled;
+}
+
+CompiledSource compile_source(char *source) {
+    CompiledSource compiled = parse_source(source);
+    compiled.symtable = symbol_table_create();
+    compiled.bbuf = bytecode_create();
+    codegen_compile(compiled.program, compiled.bbuf, compiled.symtable);
+    return compiled;
+}
+
+VM *compiled_source_load(CompiledSource *compiled) {
+    BytecodeBuf *bbuf = compiled->bbuf;
+    VM *vm = vm_create();
+    vm_load_code(vm, bbuf->instructions, bbuf->count, bbuf->functions, bbuf->function_count);
+    return vm;
+}
+
+void compiled_source_free(CompiledSource *compiled) {
+    if (compiled->bbuf) {
+        symbol_table_free(compiled->symtable);
+        bytecode_free(compiled->bbuf);
+    }
+    astprogram_free(compiled->program);
+    parser_free(compiled->parser);
+    lexer_free(compiled->lexer);
+}
+
+CompiledRun compiled_run(char *source, RunSetup setup) {
+    CompiledRun run;
+    run.compiled = compile_source(source);
+    run.vm = compiled_source_load(&run.compiled);
+    if (setup) {
+        setup(&run);
+    }
+    vm_execute(run.vm);
+    return run;
+}
+
+void compiled_run_free(CompiledRun *run) {
+    vm_free(run->vm);
+    compiled_source_free(&run->compiled);
+}
+
+char *read_back(FILE *file) {
+    long size = ftell(file);
+    char *text = calloc(size + 1, 1);
+    rewind(file);
+    if (fread(text, 1, size, file) != (size_t)size) {
+        text[0] = '\0';
+    }
+    fclose(file);
+    return text;
+}
@@ -2,6 +2,36 @@
 #define TEST_UTIL_H
 
 #include <stdbool.h>
+#include <stdio.h>
+
+#include "lexer.h"
+#include "parser.h"
+#include "codegen.h"
+#include "vm.h"
+
+/**
+ * A program compiled from source, with everything its bytecode refers to kept until it's freed
+ */
+typedef struct {
+    Lexer *lexer;
+    Parser *parser;
+    ASTProgram *program;
+    SymbolTable *symtable; // NULL if the program was only parsed
+    BytecodeBuf *bbuf; // NULL if the program was only parsed
+} CompiledSource;
+
+/**
+ * A compiled program and the VM it ran on, kept so both can be looked at and then freed
+ */
+typedef struct {
+    CompiledSource compiled;
+    VM *vm;
+} CompiledRun;
+
+/**
+ * Sets up a loaded VM before it runs, e.g. turning on a backend or instrumentation
+ */
+typedef void (*RunSetup)(CompiledRun *run);
 
 /**
  * Helper function to print if a test fails.
@@ -12,4 +42,41 @@
  */
 int test_assert(bool passed, const char *tag, const char *testPurpose);
 
+/**
+ * Lexes and parses the source, without compiling it
+ */
+CompiledSource parse_source(char *source);
+
+/**
+ * Lexes, parses and compiles the source
+ */
+CompiledSource compile_source(char *source);
+
+/**
+ * Makes a VM with the compiled code loaded, for the caller to run and free
+ */
+VM *compiled_source_load(CompiledSource *compiled);
+
+/**
+ * Frees what parse_source or compile_source made
+ */
+void compiled_source_free(CompiledSource *compiled);
+
+/**
+ * Compiles the source, loads it and runs it to the end
+ * @param setup Called on the loaded VM before it runs, or NULL to run it as it is
+ */
+CompiledRun compiled_run(char *source, RunSetup setup);
+
+/**
+ * Frees the VM and program of a compiled_run
+ */
+void compiled_run_free(CompiledRun *run);
+
+/**
+ * Reads everything written to a temporary file, and closes it
+ * @returns The text, which the caller frees
+ */
+char *read_back(FILE *file);
+
 #endif // TEST_UTIL_H
@@ -0,0 +1,339 @@
+// Analyzes a heap snapshot written by (heap-snapshot "path") or by sending lvm SIGUSR1.
+// Built by `make heapstat`:
+//
+//     build/heapstat [--top N] snapshot.heap
+//
+// Reports how much of the heap is still reachable from the stack and globals (the rest
+// is only held because the VM has no garbage collector), the roots that retain the most,
+// strings stored more than once, and how big the lists are.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapsnap.h"
+
+#define DEFAULT_TOP (10)
+#define PREVIEW_MAX (40) // Characters of a duplicated string shown
+#define HISTOGRAM_BUCKETS (32) // Powers of two of list length
+
+static const char *kind_names[] = {"string", "list", "closure"};
+
+// Objects sorted by address, so references can be looked up
+static HeapObject **by_address;
+static size_t object_count;
+
+static int compare_addresses(const void *a, const void *b) {
+    uint64_t x = (*(HeapObject * const *)a)->address;
+    uint64_t y = (*(HeapObject * const *)b)->address;
+    return (x > y) - (x < y);
+}
+
+// Index of the object the value refers to, or -1 if it isn't a reference to one
+static long find_object(HeapValue value) {
+    if (value.type != VAL_STRING && value.type != VAL_LIST && value.type != VAL_CLOSURE) {
+        return -1;
+    }
+    size_t low = 0;
+    size_t high = object_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (by_address[mid]->address < value.payload) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low < object_count && by_address[low]->address == value.payload ? (long)low : -1;
+}
+
+/**
+ * What each root keeps alive: everything it reaches, and what only it reaches
+ */
+typedef struct {
+    HeapRoot *root;
+    uint64_t reachable_bytes;
+    uint64_t retained_bytes;
+    unsigned long retained_objects;
+} Retainer;
+
+static int compare_retainers(const void *a, const void *b) {
+    uint64_t x = ((const Retainer *)a)->retained_bytes;
+    uint64_t y = ((const Retainer *)b)->retained_bytes;
+    return (x < y) - (x > y);
+}
+
+#define OWNER_NONE (-1)
+#define OWNER_SHARED (-2)
+
+// Walks everything reachable from each root. owners[i] ends up as the only root that
+// reaches object i, OWNER_SHARED if several do, or OWNER_NONE if none does.
+static void find_retainers(HeapSnapshot *snapshot, Retainer *retainers, long *owners) {
+    long *visited = malloc(sizeof(long) * (object_count + 1)); // Last root that reached each object
+    long *worklist = malloc(sizeof(long) * (object_count + 1));
+    for (size_t i = 0; i < object_count; i++) {
+        owners[i] = OWNER_NONE;
+        visited[i] = -1;
+    }
+
+    for (size_t r = 0; r < snapshot->root_count; r++) {
+        retainers[r] = (Retainer){&snapshot->roots[r], 0, 0, 0};
+        size_t worklist_count = 0;
+        long start = find_object(snapshot->roots[r].value);
+        if (start >= 0 && visited[start] != (long)r) {
+            visited[start] = (long)r;
+            worklist[worklist_count++] = start;
+        }
+        while (worklist_count > 0) {
+            long i = worklist[--worklist_count];
+            HeapObject *object = by_address[i];
+            retainers[r].reachable_bytes += object->bytes;
+            if (owners[i] == OWNER_NONE) {
+                owners[i] = (long)r;
+            }
+            else if (owners[i] != (long)r) {
+                owners[i] = OWNER_SHARED;
+            }
+            for (uint32_t v = 0; object->values && v < object->count; v++) {
+                long child = find_object(object->values[v]);
+                if (child >= 0 && visited[child] != (long)r) {
+                    visited[child] = (long)r;
+                    worklist[worklist_count++] = child;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < object_count; i++) {
+        if (owners[i] >= 0) {
+            retainers[owners[i]].retained_bytes += by_address[i]->bytes;
+            retainers[owners[i]].retained_objects++;
+        }
+    }
+    free(worklist);
+    free(visited);
+}
+
+static void print_totals(long *owners) {
+    unsigned long counts[3] = {0};
+    uint64_t bytes[3] = {0};
+    unsigned long live_count = 0;
+    uint64_t live_bytes = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        HeapObject *object = by_address[i];
+        counts[object->kind]++;
+        bytes[object->kind] += object->bytes;
+        if (owners[i] != OWNER_NONE) {
+            live_count++;
+            live_bytes += object->bytes;
+        }
+    }
+
+    printf("%-10s %12s %14s\n", "kind", "objects", "bytes");
+    for (int kind = 0; kind < 3; kind++) {
+        printf("%-10s %12lu %14llu\n", kind_names[kind], counts[kind], (unsigned long long)bytes[kind]);
+    }
+    printf("%-10s %12lu %14llu\n", "reachable", live_count, (unsigned long long)live_bytes);
+    printf("%-10s %12lu %14llu\n\n", "garbage", (unsigned long)object_count - live_count,
+        (unsigned long long)(bytes[0] + bytes[1] + bytes[2] - live_bytes));
+}
+
+static void print_retainers(HeapSnapshot *snapshot, Retainer *retainers, int top) {
+    qsort(retainers, snapshot->root_count, sizeof(Retainer), compare_retainers);
+    printf("Largest retainers\n");
+    printf("%-14s %-8s %14s %10s %14s\n", "root", "kind", "retained", "objects", "reachable");
+    for (size_t r = 0; r < snapshot->root_count && (int)r < top; r++) {
+        Retainer *retainer = &retainers[r];
+        long i = find_object(retainer->root->value);
+        if (i < 0) {
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s %u", retainer->root->global ? "global" : "stack", retainer->root->index);
+        printf("%-14s %-8s %14llu %10lu %14llu\n", name, kind_names[by_address[i]->kind],
+            (unsigned long long)retainer->retained_bytes, retainer->retained_objects,
+            (unsigned long long)retainer->reachable_bytes);
+    }
+    printf("\n");
+}
+
+static int compare_texts(const void *a, const void *b) {
+    const HeapObject *x = *(HeapObject * const *)a;
+    const HeapObject *y = *(HeapObject * const *)b;
+    if (x->count != y->count) {
+        return (x->count > y->count) - (x->count < y->count);
+    }
+    return memcmp(x->text, y->text, x->count);
+}
+
+/**
+ * A string stored more than once
+ */
+typedef struct {
+    HeapObject *example;
+    unsigned long copies;
+    uint64_t wasted_bytes; // All but one copy
+} Duplicate;
+
+static int compare_duplicates(const void *a, const void *b) {
+    uint64_t x = ((const Duplicate *)a)->wasted_bytes;
+    uint64_t y = ((const Duplicate *)b)->wasted_bytes;
+    return (x < y) - (x > y);
+}
+
+// Writes a string in quotes, escaping what isn't printable and cutting it short
+static void print_preview(const HeapObject *string) {
+    putchar('"');
+    for (uint32_t i = 0; i < string->count && i < PREVIEW_MAX; i++) {
+        char c = string->text[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        }
+        else if (c == '\n') {
+            printf("\\n");
+        }
+        else if (c < ' ' || c > '~') {
+            printf("\\x%02x", (unsigned char)c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+    printf(string->count > PREVIEW_MAX ? "\"...\n" : "\"\n");
+}
+
+static void print_duplicates(int top) {
+    HeapObject **strings = malloc(sizeof(HeapObject*) * (object_count + 1));
+    size_t string_count = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        if (by_address[i]->kind == HEAP_STRING) {
+            strings[string_count++] = by_address[i];
+        }
+    }
+    qsort(strings, string_count, sizeof(HeapObject*), compare_texts);
+
+    Duplicate *duplicates = malloc(sizeof(Duplicate) * (string_count + 1));
+    size_t duplicate_count = 0;
+    uint64_t total_wasted = 0;
+    size_t run_start = 0;
+    for (size_t i = 1; i <= string_count; i++) {
+        if (i < string_count && compare_texts(&strings[i], &strings[run_start]) == 0) {
+            continue;
+        }
+        if (i - run_start > 1) {
+            Duplicate duplicate = {strings[run_start], i - run_start, 0};
+            for (size_t j = run_start + 1; j < i; j++) {
+                duplicate.wasted_bytes += strings[j]->bytes;
+            }
+            total_wasted += duplicate.wasted_bytes;
+            duplicates[duplicate_count++] = duplicate;
+        }
+        run_start = i;
+    }
+    qsort(duplicates, duplicate_count, sizeof(Duplicate), compare_duplicates);
+
+    printf("Duplicate strings: %zu distinct, %llu bytes in extra copies\n", duplicate_count, (unsigned long long)total_wasted);
+    printf("%10s %14s  %s\n", "copies", "wasted", "text");
+    for (size_t i = 0; i < duplicate_count && (int)i < top; i++) {
+        printf("%10lu %14llu  ", duplicates[i].copies, (unsigned long long)duplicates[i].wasted_bytes);
+        print_preview(duplicates[i].example);
+    }
+    printf("\n");
+
+    free(duplicates);
+    free(strings);
+}
+
+static void print_list_histogram() {
+    unsigned long counts[HISTOGRAM_BUCKETS] = {0};
+    uint64_t bytes[HISTOGRAM_BUCKETS] = {0};
+    unsigned long element_types[VAL_CLOSURE + 1] = {0};
+    for (size_t i = 0; i < object_count; i++) {
+        HeapObject *list = by_address[i];
+        if (list->kind != HEAP_LIST) {
+            continue;
+        }
+        // Bucket 0 holds empty lists, bucket b lengths from 2^(b-1) to 2^b - 1
+        int bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && (1ul << bucket) <= list->count) {
+            bucket++;
+        }
+        counts[bucket]++;
+        bytes[bucket] += list->bytes;
+        for (uint32_t e = 0; e < list->count; e++) {
+            if (list->values[e].type <= VAL_CLOSURE) {
+                element_types[list->values[e].type]++;
+            }
+        }
+    }
+
+    printf("List lengths\n");
+    printf("%-20s %12s %14s\n", "elements", "lists", "bytes");
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (counts[bucket] == 0) {
+            continue;
+        }
+        char range[32];
+        if (bucket <= 1) {
+            snprintf(range, sizeof(range), "%d", bucket);
+        }
+        else {
+            snprintf(range, sizeof(range), "%lu-%lu", 1ul << (bucket - 1), (1ul << bucket) - 1);
+        }
+        printf("%-20s %12lu %14llu\n", range, counts[bucket], (unsigned long long)bytes[bucket]);
+    }
+
+    static const char *type_names[] = {"integer", "float", "bool", "string", "list", "closure"};
+    printf("Elements by type:");
+    for (int type = 0; type <= VAL_CLOSURE; type++) {
+        printf(" %s %lu%s", type_names[type], element_types[type], type < VAL_CLOSURE ? "," : "\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int top = DEFAULT_TOP;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        }
+        else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        printf("Usage: %s [--top N] <snapshot.heap>\n", argv[0]);
+        return 2;
+    }
+
+    HeapSnapshot *snapshot = heap_snapshot_read(path);
+    if (!snapshot) {
+        printf("Error: Unable to read heap snapshot %s\n", path);
+        return 1;
+    }
+
+    object_count = snapshot->object_count;
+    by_address = malloc(sizeof(HeapObject*) * (object_count + 1));
+    for (size_t i = 0; i < object_count; i++) {
+        by_address[i] = &snapshot->objects[i];
+    }
+    qsort(by_address, object_count, sizeof(HeapObject*), compare_addresses);
+
+    Retainer *retainers = malloc(sizeof(Retainer) * (snapshot->root_count + 1));
+    long *owners = malloc(sizeof(long) * (object_count + 1));
+    find_retainers(snapshot, retainers, owners);
+
+    printf("Heap snapshot %s: %zu objects, %zu roots\n\n", path, object_count, snapshot->root_count);
+    print_totals(owners);
+    print_retainers(snapshot, retainers, top);
+    print_duplicates(top);
+    print_list_histogram();
+
+    free(owners);
+    free(retainers);
+    free(by_address);
+    heap_snapshot_free(snapshot);
+    return 0;
+}